@@ -28,6 +28,10 @@ fi
 if [ -r $1.db.new ]; then
 	mv $1.db $1.db.old
 	mv $1.db.new $1.db
+	rm -f $1.db.delta.*
+	for delta in $1.db.new.delta.*; do
+		[ -f "$delta" ] && mv "$delta" "$1.db.delta.${delta##*.delta.}"
+	done
 	rm -f $1.db.tar.gz
 	tar cvzf $1.db.tar.gz $1.db.old &
 fi
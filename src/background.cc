@@ -82,13 +82,21 @@ static void deallocate_background_waiter(background_waiter *waiter)
         next_background_handle = 1;
 }
 
+/* Strings that background threads take references to concurrently have to be pinned. */
+static Var pinned_string(const char *s)
+{
+    Var v = str_dup_to_var(s);
+    pin(v.v.str);
+    return v;
+}
+
 /* Since threaded functions can only return Vars, not packages, we instead
  * create and return an 'error map'. Which is just a map with the keys:
  * error, which is an error type, and message, which is the error string. */
 void make_error_map(enum error error_type, const char *msg, Var *ret)
 {
-    static const Var error_key = str_dup_to_var("error");
-    static const Var message_key = str_dup_to_var("message");
+    static const Var error_key = pinned_string("error");
+    static const Var message_key = pinned_string("message");
 
     Var err;
     err.type = TYPE_ERR;
@@ -202,12 +210,49 @@ background_suspender(vm the_vm, void *data)
     return E_NONE;
 }
 
+#ifdef NONATOMIC_REFCOUNTS
+static bool holds_uncopyable(Var v);
+
+static int
+uncopyable_pair(Var key, Var value, void *data, int first)
+{
+    return holds_uncopyable(key) || holds_uncopyable(value);
+}
+
+/* Waifs, anonymous objects and iterators can't be copied by var_deep_copy(),
+ * so a thread handed one would share its reference count with the main thread. */
+static bool
+holds_uncopyable(Var v)
+{
+    switch (v.type) {
+        case TYPE_WAIF:
+        case TYPE_ANON:
+        case TYPE_ITER:
+            return true;
+        case TYPE_LIST:
+            for (int i = 1; i <= v.v.list[0].v.num; i++)
+                if (holds_uncopyable(v.v.list[i]))
+                    return true;
+            return false;
+        case TYPE_MAP:
+            return mapforeach(v, uncopyable_pair, nullptr) != 0;
+        default:
+            return false;
+    }
+}
+#endif /* NONATOMIC_REFCOUNTS */
+
 /* Create a new background thread, supplying a callback function, a Var of data, and a string of explanatory text for what the thread is.
  * If threading has been disabled for the current verb, this function will invoke the callback immediately. */
 package
 background_thread(void (*callback)(Var, Var*, void*), Var* data, void *extra_data, void (*cleanup)(void*))
 {
+#ifdef NONATOMIC_REFCOUNTS
+    /* Data the thread can't be given a private copy of is dealt with right here instead. */
+    const bool threading_enabled = get_thread_mode() && !holds_uncopyable(*data);
+#else
     const bool threading_enabled = get_thread_mode();
+#endif
     if (threading_enabled && !can_create_thread())
     {
         errlog("Can't create a new thread\n");
@@ -230,7 +275,17 @@ background_thread(void (*callback)(Var, Var*, void*), Var* data, void *extra_dat
         initialize_background_waiter(w);
         w->callback = callback;
         w->cleanup = cleanup;
+#ifdef NONATOMIC_REFCOUNTS
+        /* The thread gets a copy that shares no reference counts with anything the
+         * main thread can see, and hands it back (through network_callback) when done. */
+        w->data = var_deep_copy(*data);
+        free_var(*data);
+#else
+        /* Maps sort themselves lazily, on first iteration; get that out of the
+         * way now so that the thread only ever reads what it's been handed. */
+        map_sort_deep(*data);
         w->data = *data;
+#endif
         w->extra_data = extra_data;
         if (pipe(w->fd) == -1)
         {
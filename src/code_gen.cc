@@ -48,6 +48,7 @@ struct fixup {
 typedef struct fixup Fixup;
 
 struct gstate {
+    DB_Version version;
     unsigned total_var_refs;    /* For duplicating an old bug... */
     unsigned num_literals, max_literals;
     Var *literals;
@@ -104,8 +105,9 @@ typedef struct state State;
 #endif              /* BYTECODE_REDUCE_REF */
 
 static void
-init_gstate(GState * gstate)
+init_gstate(GState * gstate, DB_Version version)
 {
+    gstate->version = version;
     gstate->total_var_refs = 0;
     gstate->num_literals = gstate->num_fork_vectors = 0;
     gstate->max_literals = gstate->max_fork_vectors = 0;
@@ -507,6 +509,9 @@ emit_var_op(Opcode op, unsigned slot, State * state)
 {
     if (slot >= NUM_READY_VARS) {
         emit_byte(op + NUM_READY_VARS, state);
+#ifdef BYTECODE_REDUCE_REF
+        state->pushmap[state->num_bytes - 1] = op;
+#endif              /* BYTECODE_REDUCE_REF */
         add_var_ref(slot, state);
     } else {
         emit_byte(op + slot, state);
@@ -518,6 +523,56 @@ emit_var_op(Opcode op, unsigned slot, State * state)
 
 static void generate_expr(Expr *, State *);
 
+/* Compiles the most common shapes of expression combining a variable
+ * with a literal to a single extended op:
+ *
+ *      var.name    PUSH n; IMM k; GET_PROP    ->  VAR_GET_PROP n k
+ *      var[k]      PUSH n; IMM k; REF         ->  VAR_INDEX n k
+ *      var + k     PUSH n; IMM k; ADD         ->  VAR_ADD n k
+ *
+ * where `n' is a ready variable and the literal `k' is always in the
+ * literal table.  Each costs one tick, like the operation it ends with,
+ * and decompiles to the same expression.  Programs read from databases
+ * older than DBV_Superinstructions are compiled without them, so the
+ * program counters saved with their suspended tasks stay valid.
+ */
+static int
+generate_superinstruction(Expr * expr, State * state)
+{
+    Expr *lhs = expr->e.bin.lhs, *rhs = expr->e.bin.rhs;
+    Extended_Opcode eop;
+
+    switch (expr->kind) {
+        case EXPR_PROP:
+            eop = EOP_VAR_GET_PROP;
+            break;
+        case EXPR_INDEX:
+            eop = EOP_VAR_INDEX;
+            break;
+        case EXPR_PLUS:
+            eop = EOP_VAR_ADD;
+            break;
+        default:
+            return 0;
+    }
+
+    if (state->gstate->version < DBV_Superinstructions
+            || lhs->kind != EXPR_ID || lhs->e.id >= NUM_READY_VARS
+            || rhs->kind != EXPR_VAR)
+        return 0;
+
+    emit_extended_byte(eop, state);
+    emit_byte(lhs->e.id, state);
+#ifdef BYTECODE_REDUCE_REF
+    state->pushmap[state->num_bytes - 1] = OP_EXTENDED;
+#endif              /* BYTECODE_REDUCE_REF */
+    add_literal(rhs->e.var, state);
+    push_stack(2, state);
+    pop_stack(1, state);
+
+    return 1;
+}
+
 static void
 generate_map_list(Map_List *mappings, State *state)
 {
@@ -665,6 +720,8 @@ generate_expr(Expr * expr, State * state)
         {
             Opcode op = OP_ADD; /* initialize to silence warning */
 
+            if (generate_superinstruction(expr, state))
+                break;
             generate_expr(expr->e.bin.lhs, state);
             generate_expr(expr->e.bin.rhs, state);
             switch (expr->kind) {
@@ -755,6 +812,8 @@ generate_expr(Expr * expr, State * state)
         {
             unsigned old;
 
+            if (generate_superinstruction(expr, state))
+                break;
             generate_expr(expr->e.bin.lhs, state);
             old = save_stack_top(state);
             generate_expr(expr->e.bin.rhs, state);
@@ -1207,6 +1266,28 @@ bbd_cmp(int *a, int *b)
 }
 #endif              /* BYTECODE_REDUCE_REF */
 
+#ifdef BYTECODE_REDUCE_REF
+/* Returns the variable slot of the PUSH or PUT at `pc'.  The slot of
+ * a PUSH or PUT of a variable past the first NUM_READY_VARS is in the
+ * var ref fixup that follows it; `fix_i' is the index of a fixup at or
+ * after it, and is moved back to it, so the ops must be visited from
+ * the end of the code to the start.
+ */
+static unsigned
+var_op_slot(State * state, int pc, int *fix_i)
+{
+    unsigned op = state->bytes[pc];
+
+    if (op == OP_G_PUSH || op == OP_G_PUT) {
+        while (state->fixups[*fix_i].pc > (unsigned) pc + 1)
+            --*fix_i;
+        return state->fixups[*fix_i].value;
+    }
+
+    return IS_PUT_n(op) ? PUT_n_INDEX(op) : PUSH_n_INDEX(op);
+}
+#endif              /* BYTECODE_REDUCE_REF */
+
 static Bytecodes
 stmt_to_code(Stmt * stmt, GState * gstate)
 {
@@ -1215,7 +1296,9 @@ stmt_to_code(Stmt * stmt, GState * gstate)
     int old_i, new_i, fix_i;
 #ifdef BYTECODE_REDUCE_REF
     int *bbd, n_bbd;        /* basic block delimiters */
-    unsigned varbits;       /* variables we've seen */
+    Byte *varbits;          /* variables we've seen */
+    unsigned num_vars, i;
+    int var_fix_i;
 #if NUM_READY_VARS > 32
 #error assumed NUM_READY_VARS was 32
 #endif
@@ -1290,42 +1373,56 @@ stmt_to_code(Stmt * stmt, GState * gstate)
      * is identified, so that during interpretation the code can avoid
      * holding spurious references to it.
      */
+    num_vars = max(state.max_var_ref + 1, (unsigned) NUM_READY_VARS);
+    varbits = (Byte *)mymalloc(num_vars, M_CODE_GEN);
+    var_fix_i = state.num_fixups - 1;
+
     while (n_bbd-- > 1) {
-        varbits = 0;
+        memset(varbits, 0, num_vars);
 
         for (old_i = bbd[n_bbd] - 1; old_i >= bbd[n_bbd - 1]; --old_i) {
             if (state.pushmap[old_i] == OP_PUSH) {
-                int id = PUSH_n_INDEX(state.bytes[old_i]);
+                unsigned id = var_op_slot(&state, old_i, &var_fix_i);
 
-                if (varbits & (1 << id)) {
-                    varbits &= ~(1 << id);
+                /* OP_G_PUSH becomes OP_G_PUSH_CLEAR the same way */
+                if (varbits[id]) {
+                    varbits[id] = 0;
                     state.bytes[old_i] += OP_PUSH_CLEAR - OP_PUSH;
                 }
+            } else if (state.pushmap[old_i] == OP_EXTENDED) {
+                /*
+                 * A superinstruction reading the variable in this byte.
+                 * It can't be cleared, so no PUSH before it is the last
+                 * use.
+                 */
+                varbits[state.bytes[old_i]] = 0;
             } else if (state.trymap[old_i] > 0) {
                 /*
                  * Operations inside of exception handling blocks might not
                  * execute, so they can't set any bits.
                  */ ;
             } else if (state.pushmap[old_i] == OP_PUT) {
-                int id = PUT_n_INDEX(state.bytes[old_i]);
-                varbits |= 1 << id;
+                varbits[var_op_slot(&state, old_i, &var_fix_i)] = 1;
             } else if (state.pushmap[old_i] == OP_DONE) {
                 /*
                  * If the verb ends, all variables are unneeded.  This
                  * means things like `return pass(@args)' will not hold
                  * a ref to `args' during the called verb.
                  */
-                varbits = ~0U;
+                memset(varbits, 1, num_vars);
             } else if (state.pushmap[old_i] == OP_CALL_VERB) {
                 /*
                  * Verb calls implicitly pass the VR variables (dobj,
                  * dobjstr, player, etc).  They can't be clear at the
                  * time of a verbcall.
                  */
-                varbits &= NON_VR_VAR_MASK;
+                for (i = 0; i < NUM_READY_VARS; i++)
+                    if (!(NON_VR_VAR_MASK & (1 << i)))
+                        varbits[i] = 0;
             }
         }
     }
+    myfree(varbits, M_CODE_GEN);
     myfree(bbd, M_CODE_GEN);
 #endif              /* BYTECODE_REDUCE_REF */
 
@@ -1391,7 +1488,7 @@ generate_code(Stmt * stmt, DB_Version version)
     Program *prog = new_program();
     GState gstate;
 
-    init_gstate(&gstate);
+    init_gstate(&gstate, version);
 
     prog->main_vector = stmt_to_code(stmt, &gstate);
     prog->version = version;
@@ -11,8 +11,18 @@
 #include "background.h"
 #include "map.h"
 #include "list.h"
+#include "network.h"
+#include "tasks.h"
+
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
 
 static CURL *curl_handle = nullptr;
+static CURLSH *curl_share = nullptr;    /* Connections and lookups kept by curl() on the main thread. */
 
 typedef struct CurlMemoryStruct {
     char *result;
@@ -107,55 +117,96 @@ static size_t CurlHeaderCallback(char *buffer, size_t size, size_t nitems, void
     return realsize;
 }
 
-static void curl_thread_callback(Var arglist, Var *ret, void *extra_data)
-{
-    CURL *curl_handle;
-    CURLcode res;
+/* One call to curl(): the transfer, and where its results go. */
+typedef struct CurlRequest {
+    CURL *handle;
+    struct curl_slist *headers;
     CurlMemoryStruct chunk;
     CurlHeaderList header_list;
-    struct curl_slist *headers = NULL;
-    struct curl_slist *cookies;
-    struct curl_slist *nc;
-    long timeout = CURL_TIMEOUT;
+    Var arglist;                        // Keeps the URL, method and body alive.
+    const char *method;
+    CURLcode result;
+    vm the_vm;                          // The task waiting for it, if it's run by the engine.
+    std::atomic<bool> active;           // Cleared when the waiting task is killed.
+    struct CurlRequest *next;
+} CurlRequest;
+
+static void
+curl_request_free(CurlRequest *req)
+{
+    curl_easy_cleanup(req->handle);
+    curl_slist_free_all(req->headers);
+    for (size_t i = 0; i < req->header_list.num_headers; i++)
+        free(req->header_list.headers[i]);
+    free(req->header_list.headers);
+    free(req->chunk.result);
+    free_var(req->arglist);
+    delete req;
+}
 
-    header_list.headers = NULL;
-    header_list.num_headers = 0;
+/* Aborts the transfer once the task waiting for it has been killed. */
+static int
+CurlProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    return !((CurlRequest *)clientp)->active;
+}
 
-    // Get out total list of arguments
-    int nargs = arglist.v.list[0].v.num;
+/* Sets up a transfer from curl()'s arguments.  Consumes `arglist'.  If the
+ * arguments are no good, returns nullptr with an error map in `error'. */
+static CurlRequest *
+curl_request_new(Var arglist, Var *error)
+{
+    const int nargs = arglist.v.list[0].v.num;
+    CurlRequest *req = new CurlRequest();
 
+    req->arglist = arglist;
     // Default value ternary; if we don't have an arg then the default is GET.
-    const char *method = nargs <= 1 ? "GET" : arglist.v.list[2].v.str;
-    
+    req->method = nargs <= 1 ? "GET" : arglist.v.list[2].v.str;
+    req->headers = nullptr;
+    req->header_list.headers = nullptr;
+    req->header_list.num_headers = 0;
+    req->chunk.result = (char *)malloc(1);
+    req->chunk.size = 0;
+    req->result = CURLE_OK;
+    req->the_vm = nullptr;
+    req->active = true;
+    req->next = nullptr;
+
     // Set up the basic universals of the CURL handle.
-    curl_handle = curl_easy_init();
+    CURL *curl_handle = req->handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, (void *)req);
     curl_easy_setopt(curl_handle, CURLOPT_URL, arglist.v.list[1].v.str);
     curl_easy_setopt(curl_handle, CURLOPT_PROTOCOLS_STR, "http,https,dict");
     curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, (long)CURL_TIMEOUT);
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, CurlWriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&req->chunk);
     curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, CurlHeaderCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&header_list);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&req->header_list);
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, CurlProgressCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, (void *)req);
+    curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L);
 
     // This block of code reads our headers argument and writes those into the request here.
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
     if (nargs >= 3) {
         Var key, value;
         FOR_EACH_MAP(key, value, arglist.v.list[3]) {
             if (key.type != TYPE_STR) {
-                make_error_map(E_INVARG, "Header key type was not a string", ret);
-                curl_easy_cleanup(curl_handle);
-                return;
+                make_error_map(E_INVARG, "Header key type was not a string", error);
+                curl_request_free(req);
+                return nullptr;
             }
             if (value.type != TYPE_STR) {
-                make_error_map(E_INVARG, "Header value type was not a string", ret);
-                curl_easy_cleanup(curl_handle);
-                return;
+                make_error_map(E_INVARG, "Header value type was not a string", error);
+                curl_request_free(req);
+                return nullptr;
             }
-            headers = set_or_overwrite_header(headers, key.v.str, value.v.str);
+            req->headers = set_or_overwrite_header(req->headers, key.v.str, value.v.str);
         }
     }
-    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
 
     // Set body for request if necessary.
     if (nargs >= 4) {
@@ -163,36 +214,37 @@ static void curl_thread_callback(Var arglist, Var *ret, void *extra_data)
     }
 
     // Specific method handling.
-    if (!strcasecmp(method, "POST")) {
+    if (!strcasecmp(req->method, "POST")) {
       curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
-    } else if (!strcasecmp(method, "PUT")) {
+    } else if (!strcasecmp(req->method, "PUT")) {
       // https://curl.se/libcurl/c/CURLOPT_CUSTOMREQUEST.html
       curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, "PUT");
-    } else if (!strcasecmp(method, "DELETE")) {
+    } else if (!strcasecmp(req->method, "DELETE")) {
       // https://curl.se/libcurl/c/CURLOPT_CUSTOMREQUEST.html
       curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
-    } else if (!strcasecmp(method, "GET")) {
+    } else if (!strcasecmp(req->method, "GET")) {
       // Nothing needed here; GET is the default.
     } else {
       // This was an invalid method.
-      make_error_map(E_INVARG, "Invalid HTTP Method Provided", ret);
-      curl_easy_cleanup(curl_handle);
-      curl_slist_free_all(headers);
-      curl_slist_free_all(cookies);
-      for (size_t i = 0; i < header_list.num_headers; i++) {
-          free(header_list.headers[i]);
-      }
-      free(header_list.headers);
-      // Return control early, so the call doesn't actually fall-thru and call the curl handle.
-      return;
+      make_error_map(E_INVARG, "Invalid HTTP Method Provided", error);
+      curl_request_free(req);
+      return nullptr;
     }
 
-    chunk.result = (char*)malloc(1);
-    chunk.size = 0;
-    res = curl_easy_perform(curl_handle);
+    return req;
+}
 
-    if (res != CURLE_OK) {
-      make_error_map(E_INVARG, curl_easy_strerror(res), ret);
+/* Turns a finished transfer into curl()'s return value. */
+static void
+curl_request_result(CurlRequest *req, Var *ret)
+{
+    CURL *curl_handle = req->handle;
+    CurlHeaderList &header_list = req->header_list;
+    struct curl_slist *cookies = nullptr;
+    struct curl_slist *nc;
+
+    if (req->result != CURLE_OK) {
+      make_error_map(E_INVARG, curl_easy_strerror(req->result), ret);
     } else {
         // Response keys
         static const Var status_key = str_dup_to_var("status");
@@ -205,7 +257,9 @@ static void curl_thread_callback(Var arglist, Var *ret, void *extra_data)
         statusCode.type = TYPE_INT;
 
         // Assigning values from response
-        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &statusCode.v.num);
+        long response_code = 0;
+        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response_code);
+        statusCode.v.num = response_code;
 
         // Process headers
         Var headers_var = new_map();
@@ -255,40 +309,267 @@ static void curl_thread_callback(Var arglist, Var *ret, void *extra_data)
 
 
         // Process cookies
-        res = curl_easy_getinfo(curl_handle, CURLINFO_COOKIELIST, &cookies);
+        curl_easy_getinfo(curl_handle, CURLINFO_COOKIELIST, &cookies);
         Var cookie_list_var = new_list(0);
         nc = cookies;
         while(nc) {
             cookie_list_var = listappend(cookie_list_var, str_dup_to_var(nc->data));
             nc = nc->next;
         }
+        curl_slist_free_all(cookies);
 
         *ret = new_map();
         *ret = mapinsert(*ret, var_ref(status_key), statusCode);
-        *ret = mapinsert(*ret, var_ref(body_key), str_dup_to_var(raw_bytes_to_binary(chunk.result, chunk.size)));
+        *ret = mapinsert(*ret, var_ref(body_key), str_dup_to_var(raw_bytes_to_binary(req->chunk.result, req->chunk.size)));
         *ret = mapinsert(*ret, var_ref(headers_key), headers_var);
         *ret = mapinsert(*ret, var_ref(cookies_key), cookie_list_var);
 
-        oklog("CURL [%s]: %lu bytes retrieved from: %s\n", method, (unsigned long)chunk.size, arglist.v.list[1].v.str);
+        oklog("CURL [%s]: %lu bytes retrieved from: %s\n", req->method, (unsigned long)req->chunk.size, req->arglist.v.list[1].v.str);
     }
+}
 
-    curl_slist_free_all(headers);
-    for (size_t i = 0; i < header_list.num_headers; i++) {
-        free(header_list.headers[i]);
+/*
+  The engine runs every transfer started by a task in threaded mode.  A
+  single thread drives one curl multi handle, so a request waiting on the
+  network ties up no thread of its own, and connections, DNS lookups and
+  TLS sessions are kept and reused from one request to the next.
+
+  The main thread hands requests over through `pending'.  The engine
+  thread hands them back through `finished' and writes a byte to a pipe
+  that network_process_io() watches; curl_engine_readable() then resumes
+  the waiting tasks.  Only the main thread ever builds MOO values.
+*/
+static struct {
+    CURLM *multi = nullptr;
+    std::thread thread;
+    std::mutex mutex;                   // Guards pending, finished and stopping.
+    CurlRequest *pending = nullptr;
+    CurlRequest *finished = nullptr;
+    bool stopping = false;
+    int fd[2] = {-1, -1};
+    std::unordered_set<CurlRequest *> in_flight;  // Main thread only.
+} engine;
+
+/* Reverses a list built by pushing onto its head, so that requests are
+ * dealt with in the order they were made. */
+static CurlRequest *
+curl_request_list_reverse(CurlRequest *list)
+{
+    CurlRequest *reversed = nullptr;
+
+    while (list) {
+        CurlRequest *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
     }
-    free(header_list.headers);
-    curl_slist_free_all(cookies);
-    curl_easy_cleanup(curl_handle);
-    free(chunk.result);
+
+    return reversed;
+}
+
+static void
+curl_engine_loop(void)
+{
+    int running = 0;
+
+    for (;;) {
+        CurlRequest *req;
+        CURLMsg *msg;
+        int left;
+
+        engine.mutex.lock();
+        if (engine.stopping) {
+            engine.mutex.unlock();
+            break;
+        }
+        req = curl_request_list_reverse(engine.pending);
+        engine.pending = nullptr;
+        engine.mutex.unlock();
+
+        for (; req; req = req->next)
+            curl_multi_add_handle(engine.multi, req->handle);
+
+        curl_multi_perform(engine.multi, &running);
+
+        bool any_finished = false;
+        while ((msg = curl_multi_info_read(engine.multi, &left)) != nullptr) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+            req->result = msg->data.result;
+            curl_multi_remove_handle(engine.multi, msg->easy_handle);
+
+            engine.mutex.lock();
+            req->next = engine.finished;
+            engine.finished = req;
+            engine.mutex.unlock();
+            any_finished = true;
+        }
+        if (any_finished)
+            write(engine.fd[1], "1", 1);
+
+        curl_multi_poll(engine.multi, nullptr, 0, 1000, nullptr);
+    }
+}
+
+/* Called by the network module when the engine has finished requests. */
+static void
+curl_engine_readable(int fd, void *data)
+{
+    char buffer[64];
+    CurlRequest *req, *next;
+
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+        continue;
+
+    engine.mutex.lock();
+    req = curl_request_list_reverse(engine.finished);
+    engine.finished = nullptr;
+    engine.mutex.unlock();
+
+    for (; req; req = next) {
+        next = req->next;
+        engine.in_flight.erase(req);
+
+        /* Resume the MOO task if it hasn't already been killed. */
+        if (req->active) {
+            Var r;
+            curl_request_result(req, &r);
+            resume_task(req->the_vm, r);
+        }
+        curl_request_free(req);
+    }
+}
+
+static bool
+curl_engine_start(void)
+{
+    if (engine.multi != nullptr)
+        return true;
+
+    if (pipe(engine.fd) == -1) {
+        log_perror("CURL: Failed to create pipe for the transfer engine");
+        return false;
+    }
+    fcntl(engine.fd[0], F_SETFL, fcntl(engine.fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(engine.fd[1], F_SETFL, fcntl(engine.fd[1], F_GETFL) | O_NONBLOCK);
+
+    engine.multi = curl_multi_init();
+    curl_multi_setopt(engine.multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)CURL_MAX_CONNECTIONS);
+    curl_multi_setopt(engine.multi, CURLMOPT_MAXCONNECTS, (long)CURL_MAX_CONNECTIONS);
+
+    network_register_fd(engine.fd[0], curl_engine_readable, nullptr, nullptr);
+    engine.thread = std::thread(curl_engine_loop);
+
+    return true;
+}
+
+static void
+curl_engine_stop(void)
+{
+    if (engine.multi == nullptr)
+        return;
+
+    engine.mutex.lock();
+    engine.stopping = true;
+    engine.mutex.unlock();
+    curl_multi_wakeup(engine.multi);
+    engine.thread.join();
+
+    /* Any task still waiting has already been saved as interrupted. */
+    CurlRequest *lists[] = {engine.pending, engine.finished};
+    for (CurlRequest *req : lists) {
+        while (req) {
+            CurlRequest *next = req->next;
+            engine.in_flight.erase(req);
+            curl_request_free(req);
+            req = next;
+        }
+    }
+    for (CurlRequest *req : engine.in_flight) {
+        curl_multi_remove_handle(engine.multi, req->handle);
+        curl_request_free(req);
+    }
+    engine.in_flight.clear();
+    engine.pending = engine.finished = nullptr;
+
+    curl_multi_cleanup(engine.multi);
+    engine.multi = nullptr;
+    network_unregister_fd(engine.fd[0]);
+    close(engine.fd[0]);
+    close(engine.fd[1]);
+}
+
+/* Hands the request to the engine once the task has been suspended. */
+static enum error
+curl_suspender(vm the_vm, void *data)
+{
+    CurlRequest *req = (CurlRequest *)data;
+
+    if (!check_user_task_limit(the_vm->activ_stack->progr)) {
+        curl_request_free(req);
+        return E_QUOTA;
+    }
+
+    req->the_vm = the_vm;
+    engine.in_flight.insert(req);
+
+    engine.mutex.lock();
+    req->next = engine.pending;
+    engine.pending = req;
+    engine.mutex.unlock();
+    curl_multi_wakeup(engine.multi);
+
+    return E_NONE;
+}
+
+/* Lets @forked, kill_task() and the database writer see the tasks
+ * waiting on the engine. */
+static task_enum_action
+curl_enumerator(task_closure closure, void *data)
+{
+    for (CurlRequest *req : engine.in_flight) {
+        if (req->active) {
+            const task_enum_action tea = (*closure) (req->the_vm, "waiting on curl", data);
+
+            if (tea == TEA_KILL) {
+                // The engine aborts the transfer; the task is gone, so don't resume it.
+                req->active = false;
+            }
+            if (tea != TEA_CONTINUE)
+                return tea;
+        }
+    }
+
+    return TEA_CONTINUE;
 }
 
 static package
 bf_curl(Var arglist, Byte next, void *vdata, Objid progr)
 {
-    if (!is_wizard(progr))
+    if (!is_wizard(progr)) {
+        free_var(arglist);
         return make_error_pack(E_PERM);
+    }
 
-    return background_thread(curl_thread_callback, &arglist);
+    Var r;
+    CurlRequest *req = curl_request_new(arglist, &r);
+
+    if (req == nullptr)
+        return make_var_pack(r);
+
+    if (get_thread_mode() && curl_engine_start())
+        return make_suspend_pack(curl_suspender, (void *)req);
+
+    /* Without threading, the transfer happens right here, but still shares
+     * connections and lookups with the ones before it. */
+    curl_easy_setopt(req->handle, CURLOPT_SHARE, curl_share);
+    req->result = curl_easy_perform(req->handle);
+    curl_request_result(req, &r);
+    curl_request_free(req);
+
+    return make_var_pack(r);
 }
 
 static package
@@ -337,8 +618,12 @@ bf_url_decode(Var arglist, Byte next, void *vdata, Objid progr)
 
 void curl_shutdown(void)
 {
+    curl_engine_stop();
+
     if (curl_handle != nullptr)
         curl_easy_cleanup(curl_handle);
+    if (curl_share != nullptr)
+        curl_share_cleanup(curl_share);
 
     curl_global_cleanup();
 }
@@ -349,7 +634,14 @@ register_curl(void)
     oklog("REGISTER_CURL: Using libcurl version %s\n", curl_version());
     curl_global_init(CURL_GLOBAL_ALL);
     curl_handle = curl_easy_init();
- 
+
+    curl_share = curl_share_init();
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    register_task_queue(curl_enumerator);
+
     /** curl(STR url[, STR method = "GET", MAP headers, STR body]) */
     register_function("curl", 1, 4, bf_curl, TYPE_STR, TYPE_STR, TYPE_MAP, TYPE_STR);
     register_function("url_encode", 1, 1, bf_url_encode, TYPE_STR);
@@ -23,12 +23,15 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <vector>
 
 #include "collection.h"
 #include "config.h"
 #include "db.h"
 #include "db_io.h"
 #include "db_private.h"
+#include "disassemble.h"
 #include "list.h"
 #include "log.h"
 #include "options.h"
@@ -48,6 +51,16 @@ static int dump_generation = 0;
 static const char *header_format_string
     = "** LambdaMOO Database, Format Version %u **\n";
 
+/* A database in the binary encoding (see db_io.cc) has this second
+ * header line.  Its compiled programs can only be loaded by a server
+ * with the same bytecode signature.
+ */
+static const char *binary_header_format_string
+    = "** Binary Encoding %u, Bytecode Signature %x **\n";
+#define BINARY_DB_ENCODING 1
+
+static bool dump_binary = false;
+
 DB_Version dbio_input_version;
 
 
@@ -175,6 +188,9 @@ read_verbdef(Verbdef * v)
     v->prep = dbio_read_num();
     v->next = nullptr;
     v->program = nullptr;
+#ifdef LAZY_VERB_PROGRAMS
+    v->source = nullptr;
+#endif
 }
 
 static void
@@ -291,39 +307,13 @@ v4_read_object(void)
     return 1;
 }
 
-static int
-ng_read_object(int anonymous)
+static void
+ng_read_object_contents(Object *o)
 {
-    Objid oid;
-    Object *o;
-    char s[20];
     int i;
     Verbdef *v, **prevv;
     int nprops;
 
-    if (dbio_scanf("#%" SCNdN, &oid) != 1)
-        return 0;
-    dbio_read_line(s, sizeof(s));
-
-    if (strcmp(s, " recycled\n") == 0) {
-        dbpriv_new_recycled_object();
-        return 1;
-    } else if (strcmp(s, "\n") != 0)
-        return 0;
-
-    /* At the point at which we're reading anonymous objects, we know
-     * we've already created all of the anonymous objects (they were
-     * created from references in tasks, other objects or the list
-     * of values pending finalization).
-     */
-    if (anonymous) {
-        o = dbpriv_find_object(oid);
-    }
-    else {
-        o = dbpriv_new_object(-1);
-        dbpriv_assign_nonce(o);
-    }
-
     o->name = dbio_read_string_intern();
     o->flags = dbio_read_num();
 
@@ -380,9 +370,68 @@ ng_read_object(int anonymous)
     for (i = 0; i < nprops; i++) {
         read_propval(o->propval + i);
     }
+}
+
+static int
+ng_read_object(int anonymous)
+{
+    Objid oid;
+    Object *o;
+    char s[20];
+
+    if (dbio_scanf("#%" SCNdN, &oid) != 1)
+        return 0;
+    dbio_read_line(s, sizeof(s));
+
+    if (strcmp(s, " recycled\n") == 0) {
+        dbpriv_new_recycled_object();
+        return 1;
+    } else if (strcmp(s, "\n") != 0)
+        return 0;
+
+    /* At the point at which we're reading anonymous objects, we know
+     * we've already created all of the anonymous objects (they were
+     * created from references in tasks, other objects or the list
+     * of values pending finalization).
+     */
+    if (anonymous) {
+        o = dbpriv_find_object(oid);
+    }
+    else {
+        o = dbpriv_new_object(-1);
+        dbpriv_assign_nonce(o);
+    }
+
+    ng_read_object_contents(o);
+
+    return 1;
+}
+
+#ifdef INCREMENTAL_CHECKPOINTS
+/* Reads an object written to a delta, replacing whatever currently has
+ * that object number.
+ */
+static int
+ng_reread_object(void)
+{
+    Objid oid;
+    char s[20];
+
+    if (dbio_scanf("#%" SCNdN, &oid) != 1 || oid < 0)
+        return 0;
+    dbio_read_line(s, sizeof(s));
+
+    if (strcmp(s, " recycled\n") == 0) {
+        dbpriv_reload_object(oid, 0);
+        return 1;
+    } else if (strcmp(s, "\n") != 0)
+        return 0;
+
+    ng_read_object_contents(dbpriv_reload_object(oid, 1));
 
     return 1;
 }
+#endif /* INCREMENTAL_CHECKPOINTS */
 
 static void
 ng_write_object(Objid oid)
@@ -825,14 +874,123 @@ fmt_verb_name(void *data)
 }
 
 static int
-read_db_file(void)
+read_verb_programs(Num nprogs, int log_progress)
 {
     Objid oid;
-    Var user_list;
-    Num i, nobjs, nprogs, nusers, vnum, dummy;
+    Num i, vnum;
     db_verb_handle h;
     Program *program;
 
+    for (i = 1; i <= nprogs; i++) {
+        if (dbio_scanf("#%" SCNdN ":%" SCNdN "\n", &oid, &vnum) != 2) {
+            errlog("READ_DB_FILE: Bad program header, i = %" PRIdN ".\n", i);
+            return 0;
+        }
+        if (!valid(oid)) {
+            errlog("READ_DB_FILE: Verb for non-existant object: #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
+            return 0;
+        }
+        h = db_find_indexed_verb(Var::new_obj(oid), vnum + 1);  /* DB file is 0-based. */
+        if (!h.ptr) {
+            errlog("READ_DB_FILE: Unknown verb index: #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
+            return 0;
+        }
+#ifdef LAZY_VERB_PROGRAMS
+        /* Sources written by an older format version might not mean the
+         * same thing to the current parser, so they're compiled now.
+         */
+        if (dbio_input_version == current_db_version) {
+            const char *source;
+            unsigned length;
+
+            if ((source = dbpriv_read_program_source(&length))) {
+                dbpriv_set_verb_source(h, source, length);
+                if (log_progress && (i % 5000 == 0 || i == nprogs))
+                    oklog("LOADING: Done reading %" PRIdN " verb program%s ...\n", i, i > 1 ? "s" : "");
+                continue;
+            }
+        }
+#endif
+        program = dbio_read_program(dbio_input_version, fmt_verb_name, &h);
+        if (!program) {
+            errlog("READ_DB_FILE: Unparsable program #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
+            return 0;
+        }
+        db_set_verb_program(h, program);
+        if (log_progress && (i % 5000 == 0 || i == nprogs))
+            oklog("LOADING: Done reading %" PRIdN " verb program%s ...\n", i, i > 1 ? "s" : "");
+    }
+
+    return 1;
+}
+
+static int
+read_binary_header(const char *who)
+{
+    unsigned encoding, signature;
+
+    /* Nothing is consumed unless the header is there. */
+    if (dbio_scanf(binary_header_format_string, &encoding, &signature) != 2)
+        return 1;
+
+    if (encoding != BINARY_DB_ENCODING) {
+        errlog("%s: Unknown binary encoding: %u\n", who, encoding);
+        return 0;
+    }
+    if (signature != bytecode_signature()) {
+        errlog("%s: Bytecode signature %x doesn't match this server's (%x); "
+               "convert the database to text with the server that wrote it\n",
+               who, signature, bytecode_signature());
+        return 0;
+    }
+    dbpriv_set_dbio_binary_input(true);
+
+    return 2;
+}
+
+static void
+write_binary_header(void)
+{
+    if (dump_binary) {
+        dbio_printf(binary_header_format_string, BINARY_DB_ENCODING,
+                    bytecode_signature());
+        dbpriv_set_dbio_binary_output(true);
+    }
+}
+
+#ifdef LAZY_VERB_PROGRAMS
+#define HAS_PROGRAM(v) ((v)->program || (v)->source)
+#else
+#define HAS_PROGRAM(v) ((v)->program)
+#endif
+
+static void
+write_verb_program(Verbdef *v, Objid oid)
+{
+#ifdef LAZY_VERB_PROGRAMS
+    if (v->source && !dump_binary) {
+        /* Still exactly as it was read. */
+        dbio_printf("%s.\n", v->source->text);
+        return;
+    }
+    if (!dbpriv_verb_program(v, oid)) {
+        dbio_write_program(null_program());
+        return;
+    }
+#endif
+    dbio_write_program(v->program);
+}
+
+#ifdef INCREMENTAL_CHECKPOINTS
+static int replay_deltas(void);
+#endif
+
+static int
+read_db_file(void)
+{
+    Var user_list;
+    Num i, nobjs, nprogs, nusers, dummy;
+
     waif_before_loading();
 
     if (dbio_scanf(header_format_string, &dbio_input_version) != 1)
@@ -844,6 +1002,18 @@ read_db_file(void)
         return 0;
     }
 
+    switch (read_binary_header("READ_DB_FILE")) {
+        case 0:
+            return 0;
+        case 2:
+            oklog("LOADING: Using the binary encoding ...\n");
+            if (binary_db_output < 0)
+                dump_binary = true;
+            break;
+    }
+    if (binary_db_output >= 0)
+        dump_binary = binary_db_output;
+
     /* I use a `dummy' variable here and elsewhere instead of the `*'
      * assignment-suppression syntax of `scanf' because it allows more
      * straightforward error checking; unfortunately, the standard
@@ -969,29 +1139,8 @@ read_db_file(void)
     }
 
     oklog("LOADING: Reading %" PRIdN " MOO verb program%s ...\n", nprogs, nprogs > 1 ? "s" : "");
-    for (i = 1; i <= nprogs; i++) {
-        if (dbio_scanf("#%" SCNdN ":%" SCNdN "\n", &oid, &vnum) != 2) {
-            errlog("READ_DB_FILE: Bad program header, i = %" PRIdN ".\n", i);
-            return 0;
-        }
-        if (!valid(oid)) {
-            errlog("READ_DB_FILE: Verb for non-existant object: #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
-            return 0;
-        }
-        h = db_find_indexed_verb(Var::new_obj(oid), vnum + 1);  /* DB file is 0-based. */
-        if (!h.ptr) {
-            errlog("READ_DB_FILE: Unknown verb index: #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
-            return 0;
-        }
-        program = dbio_read_program(dbio_input_version, fmt_verb_name, &h);
-        if (!program) {
-            errlog("READ_DB_FILE: Unparsable program #%" PRIdN ":%" PRIdN ".\n", oid, vnum);
-            return 0;
-        }
-        db_set_verb_program(h, program);
-        if (i % 5000 == 0 || i == nprogs)
-            oklog("LOADING: Done reading %" PRIdN " verb program%s ...\n", i, i > 1 ? "s" : "");
-    }
+    if (!read_verb_programs(nprogs, 1))
+        return 0;
 
     if (DBV_Anon > dbio_input_version) {
         oklog("LOADING: Reading forked and suspended tasks ...\n");
@@ -1009,6 +1158,12 @@ read_db_file(void)
 
     /* see db_objects.c */
     dbpriv_after_load();
+
+#ifdef INCREMENTAL_CHECKPOINTS
+    if (!replay_deltas())
+        return 0;
+#endif
+
     waif_after_loading();
 
     return 1;
@@ -1031,6 +1186,7 @@ write_db_file(const char *reason)
     try {
         waif_before_saving();
         dbio_printf(header_format_string, current_db_version);
+        write_binary_header();
 
         user_list = db_all_users();
 
@@ -1066,7 +1222,7 @@ write_db_file(const char *reason)
         for (oid = 0; oid <= max_oid; oid++) {
             if (valid(oid))
                 for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next)
-                    if (v->program)
+                    if (HAS_PROGRAM(v))
                         nprogs++;
         }
 
@@ -1077,9 +1233,9 @@ write_db_file(const char *reason)
             if (valid(oid)) {
                 int vcount = 0;
                 for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next) {
-                    if (v->program) {
+                    if (HAS_PROGRAM(v)) {
                         dbio_printf("#%" PRIdN ":%" PRIdN "\n", oid, vcount);
-                        dbio_write_program(v->program);
+                        write_verb_program(v, oid);
                         if (++i % 5000 == 0 || i == nprogs)
                             oklog("%s: Done writing %" PRIdN " verb programs ...\n",
                                   reason, i);
@@ -1097,6 +1253,399 @@ write_db_file(const char *reason)
     return success;
 }
 
+/*********** Incremental checkpoints ***********/
+
+#ifdef INCREMENTAL_CHECKPOINTS
+
+/* A delta holds everything a full database file holds except for the
+ * objects (and their verb programs) that haven't changed since the
+ * previous checkpoint.  Deltas are numbered from 1 and named after the
+ * full database they apply to; each one records the size and
+ * modification time of that file so that stale deltas are never applied
+ * to the wrong database.
+ */
+static const char *delta_header_format_string
+    = "** LambdaMOO Delta, Format Version %u **\n";
+
+static std::vector<bool> dirty;         /* indexed by object number */
+static std::vector<Objid> dirty_list;   /* the objects set in `dirty' */
+static std::vector<Objid> held_list;    /* `dirty_list' when the running
+                                         * full dump started */
+
+static bool need_full_dump = true;      /* so is the first checkpoint */
+static bool held_need_full_dump = false;
+static bool full_dump_running = false;
+static bool checkpoint_forked = false;
+static int delta_count = 0;             /* deltas on the current dump */
+static unsigned int full_dump_nonce = 0;
+
+void
+dbpriv_mark_dirty(Object *o)
+{
+    if (need_full_dump)         /* nothing to keep track of */
+        return;
+
+    if (o->id == NOTHING) {
+        /* An anonymous object only makes it to disk as part of a full
+         * dump, so changes to one matter only if it was around for
+         * the last one.
+         */
+        if (o->nonce < full_dump_nonce)
+            need_full_dump = true;
+        return;
+    }
+
+    if ((size_t) o->id >= dirty.size())
+        dirty.resize(std::max((size_t) o->id + 1, dirty.size() * 2));
+    if (!dirty[o->id]) {
+        dirty[o->id] = true;
+        dirty_list.push_back(o->id);
+    }
+}
+
+void
+dbpriv_mark_dirty_objid(Objid oid)
+{
+    Object *o = dbpriv_find_object(oid);
+
+    if (o)
+        dbpriv_mark_dirty(o);
+}
+
+void
+db_note_unlogged_change(void)
+{
+    need_full_dump = true;
+}
+
+static void
+clear_dirty(void)
+{
+    for (Objid oid : dirty_list)
+        dirty[oid] = false;
+    dirty_list.clear();
+}
+
+/* The changes made so far go into the full dump about to be written.
+ * They're kept in `held_list' until it's known to have succeeded.
+ */
+static void
+full_dump_started(void)
+{
+    for (Objid oid : dirty_list)
+        dirty[oid] = false;
+    held_list.swap(dirty_list);
+    dirty_list.clear();
+
+    held_need_full_dump = need_full_dump;
+    need_full_dump = false;
+    full_dump_running = true;
+    full_dump_nonce = dbpriv_next_nonce();
+}
+
+static void
+full_dump_finished(int success)
+{
+    if (!full_dump_running)
+        return;
+    full_dump_running = false;
+
+    if (success)
+        delta_count = 0;
+    else {
+        /* The deltas written against the previous dump are still
+         * there, so carry on from them.
+         */
+        for (Objid oid : held_list)
+            if (!dirty[oid]) {
+                dirty[oid] = true;
+                dirty_list.push_back(oid);
+            }
+        need_full_dump = need_full_dump || held_need_full_dump;
+    }
+    held_list.clear();
+}
+
+static void
+remove_deltas(const char *db_name)
+{
+    Stream *s = new_stream(100);
+    int n;
+
+    for (n = 1;; n++) {
+        stream_printf(s, "%s.delta.%d", db_name, n);
+        if (remove(reset_stream(s)) != 0)
+            break;
+    }
+
+    free_stream(s);
+}
+
+static int
+write_db_delta(struct stat *base)
+{
+    Var user_list;
+    Verbdef *v;
+    Num nprogs = 0;
+    int i;
+
+    try {
+        dbio_printf(delta_header_format_string, current_db_version);
+        dbio_printf("%" PRIdN " %" PRIdN " %d\n",
+                    (Num) base->st_size, (Num) base->st_mtime, delta_count + 1);
+        write_binary_header();
+
+        user_list = db_all_users();
+
+        dbio_printf("%" PRIdN "\n", listlength(user_list));
+
+        for (i = 1; i <= user_list.v.list[0].v.num; i++)
+            dbio_write_objid(user_list.v.list[i].v.obj);
+
+        write_values_pending_finalization();
+        write_task_queue();
+        write_active_connections();
+
+        dbio_printf("%" PRIdN " %" PRIdN "\n",
+                    db_last_used_objid() + 1, (Num) dirty_list.size());
+
+        for (Objid oid : dirty_list) {
+            ng_write_object(oid);
+            if (valid(oid))
+                for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next)
+                    if (HAS_PROGRAM(v))
+                        nprogs++;
+        }
+
+        dbio_printf("%" PRIdN "\n", nprogs);
+
+        for (Objid oid : dirty_list) {
+            if (valid(oid)) {
+                int vcount = 0;
+                for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next) {
+                    if (HAS_PROGRAM(v)) {
+                        dbio_printf("#%" PRIdN ":%" PRIdN "\n", oid, vcount);
+                        write_verb_program(v, oid);
+                    }
+                    vcount++;
+                }
+            }
+        }
+    }
+    catch (dbpriv_dbio_failed& exception) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Writes the objects changed since the last checkpoint to the next delta.
+ * Returns 1 on success, 0 on failure and -1 if the changes can't be
+ * recorded in a delta, in which case a full dump is needed.
+ */
+static int
+dump_delta(const char *reason)
+{
+    Stream *s;
+    char *temp_name;
+    struct stat base;
+    FILE *f;
+    int result;
+
+    if (stat(dump_db_name, &base) < 0)
+        return -1;
+
+    s = new_stream(100);
+    stream_printf(s, "%s.delta.#%d#", dump_db_name, delta_count + 1);
+    temp_name = str_dup(reset_stream(s));
+
+    oklog("%s %" PRIdN " changed object%s on %s ...\n", reason,
+          (Num) dirty_list.size(), dirty_list.size() == 1 ? "" : "s", temp_name);
+
+    if ((f = fopen(temp_name, "w")) == nullptr) {
+        log_perror("Opening temporary delta file");
+        result = 0;
+    } else {
+        dbpriv_set_dbio_output(f);
+        dbpriv_set_dbio_plain_values_only(true);
+        try {
+            result = write_db_delta(&base);
+        }
+        catch (dbpriv_dbio_shared_value& exception) {
+            result = -1;
+        }
+        dbpriv_set_dbio_plain_values_only(false);
+
+        if (result == 1) {
+            fflush(f);
+            fsync(fileno(f));
+            fclose(f);
+            stream_printf(s, "%s.delta.%d", dump_db_name, delta_count + 1);
+            if (rename(temp_name, reset_stream(s)) != 0) {
+                log_perror("Renaming temporary delta file");
+                remove(temp_name);
+                result = 0;
+            }
+        } else {
+            if (result == 0)
+                log_perror("Trying to write delta");
+            fclose(f);
+            remove(temp_name);
+        }
+    }
+
+    if (result == 1) {
+        oklog("%s on %s.delta.%d finished\n", reason, dump_db_name, delta_count + 1);
+        delta_count++;
+        clear_dirty();
+        reset_command_history();
+    }
+
+    free_str(temp_name);
+    free_stream(s);
+
+    return result;
+}
+
+/* Returns 1 if the delta was applied, 0 if it is unusable and -1 if it
+ * doesn't belong to the database just read.
+ */
+static int
+read_db_delta(int seq, struct stat *base)
+{
+    Var user_list;
+    Num i, size, mtime, nusers, nobjs, nchanged, nprogs;
+    int n;
+
+    if (dbio_scanf(delta_header_format_string, &dbio_input_version) != 1
+            || !check_db_version(dbio_input_version)) {
+        errlog("READ_DB_DELTA: Bad header\n");
+        return 0;
+    }
+    if (dbio_scanf("%" SCNdN " %" SCNdN " %d\n", &size, &mtime, &n) != 3) {
+        errlog("READ_DB_DELTA: Bad base database\n");
+        return 0;
+    }
+    if (size != (Num) base->st_size || mtime != (Num) base->st_mtime || n != seq)
+        return -1;
+    if (!read_binary_header("READ_DB_DELTA"))
+        return 0;
+
+    if (dbio_scanf("%" SCNdN "\n", &nusers) != 1) {
+        errlog("READ_DB_DELTA: Bad number of users\n");
+        return 0;
+    }
+    user_list = new_list(nusers);
+    for (i = 1; i <= nusers; i++) {
+        user_list.v.list[i].type = TYPE_OBJ;
+        user_list.v.list[i].v.obj = dbio_read_objid();
+    }
+    free_var(db_all_users());
+    dbpriv_set_all_users(user_list);
+
+    if (!read_values_pending_finalization()) {
+        errlog("READ_DB_DELTA: Can't read values pending finalization.\n");
+        return 0;
+    }
+
+    discard_task_queue();
+    if (!read_task_queue()) {
+        errlog("READ_DB_DELTA: Can't read task queue.\n");
+        return 0;
+    }
+
+    if (!read_active_connections()) {
+        errlog("READ_DB_DELTA: Can't read active connections.\n");
+        return 0;
+    }
+
+    if (dbio_scanf("%" SCNdN " %" SCNdN "\n", &nobjs, &nchanged) != 2) {
+        errlog("READ_DB_DELTA: Bad object count\n");
+        return 0;
+    }
+    for (i = 1; i <= nchanged; i++) {
+        if (!ng_reread_object()) {
+            errlog("READ_DB_DELTA: Bad object, i = %" PRIdN ".\n", i);
+            return 0;
+        }
+    }
+    if (nobjs > 0) {
+        if (!valid(nobjs - 1))
+            dbpriv_reload_object(nobjs - 1, 0);
+        db_set_last_used_objid(nobjs);
+    }
+
+    if (dbio_scanf("%" SCNdN "\n", &nprogs) != 1) {
+        errlog("READ_DB_DELTA: Bad verb count header\n");
+        return 0;
+    }
+
+    return read_verb_programs(nprogs, 0);
+}
+
+static int
+replay_deltas(void)
+{
+    Stream *s = new_stream(100);
+    struct stat base;
+    FILE *f;
+    int n, result = 1;
+
+    if (stat(input_db_name, &base) < 0) {
+        free_stream(s);
+        return 1;
+    }
+
+    for (n = 1;; n++) {
+        stream_printf(s, "%s.delta.%d", input_db_name, n);
+        if (!(f = fopen(reset_stream(s), "r")))
+            break;
+
+        oklog("LOADING: Replaying %s.delta.%d ...\n", input_db_name, n);
+        dbpriv_set_dbio_input(f);
+        result = read_db_delta(n, &base);
+        fclose(f);
+
+        if (result < 0) {
+            oklog("LOADING: %s.delta.%d was written against another database; ignored\n",
+                  input_db_name, n);
+            result = 1;
+            break;
+        } else if (!result) {
+            errlog("READ_DB_FILE: Can't replay %s.delta.%d.\n", input_db_name, n);
+            break;
+        }
+    }
+
+    free_stream(s);
+
+    if (result && n > 1) {
+        db_clear_ancestor_cache();
+        dbpriv_flush_property_cache();
+
+        if (!ng_validate_hierarchies()) {
+            errlog("READ_DB_FILE: Errors in object hierarchies.\n");
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+int
+db_checkpoint_forked(void)
+{
+    return checkpoint_forked;
+}
+
+void
+db_checkpoint_finished(int success)
+{
+    full_dump_finished(success);
+}
+
+#endif /* INCREMENTAL_CHECKPOINTS */
+
 typedef enum {
     DUMP_SHUTDOWN, DUMP_CHECKPOINT, DUMP_PANIC
 } Dump_Reason;
@@ -1111,6 +1660,30 @@ dump_database(Dump_Reason reason)
     FILE *f;
     int success;
 
+#ifdef INCREMENTAL_CHECKPOINTS
+    if (reason == DUMP_CHECKPOINT) {
+        checkpoint_forked = false;
+        if (full_dump_running) {
+            errlog("%s: Previous full checkpoint still running; skipped\n",
+                   reason_names[reason]);
+            free_stream(s);
+            return 0;
+        }
+        if (!need_full_dump && delta_count < CHECKPOINT_COMPACT_INTERVAL) {
+            int result = dump_delta(reason_names[reason]);
+
+            if (result >= 0) {
+                free_stream(s);
+                return result;
+            }
+            oklog("%s: Changes can't be written incrementally; dumping everything\n",
+                  reason_names[reason]);
+        }
+    }
+    if (reason != DUMP_PANIC)
+        full_dump_started();
+#endif
+
 retryDumping:
 
     stream_printf(s, "%s.#%" PRIdN "#", dump_db_name, dump_generation);
@@ -1133,9 +1706,15 @@ retryDumping:
         switch (fork_server("checkpointer")) {
             case FORK_PARENT:
                 reset_command_history();
+#ifdef INCREMENTAL_CHECKPOINTS
+                checkpoint_forked = true;
+#endif
                 free_stream(s);
                 return 1;
             case FORK_ERROR:
+#ifdef INCREMENTAL_CHECKPOINTS
+                full_dump_finished(0);
+#endif
                 free_stream(s);
                 return 0;
             case FORK_CHILD:
@@ -1174,6 +1753,10 @@ retryDumping:
                     log_perror("Renaming temporary dump file");
                     success = 0;
                 }
+#ifdef INCREMENTAL_CHECKPOINTS
+                else    /* they're all in the new dump */
+                    remove_deltas(dump_db_name);
+#endif
             }
         }
     } else {
@@ -1183,6 +1766,11 @@ retryDumping:
 
     free_stream(s);
 
+#ifdef INCREMENTAL_CHECKPOINTS
+    if (reason != DUMP_PANIC)
+        full_dump_finished(success);
+#endif
+
 #ifndef UNFORKED_CHECKPOINTS
     if (reason == DUMP_CHECKPOINT)
         /* We're a child, so we'd better go away. */
@@ -1239,6 +1827,7 @@ db_load(void)
         errlog("DB_LOAD: Cannot load database!\n");
         return 0;
     }
+    dbpriv_set_dbio_input(nullptr);     /* drop the string table */
     oklog("LOADING: %s done, will dump new database on %s\n",
           input_db_name, dump_db_name);
 
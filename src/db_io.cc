@@ -25,6 +25,10 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "db.h"
 #include "db_io.h"
@@ -44,14 +48,127 @@
 #include "waif.h"
 
 
+/*********** Binary encoding ***********/
+
+/* In the binary encoding, numbers, floats, strings and programs are
+ * written as a tag byte followed by their binary representation, while
+ * everything written with dbio_printf() stays text.  The tags are never
+ * whitespace, digits or ASCII, so scanf() formats stop in front of them,
+ * and the readers fall back to text whenever the next byte isn't a tag;
+ * text written by dbio_printf() may thus still be read with the value
+ * readers below.
+ *
+ * Strings go through a table: the first occurrence of a string defines
+ * the next table index, and any later occurrence refers back to it.
+ */
+
+enum {
+    BIN_NUM = 0xF1,             /* zigzag varint */
+    BIN_FLOAT,                  /* 8 bytes, little-endian IEEE 754 */
+    BIN_STR,                    /* varint length, bytes; new table entry */
+    BIN_STR_REF,                /* varint table index */
+    BIN_LONG_STR,               /* varint length, bytes; not in the table */
+    BIN_PROGRAM                 /* see dbio_write_program() */
+};
+
+/* Longer strings are rarely repeated and aren't worth keeping around. */
+#define BIN_STR_TABLE_MAX 256
+
 /*********** Input ***********/
 
 static FILE *input;
+static bool binary_input = false;
+static std::vector<const char *> input_strings;
+
+static void
+clear_input_strings(void)
+{
+    for (auto s : input_strings)
+        free_str(s);
+    input_strings.clear();
+    input_strings.shrink_to_fit();
+}
 
 void
 dbpriv_set_dbio_input(FILE * f)
 {
     input = f;
+    binary_input = false;
+    clear_input_strings();
+}
+
+void
+dbpriv_set_dbio_binary_input(bool binary)
+{
+    binary_input = binary;
+}
+
+/* Returns the tag at the current position, if any, without consuming it. */
+static int
+peek_tag(void)
+{
+    int c;
+
+    if (!binary_input)
+        return EOF;
+
+    c = fgetc(input);
+    ungetc(c, input);
+    return c >= BIN_NUM && c <= BIN_PROGRAM ? c : EOF;
+}
+
+static uint64_t
+read_varint(void)
+{
+    uint64_t n = 0;
+    int shift = 0, c;
+
+    do {
+        if ((c = fgetc(input)) == EOF) {
+            errlog("DBIO_READ_VARINT: Unexpected EOF\n");
+            return 0;
+        }
+        if (shift < 64)
+            n |= (uint64_t) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return n;
+}
+
+static Num
+read_binary_num(void)
+{
+    uint64_t z = read_varint();
+
+    return (Num) (z >> 1) ^ -(Num) (z & 1);
+}
+
+static const char *
+read_binary_string(int tag)
+{
+    static std::string buffer;
+    uint64_t n = read_varint();
+
+    if (tag == BIN_STR_REF) {
+        if (n >= input_strings.size()) {
+            errlog("DBIO_READ_STRING: Bad string reference %" PRIu64
+                   " at file pos. %ld\n", n, ftell(input));
+            return "";
+        }
+        return input_strings[n];
+    }
+
+    buffer.resize(n);
+    if (n && fread(&buffer[0], 1, n, input) != n) {
+        errlog("DBIO_READ_STRING: Unexpected EOF\n");
+        buffer.clear();
+    }
+    if (tag == BIN_STR) {
+        input_strings.push_back(str_intern(buffer.c_str()));
+        return input_strings.back();
+    }
+    return buffer.c_str();
 }
 
 void
@@ -80,6 +197,11 @@ dbio_read_num(void)
     char *p;
     long long i;
 
+    if (peek_tag() == BIN_NUM) {
+        fgetc(input);
+        return read_binary_num();
+    }
+
     fgets(s, sizeof(s), input);
     i = strtoll(s, &p, 10);
     if (isspace(*s) || *p != '\n')
@@ -95,6 +217,17 @@ dbio_read_float(void)
     char *p;
     double d;
 
+    if (peek_tag() == BIN_FLOAT) {
+        uint64_t bits = 0;
+        int i;
+
+        fgetc(input);
+        for (i = 0; i < 8; i++)
+            bits |= (uint64_t) (fgetc(input) & 0xFF) << (8 * i);
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+
     fgets(s, 40, input);
     d = strtod(s, &p);
     if (isspace(*s) || *p != '\n')
@@ -114,7 +247,13 @@ dbio_read_string(void)
 {
     static Stream *str = nullptr;
     static char buffer[1024];
-    int len, used_stream = 0;
+    int len, used_stream = 0, tag;
+
+    if ((tag = peek_tag()) == BIN_STR || tag == BIN_STR_REF
+            || tag == BIN_LONG_STR) {
+        fgetc(input);
+        return read_binary_string(tag);
+    }
 
     if (str == nullptr)
         str = new_stream(1024);
@@ -141,6 +280,13 @@ const char *
 dbio_read_string_intern(void)
 {
     const char *s, *r;
+    int tag;
+
+    /* Table entries are interned already. */
+    if ((tag = peek_tag()) == BIN_STR || tag == BIN_STR_REF) {
+        fgetc(input);
+        return str_ref(read_binary_string(tag));
+    }
 
     s = dbio_read_string();
     r = str_intern(s);
@@ -271,6 +417,74 @@ my_getc(void *data)
 static Parser_Client parser_client =
 {my_error, my_warning, my_getc};
 
+static bool
+read_bytecodes(Bytecodes *bc)
+{
+    int i;
+    bool ok = true;
+    Byte *numbytes[] = {&bc->numbytes_label, &bc->numbytes_literal,
+                        &bc->numbytes_fork, &bc->numbytes_var_name,
+                        &bc->numbytes_stack};
+
+    for (i = 0; i < 5; i++)
+        if ((*numbytes[i] = read_varint()) > 4)
+            ok = false;
+
+    bc->size = read_varint();
+    bc->max_stack = read_varint();
+    bc->vector = (Byte *) mymalloc(ok ? bc->size : 0, M_BYTECODES);
+    return ok && fread(bc->vector, 1, bc->size, input) == bc->size;
+}
+
+static Program *
+read_binary_program(struct db_state *s)
+{
+    Program *prog = new_program();
+    unsigned i;
+    bool ok;
+
+    /* Leave nothing for free_program() to trip over if we bail out. */
+    prog->num_literals = prog->fork_vectors_size = prog->num_var_names = 0;
+    prog->literals = nullptr;
+    prog->var_names = (const char **) mymalloc(0, M_NAMES);
+    prog->main_vector.vector = nullptr;
+
+    prog->version = (DB_Version) read_varint();
+    prog->first_lineno = read_varint();
+    ok = check_db_version(prog->version) && read_bytecodes(&prog->main_vector);
+
+    if (ok && (i = read_varint()) > 0) {
+        prog->literals = (Var *) mymalloc(i * sizeof(Var), M_LIT_LIST);
+        for (; prog->num_literals < i; prog->num_literals++)
+            prog->literals[prog->num_literals] = dbio_read_var();
+    }
+
+    if (ok && (i = read_varint()) > 0) {
+        prog->fork_vectors = (Bytecodes *) mymalloc(i * sizeof(Bytecodes),
+                                                    M_FORK_VECTORS);
+        while (ok && prog->fork_vectors_size < i)
+            ok = read_bytecodes(&prog->fork_vectors[prog->fork_vectors_size++]);
+    }
+
+    if (ok && (i = read_varint()) > 0) {
+        myfree(prog->var_names, M_NAMES);
+        prog->var_names = (const char **) mymalloc(i * sizeof(const char *),
+                                                   M_NAMES);
+        for (; prog->num_var_names < i; prog->num_var_names++)
+            prog->var_names[prog->num_var_names] = dbio_read_string_intern();
+    }
+
+    if (!ok || feof(input)) {
+        my_error(s, "Bad compiled program");
+        if (!prog->main_vector.vector)
+            prog->main_vector.vector = (Byte *) mymalloc(0, M_BYTECODES);
+        free_program(prog);
+        return nullptr;
+    }
+
+    return prog;
+}
+
 Program *
 dbio_read_program(DB_Version version, const char *(*fmtr) (void *), void *data)
 {
@@ -279,18 +493,70 @@ dbio_read_program(DB_Version version, const char *(*fmtr) (void *), void *data)
     s.prev_char = '\n';
     s.fmtr = fmtr;
     s.data = data;
+
+    if (peek_tag() == BIN_PROGRAM) {
+        fgetc(input);
+        return read_binary_program(&s);
+    }
+
     return parse_program(version, parser_client, &s);
 }
 
 
+#ifdef LAZY_VERB_PROGRAMS
+const char *
+dbpriv_read_program_source(unsigned *length)
+{
+    static Stream *str = nullptr;
+    int c, prev_char = '\n';
+
+    if (peek_tag() == BIN_PROGRAM)
+        return nullptr;
+
+    if (str == nullptr)
+        str = new_stream(1024);
+
+    /* Stop where my_getc() would. */
+    while ((c = getc(input)) != EOF) {
+        if (c == '.' && prev_char == '\n') {
+            getc(input);
+            break;
+        }
+        stream_add_char(str, c);
+        prev_char = c;
+    }
+
+    *length = stream_length(str);
+    return reset_stream(str);
+}
+#endif
+
+
 /*********** Output ***********/
 
 static FILE *output;
+static bool plain_values_only = false;
+static bool binary_output = false;
+static std::unordered_map<std::string, uint64_t> output_strings;
 
 void
 dbpriv_set_dbio_output(FILE * f)
 {
     output = f;
+    binary_output = false;
+    output_strings.clear();
+}
+
+void
+dbpriv_set_dbio_binary_output(bool binary)
+{
+    binary_output = binary;
+}
+
+void
+dbpriv_set_dbio_plain_values_only(bool plain)
+{
+    plain_values_only = plain;
 }
 
 void
@@ -304,9 +570,46 @@ dbio_printf(const char *format, ...)
     va_end(args);
 }
 
+static void
+write_bytes(const void *bytes, size_t n)
+{
+    if (fwrite(bytes, 1, n, output) != n)
+        throw dbpriv_dbio_failed();
+}
+
+static void
+write_byte(int c)
+{
+    if (putc(c, output) == EOF)
+        throw dbpriv_dbio_failed();
+}
+
+static void
+write_varint(uint64_t n)
+{
+    Byte buf[10];
+    int len = 0;
+
+    do {
+        buf[len] = n & 0x7F;
+        n >>= 7;
+        if (n)
+            buf[len] |= 0x80;
+        len++;
+    } while (n);
+
+    write_bytes(buf, len);
+}
+
 void
 dbio_write_num(Num n)
 {
+    if (binary_output) {
+        write_byte(BIN_NUM);
+        write_varint(((uint64_t) n << 1) ^ (uint64_t) (n >> (sizeof(Num) * 8 - 1)));
+        return;
+    }
+
     dbio_printf("%" PRIdN "\n", n);
 }
 
@@ -316,6 +619,19 @@ dbio_write_float(double d)
     static const char *fmt = nullptr;
     static char buffer[10];
 
+    if (binary_output) {
+        uint64_t bits;
+        Byte buf[8];
+        int i;
+
+        memcpy(&bits, &d, sizeof(d));
+        for (i = 0; i < 8; i++)
+            buf[i] = bits >> (8 * i);
+        write_byte(BIN_FLOAT);
+        write_bytes(buf, 8);
+        return;
+    }
+
     if (!fmt) {
         sprintf(buffer, "%%.%dg\n", DBL_DIG + 4);
         fmt = buffer;
@@ -332,6 +648,28 @@ dbio_write_objid(Objid oid)
 void
 dbio_write_string(const char *s)
 {
+    if (binary_output) {
+        size_t len;
+
+        if (!s)
+            s = "";
+        len = strlen(s);
+        if (len <= BIN_STR_TABLE_MAX) {
+            auto found = output_strings.emplace(std::string(s, len),
+                                                output_strings.size());
+            if (!found.second) {
+                write_byte(BIN_STR_REF);
+                write_varint(found.first->second);
+                return;
+            }
+            write_byte(BIN_STR);
+        } else
+            write_byte(BIN_LONG_STR);
+        write_varint(len);
+        write_bytes(s, len);
+        return;
+    }
+
     dbio_printf("%s\n", s ? s : "");
 }
 
@@ -386,9 +724,13 @@ dbio_write_var(Var v)
                 dbio_write_var(v.v.list[i + 1]);
             break;
         case TYPE_ANON:
+            if (plain_values_only)
+                throw dbpriv_dbio_shared_value();
             db_write_anonymous(v);
             break;
         case TYPE_WAIF:
+            if (plain_values_only)
+                throw dbpriv_dbio_shared_value();
             write_waif(v);
             break;
         case TYPE_BOOL:
@@ -406,9 +748,48 @@ receiver(void *data, const char *line)
     dbio_printf("%s\n", line);
 }
 
+static void
+write_bytecodes(const Bytecodes *bc)
+{
+    write_varint(bc->numbytes_label);
+    write_varint(bc->numbytes_literal);
+    write_varint(bc->numbytes_fork);
+    write_varint(bc->numbytes_var_name);
+    write_varint(bc->numbytes_stack);
+    write_varint(bc->size);
+    write_varint(bc->max_stack);
+    write_bytes(bc->vector, bc->size);
+}
+
 void
 dbio_write_program(Program * program)
 {
+    unsigned i;
+
+    /* The binary encoding saves the compiled program as is, so that
+     * loading it doesn't involve the parser and code generator at all.
+     * Only a server with the same bytecode signature can read it back.
+     */
+    if (binary_output) {
+        write_byte(BIN_PROGRAM);
+        write_varint(program->version);
+        write_varint(program->first_lineno);
+        write_bytecodes(&program->main_vector);
+
+        write_varint(program->num_literals);
+        for (i = 0; i < program->num_literals; i++)
+            dbio_write_var(program->literals[i]);
+
+        write_varint(program->fork_vectors_size);
+        for (i = 0; i < program->fork_vectors_size; i++)
+            write_bytecodes(&program->fork_vectors[i]);
+
+        write_varint(program->num_var_names);
+        for (i = 0; i < program->num_var_names; i++)
+            dbio_write_string(program->var_names[i]);
+        return;
+    }
+
     unparse_program(program, receiver, nullptr, 1, 0, MAIN_VECTOR);
     dbio_printf(".\n");
 }
@@ -32,9 +32,10 @@
 #include "server.h"
 #include "storage.h"
 #include "utils.h"
+#include "waif.h"
 #include "dependencies/xtrapbits.h"
 #include "map.h"
-#include <unordered_map>
+#include <vector>
 #include "options.h"
 #include "log.h"
 
@@ -46,14 +47,27 @@ static unsigned int nonce = 0;
 
 static Var all_users;
 
-#ifdef USE_ANCESTOR_CACHE
-static std::unordered_map <int, Var> ancestor_cache;
-#endif /* USE_ANCESTOR_CACHE */
+/* Ancestors of objects that aren't cached (anonymous objects, or
+ * everything when USE_ANCESTOR_CACHE is off) are flattened into this.
+ * Each thread gets its own, since verb lookups can run on any of them.
+ */
+static thread_local std::vector<Objid> ancestor_scratch;
 
 /* used in graph traversals */
 static unsigned char *bit_array;
 static size_t array_size = 0;
 
+#ifdef USE_ANCESTOR_CACHE
+static void
+free_ancestor_cache(Object *o)
+{
+    if (o->ancestors) {
+        myfree(o->ancestors, M_ARRAY);
+        o->ancestors = nullptr;
+    }
+}
+#endif /* USE_ANCESTOR_CACHE */
+
 /*********** Objects qua objects ***********/
 
 Object *
@@ -138,6 +152,14 @@ void
 dbpriv_assign_nonce(Object *o)
 {
     o->nonce = nonce++;
+    if (o->id == SYSTEM_OBJECT)
+        dbpriv_system_properties_changed();
+}
+
+unsigned int
+dbpriv_next_nonce(void)
+{
+    return nonce;
 }
 
 void
@@ -172,6 +194,12 @@ dbpriv_new_object(Num new_objid)
     o = objects[new_objid] = (Object *)mymalloc(sizeof(Object), M_OBJECT);
     o->id = new_objid;
     o->waif_propdefs = nullptr;
+    dbpriv_assign_nonce(o);
+    dbpriv_assign_verb_generation(o);
+#ifdef USE_ANCESTOR_CACHE
+    o->ancestors = nullptr;
+#endif
+    dbpriv_mark_dirty(o);
 
     return o;
 }
@@ -184,6 +212,11 @@ dbpriv_new_anonymous_object(void)
     ensure_new_object();
     o = objects[num_objects] = (Object *)mymalloc(sizeof(Object), M_ANON);
     o->id = NOTHING;
+    dbpriv_assign_nonce(o);
+    dbpriv_assign_verb_generation(o);
+#ifdef USE_ANCESTOR_CACHE
+    o->ancestors = nullptr;
+#endif
     num_objects++;
 
     return o;
@@ -240,11 +273,16 @@ db_destroy_object(Objid oid)
     Verbdef *v, *w;
     int i;
 
-    db_priv_affected_callable_verb_lookup();
-
     if (!o)
         panic_moo("DB_DESTROY_OBJECT: Invalid object!");
 
+    dbpriv_mark_dirty(o);
+    db_priv_affected_callable_verb_lookup(o, VC_OBJECT_DESTROYED);
+    dbpriv_forget_cached_verbs(o);
+#ifdef USE_ANCESTOR_CACHE
+    free_ancestor_cache(o);
+#endif
+
     if (o->location.v.obj != NOTHING ||
             o->contents.v.list[0].v.num != 0 ||
             (o->parents.type == TYPE_OBJ && o->parents.v.obj != NOTHING) ||
@@ -282,8 +320,7 @@ db_destroy_object(Objid oid)
     o->nval = 0;
 
     for (v = o->verbdefs; v; v = w) {
-        if (v->program)
-            free_program(v->program);
+        dbpriv_free_verb_program(v);
         free_str(v->name);
         w = v->next;
         myfree(v, M_VERBDEF);
@@ -293,6 +330,66 @@ db_destroy_object(Objid oid)
     objects[oid] = nullptr;
 }
 
+Object *
+dbpriv_reload_object(Objid oid, int replace)
+{
+    Object *o;
+    Verbdef *v, *w;
+    int i;
+
+    extend(oid + 1);
+    if (oid >= num_objects)
+        num_objects = oid + 1;
+
+    if ((o = objects[oid]) != nullptr) {
+        dbpriv_forget_cached_verbs(o);
+#ifdef USE_ANCESTOR_CACHE
+        free_ancestor_cache(o);
+#endif
+        free_waif_propdefs((WaifPropdefs *)o->waif_propdefs);
+
+        free_var(o->parents);
+        free_var(o->children);
+        free_var(o->location);
+        free_var(o->last_move);
+        free_var(o->contents);
+        free_str(o->name);
+
+        for (i = 0; i < o->propdefs.cur_length; i++)
+            free_str(o->propdefs.l[i].name);
+        if (o->propdefs.l)
+            myfree(o->propdefs.l, M_PROPDEF);
+        for (i = 0; i < o->nval; i++)
+            free_var(o->propval[i].var);
+        if (o->propval)
+            myfree(o->propval, M_PVAL);
+
+        for (v = o->verbdefs; v; v = w) {
+            dbpriv_free_verb_program(v);
+            free_str(v->name);
+            w = v->next;
+            myfree(v, M_VERBDEF);
+        }
+
+        myfree(o, M_OBJECT);
+        objects[oid] = nullptr;
+    }
+
+    if (!replace)
+        return nullptr;
+
+    o = objects[oid] = (Object *)mymalloc(sizeof(Object), M_OBJECT);
+    o->id = oid;
+    o->waif_propdefs = nullptr;
+    dbpriv_assign_nonce(o);
+    dbpriv_assign_verb_generation(o);
+#ifdef USE_ANCESTOR_CACHE
+    o->ancestors = nullptr;
+#endif
+
+    return o;
+}
+
 Var
 db_read_anonymous()
 {
@@ -355,12 +452,17 @@ db_make_anonymous(Objid oid, Objid last)
     Var parent;
     int i, c;
 
+    dbpriv_mark_dirty(o);
+
     /* remove me from my old parents' children */
-    if (old_parents.type == TYPE_OBJ && old_parents.v.obj != NOTHING)
+    if (old_parents.type == TYPE_OBJ && old_parents.v.obj != NOTHING) {
+        dbpriv_mark_dirty(objects[old_parents.v.obj]);
         objects[old_parents.v.obj]->children = setremove(objects[old_parents.v.obj]->children, me);
-    else if (old_parents.type == TYPE_LIST)
-        FOR_EACH(parent, old_parents, i, c)
-        objects[parent.v.obj]->children = setremove(objects[parent.v.obj]->children, me);
+    } else if (old_parents.type == TYPE_LIST)
+        FOR_EACH(parent, old_parents, i, c) {
+            dbpriv_mark_dirty(objects[parent.v.obj]);
+            objects[parent.v.obj]->children = setremove(objects[parent.v.obj]->children, me);
+        }
 
     objects[oid] = nullptr;
     db_set_last_used_objid(last);
@@ -375,6 +477,11 @@ db_make_anonymous(Objid oid, Objid last)
     /* Last step, reallocate the memory and copy -- anonymous objects
      * require space for reference counting.
      */
+    dbpriv_forget_cached_verbs(o);
+#ifdef USE_ANCESTOR_CACHE
+    free_ancestor_cache(o);
+#endif
+
     Object *t = (Object *)mymalloc(sizeof(Object), M_ANON);
     memcpy(t, o, sizeof(Object));
     myfree(o, M_OBJECT);
@@ -389,6 +496,8 @@ db_destroy_anonymous_object(void *obj)
     Verbdef *v, *w;
     int i;
 
+    dbpriv_forget_cached_verbs(o);
+
     free_str(o->name);
     o->name = nullptr;
 
@@ -405,8 +514,7 @@ db_destroy_anonymous_object(void *obj)
     o->nval = 0;
 
     for (v = o->verbdefs; v; v = w) {
-        if (v->program)
-            free_program(v->program);
+        dbpriv_free_verb_program(v);
         free_str(v->name);
         w = v->next;
         myfree(v, M_VERBDEF);
@@ -474,6 +582,12 @@ db_renumber_object(Objid old)
 
     for (_new = 0; _new < old; _new++) {
         if (objects[_new] == nullptr) {
+            /* Renumbering touches every object that refers to `old'
+             * and may touch any object's owners, so leave it to the
+             * next full checkpoint.
+             */
+            db_note_unlogged_change();
+
             /* Change the identity of the object. */
             o = objects[_new] = objects[old];
             objects[old] = nullptr;
@@ -584,6 +698,10 @@ db_object_bytes(Var obj)
         count += memo_strlen(v->name) + 1;
         if (v->program)
             count += program_bytes(v->program);
+#ifdef LAZY_VERB_PROGRAMS
+        if (v->source)
+            count += sizeof(Verb_Source) + v->source->length;
+#endif
     }
 
     count += sizeof(Propdef) * o->propdefs.cur_length;
@@ -702,34 +820,80 @@ DEFUNC(descendants, children);
 DEFUNC(all_locations, location);
 DEFUNC(all_contents, contents);
 
-#ifdef USE_ANCESTOR_CACHE
 DEFUNC(find_ancestors, parents);
 
-Var db_ancestors(Var obj, bool full) {
-    Object *o = dbpriv_dereference(obj);
+static const Objid *
+flatten_ancestors(Var obj, int *count)
+{
+    Var ancestors = db_find_ancestors(obj, false);
+    int i, n = listlength(ancestors);
 
-    if (obj.type != TYPE_OBJ || !is_valid(obj) || o->parents.v.obj == NOTHING)
-        return db_find_ancestors(obj, full);
+    ancestor_scratch.resize(n);
+    for (i = 0; i < n; i++)
+        ancestor_scratch[i] = ancestors.v.list[i + 1].v.obj;
 
-    if (ancestor_cache.count(o->id) == 0)
-        ancestor_cache[o->id] = db_find_ancestors(obj, false);
+    free_var(ancestors);
 
-    Var ancestors = var_ref(ancestor_cache[o->id]);
+    *count = n;
+    return ancestor_scratch.data();
+}
 
-    /* The 'full' refcount only needs to be 1 because listinsert will be creating a new list and consuming
-     * the second reference to the cached copy (which we just created directly above this). This leaves us
-     * with a refcount of 1, which is the new list that we WANT to get destroyed.
-     * The non-full list should have a refcount of 2 so that when it gets consumed, the copy in the cache
-     * won't be freed. */
-    if (full)
-        return listinsert(ancestors, var_ref(obj), 1); /* listinsert consumes the list */
-    else
-        return ancestors;
+const Objid *
+dbpriv_ancestors(Object *o, int *count)
+{
+    Var obj;
+
+    if (o->parents.type == TYPE_OBJ && o->parents.v.obj == NOTHING) {
+        *count = 0;
+        return nullptr;
+    }
+
+    if (o->id > NOTHING)
+        obj = Var::new_obj(o->id);
+    else {
+        obj.type = TYPE_ANON;
+        obj.v.anon = o;
+    }
+
+#ifdef USE_ANCESTOR_CACHE
+    /* Anonymous objects aren't in their parents' lists of children, so
+     * there'd be no way to find their entries when an ancestor changes.
+     */
+    if (o->id > NOTHING) {
+        if (!o->ancestors) {
+            const Objid *ancestors = flatten_ancestors(obj, &o->ancestor_count);
+            o->ancestors = (Objid *)mymalloc(o->ancestor_count * sizeof(Objid), M_ARRAY);
+            memcpy(o->ancestors, ancestors, o->ancestor_count * sizeof(Objid));
+        }
+        *count = o->ancestor_count;
+        return o->ancestors;
+    }
+#endif /* USE_ANCESTOR_CACHE */
+
+    return flatten_ancestors(obj, count);
 }
-#else
-DEFUNC(ancestors, parents);
+
+Var
+db_ancestors(Var obj, bool full)
+{
+#ifdef USE_ANCESTOR_CACHE
+    if (obj.type == TYPE_OBJ && is_valid(obj)) {
+        int i, n;
+        const Objid *ancestors = dbpriv_ancestors(dbpriv_dereference(obj), &n);
+        Var list = new_list(n + (full ? 1 : 0));
+
+        if (full)
+            list.v.list[1] = obj;
+        for (i = 0; i < n; i++)
+            list.v.list[i + (full ? 2 : 1)] = Var::new_obj(ancestors[i]);
+
+        return list;
+    }
 #endif /* USE_ANCESTOR_CACHE */
 
+    return db_find_ancestors(obj, full);
+}
+
 #undef DEFUNC
 
 /*********** Object attributes ***********/
@@ -791,6 +955,7 @@ dbpriv_object_owner(Object *o)
 void
 dbpriv_set_object_owner(Object *o, Objid owner)
 {
+    dbpriv_mark_dirty(o);
     o->owner = owner;
 }
 
@@ -815,6 +980,7 @@ dbpriv_object_name(Object *o)
 void
 dbpriv_set_object_name(Object *o, const char *name)
 {
+    dbpriv_mark_dirty(o);
     if (o->name)
         free_str(o->name);
     o->name = name;
@@ -936,7 +1102,7 @@ db_change_parents(Var obj, Var new_parents, Var anon_kids)
         /* In any case, don't clear the cache. */
         ;
     } else {
-        db_priv_affected_callable_verb_lookup();
+        db_priv_affected_callable_verb_lookup(o, VC_PARENTS_CHANGED);
     }
 
     Var old_parents = o->parents;
@@ -950,18 +1116,24 @@ db_change_parents(Var obj, Var new_parents, Var anon_kids)
         int i, c;
 
         /* remove me/obj from my old parents' children */
-        if (old_parents.type == TYPE_OBJ && old_parents.v.obj != NOTHING)
+        if (old_parents.type == TYPE_OBJ && old_parents.v.obj != NOTHING) {
+            dbpriv_mark_dirty(objects[old_parents.v.obj]);
             objects[old_parents.v.obj]->children = setremove(objects[old_parents.v.obj]->children, obj);
-        else if (old_parents.type == TYPE_LIST)
-            FOR_EACH(parent, old_parents, i, c)
-            objects[parent.v.obj]->children = setremove(objects[parent.v.obj]->children, obj);
+        } else if (old_parents.type == TYPE_LIST)
+            FOR_EACH(parent, old_parents, i, c) {
+                dbpriv_mark_dirty(objects[parent.v.obj]);
+                objects[parent.v.obj]->children = setremove(objects[parent.v.obj]->children, obj);
+            }
 
         /* add me/obj to my new parents' children */
-        if (new_parents.type == TYPE_OBJ && new_parents.v.obj != NOTHING)
+        if (new_parents.type == TYPE_OBJ && new_parents.v.obj != NOTHING) {
+            dbpriv_mark_dirty(objects[new_parents.v.obj]);
             objects[new_parents.v.obj]->children = setadd(objects[new_parents.v.obj]->children, obj);
-        else if (new_parents.type == TYPE_LIST)
-            FOR_EACH(parent, new_parents, i, c)
-            objects[parent.v.obj]->children = setadd(objects[parent.v.obj]->children, obj);
+        } else if (new_parents.type == TYPE_LIST)
+            FOR_EACH(parent, new_parents, i, c) {
+                dbpriv_mark_dirty(objects[parent.v.obj]);
+                objects[parent.v.obj]->children = setadd(objects[parent.v.obj]->children, obj);
+            }
     }
 
     free_var(o->parents);
@@ -979,14 +1151,8 @@ db_change_parents(Var obj, Var new_parents, Var anon_kids)
     int i, c;
 
     Var descendants = db_descendants(obj, true);
-    FOR_EACH(desc, descendants, i, c) {
-        if (ancestor_cache.count(desc.v.obj) > 0) {
-            if (var_refcount(ancestor_cache[desc.v.obj]) > 1)
-                applog(LOG_ERROR, "Refcount too high for ancestor cache invalidation of #%i. Refcount = %i\n", desc.v.obj, var_refcount(ancestor_cache[desc.v.obj]));
-            free_var(ancestor_cache[desc.v.obj]);
-            ancestor_cache.erase(desc.v.obj);
-        }
-    }
+    FOR_EACH(desc, descendants, i, c)
+        free_ancestor_cache(dbpriv_dereference(desc));
     free_var(descendants);
 #endif /* USE_ANCESTOR_CACHE */
 
@@ -1052,6 +1218,10 @@ db_change_location(Objid oid, Objid new_location, int position)
 
     Objid old_location = objects[oid]->location.v.obj;
 
+    dbpriv_mark_dirty(objects[oid]);
+    dbpriv_mark_dirty_objid(old_location);
+    dbpriv_mark_dirty_objid(new_location);
+
     if (valid(old_location))
         objects[old_location]->contents = setremove(objects[old_location]->contents, var_dup(me));
 
@@ -1088,12 +1258,14 @@ dbpriv_object_has_flag(Object *o, db_object_flag f)
 void
 dbpriv_set_object_flag(Object *o, db_object_flag f)
 {
+    dbpriv_mark_dirty(o);
     o->flags |= (1 << f);
 }
 
 void
 dbpriv_clear_object_flag(Object *o, db_object_flag f)
 {
+    dbpriv_mark_dirty(o);
     o->flags &= ~(1 << f);
 }
 
@@ -1201,17 +1373,23 @@ db_fixup_owners(const Objid obj)
         if (!o)
             continue;
 
-        if (o->owner == obj)
+        if (o->owner == obj) {
+            dbpriv_mark_dirty(o);
             o->owner = NOTHING;
+        }
 
         for (Verbdef *v = o->verbdefs; v; v = v->next)
-            if (v->owner == obj)
+            if (v->owner == obj) {
+                dbpriv_mark_dirty(o);
                 v->owner = NOTHING;
+            }
 
         p = o->propval;
         for (int i = 0, count = o->nval; i < count; i++)
-            if (p[i].owner == obj)
+            if (p[i].owner == obj) {
+                dbpriv_mark_dirty(o);
                 p[i].owner = NOTHING;
+            }
     }
 }
 
@@ -1219,8 +1397,8 @@ void
 db_clear_ancestor_cache(void)
 {
 #ifdef USE_ANCESTOR_CACHE /*Just in case */
-    for (auto const& x : ancestor_cache)
-        free_var(x.second);
-    ancestor_cache.clear();
+    for (Objid oid = 0; oid < num_objects; oid++)
+        if (objects[oid])
+            free_ancestor_cache(objects[oid]);
 #endif
 }
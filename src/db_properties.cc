@@ -117,6 +117,8 @@ insert_prop2(Var obj, int pos, Pval pval)
     Pval *new_propval;
     int i, nprops;
 
+    dbpriv_mark_dirty(o);
+
     nprops = ++o->nval;
     new_propval = (Pval *)mymalloc(nprops * sizeof(Pval), M_PVAL);
 
@@ -201,6 +203,7 @@ db_add_propdef(Var obj, const char *pname, Var value, Objid owner,
         if (old_props)
             myfree(old_props, M_PROPDEF);
     }
+    dbpriv_mark_dirty(o);
     o->propdefs.l[o->propdefs.cur_length++] = dbpriv_new_propdef(pname);
 
     pval.var = value;
@@ -256,9 +259,12 @@ db_rename_propdef(Var obj, const char *old, const char *_new)
                     return 0;
             }
             rename_waif_prop_recursively(obj, props->l[i].name, _new);
+            dbpriv_mark_dirty(o);
             free_str(props->l[i].name);
             props->l[i].name = str_ref(_new);
             props->l[i].hash = str_hash(_new);
+            dbpriv_flush_property_cache();
+            dbpriv_system_properties_changed();
 
             return 1;
         }
@@ -274,6 +280,8 @@ remove_prop2(Var obj, int pos)
     Pval *new_propval;
     int i, nprops;
 
+    dbpriv_mark_dirty(o);
+
     nprops = --o->nval;
 
     dbpriv_assign_nonce(o);
@@ -467,6 +475,76 @@ get_bi_value(db_prop_handle h, Var * value)
     }
 }
 
+#ifdef PROPERTY_CACHE
+
+/*
+ * A direct-mapped cache of user-defined property lookups.  An entry
+ * remembers where `name' was found on `o' -- the defining object, the
+ * index of the propdef on the definer and the offset into `o->propval'.
+ * It stays good as long as `o' keeps the nonce it had when the entry
+ * was made, since every change to the propval layout of an object (or
+ * to the ancestors it inherits properties from) assigns a new nonce.
+ * Renaming a property doesn't touch the layout, so it flushes the whole
+ * cache instead.
+ */
+#define PC_TABLE_SIZE 4096
+#define PC_NAME_MAX 32
+
+struct pc_entry {
+    Object *o;
+    unsigned int nonce;
+    unsigned int generation;
+    int hash;
+    char name[PC_NAME_MAX];
+    Object *definer;
+    int index;
+    int offset;
+};
+
+static pc_entry pc_table[PC_TABLE_SIZE];
+static unsigned int pc_generation = 1;
+
+static int pc_hits = 0;
+static int pc_misses = 0;
+static int pc_flushes = 0;
+
+static inline pc_entry *
+pc_slot(Object *o, int hash)
+{
+    uintptr_t key = ((uintptr_t) o >> 4) ^ (o->nonce * 2654435761u) ^ (unsigned) hash;
+
+    return &pc_table[key & (PC_TABLE_SIZE - 1)];
+}
+
+void
+dbpriv_flush_property_cache(void)
+{
+    pc_generation++;
+    pc_flushes++;
+}
+
+Var
+db_property_cache_stats(void)
+{
+    int i, used = 0;
+    Var r;
+
+    for (i = 0; i < PC_TABLE_SIZE; i++)
+        if (pc_table[i].generation == pc_generation)
+            used++;
+
+    r = new_list(5);
+    r.v.list[1] = Var::new_int(pc_hits);
+    r.v.list[2] = Var::new_int(pc_misses);
+    r.v.list[3] = Var::new_int(pc_flushes);
+    r.v.list[4] = Var::new_int(used);
+    r.v.list[5] = Var::new_int(PC_TABLE_SIZE);
+
+    return r;
+}
+
+#endif /* PROPERTY_CACHE */
+
 /* does NOT consume `obj' and `name' */
 db_prop_handle
 db_find_property(Var obj, const char *name, Var *value)
@@ -485,7 +563,9 @@ db_find_property(Var obj, const char *name, Var *value)
     };
     static int ptable_init = 0;
     db_prop_handle h;
-    int i, n;
+    Proplist *props;
+    Propdef *defs;
+    int i, n, length;
 
     if (!ptable_init) {
         for (i = 0; i < Arraysize(ptable); i++)
@@ -495,6 +575,24 @@ db_find_property(Var obj, const char *name, Var *value)
 
     h.definer = nullptr;
     h.ptr = nullptr;
+    h.object = o;
+
+#ifdef PROPERTY_CACHE
+    /* Built-in property names are never cached, so a hit here can skip
+     * the built-in table.
+     */
+    pc_entry *pc = pc_slot(o, hash);
+
+    if (pc->o == o && pc->nonce == o->nonce && pc->generation == pc_generation
+            && pc->hash == hash && !strcasecmp(pc->name, name)) {
+        pc_hits++;
+        h.built_in = BP_NONE;
+        h.definer = pc->definer;
+        h.ptr = o->propval + pc->offset;
+        i = pc->index;
+        goto done;
+    }
+#endif
 
     for (i = 0; i < Arraysize(ptable); i++) {
         if (ptable[i].hash == hash && !strcasecmp(name, ptable[i].name)) {
@@ -508,11 +606,9 @@ db_find_property(Var obj, const char *name, Var *value)
 
     h.built_in = BP_NONE;
 
-    Var ancestor, ancestors = db_ancestors(obj, false);
-
-    Proplist *props = &(o->propdefs);
-    Propdef *defs = props->l;
-    int length = props->cur_length;
+    props = &(o->propdefs);
+    defs = props->l;
+    length = props->cur_length;
 
     n = 0;
 
@@ -520,18 +616,19 @@ db_find_property(Var obj, const char *name, Var *value)
         if (defs[i].hash == hash && !strcasecmp(defs[i].name, name)) {
             h.definer = o;
             h.ptr = o->propval + n;
-            goto done;
+            goto found;
         }
     }
 
     Object *t;
     int ai, ac;
+    const Objid *ancestors;
 
-    FOR_EACH(ancestor, ancestors, ai, ac) {
-        if (!is_valid(ancestor))
-            continue;
+    ancestors = dbpriv_ancestors(o, &ac);
 
-        t = dbpriv_dereference(ancestor);
+    for (ai = 0; ai < ac; ai++) {
+        if (!(t = dbpriv_find_object(ancestors[ai])))
+            continue;
 
         props = &(t->propdefs);
         defs = props->l;
@@ -541,17 +638,34 @@ db_find_property(Var obj, const char *name, Var *value)
             if (defs[i].hash == hash && !strcasecmp(defs[i].name, name)) {
                 h.definer = t;
                 h.ptr = o->propval + n;
-                goto done;
+                goto found;
             }
         }
     }
 
-done:
+#ifdef PROPERTY_CACHE
+    pc_misses++;
+#endif
 
-    free_var(ancestors);
+    return h;
+
+found:
+
+#ifdef PROPERTY_CACHE
+    pc_misses++;
+    if (strlen(name) < PC_NAME_MAX) {
+        pc->o = o;
+        pc->nonce = o->nonce;
+        pc->generation = pc_generation;
+        pc->hash = hash;
+        strcpy(pc->name, name);
+        pc->definer = (Object *)h.definer;
+        pc->index = i;
+        pc->offset = (Pval *)h.ptr - o->propval;
+    }
+#endif
 
-    if (!h.ptr)
-        return h;
+done:
 
     if (value) {
         Pval *prop = (Pval *)h.ptr;
@@ -612,12 +726,29 @@ db_property_value(db_prop_handle h)
     return value;
 }
 
+static unsigned int system_generation = 1;
+
+void
+dbpriv_system_properties_changed(void)
+{
+    system_generation++;
+}
+
+unsigned int
+db_system_property_generation(void)
+{
+    return system_generation;
+}
+
 void
 db_set_property_value(db_prop_handle h, Var value)
 {
     if (!h.built_in) {
         Pval *prop = (Pval *)h.ptr;
 
+        if (((Object *)h.object)->id == SYSTEM_OBJECT)
+            dbpriv_system_properties_changed();
+        dbpriv_mark_dirty((Object *)h.object);
         free_var(prop->var);
         prop->var = value;
     } else {
@@ -692,6 +823,9 @@ db_set_property_owner(db_prop_handle h, Objid oid)
     else {
         Pval *prop = (Pval *)h.ptr;
 
+        if (((Object *)h.object)->id == SYSTEM_OBJECT)
+            dbpriv_system_properties_changed();
+        dbpriv_mark_dirty((Object *)h.object);
         prop->owner = oid;
     }
 }
@@ -717,6 +851,9 @@ db_set_property_flags(db_prop_handle h, unsigned flags)
     else {
         Pval *prop = (Pval *)h.ptr;
 
+        if (((Object *)h.object)->id == SYSTEM_OBJECT)
+            dbpriv_system_properties_changed();
+        dbpriv_mark_dirty((Object *)h.object);
         prop->perms = flags;
     }
 }
@@ -923,6 +1060,8 @@ dbpriv_fix_properties_after_chparent(Var obj, Var old_ancestors, Var new_ancesto
 
     assert(old_count == me->nval);
 
+    dbpriv_mark_dirty(me);
+
     if (new_count != 0) {
         new_propval = (Pval *)mymalloc(new_count * sizeof(Pval), M_PVAL);
         int i2, c2, i3, c3;
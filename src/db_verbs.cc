@@ -21,7 +21,7 @@
 
 #include <assert.h>
 #include <ctype.h>
-
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -31,7 +31,9 @@
 #include "db_tune.h"
 #include "list.h"
 #include "log.h"
+#include "map.h"
 #include "parse_cmd.h"
+#include "parser.h"
 #include "program.h"
 #include "server.h"
 #include "storage.h"
@@ -205,7 +207,8 @@ db_add_verb(Var obj, const char *vnames, Objid owner, unsigned flags,
     Verbdef *v, *newv;
     int count;
 
-    db_priv_affected_callable_verb_lookup();
+    db_priv_affected_callable_verb_lookup(o, VC_VERB_ADDED);
+    dbpriv_mark_dirty(o);
 
     newv = (Verbdef *)mymalloc(sizeof(Verbdef), M_VERBDEF);
     newv->name = vnames;
@@ -214,6 +217,9 @@ db_add_verb(Var obj, const char *vnames, Objid owner, unsigned flags,
     newv->prep = prep;
     newv->next = nullptr;
     newv->program = nullptr;
+#ifdef LAZY_VERB_PROGRAMS
+    newv->source = nullptr;
+#endif
     if (o->verbdefs) {
         for (v = o->verbdefs, count = 2; v->next; v = v->next, ++count);
         v->next = newv;
@@ -281,7 +287,8 @@ db_delete_verb(db_verb_handle vh)
     Verbdef *v = h->verbdef;
     Verbdef *vv;
 
-    db_priv_affected_callable_verb_lookup();
+    db_priv_affected_callable_verb_lookup(o, VC_VERB_DELETED);
+    dbpriv_mark_dirty(o);
 
     vv = o->verbdefs;
     if (vv == v)
@@ -292,8 +299,7 @@ db_delete_verb(db_verb_handle vh)
         vv->next = v->next;
     }
 
-    if (v->program)
-        free_program(v->program);
+    dbpriv_free_verb_program(v);
     if (v->name)
         free_str(v->name);
     myfree(v, M_VERBDEF);
@@ -343,50 +349,115 @@ db_find_command_verb(Objid oid, const char *verb,
 }
 
 #ifdef VERB_CACHE
-int db_verb_generation = 0;
+/* Cache entries are keyed on the first object in a lookup that defines
+ * any verbs, and a lookup starting there depends only on that object and
+ * its ancestors.  So rather than flushing the whole table on every change,
+ * each object carries a generation; a change to an object gives it and all
+ * of its descendants a fresh one, and entries recorded under an older
+ * generation are treated as misses and replaced.
+ *
+ * Anonymous objects don't appear in their parents' children lists, so
+ * entries keyed on anonymous objects additionally record
+ * `vc_anon_generation', which moves whenever any permanent object is
+ * invalidated.
+ */
+unsigned int db_verb_generation = 0;
+static unsigned int vc_anon_generation = 0;
 
 int verbcache_hit = 0;
 int verbcache_neg_hit = 0;
 int verbcache_miss = 0;
+int verbcache_stale = 0;
+
+static int vc_invalidations[VC_REASON_COUNT];
+static int vc_objects_invalidated = 0;
+
+static const char *vc_reason_names[] = {
+    "verb added", "verb deleted", "verb renamed", "verb flags",
+    "verb args", "parents changed", "object destroyed"
+};
 
 typedef struct vc_entry vc_entry;
 
 struct vc_entry {
     unsigned int hash;
-#ifdef RONG
-    int generation;
-#endif
+    unsigned int generation;
+    unsigned int anon_generation;
     Object *object;
     char *verbname;
     handle h;
     struct vc_entry *next;
+    struct vc_entry *object_next;   /* other entries keyed on `object' */
+    struct vc_entry **object_prev;
 };
 
 static vc_entry **vc_table = nullptr;
 static int vc_size = 0;
+static int vc_count = 0;
 
 #define DEFAULT_VC_SIZE 7507
 
+static inline bool
+vc_entry_is_current(vc_entry *vc)
+{
+    return vc->generation == vc->object->verb_generation
+           && (vc->object->id > NOTHING || vc->anon_generation == vc_anon_generation);
+}
+
+static void
+free_vc_entry(vc_entry *vc)
+{
+    if (vc->object_next)
+        vc->object_next->object_prev = vc->object_prev;
+    *vc->object_prev = vc->object_next;
+    vc_count--;
+    free_str(vc->verbname);
+    myfree(vc, M_VC_ENTRY);
+}
+
 void
-db_priv_affected_callable_verb_lookup(void)
+dbpriv_assign_verb_generation(Object *o)
 {
-    int i;
-    vc_entry *vc, *vc_next;
+    o->verb_generation = ++db_verb_generation;
+    o->verb_cache_entries = nullptr;
+}
+
+void
+db_priv_affected_callable_verb_lookup(Object *o, vc_reason why)
+{
+    unsigned int generation = ++db_verb_generation;
+
+    vc_invalidations[why]++;
 
-    if (vc_table == nullptr)
+    o->verb_generation = generation;
+    vc_objects_invalidated++;
+
+    if (o->id <= NOTHING)
         return;
 
-    db_verb_generation++;
+    vc_anon_generation++;
 
-    for (i = 0; i < vc_size; i++) {
-        vc = vc_table[i];
-        while (vc) {
-            vc_next = vc->next;
-            free_str(vc->verbname);
-            myfree(vc, M_VC_ENTRY);
-            vc = vc_next;
-        }
-        vc_table[i] = nullptr;
+    Var desc, descendants = db_descendants(Var::new_obj(o->id), false);
+    int i, c;
+
+    FOR_EACH(desc, descendants, i, c) {
+        dbpriv_find_object(desc.v.obj)->verb_generation = generation;
+        vc_objects_invalidated++;
+    }
+
+    free_var(descendants);
+}
+
+void
+dbpriv_forget_cached_verbs(Object *o)
+{
+    vc_entry *vc, **prev;
+
+    while ((vc = o->verb_cache_entries)) {
+        for (prev = &vc_table[vc->hash % vc_size]; *prev != vc; prev = &(*prev)->next)
+            ;
+        *prev = vc->next;
+        free_vc_entry(vc);
     }
 }
 
@@ -402,8 +473,35 @@ make_vc_table(int size)
     }
 }
 
+/* Entries are no longer flushed wholesale, so let the table grow
+ * with the number of (object, verb) pairs actually looked up.
+ */
+static void
+grow_vc_table(void)
+{
+    vc_entry **old_table = vc_table;
+    int i, old_size = vc_size;
+    vc_entry *vc, *vc_next;
+
+    make_vc_table(old_size * 2 + 1);
+
+    for (i = 0; i < old_size; i++) {
+        for (vc = old_table[i]; vc; vc = vc_next) {
+            vc_next = vc->next;
+            vc->next = vc_table[vc->hash % vc_size];
+            vc_table[vc->hash % vc_size] = vc;
+        }
+    }
+
+    myfree(old_table, M_VC_TABLE);
+}
+
 #define VC_CACHE_STATS_MAX 16
 
+/* Returns {hits, negative hits, misses, generation, {depth histogram},
+ *          stale entries replaced, objects invalidated,
+ *          ["reason" -> invalidations, ...]}
+ */
 Var
 db_verb_cache_stats(void)
 {
@@ -424,7 +522,7 @@ db_verb_cache_stats(void)
         histogram[depth]++;
     }
 
-    v = new_list(5);
+    v = new_list(9);
     v.v.list[1].type = TYPE_INT;
     v.v.list[1].v.num = verbcache_hit;
     v.v.list[2].type = TYPE_INT;
@@ -438,6 +536,14 @@ db_verb_cache_stats(void)
         vv.v.list[i + 1].type = TYPE_INT;
         vv.v.list[i + 1].v.num = histogram[i];
     }
+    v.v.list[6] = Var::new_int(verbcache_stale);
+    v.v.list[7] = Var::new_int(vc_objects_invalidated);
+    vv = new_map();
+    for (i = 0; i < VC_REASON_COUNT; i++)
+        vv = mapinsert(vv, str_dup_to_var(vc_reason_names[i]), Var::new_int(vc_invalidations[i]));
+    v.v.list[8] = vv;
+    v.v.list[9] = Var::new_int(dbpriv_uncompiled_verbs());
+
     return v;
 }
 
@@ -460,14 +566,16 @@ db_log_cache_stats(void)
         histogram[depth]++;
     }
 
-    oklog("Verb cache stat summary: %d hits, %d misses, %d generations\n",
-          verbcache_hit, verbcache_miss, db_verb_generation);
+    oklog("Verb cache stat summary: %d hits, %d misses, %d stale, %d generations\n",
+          verbcache_hit, verbcache_miss, verbcache_stale, db_verb_generation);
+    oklog("Invalidations:\n");
+    for (i = 0; i < VC_REASON_COUNT; i++)
+        oklog("%-18s %d\n", vc_reason_names[i], vc_invalidations[i]);
     oklog("Depth   Count\n");
     for (i = 0; i < VC_CACHE_STATS_MAX + 1; i++)
         oklog("%-5d   %-5d\n", i, histogram[i]);
     oklog("---\n");
 }
-
 #endif
 
 /*
@@ -493,30 +601,17 @@ find_callable_verbdef(Object *start, const char *verb)
         return data;
     }
 
-    Var stack = enlist_var(var_ref(start->parents));
-
-    while (listlength(stack) > 0) {
-        Var top;
-
-        POP_TOP(top, stack);
-
-        o = dbpriv_find_object(top.v.obj);
-        free_var(top);
+    int i, count;
+    const Objid *ancestors = dbpriv_ancestors(start, &count);
 
-        if (!o) /* if it's invalid, AKA $nothing */
+    for (i = 0; i < count; i++) {
+        if (!(o = dbpriv_find_object(ancestors[i])))
             continue;
 
         if ((v = find_verbdef_by_name(o, verb, 1)) != nullptr)
             break;
-
-        if (TYPE_OBJ == o->parents.type)
-            stack = listinsert(stack, var_ref(o->parents), 1);
-        else
-            stack = listconcat(var_ref(o->parents), stack);
     }
 
-    free_var(stack);
-
     struct verbdef_definer_data data;
     data.o = o;
     data.v = v;
@@ -589,9 +684,18 @@ try_again:
         hash = str_hash(verb) ^ (~first_parent_with_verbs); /* ewww, but who cares */
         bucket = hash % vc_size;
 
-        for (vc = vc_table[bucket]; vc; vc = vc->next) {
+        vc_entry **prev;
+
+        for (prev = &vc_table[bucket]; (vc = *prev); prev = &vc->next) {
             if (hash == vc->hash
                     && o == vc->object && !strcasecmp(verb, vc->verbname)) {
+                if (!vc_entry_is_current(vc)) {
+                    /* recorded before a change to `o' or an ancestor */
+                    verbcache_stale++;
+                    *prev = vc->next;
+                    free_vc_entry(vc);
+                    break;
+                }
                 /* we haaave a winnaaah */
                 if (vc->h.verbdef) {
                     verbcache_hit++;
@@ -625,10 +729,23 @@ try_again:
          * so that repeated failures hit the cache instead of going
          * through a lookup.
          */
+        if (vc_count > vc_size * 2) {
+            grow_vc_table();
+            bucket = hash % vc_size;
+        }
+
         new_vc = (vc_entry *)mymalloc(sizeof(vc_entry), M_VC_ENTRY);
 
         new_vc->hash = hash;
+        new_vc->generation = o->verb_generation;
+        new_vc->anon_generation = vc_anon_generation;
         new_vc->object = o;
+        new_vc->object_next = o->verb_cache_entries;
+        new_vc->object_prev = &o->verb_cache_entries;
+        if (o->verb_cache_entries)
+            o->verb_cache_entries->object_prev = &new_vc->object_next;
+        o->verb_cache_entries = new_vc;
+        vc_count++;
         new_vc->verbname = str_dup(verb);
         new_vc->h.verbdef = nullptr;
         new_vc->next = vc_table[bucket];
@@ -759,9 +876,9 @@ db_set_verb_names(db_verb_handle vh, const char *names)
 {
     handle *h = (handle *) vh.ptr;
 
-    db_priv_affected_callable_verb_lookup();
-
     if (h) {
+        db_priv_affected_callable_verb_lookup(h->definer, VC_VERB_RENAMED);
+        dbpriv_mark_dirty(h->definer);
         if (h->verbdef->name)
             free_str(h->verbdef->name);
         h->verbdef->name = names;
@@ -786,9 +903,10 @@ db_set_verb_owner(db_verb_handle vh, Objid owner)
 {
     handle *h = (handle *) vh.ptr;
 
-    if (h)
+    if (h) {
+        dbpriv_mark_dirty(h->definer);
         h->verbdef->owner = owner;
-    else
+    } else
         panic_moo("DB_SET_VERB_OWNER: Null handle!");
 }
 
@@ -809,9 +927,9 @@ db_set_verb_flags(db_verb_handle vh, unsigned flags)
 {
     handle *h = (handle *) vh.ptr;
 
-    db_priv_affected_callable_verb_lookup();
-
     if (h) {
+        db_priv_affected_callable_verb_lookup(h->definer, VC_VERB_FLAGS);
+        dbpriv_mark_dirty(h->definer);
         h->verbdef->perms &= ~PERMMASK;
         h->verbdef->perms |= flags;
     } else
@@ -824,7 +942,7 @@ db_verb_program(db_verb_handle vh)
     handle *h = (handle *) vh.ptr;
 
     if (h) {
-        Program *p = h->verbdef->program;
+        Program *p = dbpriv_verb_program(h->verbdef, h->definer->id);
 
         return p ? p : null_program();
     }
@@ -838,13 +956,173 @@ db_set_verb_program(db_verb_handle vh, Program * program)
     handle *h = (handle *) vh.ptr;
 
     if (h) {
-        if (h->verbdef->program)
-            free_program(h->verbdef->program);
+        dbpriv_mark_dirty(h->definer);
+        dbpriv_free_verb_program(h->verbdef);
         h->verbdef->program = program;
     } else
         panic_moo("DB_SET_VERB_PROGRAM: Null handle!");
 }
 
+#ifdef LAZY_VERB_PROGRAMS
+
+/* Sources waiting to be compiled are packed into blocks of at least
+ * SOURCE_BLOCK_SIZE bytes.  A block is freed once the last of its
+ * sources has been compiled or discarded.
+ */
+#define SOURCE_BLOCK_SIZE 65536
+
+struct Source_Block {
+    size_t pending;             /* sources in the block still waiting */
+    size_t used, size;          /* bytes of the block after this header */
+};
+
+static Source_Block *current_block = nullptr;
+static int uncompiled_verbs = 0;
+
+static Verb_Source *
+new_verb_source(const char *text, unsigned length)
+{
+    size_t need = offsetof(Verb_Source, text) + length + 1;
+    Verb_Source *s;
+
+    need = (need + alignof(Verb_Source) - 1) & ~(alignof(Verb_Source) - 1);
+
+    if (!current_block || current_block->size - current_block->used < need) {
+        Source_Block *old = current_block;
+        size_t size = need > SOURCE_BLOCK_SIZE ? need : SOURCE_BLOCK_SIZE;
+
+        current_block = (Source_Block *)mymalloc(sizeof(Source_Block) + size,
+                                                 M_PROGRAM);
+        current_block->pending = current_block->used = 0;
+        current_block->size = size;
+
+        if (old && !old->pending)
+            myfree(old, M_PROGRAM);
+    }
+
+    s = (Verb_Source *)((char *)(current_block + 1) + current_block->used);
+    current_block->used += need;
+    current_block->pending++;
+
+    s->block = current_block;
+    s->length = length;
+    s->unparsable = false;
+    memcpy(s->text, text, length);
+    s->text[length] = '\0';
+
+    uncompiled_verbs++;
+
+    return s;
+}
+
+static void
+release_verb_source(Verb_Source *s)
+{
+    Source_Block *b = s->block;
+
+    if (!s->unparsable)
+        uncompiled_verbs--;
+    if (--b->pending == 0 && b != current_block)
+        myfree(b, M_PROGRAM);
+}
+
+void
+dbpriv_set_verb_source(db_verb_handle vh, const char *text, unsigned length)
+{
+    handle *h = (handle *) vh.ptr;
+
+    if (h) {
+        dbpriv_mark_dirty(h->definer);
+        dbpriv_free_verb_program(h->verbdef);
+        h->verbdef->source = new_verb_source(text, length);
+    } else
+        panic_moo("DBPRIV_SET_VERB_SOURCE: Null handle!");
+}
+
+void
+dbpriv_free_verb_program(Verbdef *v)
+{
+    if (v->program)
+        free_program(v->program);
+    v->program = nullptr;
+
+    if (v->source)
+        release_verb_source(v->source);
+    v->source = nullptr;
+}
+
+struct compile_state {
+    const char *next;
+    Objid definer;
+    const char *name;
+};
+
+static void
+compile_error(void *data, const char *msg)
+{
+    struct compile_state *s = (struct compile_state *)data;
+
+    errlog("PARSER: Error in #%" PRIdN ":%s:\n", s->definer, s->name);
+    errlog("           %s\n", msg);
+}
+
+static void
+compile_warning(void *data, const char *msg)
+{
+    struct compile_state *s = (struct compile_state *)data;
+
+    oklog("PARSER: Warning in #%" PRIdN ":%s:\n", s->definer, s->name);
+    oklog("           %s\n", msg);
+}
+
+static int
+compile_getc(void *data)
+{
+    struct compile_state *s = (struct compile_state *)data;
+
+    return *s->next ? (unsigned char) *s->next++ : EOF;
+}
+
+static Parser_Client compile_client =
+{compile_error, compile_warning, compile_getc};
+
+Program *
+dbpriv_verb_program(Verbdef *v, Objid definer)
+{
+    if (v->source && !v->source->unparsable) {
+        Verb_Source *source = v->source;
+        struct compile_state s = {source->text, definer, v->name};
+
+        /* Only sources written by this database format version are
+         * kept, see read_verb_programs().
+         */
+        v->program = parse_program(current_db_version, compile_client, &s);
+
+        if (v->program) {
+            v->source = nullptr;
+            release_verb_source(source);
+        } else {
+            /* Keep the source, so that checkpoints don't lose it; the verb
+             * runs as if it had no program until it is reprogrammed.
+             */
+            source->unparsable = true;
+            uncompiled_verbs--;
+            errlog("DBPRIV_VERB_PROGRAM: Unparsable program #%" PRIdN ":%s\n",
+                   definer, v->name);
+        }
+    }
+
+    return v->program;
+}
+
+int
+dbpriv_uncompiled_verbs(void)
+{
+    return uncompiled_verbs;
+}
+
+#endif /* LAZY_VERB_PROGRAMS */
+
 void
 db_verb_arg_specs(db_verb_handle vh,
                   db_arg_spec * dobj, db_prep_spec * prep, db_arg_spec * iobj)
@@ -865,9 +1143,9 @@ db_set_verb_arg_specs(db_verb_handle vh,
 {
     handle *h = (handle *) vh.ptr;
 
-    db_priv_affected_callable_verb_lookup();
-
     if (h) {
+        db_priv_affected_callable_verb_lookup(h->definer, VC_VERB_ARGS);
+        dbpriv_mark_dirty(h->definer);
         h->verbdef->perms = ((h->verbdef->perms & PERMMASK)
                              | (dobj << DOBJSHIFT)
                              | (iobj << IOBJSHIFT));
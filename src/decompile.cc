@@ -295,6 +295,9 @@ finish_while:
                 push_expr((Expr *)HOT_OP(e));
                 break;
             case OP_G_PUSH:
+#ifdef BYTECODE_REDUCE_REF
+            case OP_G_PUSH_CLEAR:
+#endif              /* BYTECODE_REDUCE_REF */
                 e = alloc_expr(EXPR_ID);
                 e->e.id = READ_ID();
                 push_expr((Expr *)HOT_OP(e));
@@ -880,6 +883,23 @@ finish_extended_binary:
                         push_expr((Expr *)HOT_OP1(e->e.expr, e));
                         break;
 
+                    case EOP_VAR_GET_PROP:
+                        kind = EXPR_PROP;
+                        goto finish_superinstruction;
+                    case EOP_VAR_INDEX:
+                        kind = EXPR_INDEX;
+                        goto finish_superinstruction;
+                    case EOP_VAR_ADD:
+                        kind = EXPR_PLUS;
+finish_superinstruction:
+                        e = alloc_expr(EXPR_ID);
+                        e->e.id = READ_BYTES(1);
+                        push_expr(e);
+                        e = alloc_expr(EXPR_VAR);
+                        e->e.var = var_ref(READ_LITERAL());
+                        push_expr(e);
+                        goto finish_extended_binary;
+
                     default:
                         panic_moo("Unknown extended opcode in DECOMPILE!");
                 }
@@ -20,6 +20,7 @@
 #include "bf_register.h"
 #include "config.h"
 #include "db.h"
+#include "disassemble.h"
 #include "functions.h"
 #include "list.h"
 #include "opcode.h"
@@ -119,7 +120,10 @@ struct mapping ext_mappings[] =
     {EOP_BITXOR, "BITXOR"},
     {EOP_BITSHL, "BITSHL"},
     {EOP_BITSHR, "BITSHR"},
-    {EOP_COMPLEMENT, "COMPLEMENT"}
+    {EOP_COMPLEMENT, "COMPLEMENT"},
+    {EOP_VAR_GET_PROP, "VAR_GET_PROP"},
+    {EOP_VAR_INDEX, "VAR_INDEX"},
+    {EOP_VAR_ADD, "VAR_ADD"}
 };
 
 static void
@@ -145,6 +149,33 @@ initialize_tables(void)
     tables_initialized = 1;
 }
 
+const char *
+opcode_name(unsigned op)
+{
+    initialize_tables();
+
+    if (IS_OPTIM_NUM_OPCODE(op))
+        return "NUM";
+#ifdef BYTECODE_REDUCE_REF
+    else if (IS_PUSH_CLEAR_n(op))
+        return mnemonics[OP_G_PUSH_CLEAR];
+#endif /* BYTECODE_REDUCE_REF */
+    else if (IS_PUSH_n(op))
+        return mnemonics[OP_G_PUSH];
+    else if (IS_PUT_n(op))
+        return mnemonics[OP_G_PUT];
+    else
+        return mnemonics[op];
+}
+
+const char *
+ext_opcode_name(unsigned eop)
+{
+    initialize_tables();
+
+    return ext_mnemonics[eop];
+}
+
 typedef void (*Printer) (const char *, void *);
 static Printer print;
 static void *print_data;
@@ -192,6 +223,40 @@ finish_insn(Stream * s, Stream * insn)
     output(s);
 }
 
+static void
+add_literal(Stream * insn, Var v)
+{
+    const char *ptr;
+
+    switch (v.type) {
+        case TYPE_OBJ:
+            stream_printf(insn, " #%" PRIdN, v.v.obj);
+            break;
+        case TYPE_INT:
+            stream_printf(insn, " %" PRIdN, v.v.num);
+            break;
+        case TYPE_FLOAT:
+            stream_add_char(insn, ' ');
+            unparse_value(insn, v);
+            break;
+        case TYPE_STR:
+            stream_add_string(insn, " \"");
+            for (ptr = v.v.str; *ptr; ptr++) {
+                if (*ptr == '"' || *ptr == '\\')
+                    stream_add_char(insn, '\\');
+                stream_add_char(insn, *ptr);
+            }
+            stream_add_char(insn, '"');
+            break;
+        case TYPE_ERR:
+            stream_printf(insn, " %s", error_name(v.v.err));
+            break;
+        default:
+            stream_printf(insn, " <literal type = %d>", v.type);
+            break;
+    }
+}
+
 static void
 disassemble(Program * prog, Printer p, void *data)
 {
@@ -200,7 +265,6 @@ disassemble(Program * prog, Printer p, void *data)
     int i, l;
     unsigned pc;
     Bytecodes bc;
-    const char *ptr;
     const char **names = prog->var_names;
     unsigned tmp, num_names = prog->num_var_names;
 #   define NAMES(i) (tmp = i, tmp < num_names ? names[tmp] : "*** Unknown variable ***")
@@ -324,6 +388,12 @@ disassemble(Program * prog, Printer p, void *data)
                         a3 = ADD_BYTES(bc.numbytes_label);
                         stream_printf(insn, " %s %s %d", NAMES(a1), NAMES(a2), a3);
                         break;
+                    case EOP_VAR_GET_PROP:
+                    case EOP_VAR_INDEX:
+                    case EOP_VAR_ADD:
+                        stream_printf(insn, " %s", NAMES(ADD_BYTES(1)));
+                        add_literal(insn, literals[ADD_BYTES(bc.numbytes_literal)]);
+                        break;
                     default:
                         break;
                 }
@@ -362,40 +432,8 @@ disassemble(Program * prog, Printer p, void *data)
                                       NAMES(ADD_BYTES(bc.numbytes_var_name)));
                         break;
                     case OP_IMM:
-                    {
-                        Var v;
-
-                        v = literals[ADD_BYTES(bc.numbytes_literal)];
-                        switch (v.type) {
-                            case TYPE_OBJ:
-                                stream_printf(insn, " #%" PRIdN, v.v.obj);
-                                break;
-                            case TYPE_INT:
-                                stream_printf(insn, " %" PRIdN, v.v.num);
-                                break;
-                            case TYPE_FLOAT:
-                                stream_add_char(insn, ' ');
-                                unparse_value(insn, v);
-                                break;
-                            case TYPE_STR:
-                                stream_add_string(insn, " \"");
-                                for (ptr = v.v.str; *ptr; ptr++) {
-                                    if (*ptr == '"' || *ptr == '\\')
-                                        stream_add_char(insn, '\\');
-                                    stream_add_char(insn, *ptr);
-                                }
-                                stream_add_char(insn, '"');
-                                break;
-                            case TYPE_ERR:
-                                stream_printf(insn, " %s", error_name(v.v.err));
-                                break;
-                            default:
-                                stream_printf(insn, " <literal type = %d>",
-                                              v.type);
-                                break;
-                        }
-                    }
-                    break;
+                        add_literal(insn, literals[ADD_BYTES(bc.numbytes_literal)]);
+                        break;
                     case OP_BI_FUNC_CALL:
                         stream_printf(insn, " %s", name_func_by_num(ADD_BYTES(1)));
                     default:
@@ -431,6 +469,41 @@ disassemble_to_stderr(Program * prog)
     disassemble_to_file(stderr, prog);
 }
 
+static unsigned
+hash_signature(unsigned hash, const char *s, unsigned value)
+{
+    /* FNV-1a */
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char) *s) * 16777619;
+    return (hash ^ value) * 16777619;
+}
+
+unsigned
+bytecode_signature(void)
+{
+    const char *not_found = name_func_by_num(FUNC_NOT_FOUND);
+    const char *name;
+    unsigned hash = 2166136261u, i;
+
+    for (i = 0; i < Arraysize(mappings); i++)
+        hash = hash_signature(hash, mappings[i].name, mappings[i].value);
+    for (i = 0; i < Arraysize(ext_mappings); i++)
+        hash = hash_signature(hash, ext_mappings[i].name, ext_mappings[i].value);
+
+    hash = hash_signature(hash, "NUM_READY_VARS", NUM_READY_VARS);
+    hash = hash_signature(hash, "OPTIM_NUM_START", OPTIM_NUM_START);
+    hash = hash_signature(hash, "OPTIM_NUM_LOW", OPTIM_NUM_LOW);
+#ifdef BYTECODE_REDUCE_REF
+    /* Servers before this one never emitted G_PUSH_CLEAR, and can't run it. */
+    hash = hash_signature(hash, "G_PUSH_CLEAR", 1);
+#endif
+
+    for (i = 0; (name = name_func_by_num(i)) != not_found; i++)
+        hash = hash_signature(hash, name, i);
+
+    return hash;
+}
+
 struct data {
     char **lines;
     int used, max;
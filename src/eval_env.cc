@@ -17,29 +17,90 @@
 
 #include "config.h"
 #include "eval_env.h"
+#include "list.h"
 #include "storage.h"
 #include "structures.h"
 #include "sym_table.h"
 #include "utils.h"
 
 /*
- * Keep a pool of rt_envs big enough to hold NUM_READY_VARS variables to
- * avoid lots of malloc/free.
+ * Keep pools of rt_envs and rt_stacks around to avoid lots of
+ * malloc/free, since every verb call needs one of each.  Sizes are
+ * rounded up to a power of two, from RT_POOL_MIN_SIZE to
+ * RT_POOL_MAX_SIZE variables, and each size class has its own free
+ * list, chained through the first variable of each free block.
+ * Anything bigger goes straight to mymalloc().
  */
-static Var *ready_size_rt_envs;
+#define RT_POOL_MIN_SIZE    16
+#define RT_POOL_CLASSES     8
+#define RT_POOL_MAX_SIZE    (RT_POOL_MIN_SIZE << (RT_POOL_CLASSES - 1))
+
+typedef struct {
+    const char *name;
+    Memory_Type type;
+    Var *free[RT_POOL_CLASSES];
+    unsigned pooled[RT_POOL_CLASSES];
+    uint64_t hits[RT_POOL_CLASSES];
+    uint64_t misses[RT_POOL_CLASSES];
+} Rt_Pool;
+
+static Rt_Pool env_pool = {"env", M_RT_ENV};
+static Rt_Pool stack_pool = {"stack", M_RT_STACK};
+
+static unsigned
+rt_pool_class(unsigned size)
+{
+    unsigned c = 0, n = RT_POOL_MIN_SIZE;
+
+    while (n < size && c < RT_POOL_CLASSES) {
+        n <<= 1;
+        c++;
+    }
+
+    return c;
+}
+
+static Var *
+rt_pool_alloc(Rt_Pool *pool, unsigned size)
+{
+    unsigned c = rt_pool_class(size);
+    Var *ret;
+
+    if (c == RT_POOL_CLASSES)
+        return (Var *)mymalloc(size * sizeof(Var), pool->type);
+
+    if ((ret = pool->free[c])) {
+        pool->free[c] = ret[0].v.list;
+        pool->pooled[c]--;
+        pool->hits[c]++;
+    } else {
+        ret = (Var *)mymalloc((RT_POOL_MIN_SIZE << c) * sizeof(Var), pool->type);
+        pool->misses[c]++;
+    }
+
+    return ret;
+}
+
+static void
+rt_pool_free(Rt_Pool *pool, Var *block, unsigned size)
+{
+    unsigned c = rt_pool_class(size);
+
+    if (c == RT_POOL_CLASSES)
+        myfree(block, pool->type);
+    else {
+        block[0].v.list = pool->free[c];
+        pool->free[c] = block;
+        pool->pooled[c]++;
+    }
+}
 
 Var *
 new_rt_env(unsigned size)
 {
-    Var *ret;
+    Var *ret = rt_pool_alloc(&env_pool, size);
     unsigned i;
 
-    if (size <= NUM_READY_VARS && ready_size_rt_envs) {
-        ret = ready_size_rt_envs;
-        ready_size_rt_envs = ret[0].v.list;
-    } else
-        ret = (Var *)mymalloc(MAX(size, NUM_READY_VARS) * sizeof(Var), M_RT_ENV);
-
     for (i = 0; i < size; i++)
         ret[i].type = TYPE_NONE;
 
@@ -54,11 +115,52 @@ free_rt_env(Var * rt_env, unsigned size)
     for (i = 0; i < size; i++)
         free_var(rt_env[i]);
 
-    if (size <= NUM_READY_VARS) {
-        rt_env[0].v.list = ready_size_rt_envs;
-        ready_size_rt_envs = rt_env;
-    } else
-        myfree((void *) rt_env, M_RT_ENV);
+    rt_pool_free(&env_pool, rt_env, size);
+}
+
+Var *
+new_rt_stack(unsigned size)
+{
+    return rt_pool_alloc(&stack_pool, size);
+}
+
+void
+free_rt_stack(Var * rt_stack, unsigned size)
+{
+    rt_pool_free(&stack_pool, rt_stack, size);
+}
+
+static Var
+rt_pool_rows(Var r, const Rt_Pool *pool)
+{
+    unsigned c;
+
+    for (c = 0; c < RT_POOL_CLASSES; c++) {
+        if (!pool->hits[c] && !pool->misses[c])
+            continue;
+
+        Var row = new_list(5);
+
+        row.v.list[1] = str_dup_to_var(pool->name);
+        row.v.list[2] = Var::new_int(RT_POOL_MIN_SIZE << c);
+        row.v.list[3] = Var::new_int(pool->pooled[c]);
+        row.v.list[4] = Var::new_int(pool->hits[c]);
+        row.v.list[5] = Var::new_int(pool->misses[c]);
+        r = listappend(r, row);
+    }
+
+    return r;
+}
+
+Var
+rt_pool_stats(void)
+{
+    Var r = new_list(0);
+
+    r = rt_pool_rows(r, &env_pool);
+    r = rt_pool_rows(r, &stack_pool);
+
+    return r;
 }
 
 Var *
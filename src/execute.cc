@@ -35,6 +35,7 @@
 #include "opcode.h"
 #include "options.h"
 #include "parse_cmd.h"
+#include "profiler.h"
 #include "server.h"
 #include "storage.h"
 #include "streams.h"
@@ -60,6 +61,12 @@ static Num root_activ_vector;   /* root_activ_vector == MAIN_VECTOR
 
 /* these globals are not part of the vm because they get re-initialized after a suspend */
 static int ticks_remaining;
+/* While the profiler is running, all but one of the running task's ticks
+ * are held here, so that every ticking opcode runs out and goes to
+ * profile_tick().  FETCH_OPCODE() then needs no check of its own for the
+ * profiler.
+ */
+static int ticks_held;
 int task_timed_out;
 static int interpreter_is_running = 0;
 static Timer_ID task_alarm_id;
@@ -111,43 +118,13 @@ typedef enum {          /* Reasons for executing a FINALLY handler */
     FIN_EXIT
 } Finally_Reason;
 
-/*
- * Keep a pool of the common size rt_stacks around to avoid beating up on
- * malloc.  This doesn't really need tuning.  Most rt_stacks will be less
- * than size 10.  I rounded up to a size which won't waste a lot of space
- * with a powers-of-two malloc (while leaving some room for mymalloc
- * overhead, if any).
- */
-static Var *rt_stack_quick;
-#define RT_STACK_QUICKSIZE  15
-
 static void
 alloc_rt_stack(activation * a, Num size)
 {
-    Var *res;
-
-    if (size <= RT_STACK_QUICKSIZE && rt_stack_quick) {
-        res = rt_stack_quick;
-        rt_stack_quick = rt_stack_quick[0].v.list;
-    } else {
-        res = (Var *)mymalloc(MAX(size, RT_STACK_QUICKSIZE) * sizeof(Var), M_RT_STACK);
-    }
-    a->base_rt_stack = a->top_rt_stack = res;
+    a->base_rt_stack = a->top_rt_stack = new_rt_stack(size);
     a->rt_stack_size = size;
 }
 
-static void
-free_rt_stack(activation * a)
-{
-    Var *stack = a->base_rt_stack;
-
-    if (a->rt_stack_size <= RT_STACK_QUICKSIZE) {
-        stack[0].v.list = rt_stack_quick;
-        rt_stack_quick = stack;
-    } else
-        myfree(stack, M_RT_STACK);
-}
-
 void
 print_error_backtrace(const char *msg, void (*output) (const char *))
 {
@@ -623,7 +600,7 @@ free_activation(activation * ap, char data_too)
 
     for (i = ap->base_rt_stack; i < ap->top_rt_stack; i++)
         free_var(*i);
-    free_rt_stack(ap);
+    free_rt_stack(ap->base_rt_stack, ap->rt_stack_size);
     free_var(ap->temp);
     free_var(ap->_this);
     free_var(ap->vloc);
@@ -638,6 +615,83 @@ free_activation(activation * ap, char data_too)
 }
 
 
+/*
+ * Verbs called on WAIFs are looked up on their class under the verb
+ * name prefixed with WAIF_VERB_PREFIX.  Recently used names are kept
+ * here in both forms so that calls don't build a new string each time.
+ */
+#define WAIF_VERB_NAMES 256
+
+static struct {
+    const char *name;
+    const char *prefixed;
+} waif_verb_names[WAIF_VERB_NAMES];
+
+/* Returns a reference to NAME with WAIF_VERB_PREFIX in front. */
+static const char *
+waif_verb_name(const char *name)
+{
+    auto &e = waif_verb_names[str_hash(name) & (WAIF_VERB_NAMES - 1)];
+
+    if (!e.name || strcmp(e.name, name) != 0) {
+        char *str = (char *)mymalloc(strlen(name) + 2, M_STRING);
+
+        str[0] = WAIF_VERB_PREFIX;
+        strcpy(str + 1, name);
+        if (e.name) {
+            free_str(e.name);
+            free_str(e.prefixed);
+        }
+        e.name = str_ref(name);
+        e.prefixed = str;
+    }
+
+    return str_ref(e.prefixed);
+}
+
+/* Returns a reference to VNAME without WAIF_VERB_PREFIX. */
+static const char *
+waif_verb_name_unprefixed(const char *vname)
+{
+    auto &e = waif_verb_names[str_hash(vname + 1) & (WAIF_VERB_NAMES - 1)];
+
+    if (e.prefixed == vname)
+        return str_ref(e.name);
+
+    return str_dup(vname + 1);
+}
+
+/*
+ * Verbs called on values that aren't objects are looked up on the
+ * prototype object for their type, `#0.<type>_proto'.  The prototypes
+ * are remembered until a property of #0 changes.
+ */
+static struct {
+    unsigned int generation;
+    Objid proto;
+} type_protos[TYPE_COMPLEX_FLAG];
+
+static Objid
+type_prototype(var_type type, const char *pname)
+{
+    auto &c = type_protos[type & ~TYPE_COMPLEX_FLAG];
+    unsigned int generation = db_system_property_generation();
+    db_prop_handle h;
+    Var p;
+
+    if (c.generation != generation) {
+        h = db_find_property(Var::new_obj(SYSTEM_OBJECT), pname, &p);
+        if (!h.ptr || p.type != TYPE_OBJ)
+            p = Var::new_obj(NOTHING);
+        /* The cache doesn't notice changes to inherited values. */
+        if (!h.ptr || db_property_value(h).type != TYPE_CLEAR)
+            c.generation = generation;
+        c.proto = p.v.obj;
+    }
+
+    return valid(c.proto) ? c.proto : NOTHING;
+}
+
 /** Set up another activation for calling a verb
   does not change the vm in case of any error **/
 
@@ -773,7 +827,7 @@ call_verb2(Objid recv, const char *vname, Var _this, Var args, int do_pass, bool
 
     v.type = TYPE_STR;
     if (vname[0] == WAIF_VERB_PREFIX)
-        v.v.str = str_dup(vname + 1);
+        v.v.str = waif_verb_name_unprefixed(vname);
     else
         v.v.str = str_ref(vname);
     set_rt_env_var(env, SLOT_VERB, v);  /* no var_dup */
@@ -788,6 +842,63 @@ call_verb2(Objid recv, const char *vname, Var _this, Var args, int do_pass, bool
 #define bi_prop_protected(prop, progr) ((!is_wizard(progr)) && server_flag_option_cached(prop))
 #endif              /* IGNORE_PROP_PROTECTED */
 
+/* Hands the running task's stack to the profiler. */
+static void
+profile_sample(void)
+{
+    static Profile_Frame *frames = nullptr;
+    static unsigned max_frames = 0;
+    unsigned i, count = top_activ_stack + 1;
+
+    if (count > max_frames) {
+        if (frames)
+            myfree(frames, M_STRUCT);
+        max_frames = count * 2;
+        frames = (Profile_Frame *)mymalloc(max_frames * sizeof(Profile_Frame), M_STRUCT);
+    }
+
+    for (i = 0; i < count; i++) {
+        activation *a = &activ_stack[i];
+
+        frames[i].prog = a->prog;
+        frames[i].vector = (i == 0 ? root_activ_vector : MAIN_VECTOR);
+        frames[i].pc = a->error_pc;
+        frames[i].definer = (TYPE_OBJ == a->vloc.type ? a->vloc.v.obj : NOTHING);
+        frames[i].verbname = a->verbname;
+    }
+
+    profiler_sample(frames, count);
+}
+
+void
+hold_ticks_for_profiler(void)
+{
+    if (profiler_running && ticks_remaining > 1) {
+        ticks_held += ticks_remaining - 1;
+        ticks_remaining = 1;
+    }
+}
+
+/* Called by FETCH_OPCODE() when ticks_remaining runs out, with the state
+ * variables stored.  Returns false if the task really is out of ticks.
+ */
+static bool
+profile_tick(Opcode op)
+{
+    ticks_remaining += ticks_held;
+    ticks_held = 0;
+    if (ticks_remaining <= 0)
+        return false;
+
+    if (profiler_running) {
+        profiler_opcode_counts[op]++;
+        if (--profiler_countdown <= 0)
+            profile_sample();
+        hold_ticks_for_profiler();
+    }
+    return true;
+}
+
 /**
   the main interpreter -- run()
   everything is just an entry point to it
@@ -961,37 +1072,134 @@ run(char raise, enum error resumption_error, Var * result)
 
 #define JUMP(label)     (bv = bc.vector + label)
 
+#define FETCH_OPCODE()                              \
+    do {                                            \
+        error_bv = bv;                              \
+        op = (Opcode)(*bv++);                       \
+        if (COUNT_TICK(op)) {                       \
+            if (--ticks_remaining <= 0) {           \
+                STORE_STATE_VARIABLES();            \
+                if (!profile_tick(op)) {            \
+                    abort_task(ABORT_TICKS);        \
+                    return OUTCOME_ABORTED;         \
+                }                                   \
+            }                                       \
+            if (task_timed_out) {                   \
+                STORE_STATE_VARIABLES();            \
+                abort_task(ABORT_SECONDS);          \
+                return OUTCOME_ABORTED;             \
+            }                                       \
+        }                                           \
+    } while (0)
+
+    /* With THREADED_DISPATCH, every opcode's code ends by fetching the
+     * next opcode and jumping straight to its code through
+     * `dispatch_table', rather than going back around the loop to the
+     * switch.  The branch predictor then gets to learn which opcode
+     * tends to follow which.  TARGET() labels each opcode's code for the
+     * table; DISPATCH() ends it.  Without THREADED_DISPATCH, they are
+     * just the switch's `break'.
+     */
+#ifdef THREADED_DISPATCH
+#define TARGET(name)    name:
+#define DISPATCH()                                  \
+    do {                                            \
+        FETCH_OPCODE();                             \
+        goto *dispatch_table[op];                   \
+    } while (0)
+#else
+#define TARGET(name)
+#define DISPATCH()      break
+#endif
+
     /* end of major run() macros */
 
+#ifdef THREADED_DISPATCH
+    static void *dispatch_table[256];
+
+    if (!dispatch_table[0]) {
+        int i;
+
+        for (i = 0; i < 256; i++)
+            dispatch_table[i] = &&op_default;
+
+        dispatch_table[OP_IF_QUES] = dispatch_table[OP_IF] = &&op_IF_QUES;
+        dispatch_table[OP_WHILE] = dispatch_table[OP_EIF] = &&op_IF_QUES;
+        dispatch_table[OP_JUMP] = &&op_JUMP;
+        dispatch_table[OP_FOR_RANGE] = &&op_FOR_RANGE;
+        dispatch_table[OP_POP] = &&op_POP;
+        dispatch_table[OP_IMM] = &&op_IMM;
+        dispatch_table[OP_MAP_CREATE] = &&op_MAP_CREATE;
+        dispatch_table[OP_MAP_INSERT] = &&op_MAP_INSERT;
+        dispatch_table[OP_MAKE_EMPTY_LIST] = &&op_MAKE_EMPTY_LIST;
+        dispatch_table[OP_LIST_ADD_TAIL] = &&op_LIST_ADD_TAIL;
+        dispatch_table[OP_LIST_APPEND] = &&op_LIST_APPEND;
+        dispatch_table[OP_INDEXSET] = &&op_INDEXSET;
+        dispatch_table[OP_MAKE_SINGLETON_LIST] = &&op_MAKE_SINGLETON_LIST;
+        dispatch_table[OP_CHECK_LIST_FOR_SPLICE] = &&op_CHECK_LIST_FOR_SPLICE;
+        dispatch_table[OP_PUT_TEMP] = &&op_PUT_TEMP;
+        dispatch_table[OP_PUSH_TEMP] = &&op_PUSH_TEMP;
+        dispatch_table[OP_EQ] = dispatch_table[OP_NE] = &&op_EQ;
+        dispatch_table[OP_GT] = dispatch_table[OP_LT] = &&op_GT;
+        dispatch_table[OP_GE] = dispatch_table[OP_LE] = &&op_GT;
+        dispatch_table[OP_IN] = &&op_IN;
+        dispatch_table[OP_MULT] = dispatch_table[OP_MINUS] = &&op_MULT;
+        dispatch_table[OP_DIV] = dispatch_table[OP_MOD] = &&op_MULT;
+        dispatch_table[OP_ADD] = &&op_ADD;
+        dispatch_table[OP_AND] = dispatch_table[OP_OR] = &&op_AND;
+        dispatch_table[OP_NOT] = &&op_NOT;
+        dispatch_table[OP_UNARY_MINUS] = &&op_UNARY_MINUS;
+        dispatch_table[OP_REF] = &&op_REF;
+        dispatch_table[OP_PUSH_REF] = &&op_PUSH_REF;
+        dispatch_table[OP_RANGE_REF] = &&op_RANGE_REF;
+        dispatch_table[OP_G_PUT] = &&op_G_PUT;
+        dispatch_table[OP_G_PUSH] = &&op_G_PUSH;
+        dispatch_table[OP_GET_PROP] = &&op_GET_PROP;
+        dispatch_table[OP_PUSH_GET_PROP] = &&op_PUSH_GET_PROP;
+        dispatch_table[OP_PUT_PROP] = &&op_PUT_PROP;
+        dispatch_table[OP_FORK] = dispatch_table[OP_FORK_WITH_ID] = &&op_FORK;
+        dispatch_table[OP_CALL_VERB] = &&op_CALL_VERB;
+        dispatch_table[OP_RETURN] = dispatch_table[OP_RETURN0] = &&op_RETURN;
+        dispatch_table[OP_DONE] = &&op_RETURN;
+        dispatch_table[OP_BI_FUNC_CALL] = &&op_BI_FUNC_CALL;
+        dispatch_table[OP_EXTENDED] = &&op_EXTENDED;
+        for (i = 0; i < NUM_READY_VARS; i++) {
+            dispatch_table[OP_PUSH + i] = &&op_PUSH;
+            dispatch_table[OP_PUT + i] = &&op_PUT;
+#ifdef BYTECODE_REDUCE_REF
+            dispatch_table[OP_PUSH_CLEAR + i] = &&op_PUSH_CLEAR;
+#endif
+        }
+#ifdef BYTECODE_REDUCE_REF
+        dispatch_table[OP_G_PUSH_CLEAR] = &&op_G_PUSH_CLEAR;
+#endif
+    }
+#endif /* THREADED_DISPATCH */
+
     LOAD_STATE_VARIABLES();
 
+    if (profiler_running) {
+        profiler_task_resumed();
+        hold_ticks_for_profiler();
+    }
+
     if (raise) {
         error_bv = bv;
         PUSH_ERROR(resumption_error);
     }
     for (;;) {
 next_opcode:
-        error_bv = bv;
-        op = (Opcode)(*bv++);
-
-        if (COUNT_TICK(op)) {
-            if (--ticks_remaining <= 0) {
-                STORE_STATE_VARIABLES();
-                abort_task(ABORT_TICKS);
-                return OUTCOME_ABORTED;
-            }
-            if (task_timed_out) {
-                STORE_STATE_VARIABLES();
-                abort_task(ABORT_SECONDS);
-                return OUTCOME_ABORTED;
-            }
-        }
+        FETCH_OPCODE();
+#ifdef THREADED_DISPATCH
+        goto *dispatch_table[op];
+#endif
         switch (op) {
 
             case OP_IF_QUES:
             case OP_IF:
             case OP_WHILE:
             case OP_EIF:
+            TARGET(op_IF_QUES)
 do_test:
                 {
                     Var cond;
@@ -1006,16 +1214,18 @@ do_test:
                     }
                     free_var(cond);
                 }
-                break;
+                DISPATCH();
 
             case OP_JUMP:
+            TARGET(op_JUMP)
             {
                 unsigned lab = READ_BYTES(bv, bc.numbytes_label);
                 JUMP(lab);
             }
-            break;
+            DISPATCH();
 
             case OP_FOR_RANGE:
+            TARGET(op_FOR_RANGE)
             {
                 unsigned id = READ_BYTES(bv, bc.numbytes_var_name);
                 unsigned lab = READ_BYTES(bv, bc.numbytes_label);
@@ -1060,13 +1270,15 @@ do_test:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_POP:
+            TARGET(op_POP)
                 free_var(POP());
-                break;
+                DISPATCH();
 
             case OP_IMM:
+            TARGET(op_IMM)
             {
                 int slot;
 
@@ -1076,23 +1288,25 @@ do_test:
                  */
                 if (bv[bc.numbytes_literal] == OP_POP) {
                     bv += bc.numbytes_literal + 1;
-                    break;
+                    DISPATCH();
                 }
                 slot = READ_BYTES(bv, bc.numbytes_literal);
                 PUSH_REF(RUN_ACTIV.prog->literals[slot]);
             }
-            break;
+            DISPATCH();
 
             case OP_MAP_CREATE:
+            TARGET(op_MAP_CREATE)
             {
                 Var map;
 
                 map = new_map();
                 PUSH(map);
             }
-            break;
+            DISPATCH();
 
             case OP_MAP_INSERT:
+            TARGET(op_MAP_INSERT)
             {
                 Var r, map, key, value;
                 key = POP(); /* any except list or map */
@@ -1113,18 +1327,20 @@ do_test:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_MAKE_EMPTY_LIST:
+            TARGET(op_MAKE_EMPTY_LIST)
             {
                 Var list;
 
                 list = new_list(0);
                 PUSH(list);
             }
-            break;
+            DISPATCH();
 
             case OP_LIST_ADD_TAIL:
+            TARGET(op_LIST_ADD_TAIL)
             {
                 Var r, tail, list;
 
@@ -1144,9 +1360,10 @@ do_test:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_LIST_APPEND:
+            TARGET(op_LIST_APPEND)
             {
                 Var r, tail, list;
 
@@ -1166,13 +1383,14 @@ do_test:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             /* This opcode will not increase the length of a string
              * but it may increase the size of a list or map, thus the
              * check.
              */
             case OP_INDEXSET:
+            TARGET(op_INDEXSET)
             {
                 Var value, index, list;
 
@@ -1262,9 +1480,10 @@ do_test:
                         PUSH(list);
                     }
             }
-            break;
+            DISPATCH();
 
             case OP_MAKE_SINGLETON_LIST:
+            TARGET(op_MAKE_SINGLETON_LIST)
             {
                 Var list;
 
@@ -1272,28 +1491,32 @@ do_test:
                 list.v.list[1] = POP();
                 PUSH(list);
             }
-            break;
+            DISPATCH();
 
             case OP_CHECK_LIST_FOR_SPLICE:
+            TARGET(op_CHECK_LIST_FOR_SPLICE)
                 if (TOP_RT_VALUE.type != TYPE_LIST) {
                     var_type rt_value_type = TOP_RT_VALUE.type;
                     free_var(POP());
                     PUSH_TYPE_MISMATCH(1, rt_value_type, TYPE_LIST);
                 }
                 /* no op if top-rt-stack is a list */
-                break;
+                DISPATCH();
 
             case OP_PUT_TEMP:
+            TARGET(op_PUT_TEMP)
                 RUN_ACTIV.temp = var_ref(TOP_RT_VALUE);
-                break;
+                DISPATCH();
 
             case OP_PUSH_TEMP:
+            TARGET(op_PUSH_TEMP)
                 PUSH(RUN_ACTIV.temp);
                 RUN_ACTIV.temp.type = TYPE_NONE;
-                break;
+                DISPATCH();
 
             case OP_EQ:
             case OP_NE:
+            TARGET(op_EQ)
             {
                 Var rhs, lhs, ans;
 
@@ -1307,12 +1530,13 @@ do_test:
                 free_var(rhs);
                 free_var(lhs);
             }
-            break;
+            DISPATCH();
 
             case OP_GT:
             case OP_LT:
             case OP_GE:
             case OP_LE:
+            TARGET(op_GT)
             {
                 Var rhs, lhs, ans;
                 int comparison;
@@ -1378,9 +1602,10 @@ finish_comparison:
                     free_var(lhs);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_IN:
+            TARGET(op_IN)
             {
                 Var lhs, rhs, ans;
 
@@ -1406,12 +1631,13 @@ finish_comparison:
                     free_var(lhs);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_MULT:
             case OP_MINUS:
             case OP_DIV:
             case OP_MOD:
+            TARGET(op_MULT)
             {
                 Var lhs, rhs, ans;
                 var_type lhs_type, rhs_type;
@@ -1461,9 +1687,11 @@ finish_comparison:
                     PUSH(ans);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_ADD:
+            TARGET(op_ADD)
+do_add:
             {
                 Var rhs, lhs, ans;
                 var_type lhs_type, rhs_type;
@@ -1530,10 +1758,11 @@ finish_comparison:
                     PUSH(ans);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_AND:
             case OP_OR:
+            TARGET(op_AND)
             {
                 Var lhs;
                 unsigned lab = READ_BYTES(bv, bc.numbytes_label);
@@ -1546,9 +1775,10 @@ finish_comparison:
                     free_var(POP());
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_NOT:
+            TARGET(op_NOT)
             {
                 Var arg, ans;
 
@@ -1558,9 +1788,10 @@ finish_comparison:
                 PUSH(ans);
                 free_var(arg);
             }
-            break;
+            DISPATCH();
 
             case OP_UNARY_MINUS:
+            TARGET(op_UNARY_MINUS)
             {
                 Var arg, ans;
                 var_type arg_type;
@@ -1576,15 +1807,17 @@ finish_comparison:
                     arg_type = arg.type;
                     free_var(arg);
                     PUSH_TYPE_MISMATCH(2, arg_type, TYPE_INT, TYPE_FLOAT);
-                    break;
+                    DISPATCH();
                 }
 
                 PUSH(ans);
                 free_var(arg);
             }
-            break;
+            DISPATCH();
 
             case OP_REF:
+            TARGET(op_REF)
+do_ref:
             {
                 Var index, list;
 
@@ -1663,9 +1896,10 @@ finish_comparison:
                         }
                     }
             }
-            break;
+            DISPATCH();
 
             case OP_PUSH_REF:
+            TARGET(op_PUSH_REF)
             {
                 /* This is about the sketchiest manoeuvre I can
                  * imagine.  The goal is to mutate a nested list/map
@@ -1700,7 +1934,7 @@ finish_comparison:
                         PUSH_ERROR(E_RANGE);
                     } else {
                         PUSH(value);
-                        clear_node_value(node);
+                        clear_node_value(list, node);
                     }
                 } else if (list.type == TYPE_LIST) {
                     if (index.type != TYPE_INT) {
@@ -1710,15 +1944,16 @@ finish_comparison:
                         PUSH_ERROR(E_RANGE);
                     } else {
                         PUSH(list.v.list[index.v.num]);
-                        list.v.list[index.v.num].type = TYPE_NONE;
+                        clear_list_value(list, index.v.num);
                     }
                 } else {
                     PUSH_TYPE_MISMATCH(2, list.type, TYPE_LIST, TYPE_MAP);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_RANGE_REF:
+            TARGET(op_RANGE_REF)
             {
                 Var base, from, to;
 
@@ -1793,17 +2028,19 @@ finish_comparison:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_G_PUT:
+            TARGET(op_G_PUT)
             {
                 unsigned id = READ_BYTES(bv, bc.numbytes_var_name);
                 free_var(RUN_ACTIV.rt_env[id]);
                 RUN_ACTIV.rt_env[id] = var_ref(TOP_RT_VALUE);
             }
-            break;
+            DISPATCH();
 
             case OP_G_PUSH:
+            TARGET(op_G_PUSH)
             {
                 Var value;
 
@@ -1817,9 +2054,11 @@ finish_comparison:
                 else
                     PUSH_REF(value);
             }
-            break;
+            DISPATCH();
 
             case OP_GET_PROP:
+            TARGET(op_GET_PROP)
+do_get_prop:
             {
                 Var propname, obj, prop;
 
@@ -1875,9 +2114,10 @@ finish_comparison:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_PUSH_GET_PROP:
+            TARGET(op_PUSH_GET_PROP)
             {
                 Var propname, obj, prop;
 
@@ -1921,9 +2161,10 @@ finish_comparison:
                         PUSH_REF(prop);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_PUT_PROP:
+            TARGET(op_PUT_PROP)
             {
                 Var obj, propname, rhs;
 
@@ -2046,10 +2287,11 @@ finish_comparison:
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_FORK:
             case OP_FORK_WITH_ID:
+            TARGET(op_FORK)
             {
                 Var time;
                 unsigned id = 0, f_index;
@@ -2077,9 +2319,10 @@ finish_comparison:
                         RAISE_ERROR(e);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_CALL_VERB:
+            TARGET(op_CALL_VERB)
             {
                 enum error err;
                 Var args, verb, obj;
@@ -2092,11 +2335,9 @@ finish_comparison:
                 if (args.type != TYPE_LIST || verb.type != TYPE_STR)
                     err = E_TYPE;
                 else if (obj.type == TYPE_WAIF) {
-                    char *str = (char *)mymalloc(strlen(verb.v.str) + 2, M_STRING);
+                    const char *str = waif_verb_name(verb.v.str);
 
                     _class = obj.v.waif->_class;
-                    str[0] = WAIF_VERB_PREFIX;
-                    strcpy(str + 1, verb.v.str);
                     free_str(verb.v.str);
                     verb.v.str = str;
                     STORE_STATE_VARIABLES();
@@ -2104,21 +2345,15 @@ finish_comparison:
                     LOAD_STATE_VARIABLES();
                 } else {
                     Objid recv = NOTHING;
-                    db_prop_handle h;
-                    Var p;
 
                     /* If it's an object, we're good.
                      * Otherwise, look for a property on the system
                      * object that points us to the prototype/handler
                      * for the primitive type.
                      */
-                    Var system = Var::new_obj(SYSTEM_OBJECT);
-
 #define         MATCH_TYPE(t1, t2)                      \
 else if (obj.type == TYPE_##t1) {           \
-    h = db_find_property(system, #t2 "_proto", &p); \
-    if (h.ptr && p.type == TYPE_OBJ && valid(p.v.obj))  \
-        recv = p.v.obj;                 \
+    recv = type_prototype(TYPE_##t1, #t2 "_proto"); \
 }
                     if (obj.type == TYPE_ANON)
                         recv = NOTHING;
@@ -2133,8 +2368,6 @@ else if (obj.type == TYPE_##t1) {           \
                     MATCH_TYPE(MAP, map)
 #undef          MATCH_TYPE
 
-                    free_var(system);
-
                     if (obj.is_object() || recv != NOTHING) {
                         STORE_STATE_VARIABLES();
                         err = call_verb2(recv, verb.v.str, obj, args, 0, DEFAULT_THREAD_MODE);
@@ -2163,11 +2396,12 @@ else if (obj.type == TYPE_##t1) {           \
                     free_var(obj);
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_RETURN:
             case OP_RETURN0:
             case OP_DONE:
+            TARGET(op_RETURN)
             {
                 Var ret_val;
 
@@ -2186,9 +2420,10 @@ else if (obj.type == TYPE_##t1) {           \
                 }
                 LOAD_STATE_VARIABLES();
             }
-            break;
+            DISPATCH();
 
             case OP_BI_FUNC_CALL:
+            TARGET(op_BI_FUNC_CALL)
             {
                 unsigned func_id;
                 Var args;
@@ -2245,14 +2480,18 @@ else if (obj.type == TYPE_##t1) {           \
                     }
                 }
             }
-            break;
+            DISPATCH();
 
             case OP_EXTENDED:
+            TARGET(op_EXTENDED)
             {
                 enum Extended_Opcode eop = (Extended_Opcode)(*bv);
                 bv++;
-                if (COUNT_EOP_TICK(eop))
+                if (COUNT_EOP_TICK(eop)) {
                     ticks_remaining--;
+                    if (profiler_running)
+                        profiler_ext_opcode_counts[eop]++;
+                }
                 switch (eop) {
                     case EOP_RANGESET:
                     {
@@ -2354,7 +2593,7 @@ else if (obj.type == TYPE_##t1) {           \
                             }
                         }
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_FIRST:
                     {
@@ -2379,7 +2618,7 @@ else if (obj.type == TYPE_##t1) {           \
                         } else
                             PUSH_TYPE_MISMATCH(3, item.type, TYPE_STR, TYPE_LIST, TYPE_MAP);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_LAST:
                     {
@@ -2404,7 +2643,7 @@ else if (obj.type == TYPE_##t1) {           \
                         } else
                             PUSH_TYPE_MISMATCH(3, item.type, TYPE_STR, TYPE_LIST, TYPE_MAP);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_EXP:
                     {
@@ -2420,7 +2659,7 @@ else if (obj.type == TYPE_##t1) {           \
                         else
                             PUSH(ans);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_SCATTER:
                     {
@@ -2489,7 +2728,7 @@ else if (obj.type == TYPE_##t1) {           \
                         else
                             JUMP(where);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_PUSH_LABEL:
                     case EOP_TRY_FINALLY:
@@ -2500,7 +2739,7 @@ else if (obj.type == TYPE_##t1) {           \
                         v.v.num = READ_BYTES(bv, bc.numbytes_label);
                         PUSH(v);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_CATCH:
                     case EOP_TRY_EXCEPT:
@@ -2511,7 +2750,7 @@ else if (obj.type == TYPE_##t1) {           \
                         v.v.num = (eop == EOP_CATCH ? 1 : READ_BYTES(bv, 1));
                         PUSH(v);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_END_CATCH:
                     case EOP_END_EXCEPT:
@@ -2539,7 +2778,7 @@ else if (obj.type == TYPE_##t1) {           \
                         lab = READ_BYTES(bv, bc.numbytes_label);
                         JUMP(lab);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_END_FINALLY:
                     {
@@ -2553,7 +2792,7 @@ else if (obj.type == TYPE_##t1) {           \
                         PUSH(why);
                         PUSH(zero);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_CONTINUE:
                     {
@@ -2578,7 +2817,7 @@ else if (obj.type == TYPE_##t1) {           \
                                 panic_moo("Unknown FINALLY reason!");
                         }
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_WHILE_ID:
                     {
@@ -2604,7 +2843,7 @@ else if (obj.type == TYPE_##t1) {           \
                         (void) unwind_stack(FIN_EXIT, v, nullptr);
                         LOAD_STATE_VARIABLES();
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_FOR_LIST_1:
                     {
@@ -2665,7 +2904,7 @@ else if (obj.type == TYPE_##t1) {           \
 #           undef ITER
 #           undef BASE
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_FOR_LIST_2:
                     {
@@ -2729,7 +2968,7 @@ else if (obj.type == TYPE_##t1) {           \
 #           undef ITER
 #           undef BASE
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_BITOR:
                     case EOP_BITAND:
@@ -2767,7 +3006,7 @@ else if (obj.type == TYPE_##t1) {           \
                         else
                             PUSH(ans);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_BITSHL:
                     case EOP_BITSHR:
@@ -2814,7 +3053,7 @@ else if (obj.type == TYPE_##t1) {           \
                         else
                             PUSH(ans);
                     }
-                    break;
+                    DISPATCH();
 
                     case EOP_COMPLEMENT:
                     {
@@ -2840,13 +3079,40 @@ else if (obj.type == TYPE_##t1) {           \
                         else
                             PUSH(ans);
                     }
-                    break;
+                    DISPATCH();
+
+                    case EOP_VAR_GET_PROP:
+                    case EOP_VAR_INDEX:
+                    case EOP_VAR_ADD:
+                    {
+                        /* Do what the PUSH and IMM it replaced would
+                         * have done, then finish as the last op.
+                         */
+                        unsigned id = READ_BYTES(bv, 1);
+                        unsigned slot = READ_BYTES(bv, bc.numbytes_literal);
+                        Var value = RUN_ACTIV.rt_env[id];
+
+                        if (value.type == TYPE_NONE) {
+                            Var not_found = str_ref_to_var(RUN_ACTIV.prog->var_names[id]);
+                            var_ref(nothing);
+                            PUSH_X_NOT_FOUND(E_VARNF, not_found, nothing);
+                        } else
+                            PUSH_REF(value);
+                        PUSH_REF(RUN_ACTIV.prog->literals[slot]);
+
+                        if (eop == EOP_VAR_GET_PROP)
+                            goto do_get_prop;
+                        else if (eop == EOP_VAR_INDEX)
+                            goto do_ref;
+                        else
+                            goto do_add;
+                    }
 
                     default:
                         panic_moo("Unknown extended opcode!");
                 }
             }
-            break;
+            DISPATCH();
 
                 /* These opcodes account for about 20% of all opcodes executed, so
                    let's split out the case stmt so the compiler can help us out.
@@ -2889,6 +3155,7 @@ else if (obj.type == TYPE_##t1) {           \
             case OP_PUSH + 29:
             case OP_PUSH + 30:
             case OP_PUSH + 31:
+            TARGET(op_PUSH)
             {
                 Var value;
                 value = RUN_ACTIV.rt_env[PUSH_n_INDEX(op)];
@@ -2900,7 +3167,7 @@ else if (obj.type == TYPE_##t1) {           \
                 } else
                     PUSH_REF(value);
             }
-            break;
+            DISPATCH();
 
 #ifdef BYTECODE_REDUCE_REF
             case OP_PUSH_CLEAR:
@@ -2935,6 +3202,7 @@ else if (obj.type == TYPE_##t1) {           \
             case OP_PUSH_CLEAR + 29:
             case OP_PUSH_CLEAR + 30:
             case OP_PUSH_CLEAR + 31:
+            TARGET(op_PUSH_CLEAR)
             {
                 Var *vp;
                 vp = &RUN_ACTIV.rt_env[PUSH_CLEAR_n_INDEX(op)];
@@ -2947,7 +3215,25 @@ else if (obj.type == TYPE_##t1) {           \
                     vp->type = TYPE_NONE;
                 }
             }
-            break;
+            DISPATCH();
+
+            case OP_G_PUSH_CLEAR:
+            TARGET(op_G_PUSH_CLEAR)
+            {
+                Var *vp;
+                int var_pos = READ_BYTES(bv, bc.numbytes_var_name);
+
+                vp = &RUN_ACTIV.rt_env[var_pos];
+                if (vp->type == TYPE_NONE) {
+                    Var not_found = str_ref_to_var(*(&RUN_ACTIV.prog->var_names[var_pos]));
+                    var_ref(nothing);
+                    PUSH_X_NOT_FOUND(E_VARNF, not_found, nothing);
+                } else {
+                    PUSH(*vp);
+                    vp->type = TYPE_NONE;
+                }
+            }
+            DISPATCH();
 #endif              /* BYTECODE_REDUCE_REF */
 
             case OP_PUT:
@@ -2982,6 +3268,7 @@ else if (obj.type == TYPE_##t1) {           \
             case OP_PUT + 29:
             case OP_PUT + 30:
             case OP_PUT + 31:
+            TARGET(op_PUT)
             {
                 Var *varp = &RUN_ACTIV.rt_env[PUT_n_INDEX(op)];
                 free_var(*varp);
@@ -2991,9 +3278,10 @@ else if (obj.type == TYPE_##t1) {           \
                 } else
                     *varp = var_ref(TOP_RT_VALUE);
             }
-            break;
+            DISPATCH();
 
             default:
+            TARGET(op_default)
                 if (IS_OPTIM_NUM_OPCODE(op)) {
                     Var value;
                     value.type = TYPE_INT;
@@ -3001,7 +3289,7 @@ else if (obj.type == TYPE_##t1) {           \
                     PUSH(value);
                 } else
                     panic_moo("Unknown opcode!");
-                break;
+                DISPATCH();
         }
     }
 }
@@ -3025,6 +3313,7 @@ setup_task_execution_limits(int seconds, int ticks)
                                       task_timeout, nullptr);
     task_timed_out = 0;
     ticks_remaining = (ticks < 100 ? 100 : ticks);
+    ticks_held = 0;
     return task_alarm_id;
 }
 
@@ -3538,7 +3827,7 @@ bf_yield_if_needed(Var arglist, Byte next, void *vdata, Objid progr)
                        || min_seconds >= server_int_option("fg_seconds", DEFAULT_FG_SECONDS)))
         return make_error_pack(E_INVARG);
 
-    if (ticks_remaining < min_ticks || timer_wakeup_interval(task_alarm_id) < min_seconds)
+    if (ticks_remaining + ticks_held < min_ticks || timer_wakeup_interval(task_alarm_id) < min_seconds)
         return make_suspend_pack(enqueue_suspended_task, secondsp);
     else
         return no_var_pack();
@@ -3597,7 +3886,7 @@ bf_ticks_left(Var arglist, Byte next, void *vdata, Objid progr)
 {
     Var r;
     r.type = TYPE_INT;
-    r.v.num = ticks_remaining;
+    r.v.num = ticks_remaining + ticks_held;
     free_var(arglist);
     return make_var_pack(r);
 }
@@ -35,6 +35,7 @@
 #include "bf_register.h"
 #include "functions.h"
 #include "db_tune.h"
+#include "eval_env.h"
 
 #if EXAMPLE
 
@@ -171,6 +172,30 @@ bf_log_cache_stats(Var arglist, Byte next, void *vdata, Objid progr)
 }
 #endif
 
+static package
+bf_property_cache_stats(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    free_var(arglist);
+
+    if (!is_wizard(progr)) {
+        return make_error_pack(E_PERM);
+    }
+
+    return make_var_pack(db_property_cache_stats());
+}
+
+static package
+bf_rt_pool_stats(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    free_var(arglist);
+
+    if (!is_wizard(progr)) {
+        return make_error_pack(E_PERM);
+    }
+
+    return make_var_pack(rt_pool_stats());
+}
+
 void
 register_extensions()
 {
@@ -182,4 +207,6 @@ register_extensions()
     register_function("log_cache_stats", 0, 0, bf_log_cache_stats);
     register_function("verb_cache_stats", 0, 0, bf_verb_cache_stats);
 #endif
+    register_function("property_cache_stats", 0, 0, bf_property_cache_stats);
+    register_function("rt_pool_stats", 0, 0, bf_rt_pool_stats);
 }
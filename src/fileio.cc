@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 /* some things are not defined in stdio on all systems -- AAB 06/03/97 */
 #include <sys/types.h>
@@ -26,6 +27,7 @@
 #include "server.h"
 #include "network.h"
 #include <unordered_map>
+#include <vector>
 #include "tasks.h"
 #include "log.h"
 #include "fileio.h"
@@ -51,9 +53,28 @@ file_type file_type_text = nullptr;
 #define FILE_O_READ       1
 #define FILE_O_WRITE      2
 #define FILE_O_FLUSH      4
+#define FILE_O_MMAP       8
 
 typedef unsigned char file_mode;
 
+/*
+ *  Where the lines of a file start, as far as it's been read.  Only every
+ *  FILE_IO_LINE_INDEX_INTERVAL'th line is remembered; the rest are found
+ *  by reading on from there.  The index is thrown away whenever the file
+ *  is written to or changes size or modification time.
+ */
+
+typedef struct file_line_index file_line_index;
+
+struct file_line_index {
+    std::vector<long> offsets; /* offsets[k] is where line k * INTERVAL + 1 starts */
+    Num lines;                 /* lines read so far        */
+    long end;                  /* where the next one starts */
+    bool complete;             /* ...if there is one       */
+    off_t size;                /* what the file looked like */
+    time_t mtime;              /* when it was indexed      */
+};
+
 typedef struct file_handle file_handle;
 
 struct file_handle {
@@ -62,13 +83,10 @@ struct file_handle {
     file_type type;            /* text or binary, sir?     */
     file_mode mode;            /* readin', writin' or both */
     FILE  *file;               /* the actual file handle   */
-};
-
-typedef struct line_buffer line_buffer;
-
-struct line_buffer {
-    char *line;
-    struct line_buffer *next;
+    file_line_index *index;    /* where its lines start    */
+    const char *map;           /* the file, if it's mapped */
+    size_t map_size;           /* ...and how long it is    */
+    time_t map_mtime;          /* when it was mapped       */
 };
 
 /***************************************************************
@@ -79,6 +97,9 @@ struct line_buffer {
 static std::unordered_map <Num, file_handle> file_table;
 static Num next_handle = 1;
 
+static char *line_read;
+static size_t line_size = 0;
+
 static char file_handle_valid(Var fhandle) {
     if (fhandle.type != TYPE_INT)
         return 0;
@@ -117,6 +138,9 @@ static file_mode file_handle_mode(Var fhandle) {
 static void file_handle_destroy(Var fhandle) {
     Num i = fhandle.v.num;
     free_str(file_table[i].name);
+    delete file_table[i].index;
+    if (file_table[i].map)
+        munmap((void *)file_table[i].map, file_table[i].map_size);
     file_table.erase(i);
     if (file_table.size() == 0)
         next_handle = 1;
@@ -146,6 +170,10 @@ static Var file_handle_new(const char *name, file_type type, file_mode mode) {
         file.type = type;
         file.mode = mode;
         file.file = nullptr;
+        file.index = nullptr;
+        file.map = nullptr;
+        file.map_size = 0;
+        file.map_mtime = 0;
         file_table[handle] = file;
         next_handle++;
     }
@@ -158,6 +186,48 @@ static void file_handle_set_file(Var fhandle, FILE *f) {
     file_table[i].file = f;
 }
 
+/*
+ *  Map the whole of a handle's file into memory, read-only, unless it's
+ *  mapped already and hasn't changed size or modification time since.
+ *  Reading a mapping past the end of a file that has since shrunk kills
+ *  the server, so this comes before every use of the mapping.  There's
+ *  nothing to map for an empty file.  Returns 0 and sets errno on failure.
+ */
+
+static int file_handle_map_file(Var fhandle) {
+    file_handle *h = &file_table[fhandle.v.num];
+    struct stat buf;
+
+    if (fstat(fileno(h->file), &buf) != 0)
+        return 0;
+
+    if (h->map_mtime == buf.st_mtime && h->map_size == (size_t)buf.st_size
+        && (h->map || buf.st_size == 0))
+        return 1;
+
+    if (h->map)
+        munmap((void *)h->map, h->map_size);
+    h->map = nullptr;
+    h->map_size = 0;
+
+    if (buf.st_size > 0) {
+        void *map = mmap(nullptr, buf.st_size, PROT_READ, MAP_PRIVATE, fileno(h->file), 0);
+        if (map == MAP_FAILED)
+            return 0;
+        h->map = (const char *)map;
+        h->map_size = buf.st_size;
+    }
+    h->map_mtime = buf.st_mtime;
+
+    return 1;
+}
+
+static void file_handle_invalidate_index(Var fhandle) {
+    Num i = fhandle.v.num;
+    delete file_table[i].index;
+    file_table[i].index = nullptr;
+}
+
 
 /***************************************************************
  * Interface for modestrings
@@ -210,6 +280,8 @@ static const char *file_modestr_to_mode(const char *s, file_type *type, file_mod
         return nullptr;
 
     if (s[3] == 'f')            m |= FILE_O_FLUSH;
+    else if (s[3] == 'm' && m == FILE_O_READ)
+        m |= FILE_O_MMAP;       /* files are only mapped read-only */
     else if (s[3] != 'n')
         return nullptr;
 
@@ -376,7 +448,12 @@ bf_file_open(Var arglist, Byte next, void *vdata, Objid progr)
     } else {
         /* phew, we actually got a successfull open */
         file_handle_set_file(fhandle, f);
-        r = make_var_pack(fhandle);
+        if ((rmode & FILE_O_MMAP) && !file_handle_map_file(fhandle)) {
+            r = file_raise_errno("file_open");
+            fclose(f);
+            file_handle_destroy(fhandle);
+        } else
+            r = make_var_pack(fhandle);
     }
     free_var(arglist);
     return r;
@@ -455,7 +532,7 @@ bf_file_openmode(Var arglist, Byte next, void *vdata, Objid progr)
         } else if (mode & FILE_O_WRITE) {
             buffer[0] = 'w';
         }
-        if (mode & (FILE_O_READ | FILE_O_WRITE))
+        if ((mode & FILE_O_READ) && (mode & FILE_O_WRITE))
             buffer[1] = '+';
         else
             buffer[1] = '-';
@@ -465,7 +542,9 @@ bf_file_openmode(Var arglist, Byte next, void *vdata, Objid progr)
         else
             buffer[2] = 't';
 
-        if (mode & FILE_O_FLUSH)
+        if (mode & FILE_O_MMAP)
+            buffer[3] = 'm';
+        else if (mode & FILE_O_FLUSH)
             buffer[3] = 'f';
         else
             buffer[3] = 'n';
@@ -504,6 +583,96 @@ static const char *file_get_line(Var fhandle, int *count)
     return line_read;
 }
 
+/*
+ * Returns the line index of a handle, starting a new one if the file has
+ * changed since it was built.
+ */
+
+static file_line_index *file_handle_index(Var fhandle)
+{
+    file_handle *h = &file_table[fhandle.v.num];
+    struct stat buf;
+
+    int saved_errno = errno;
+    if (fstat(fileno(h->file), &buf) != 0)
+        buf.st_size = buf.st_mtime = -1;
+    errno = saved_errno;
+
+    if (h->index && (h->index->size != buf.st_size || h->index->mtime != buf.st_mtime)) {
+        delete h->index;
+        h->index = nullptr;
+    }
+
+    if (!h->index) {
+        h->index = new file_line_index;
+        h->index->offsets.push_back(0);
+        h->index->lines = 0;
+        h->index->end = 0;
+        h->index->complete = false;
+        h->index->size = buf.st_size;
+        h->index->mtime = buf.st_mtime;
+    }
+
+    return h->index;
+}
+
+/*
+ * Record that line number `line', `len' bytes long, was just read.  Only
+ * the line just past the end of the index extends it.
+ */
+
+static void file_index_line(file_line_index *index, Num line, int len)
+{
+    if (line != index->lines + 1)
+        return;
+
+    index->lines++;
+    index->end += len;
+    if (index->lines % FILE_IO_LINE_INDEX_INTERVAL == 0)
+        index->offsets.push_back(index->end);
+}
+
+/*
+ * Leave the file at the start of line number `line'.  Returns 0 (with
+ * errno set if something went wrong) if the file ends before it.
+ */
+
+static int file_seek_line(Var fhandle, Num line)
+{
+    FILE *f = file_handle_file(fhandle);
+    file_line_index *index = file_handle_index(fhandle);
+    Num current;
+    int len;
+
+    if (line - 1 <= index->lines) {
+        /* It's been seen before; skip ahead from the closest line remembered. */
+        Num k = (line - 1) / FILE_IO_LINE_INDEX_INTERVAL;
+        if (fseek(f, index->offsets[k], SEEK_SET) == -1)
+            return 0;
+        for (current = k * FILE_IO_LINE_INDEX_INTERVAL + 1; current < line; current++)
+            if (file_get_line(fhandle, &len) == nullptr)
+                return 0;
+        return 1;
+    }
+
+    if (index->complete) {
+        errno = 0;
+        return 0;
+    }
+
+    /* Read on from the end of the index until we get there. */
+    if (fseek(f, index->end, SEEK_SET) == -1)
+        return 0;
+    for (current = index->lines + 1; current < line; current++) {
+        if (file_get_line(fhandle, &len) == nullptr) {
+            index->complete = !ferror(f);
+            return 0;
+        }
+        file_index_line(index, current, len);
+    }
+    return 1;
+}
+
 
 /*
  * STR file_readline(FHANDLE handle)
@@ -552,29 +721,6 @@ bf_file_readline(Var arglist, Byte next, void *vdata, Objid progr)
  * STR file_readlines(FHANDLE handle, INT start, INT end)
  */
 
-static void free_line_buffer(line_buffer *head, int strings_too) {
-    line_buffer *next;
-    if (head) {
-        next = head->next;
-        myfree(head, M_STRUCT);
-        head = next;
-        while (head != nullptr) {
-            next = head->next;
-            if (strings_too)
-                free_str(head->line);
-            myfree(head, M_STRUCT);
-            head = next;
-        }
-    }
-}
-
-static line_buffer *new_line_buffer(char *line) {
-    line_buffer *p = (line_buffer *)mymalloc(sizeof(line_buffer), M_STRUCT);
-    p->line = line;
-    p->next = nullptr;
-    return p;
-}
-
 static package
 bf_file_readlines(Var arglist, Byte next, void *vdata, Objid progr)
 {
@@ -582,13 +728,14 @@ bf_file_readlines(Var arglist, Byte next, void *vdata, Objid progr)
     Var fhandle = arglist.v.list[1];
     Num begin = arglist.v.list[2].v.num;
     Num end   = arglist.v.list[3].v.num;
-    Num begin_loc = 0, linecount = 0;
+    Num begin_loc = 0;
     file_mode mode;
-    Var rv;
-    int current_line = 0, len = 0, i = 0;
+    Var rv, lv;
+    Num current_line;
+    int len = 0;
     const char *line = nullptr;
     FILE *f;
-    line_buffer *linebuf_head = nullptr, *linebuf_cur = nullptr;
+    file_line_index *index;
 
     errno = 0;
 
@@ -604,16 +751,8 @@ bf_file_readlines(Var arglist, Byte next, void *vdata, Objid progr)
 #ifndef UNSAFE_FIO
         file_type type = file_handle_type(fhandle); /* Quiet warning */
 #endif
-        /* Back to the beginning ... */
-        rewind(f);
-
         /* "seek" to that line */
-        begin--;
-        while ((current_line != begin)
-                && ((line = file_get_line(fhandle, &len)) != nullptr))
-            current_line++;
-
-        if (((begin != 0) && (line == nullptr)) || ((begin_loc = ftell(f)) == -1))
+        if (!file_seek_line(fhandle, begin) || ((begin_loc = ftell(f)) == -1))
             r = file_raise_errno("read_line");
         else {
             /*
@@ -621,12 +760,19 @@ bf_file_readlines(Var arglist, Byte next, void *vdata, Objid progr)
              * and seek to EOF or to the end_line, whichever comes first
              */
 
-            linebuf_head = linebuf_cur = new_line_buffer(nullptr);
+            index = file_handle_index(fhandle);
+            lv.type = TYPE_STR;
+            rv = new_list(0);
 
-            while ((current_line != end)
-                    && ((line = file_get_line(fhandle, &len)) != nullptr)) {
+            for (current_line = begin; current_line <= end; current_line++) {
+                if ((line = file_get_line(fhandle, &len)) == nullptr) {
+                    if (current_line == index->lines + 1)
+                        index->complete = !ferror(f);
+                    break;
+                }
+                file_index_line(index, current_line, len);
 #ifndef UNSAFE_FIO
-                linebuf_cur->next = new_line_buffer(str_dup((type->in_filter)(line, len)));
+                lv.v.str = str_dup((type->in_filter)(line, len));
 #else
                 /* For good reason, you can't modify a const char. But shh, we're doing it anyway. */
                 char *dirty_hack = (char*)line;
@@ -634,29 +780,15 @@ bf_file_readlines(Var arglist, Byte next, void *vdata, Objid progr)
                     dirty_hack[len - 1] = '\0';
                 else
                     dirty_hack[len] = '\0';
-                linebuf_cur->next = new_line_buffer(str_dup(dirty_hack));
+                lv.v.str = str_dup(dirty_hack);
 #endif
-                linebuf_cur = linebuf_cur->next;
-
-                current_line++;
+                rv = listappend(rv, lv);
             }
-            linecount =  current_line - begin;
-
-            linebuf_cur = linebuf_head->next;
 
             if (fseek(f, begin_loc, SEEK_SET) == -1) {
-                free_line_buffer(linebuf_head, 1);
+                free_var(rv);
                 r = file_raise_errno("seeking");
             } else {
-                rv = new_list(linecount);
-                i = 1;
-                while (linebuf_cur != nullptr) {
-                    rv.v.list[i].type = TYPE_STR;
-                    rv.v.list[i].v.str = linebuf_cur->line;
-                    linebuf_cur = linebuf_cur->next;
-                    i++;
-                }
-                free_line_buffer(linebuf_head, 0);
                 r = make_var_pack(rv);
             }
         }
@@ -697,6 +829,7 @@ bf_file_writeline(Var arglist, Byte next, void *vdata, Objid progr)
         else if ((fputs(rawbuffer, f) == EOF) || (fputc('\n', f) != '\n'))
             r = file_raise_errno(file_handle_name(fhandle));
         else {
+            file_handle_invalidate_index(fhandle);
             if (mode & FILE_O_FLUSH) {
                 fflush(f);
             }
@@ -846,6 +979,7 @@ bf_file_write(Var arglist, Byte next, void *vdata, Objid progr)
         else if (!(written = fwrite(rawbuffer, sizeof(char), len, f)))
             r = file_raise_errno(file_handle_name(fhandle));
         else {
+            file_handle_invalidate_index(fhandle);
             if (mode & FILE_O_FLUSH)
                 fflush(f);
             rv.type = TYPE_INT;
@@ -1464,6 +1598,101 @@ static package bf_file_handles(Var arglist, Byte next, void *vdata, Objid progr)
     return make_var_pack(r);
 }
 
+/*
+ * A new MOO string holding the `len' bytes at `s', which needn't be
+ * NUL-terminated.  Like str_dup(), it stops at a NUL.
+ */
+
+static const char *file_map_str(const char *s, size_t len)
+{
+    const char *nul = (const char *)memchr(s, '\0', len);
+    if (nul)
+        len = nul - s;
+    if (len == 0)
+        return str_dup("");
+
+    char *r = (char *)mymalloc(len + 1, M_STRING);
+    memcpy(r, s, len);
+    r[len] = '\0';
+    return r;
+}
+
+/*
+ * Case-insensitive search for `what' in the `len' bytes at `s', which
+ * needn't be NUL-terminated.  Candidates are found with memchr(), which
+ * is much faster than comparing at every byte.
+ */
+
+static const char *file_map_find(const char *s, size_t len, const char *what, size_t what_len)
+{
+    if (what_len == 0)
+        return s;
+    if (len < what_len)
+        return nullptr;
+
+    const char *last = s + len - what_len;
+    const int lower = tolower((unsigned char)what[0]);
+    const int upper = toupper((unsigned char)what[0]);
+    const char *next_lower = nullptr, *next_upper = nullptr, *c;
+    bool lower_done = false, upper_done = (lower == upper);
+
+    for (const char *p = s; p <= last; p = c + 1) {
+        /* Where each case of the first character next appears. */
+        if (!lower_done && (next_lower == nullptr || next_lower < p))
+            lower_done = (next_lower = (const char *)memchr(p, lower, last - p + 1)) == nullptr;
+        if (!upper_done && (next_upper == nullptr || next_upper < p))
+            upper_done = (next_upper = (const char *)memchr(p, upper, last - p + 1)) == nullptr;
+
+        if (lower_done && upper_done)
+            return nullptr;
+        else if (lower_done)
+            c = next_upper;
+        else if (upper_done)
+            c = next_lower;
+        else
+            c = next_lower < next_upper ? next_lower : next_upper;
+
+        if (strncasecmp(c + 1, what + 1, what_len - 1) == 0)
+            return c;
+    }
+    return nullptr;
+}
+
+/*
+ * file_grep() on a mapped file: the same results, found by searching the
+ * whole file at once and only counting the lines between matches.
+ */
+
+static Var file_map_grep(const char *map, size_t size, const char *what, size_t what_len, int match_all)
+{
+    Var ret = new_list(0), tmp;
+    const char *end = map + size, *line_start = map, *found, *line_end, *nl;
+    Num line_num = 1;   /* the number of the line at line_start */
+
+    while (line_start < end && (found = file_map_find(line_start, end - line_start, what, what_len)) != nullptr) {
+        while ((nl = (const char *)memchr(line_start, '\n', found - line_start)) != nullptr) {
+            line_num++;
+            line_start = nl + 1;
+        }
+        if ((line_end = (const char *)memchr(found, '\n', end - found)) == nullptr)
+            line_end = end;
+
+        tmp = new_list(2);
+        tmp.v.list[1].type = TYPE_STR;
+        tmp.v.list[1].v.str = file_map_str(line_start, line_end - line_start);
+        tmp.v.list[2] = Var::new_int(line_num);
+        ret = listappend(ret, tmp);
+
+        if (!match_all)
+            break;
+
+        line_start = line_end + 1;
+        line_num++;
+    }
+
+    return ret;
+}
+
 static package
 bf_file_grep(Var arglist, Byte next, void *vdata, Objid progr)
 {
@@ -1483,6 +1712,15 @@ bf_file_grep(Var arglist, Byte next, void *vdata, Objid progr)
         r = make_raise_pack(E_INVARG, "Invalid FHANDLE", var_ref(fhandle));
     else if (!((mode = file_handle_mode(fhandle)) & FILE_O_READ))
         r = make_raise_pack(E_INVARG, "File is open write-only", var_ref(fhandle));
+    else if ((mode & FILE_O_MMAP) && !file_handle_map_file(fhandle))
+        r = file_raise_errno(file_handle_name(fhandle));
+    else if (mode & FILE_O_MMAP)
+    {
+        file_handle *h = &file_table[fhandle.v.num];
+        match_all = arglist.v.list[0].v.num >= 3 && is_true(arglist.v.list[3]);
+        ret = file_map_grep(h->map, h->map_size, arglist.v.list[2].v.str, memo_strlen(arglist.v.list[2].v.str), match_all);
+        r = make_var_pack(ret);
+    }
     else
     {
         tmp_name.type = TYPE_STR;
@@ -1523,6 +1761,49 @@ bf_file_grep(Var arglist, Byte next, void *vdata, Objid progr)
     return r;
 }
 
+/*
+ * STR file_slice(FHANDLE handle, INT start, INT end)
+ * Bytes start through end of a mapped file, copied straight out of the mapping.
+ */
+
+static package
+bf_file_slice(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    package r;
+    Var fhandle = arglist.v.list[1];
+    Num start = arglist.v.list[2].v.num;
+    Num end = arglist.v.list[3].v.num;
+    file_handle *h;
+    Var rv;
+
+    if (!file_verify_caller(progr))
+        r = file_raise_notokcall("file_slice", progr);
+    else if (!file_handle_valid(fhandle))
+        r = make_raise_pack(E_INVARG, "Invalid FHANDLE", var_ref(fhandle));
+    else if (!((h = &file_table[fhandle.v.num])->mode & FILE_O_MMAP))
+        r = make_raise_pack(E_INVARG, "File is not mapped", var_ref(fhandle));
+    else if (!file_handle_map_file(fhandle))
+        r = file_raise_errno(file_handle_name(fhandle));
+    else if (start < 1 || end < start - 1 || end > (Num)h->map_size)
+        r = make_error_pack(E_RANGE);
+    else if (end - start + 1 > server_int_option_cached(SVO_MAX_STRING_CONCAT))
+        r = make_raise_pack(E_QUOTA, "Slice too long", zero);
+    else {
+        rv.type = TYPE_STR;
+        if (end < start)
+            rv.v.str = str_dup("");
+#ifdef UNSAFE_FIO
+        else if (h->type == file_type_text)
+            rv.v.str = file_map_str(h->map + start - 1, end - start + 1);
+#endif
+        else
+            rv.v.str = str_dup((h->type->in_filter)(h->map + start - 1, end - start + 1));
+        r = make_var_pack(rv);
+    }
+    free_var(arglist);
+    return r;
+}
+
 /*
  * STR file_count_lines(FHANDLE handle)
  */
@@ -1544,18 +1825,22 @@ bf_file_count_lines(Var arglist, Byte next, void *vdata, Objid progr)
         r = make_raise_pack(E_INVARG, "File is open write-only", var_ref(fhandle));
     else
     {
-        int throwaway = 0;
         FILE *fp = file_handle_file_safe(fhandle);
+        file_line_index *index = file_handle_index(fhandle);
 
-        rewind(fp);
-
-        long count = 0;
-        while (file_get_line(fhandle, &throwaway) != nullptr)
-            count++;
+        /* Read on from the end of the index to the end of the file. */
+        errno = 0;
+        if (!index->complete)
+            file_seek_line(fhandle, MAXINT);
 
-        rv.type = TYPE_INT;
-        rv.v.num = count;
-        r = make_var_pack(rv);
+        if (!index->complete)
+            r = file_raise_errno("count_lines");
+        else {
+            fseek(fp, 0, SEEK_END);
+            rv.type = TYPE_INT;
+            rv.v.num = index->lines;
+            r = make_var_pack(rv);
+        }
     }
 
     return r;
@@ -1580,6 +1865,7 @@ register_fileio(void)
     register_function("file_readlines", 3, 3, bf_file_readlines, TYPE_INT, TYPE_INT, TYPE_INT);
     register_function("file_writeline", 2, 2, bf_file_writeline, TYPE_INT, TYPE_STR);
     register_function("file_grep", 2, 3, bf_file_grep, TYPE_INT, TYPE_STR, TYPE_INT);
+    register_function("file_slice", 3, 3, bf_file_slice, TYPE_INT, TYPE_INT, TYPE_INT);
 
     register_function("file_read", 2, 2, bf_file_read, TYPE_INT, TYPE_INT);
     register_function("file_write", 2, 2, bf_file_write, TYPE_INT, TYPE_STR);
@@ -74,7 +74,8 @@ static registry bi_function_registries[] =
     register_argon2,
     register_spellcheck,
     register_curl,
-    register_sql
+    register_sql,
+    register_profiler
 };
 
 void
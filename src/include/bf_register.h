@@ -43,4 +43,5 @@ extern void register_waif(void);
 extern void register_argon2(void);
 extern void register_spellcheck(void);
 extern void register_curl(void);
-extern void register_sql(void);
\ No newline at end of file
+extern void register_sql(void);
+extern void register_profiler(void);
@@ -54,6 +54,7 @@
 #cmakedefine01 HAVE_TZNAME
 #cmakedefine01 HAVE_SELECT
 #cmakedefine01 HAVE_POLL
+#cmakedefine01 HAVE_EPOLL
 #cmakedefine01 HAVE_RANDOM
 #cmakedefine01 HAVE_LRAND48
 #cmakedefine01 HAVE_WAITPID
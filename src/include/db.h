@@ -83,6 +83,30 @@ extern int db_flush(enum db_flush_type);
 				 * argument.  Returns true on success.
 				 */
 
+#ifdef INCREMENTAL_CHECKPOINTS
+extern int db_checkpoint_forked(void);
+				/* Returns true iff the last successful
+				 * FLUSH_ALL_NOW left the actual writing to a
+				 * forked child, in which case the server must
+				 * wait for the child's exit status to learn
+				 * whether the checkpoint succeeded.
+				 */
+
+extern void db_checkpoint_finished(int success);
+				/* Tells the database that the child forked
+				 * by the last FLUSH_ALL_NOW has exited.
+				 */
+
+extern void db_note_unlogged_change(void);
+				/* Something that is part of the database, but
+				 * not of any single permanent object, has
+				 * changed; the next checkpoint must write the
+				 * whole database.
+				 */
+#else
+#define db_note_unlogged_change()
+#endif
+
 extern Num db_disk_size(void);
 				/* Return the total size, in bytes, of the most
 				 * recent full representation of the database
@@ -395,6 +419,7 @@ typedef struct {
     enum bi_prop built_in;	/* true iff property is a built-in one */
     void *definer;		/* null iff property is a built-in one */
     void *ptr;			/* null iff property not found */
+    void *object;		/* the object the property was found on */
 } db_prop_handle;
 
 extern db_prop_handle db_find_property(Var obj, const char *name,
@@ -439,6 +464,14 @@ extern void db_set_property_value(db_prop_handle, Var);
 				 * illegal value for a built-in property.
 				 */
 
+extern unsigned int db_system_property_generation(void);
+				/* Changes whenever a property of the system
+				 * object is set, added, removed or renamed,
+				 * so that values read from #0 can be cached.
+				 * Changes to values #0 inherits through clear
+				 * slots are not noticed.
+				 */
+
 extern Objid db_property_owner(db_prop_handle);
 extern void db_set_property_owner(db_prop_handle, Objid);
 				/* These functions may not be called for
@@ -27,6 +27,12 @@ extern int waif_conversion_type;
 
 extern int clear_last_move;
 
+extern int binary_db_output;
+				/* 1 to dump the database in the binary
+				 * encoding, 0 to dump it as text, or -1 to
+				 * keep the encoding of the input database.
+				 */
+
 /*********** Input ***********/
 
 extern DB_Version dbio_input_version;
@@ -24,14 +24,22 @@
 #include <stdexcept>
 
 #include "config.h"
+#include "db.h"
 #include "program.h"
 #include "structures.h"
 
 typedef struct Verbdef Verbdef;
 
+#ifdef LAZY_VERB_PROGRAMS
+typedef struct Verb_Source Verb_Source;
+#endif
+
 struct Verbdef {
     const char *name;
     Program *program;
+#ifdef LAZY_VERB_PROGRAMS
+    Verb_Source *source;	/* program waiting to be compiled, if any */
+#endif
     Objid owner;
     short perms;
     short prep;
@@ -84,6 +92,22 @@ typedef struct Object {
      */
     unsigned int nonce;
 
+    /* Verb cache entries keyed on this object are only valid while
+     * their generation matches this one.  `verb_cache_entries' lists
+     * the entries keyed on this object so that they can be dropped
+     * before the object's memory goes away.
+     */
+    unsigned int verb_generation;
+    struct vc_entry *verb_cache_entries;
+
+#ifdef USE_ANCESTOR_CACHE
+    /* Flattened ancestors of a permanent object, in db_ancestors()
+     * order, or null if not (yet) cached.  See dbpriv_ancestors().
+     */
+    Objid *ancestors;
+    int ancestor_count;
+#endif
+
     void *waif_propdefs;
 } Object;
 
@@ -98,22 +122,68 @@ typedef struct Object {
 
 #define VERB_CACHE 1
 
+/* Why an object's cached verb lookups were invalidated.  Reported by
+ * verb_cache_stats(); add new reasons before VC_REASON_COUNT and give
+ * them a name in db_verbs.cc.
+ */
+typedef enum {
+    VC_VERB_ADDED, VC_VERB_DELETED, VC_VERB_RENAMED, VC_VERB_FLAGS,
+    VC_VERB_ARGS, VC_PARENTS_CHANGED, VC_OBJECT_DESTROYED,
+    VC_REASON_COUNT
+} vc_reason;
+
 #ifdef VERB_CACHE
 
 /* Whenever anything is modified that could influence callable verb
- * lookup, this function must be called.
+ * lookup on an object, this function must be called with that object.
+ * Only cache entries keyed on the object and its descendants are
+ * invalidated.
  */
+extern void db_priv_affected_callable_verb_lookup(Object *, vc_reason);
+
+/* Must be called before an object's memory is freed or moved. */
+extern void dbpriv_forget_cached_verbs(Object *);
+
+extern void dbpriv_assign_verb_generation(Object *);
 
-#ifdef RONG
-#define db_priv_affected_callable_verb_lookup() (db_verb_generation++)
-                                 /* The choice of a new generation. */
-extern unsigned int db_verb_generation;
+#else /* no cache */
+#define db_priv_affected_callable_verb_lookup(o, why)
+#define dbpriv_forget_cached_verbs(o)
+#define dbpriv_assign_verb_generation(o)
 #endif
 
-extern void db_priv_affected_callable_verb_lookup(void);
+/*********** Property cache support ***********/
+
+#define PROPERTY_CACHE 1
+
+#ifdef PROPERTY_CACHE
+
+/* Must be called whenever a property lookup could resolve differently
+ * without any object's propval layout (and thus its nonce) changing,
+ * e.g. when a property is renamed.
+ */
+extern void dbpriv_flush_property_cache(void);
 
 #else /* no cache */
-#define db_priv_affected_callable_verb_lookup()
+#define dbpriv_flush_property_cache()
+#endif
+
+/*********** Incremental checkpoint support ***********/
+
+#ifdef INCREMENTAL_CHECKPOINTS
+
+/* Must be called whenever anything that is written to the database file
+ * as part of an object (its flags, hierarchy, verbs, properties or
+ * property values) changes, before the object's nonce is reassigned.
+ */
+extern void dbpriv_mark_dirty(Object *);
+
+/* Marks the object with the given number, if it is valid. */
+extern void dbpriv_mark_dirty_objid(Objid);
+
+#else /* no incremental checkpoints */
+#define dbpriv_mark_dirty(o)
+#define dbpriv_mark_dirty_objid(oid)
 #endif
 
 /*********** Objects ***********/
@@ -123,6 +193,19 @@ extern void db_write_anonymous(Var);
 
 extern void dbpriv_assign_nonce(Object *);
 
+extern void dbpriv_system_properties_changed(void);
+				/* Advances db_system_property_generation().
+				 */
+
+extern const Objid *dbpriv_ancestors(Object *, int *count);
+				/* Returns the ancestors of the object (not
+				 * including the object itself) in the same
+				 * order as db_ancestors(), without building a
+				 * list.  The array belongs to the DB and is
+				 * only good until the next call or the next
+				 * change to the parent hierarchy.
+				 */
+
 extern Objid dbpriv_object_owner(Object *);
 extern void dbpriv_set_object_owner(Object *, Objid owner);
 
@@ -176,6 +259,21 @@ extern Object *dbpriv_find_object(Objid);
 
 extern void dbpriv_after_load(void);
 
+extern unsigned int dbpriv_next_nonce(void);
+				/* Returns the nonce the next new object or
+				 * layout change will get.  Nonces are handed
+				 * out in increasing order.
+				 */
+
+extern Object *dbpriv_reload_object(Objid, int replace);
+				/* Frees the object with the given number, if
+				 * any, without regard for the hierarchy it
+				 * is part of.  If `replace' is true, returns
+				 * a new object with that number, but with none
+				 * of the fields other than `id' filled in.
+				 * Used to replay incremental checkpoints.
+				 */
+
 /*********** Properties ***********/
 
 extern Propdef dbpriv_new_propdef(const char *);
@@ -209,6 +307,39 @@ extern void dbpriv_build_prep_table(void);
 				 * prepositional-phrase matching table.
 				 */
 
+#ifdef LAZY_VERB_PROGRAMS
+
+struct Verb_Source {
+    struct Source_Block *block;
+    unsigned length;
+    bool unparsable;		/* kept only to be written back out */
+    char text[1];		/* null-terminated */
+};
+
+extern void dbpriv_set_verb_source(db_verb_handle, const char *text,
+				   unsigned length);
+				/* Like db_set_verb_program(), but leaves the
+				 * program to be compiled from TEXT when it
+				 * is first needed.
+				 */
+
+extern Program *dbpriv_verb_program(Verbdef *, Objid definer);
+				/* Returns the verb's program, compiling it
+				 * first if necessary, or null if it has none.
+				 */
+
+extern void dbpriv_free_verb_program(Verbdef *);
+				/* Frees the verb's program or source. */
+
+extern int dbpriv_uncompiled_verbs(void);
+
+#else /* no lazy verb programs */
+#define dbpriv_verb_program(v, definer) ((v)->program)
+#define dbpriv_free_verb_program(v) \
+    do { if ((v)->program) free_program((v)->program); } while (0)
+#define dbpriv_uncompiled_verbs() 0
+#endif
+
 /*********** DBIO ***********/
 
 class dbpriv_dbio_failed: public std::exception
@@ -228,8 +359,50 @@ public:
 				 * running out of disk space for the dump).
 				 */
 
+class dbpriv_dbio_shared_value: public std::exception
+{
+public:
+
+    dbpriv_dbio_shared_value() throw() {}
+
+    ~dbpriv_dbio_shared_value() throw() override {}
+
+    const char* what() const throw() override {
+	return "shared value in plain output";
+    }
+};
+
+				/* Raised by DBIO when asked to write an
+				 * anonymous object or a WAIF while plain
+				 * values only are allowed.
+				 */
+
 extern void dbpriv_set_dbio_input(FILE *);
 extern void dbpriv_set_dbio_output(FILE *);
+extern void dbpriv_set_dbio_plain_values_only(bool);
+				/* While set, writing values that can be
+				 * shared by reference across the whole
+				 * database (anonymous objects and WAIFs)
+				 * raises dbpriv_dbio_shared_value instead.
+				 * Incremental checkpoints can only record
+				 * plain values.
+				 */
+extern void dbpriv_set_dbio_binary_input(bool);
+extern void dbpriv_set_dbio_binary_output(bool);
+				/* Switch values and programs to the binary
+				 * encoding (see db_io.cc).  Setting a new
+				 * input or output switches it back to text.
+				 */
+
+#ifdef LAZY_VERB_PROGRAMS
+extern const char *dbpriv_read_program_source(unsigned *length);
+				/* If the next program in the input is text,
+				 * reads it and returns it (without the final
+				 * `.' line) in private storage of the DBIO
+				 * module.  Otherwise, reads nothing and
+				 * returns null.
+				 */
+#endif
 
 /****/
 
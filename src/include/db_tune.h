@@ -4,3 +4,4 @@
 
 extern void db_log_cache_stats(void);
 extern Var db_verb_cache_stats(void);
+extern Var db_property_cache_stats(void);
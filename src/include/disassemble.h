@@ -21,3 +21,17 @@
 
 extern void disassemble_to_file(FILE * fp, Program * program);
 extern void disassemble_to_stderr(Program * program);
+
+extern const char *opcode_name(unsigned op);
+extern const char *ext_opcode_name(unsigned eop);
+				/* The mnemonics disassemble() uses, with
+				 * all of the PUSH, PUT and NUM variants
+				 * sharing one name.
+				 */
+
+extern unsigned bytecode_signature(void);
+				/* Identifies the opcodes and built-in
+				 * function numbers compiled programs are
+				 * expressed in.  Must be called after all
+				 * built-in functions have been registered.
+				 */
@@ -26,6 +26,16 @@ extern Var *new_rt_env(unsigned size);
 extern void free_rt_env(Var * rt_env, unsigned size);
 extern Var *copy_rt_env(Var * from, unsigned size);
 
+extern Var *new_rt_stack(unsigned size);
+extern void free_rt_stack(Var * rt_stack, unsigned size);
+
+extern Var rt_pool_stats(void);
+				/* Returns a list with one row per size class
+				 * of rt_envs and rt_stacks that has been
+				 * used: {"env" or "stack", size, free blocks
+				 * pooled, reuse hits, misses}.
+				 */
+
 void set_rt_env_obj(Var * env, int slot, Objid o);
 void set_rt_env_str(Var * env, int slot, const char *s);
 void set_rt_env_var(Var * env, int slot, Var v);
@@ -117,6 +117,11 @@ extern enum outcome do_server_program_task(Var _this, const char *verb,
 extern enum outcome resume_from_previous_vm(vm the_vm, Var value);
 
 extern int task_timed_out;
+extern void hold_ticks_for_profiler(void);
+				/* Called when the profiler starts, so that
+				 * the running task's opcodes are counted
+				 * from then on.
+				 */
 extern void abort_running_task(void);
 extern void print_error_backtrace(const char *, void (*)(const char *));
 extern Var caller(void);
@@ -25,10 +25,14 @@ extern Var new_list(int size);
 extern void destroy_list(Var list);
 extern Var list_dup(Var list);
 
+/* The number of times list_dup() has copied a list. */
+extern uint64_t list_dup_count;
+
 extern Var listappend(Var list, Var value);
 extern Var listinsert(Var list, Var value, int pos);
 extern Var listdelete(Var list, int pos);
 extern Var listset(Var list, Var value, int pos);
+extern void clear_list_value(Var list, int pos);
 extern Var listrangeset(Var list, int from, int to, Var value);
 extern Var listconcat(Var first, Var second);
 extern Var setadd(Var list, Var value);
@@ -31,25 +31,33 @@
 
 #ifndef MAP_H
 #define MAP_H
-#define HEIGHT_LIMIT 64     /* Tallest allowable tree */
 
+/* A map is a hash table.  Entries live in a single array; `slots' is an
+ * open-addressed index into it, keyed on a case-insensitive hash of the
+ * key, so lookups and insertions don't depend on the size of the map.
+ * New keys are appended to the array, which is only put back into key
+ * order when something needs to visit the entries in order (iteration,
+ * ranges, `mapkeys()', ...).  The names are left over from when maps
+ * were red-black trees.
+ */
 struct rbtree {
-    rbnode *root;       /* Top of the tree */
+    rbnode *nodes;      /* Entries; deleted ones have a key of TYPE_NONE */
+    uint32_t *slots;    /* 0 if empty, else 1 + the entry's index */
     size_t size;        /* Number of items */
+    uint32_t used;      /* Entries in `nodes', including deleted ones */
+    uint32_t capacity;  /* Room for entries in `nodes' */
+    uint32_t mask;      /* Number of slots - 1 */
+    bool sorted;        /* Are the entries in key order? */
 };
 
 struct rbnode {
     Var key;
     Var value;
-    int red;            /* Color (1=red, 0=black) */
-    rbnode *link[2];        /* Left (0) and right (1) links */
 };
 
 struct rbtrav {
     rbtree *tree;       /* Paired tree */
     rbnode *it;         /* Current node */
-    rbnode *path[HEIGHT_LIMIT]; /* Traversal path */
-    size_t top;         /* Top of stack */
 };
 #endif
 
@@ -57,6 +65,9 @@ extern Var new_map(void);
 extern void destroy_map(Var map);
 extern Var map_dup(Var map);
 
+/* The number of times map_dup() has copied a map. */
+extern uint64_t map_dup_count;
+
 extern Var mapinsert(Var map, Var key, Var value);
 extern const rbnode *maplookup(Var map, Var key, Var *value, int case_matters);
 extern const rbnode *mapstrlookup(Var map, const char *key, Var *value, int case_matters);
@@ -85,6 +96,11 @@ extern enum error maprangeset(Var map, rbtrav *from, rbtrav *to, Var value, Var
 typedef int (*mapfunc) (Var key, Var value, void *data, int first);
 extern int mapforeach(Var map, mapfunc func, void *data);
 
+/* Puts every map reachable from `v' into key order ahead of time, so that
+ * another thread can iterate over them without writing to them.
+ */
+extern void map_sort_deep(Var v);
+
 /*
  * Iterate over the key-value pairs in the map `mp`. Sets `key` and `val`
  * to each key-value pair in turn. `idx` and `cnt` must be int variables.
@@ -111,4 +127,4 @@ extern int mapforeach(Var map, mapfunc func, void *data);
  * removes a `var_ref' and eventual `map_dup' when the vm can
  * guarantee that a nested map is not shared.
  */
-extern void clear_node_value(const rbnode *node);
+extern void clear_node_value(Var map, const rbnode *node);
@@ -20,40 +20,50 @@
  *
  * The `mplex' abstraction provides a way to wait until it is possible to
  * perform an I/O operation on any of a set of file descriptors without
- * blocking.  Uses of the abstraction always have the following form:
+ * blocking.  The set of file descriptors maintained by the abstraction is
+ * referred to below as the `wait set'.  Each file descriptor in the wait
+ * set is marked with the kind of I/O (i.e., reading, writing, or both)
+ * desired.  The wait set is kept from one wait to the next, so it only has
+ * to be told when what is wanted of a descriptor changes.  Uses of the
+ * abstraction have the following form:
  *
- *      mplex_clear();
- *      { mplex_add_reader(fd)  or  mplex_add_writer(fd) }*
+ *      { mplex_watch(fd, kinds) }*
  *      timed_out = mplex_wait(timeout);
- *      { mplex_is_readable(fd)  or  mplex_is_writable(fd) }*
- *
- * The set of file descriptors maintained by the abstraction is referred to
- * below as the `wait set'.  Each file descriptor in the wait set is marked
- * with the kind of I/O (i.e., reading, writing, or both) desired.
+ *      count = mplex_ready(&fds);
+ *      { mplex_is_readable(fds[i])  or  mplex_is_writable(fds[i]) }*
  */
 
 #ifndef Net_MPlex_H
 #define Net_MPlex_H 1
 
-extern void mplex_clear(void);
-				/* Reset the wait set to be empty. */
-
-extern void mplex_add_reader(int fd);
-				/* Add the given file descriptor to the wait
-				 * set, marked for reading.
-				 */
+#define MPLEX_READ	1
+#define MPLEX_WRITE	2
 
-extern void mplex_add_writer(int fd);
-				/* Add the given file descriptor to the wait
-				 * set, marked for writing.
+extern void mplex_watch(int fd, int kinds);
+				/* Mark the given file descriptor in the wait
+				 * set with `kinds', some combination of
+				 * MPLEX_READ and MPLEX_WRITE, replacing what
+				 * it was marked with before.  Zero removes it
+				 * from the wait set, which must be done before
+				 * the descriptor is closed.  A removed
+				 * descriptor isn't reported ready again until
+				 * after the next wait.
 				 */
 
 extern int mplex_wait(unsigned timeout);
 				/* Wait until it is possible either to do the
 				 * appropriate kind of I/O on some descriptor
-				 * in the wait set or until `timeout' seconds
-				 * have elapsed.  Return true iff the timeout
-				 * expired without any I/O becoming possible.
+				 * in the wait set or until `timeout'
+				 * microseconds have elapsed.  Return true iff
+				 * the timeout expired without any I/O becoming
+				 * possible.
+				 */
+
+extern int mplex_ready(const int **fds);
+				/* Set *fds to the descriptors the most recent
+				 * mplex_wait() call found ready and return how
+				 * many there are.  The list stays valid until
+				 * the next wait.
 				 */
 
 extern int mplex_is_readable(int fd);
@@ -64,7 +74,7 @@ extern int mplex_is_readable(int fd);
 
 extern int mplex_is_writable(int fd);
 				/* Return true iff the most recent mplex_wait()
-				 * call terminated (in part) because reading
+				 * call terminated (in part) because writing
 				 * had become possible on the given descriptor.
 				 */
 
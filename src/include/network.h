@@ -402,6 +402,12 @@ int network_parse_proxy_string(char *command, Stream *new_connection_name, struc
                  * it into a new connection_name and sockaddr_storage
                  * for the connection. */
 
+extern Var network_output_stats(network_handle);
+				/* Return a map of the bytes written, write
+				 * system calls made, output flushes and bytes
+				 * still queued on the given connection.
+				 */
+
 #ifdef USE_TLS
 extern int network_handle_is_tls(network_handle);
 extern int nlistener_is_tls(const void *);
@@ -423,7 +429,8 @@ extern void network_register_fd(int fd, network_fd_callback readable,
 
 extern void network_unregister_fd(int fd);
 				/* Any existing registration for FD is
-				 * forgotten.
+				 * forgotten.  This must be done before FD is
+				 * closed.
 				 */
 
 #ifndef HAVE_ACCEPT4
@@ -40,6 +40,11 @@ enum Extended_Opcode {
     EOP_BITOR, EOP_BITAND, EOP_BITXOR,
     EOP_BITSHL, EOP_BITSHR, EOP_COMPLEMENT,
 
+    /* superinstructions: `var.name', `var[literal]' and `var + literal'
+     * as one op (see generate_superinstruction() in code_gen.cc)
+     */
+    EOP_VAR_GET_PROP, EOP_VAR_INDEX, EOP_VAR_ADD,
+
     Last_Extended_Opcode = 255
 };
 
@@ -74,6 +74,54 @@
 
 /* #define UNFORKED_CHECKPOINTS */
 
+/******************************************************************************
+ * Define INCREMENTAL_CHECKPOINTS to have most checkpoints write only the
+ * objects that changed since the previous one.  The server keeps track of
+ * which objects have been modified and, instead of forking, appends their new
+ * contents (along with the task queue and the other small, global parts of the
+ * database) to a numbered delta file next to the output database, e.g.
+ * `foo.db.new.delta.1'.  Writing a delta takes time proportional to the amount
+ * of change rather than to the size of the database, so it is done in the
+ * server process itself.
+ *
+ * Every CHECKPOINT_COMPACT_INTERVAL deltas, the server instead writes a full
+ * database as usual (forked, unless UNFORKED_CHECKPOINTS is defined) and
+ * discards the deltas once it is safely on disk.  The first checkpoint after
+ * startup, the shutdown dump, and any checkpoint after a change the server
+ * can't attribute to a single permanent object (a WAIF property being set, or
+ * a change to an anonymous object that is already in the last full dump) are
+ * always full.
+ *
+ * When loading `foo.db', the server replays `foo.db.delta.1', `foo.db.delta.2',
+ * ... in order, as long as they were written against that exact file.  The
+ * restart script moves the deltas along with the database it renames.
+ */
+
+/* #define INCREMENTAL_CHECKPOINTS */
+
+#define CHECKPOINT_COMPACT_INTERVAL 24
+
+/******************************************************************************
+ * Define LAZY_VERB_PROGRAMS to postpone compiling the verb programs of a text
+ * database until each verb is first called, listed or otherwise needs its
+ * program.  Until then, the source read from the database is kept packed
+ * into large blocks, which are freed as soon as none of their verbs are
+ * waiting to be compiled anymore.  Checkpoints write the source of verbs
+ * still waiting back out unchanged.  In most databases, only a fraction of
+ * the verbs are used between restarts, so this shortens startup considerably.
+ *
+ * A verb whose source doesn't parse no longer stops the database from
+ * loading: the error is logged the first time the verb is needed, the verb
+ * then behaves as if it had no program, and text checkpoints keep writing
+ * its source until it is reprogrammed.
+ *
+ * Programs saved in the binary database encoding or by another database
+ * format version are always loaded right away.  verb_cache_stats() reports
+ * how many verbs are still waiting to be compiled.
+ */
+
+/* #define LAZY_VERB_PROGRAMS */
+
 /******************************************************************************
  * If OUT_OF_BAND_PREFIX is defined as a non-empty string, then any lines of
  * input from any player that begin with that prefix will bypass both normal
@@ -142,6 +190,9 @@
 /******************************************************************************
  * MP_SELECT   The server will assume that the select() system call exists.
  * MP_POLL      The server will assume that the poll() system call exists.
+ * MP_EPOLL     The server will use Linux's epoll facility, which keeps the
+ *              set of watched descriptors in the kernel between waits, so
+ *              idle connections cost next to nothing per wait.
  *
  * Usually, it works best to leave MPLEX_STYLE undefined and let the code at
  * the bottom of this file pick the right value.
@@ -317,6 +368,20 @@
 
 #define BYTECODE_REDUCE_REF /* */
 
+/******************************************************************************
+ * The interpreter normally dispatches every opcode through one big switch
+ * statement, so a single indirect jump decides where each of the opcodes in
+ * every verb goes next, and the processor predicts it poorly.  Define
+ * THREADED_DISPATCH to have the code for each opcode jump directly to the
+ * code for the next one instead (`direct threading').  This typically makes
+ * MOO code run noticeably faster, but needs a compiler that supports GCC's
+ * labels-as-values extension (GCC and Clang do).  The bytecode itself is
+ * unaffected, so databases and suspended tasks are compatible either way.
+ * test/benchmarks/bench_dispatch.rb measures the difference.
+ */
+
+/* #define THREADED_DISPATCH */
+
 /******************************************************************************
  * The server can merge duplicate strings on load to conserve memory.  This
  * involves a rather expensive step at startup to dispose of the table used
@@ -339,6 +404,36 @@
 
 #define MEMO_SIZE
 
+/******************************************************************************
+ * Define USE_SLAB_ALLOCATOR to serve small allocations (strings, lists, map
+ * nodes, waifs and so on) from per-type, size-class slabs with per-thread
+ * free lists rather than calling malloc() and free() every time.  This trades
+ * a little memory, since slab chunks are never given back to the system, for
+ * considerably less time spent in the allocator.  The slab_stats() built-in
+ * reports per-class occupancy, fragmentation and hit rates.
+ ******************************************************************************
+*/
+
+/* #define USE_SLAB_ALLOCATOR */
+
+/******************************************************************************
+ * Reference counts on strings, lists, maps and other shared values are
+ * normally updated with atomic instructions, since values are also handed to
+ * background threads (sort(), sqlite_execute(), curl() and so on).  Define
+ * NONATOMIC_REFCOUNTS to use plain increments and decrements instead, which
+ * are considerably cheaper on every value the interpreter copies or frees.
+ * In exchange, the arguments given to background_thread() are copied deeply
+ * before the thread starts, so that the thread shares no reference counts
+ * with the main thread until its work is done.  Arguments holding waifs or
+ * anonymous objects, which can't be copied, are handled on the main thread
+ * as if threading were disabled.  Values any thread may take references to
+ * at any time, such as the empty list, are pinned instead.
+ * test/benchmarks/bench_refcounts.rb measures the difference.
+ ******************************************************************************
+ */
+
+/* #define NONATOMIC_REFCOUNTS */
+
 /******************************************************************************
  * DEFAULT_MAX_STRING_CONCAT,      if set to a positive value, is the length
  *                                 of the largest constructible string.
@@ -403,12 +498,15 @@
  * directory inside the working directory in which all files must
  * reside. FILE_IO_MAX_FILES can be overridden in-database by adding the
  * $server_options.file_io_max_files property and calling load_server_options()
+ * Each open file remembers where every FILE_IO_LINE_INDEX_INTERVAL'th line
+ * starts, so file_readlines() needn't read a file from the top to find a line.
  ******************************************************************************
  */
 
 #define FILE_SUBDIR "files/"
 #define FILE_IO_BUFFER_LENGTH 4096
 #define FILE_IO_MAX_FILES     256
+#define FILE_IO_LINE_INDEX_INTERVAL 64
 
 /******************************************************************************
  * Enable log output colorization.
@@ -434,9 +532,9 @@
 /* #define OWNERSHIP_QUOTA */
 
 /******************************************************************************
- * Cache ancestor lists until a parent changes. This is a quick and dirty solution
- * that will allow loops performing property lookups to happen much faster. Its
- * use in other applications is minimal, as the cache is invalidated often.
+ * Cache a flat array of each object's ancestors until a parent changes. Property
+ * and verb lookups walk this array directly. Changing an object's parents only
+ * invalidates the cached arrays of that object and its descendants.
  ******************************************************************************
 */
 #define USE_ANCESTOR_CACHE
@@ -543,9 +641,14 @@
 
 /******************************************************************************
  * The default maximum number of seconds a curl() transfer can last.
+ *
+ * CURL_MAX_CONNECTIONS is the most connections curl() keeps open at once,
+ * counting both the ones in use and the idle ones kept for reuse.  Requests
+ * beyond it wait for a connection to free up.
 */
 
 #define CURL_TIMEOUT 60
+#define CURL_MAX_CONNECTIONS 64
 
 /*****************************************************************************
  ********** You shouldn't need to change anything below this point. **********
@@ -590,6 +693,7 @@
 
 #define MP_SELECT 1
 #define MP_POLL   2
+#define MP_EPOLL  3
 
 #include "config.h"
 
@@ -620,7 +724,9 @@
 
 #if !defined(MPLEX_STYLE)
 #  if NETWORK_STYLE == NS_BSD
-#    if HAVE_POLL
+#    if HAVE_EPOLL
+#       define MPLEX_STYLE MP_EPOLL
+#    elif HAVE_POLL
 #       define MPLEX_STYLE MP_POLL
 #    elif HAVE_SELECT
 #      define MPLEX_STYLE MP_SELECT
@@ -648,8 +754,13 @@
 
 #if defined(MPLEX_STYLE)  \
     && MPLEX_STYLE != MP_SELECT \
-    && MPLEX_STYLE != MP_POLL
+    && MPLEX_STYLE != MP_POLL \
+    && MPLEX_STYLE != MP_EPOLL
 #  error Illegal value for "MPLEX_STYLE"
 #endif
 
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#  error THREADED_DISPATCH needs a compiler supporting labels as values
+#endif
+
 #endif        /* !Options_h */
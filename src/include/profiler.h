@@ -0,0 +1,37 @@
+#ifndef Profiler_h
+#define Profiler_h 1
+
+#include <stdint.h>
+
+#include "program.h"
+#include "structures.h"
+
+/* One activation on the stack of a sampled task. */
+typedef struct {
+    Program *prog;
+    int vector;                 /* MAIN_VECTOR or a fork vector index */
+    unsigned pc;                /* start of the opcode being executed */
+    Objid definer;              /* NOTHING if anonymous */
+    const char *verbname;
+} Profile_Frame;
+
+extern bool profiler_running;
+extern int profiler_countdown;
+				/* Ticks until the interpreter should call
+				 * profiler_sample() again.
+				 */
+extern uint64_t profiler_opcode_counts[256];
+extern uint64_t profiler_ext_opcode_counts[256];
+
+extern void profiler_task_resumed(void);
+				/* Called when the interpreter starts running
+				 * a task, so that time and allocations from
+				 * elsewhere aren't blamed on its next sample.
+				 */
+extern void profiler_sample(const Profile_Frame *frames, unsigned count);
+				/* Blames the ticks, time and allocations
+				 * since the last sample on the given stack,
+				 * outermost activation first.
+				 */
+
+#endif				/* !Profiler_h */
@@ -6,6 +6,10 @@
                                         // instead just close connections that are created over
                                         // the cap after they're done their work.
 
+#define SQL_STATEMENT_CACHE_SIZE   32   // The number of prepared statements each
+                                        // connection keeps for reuse, evicting the least
+                                        // recently used when it's full.
+
 #define SQL_PARSE_TYPES      2   // Return all strings if unset
 #define SQL_PARSE_OBJECTS    4   // Turn "#100" into OBJ
 #define SQL_SANITIZE_STRINGS 8   // Strip newlines from returned strings.
@@ -40,7 +40,11 @@ typedef enum GC_Color {
  #endif
 
 typedef struct var_metadata {
+#ifdef NONATOMIC_REFCOUNTS
+    uint32_t refcount;
+#else
     std::atomic<uint32_t> refcount;
+#endif
 #ifdef MEMO_SIZE
     uint32_t size;                      // MEMO_SIZE: strlen / list/map bytes
 #endif
@@ -50,6 +54,22 @@ typedef struct var_metadata {
 #endif
 } var_metadata;
 
+/* Lists also record how many elements they have room for, so that an
+ * unshared list can grow geometrically as it is appended to.  The header
+ * may be smaller than the alignment of the Var elements after it, in which
+ * case refcount_overhead() leaves unused space in front of it.
+ */
+typedef struct list_metadata {
+    uint32_t capacity;
+    var_metadata metadata;
+} list_metadata;
+
+/* list_capacity() and addref() both find their fields by stepping back
+ * from the elements, so there must be no padding after `metadata'.
+ */
+static_assert(sizeof(list_metadata) == sizeof(uint32_t) + sizeof(var_metadata),
+              "list_metadata must end with its var_metadata");
+
 static inline uint32_t
 addref(const void *ptr)
 {
@@ -71,6 +91,20 @@ refcount(const void *ptr)
     return metadata->refcount;
 }
 
+/* Values that any thread may take references to, without them being
+ * handed over as described under NONATOMIC_REFCOUNTS in options.h, must
+ * be pinned: their reference count is set so high that updates lost to
+ * a race can never bring it down to zero.  Pinned values are never freed.
+ */
+#define PINNED_REFCOUNT (1u << 30)
+
+static inline void
+pin(const void *ptr)
+{
+    var_metadata *metadata = ((var_metadata*)ptr) - 1;
+    metadata->refcount = PINNED_REFCOUNT;
+}
+
 #ifdef ENABLE_GC
 static inline void
 gc_set_buffered(const void *ptr)
@@ -138,11 +172,18 @@ typedef enum Memory_Type {
 
 extern char *str_dup(const char *);
 extern const char *str_ref(const char *);
+extern const char *str_char_ref(unsigned char c);
 
 extern void myfree(void *where, Memory_Type type);
 extern void *mymalloc(unsigned size, Memory_Type type);
+extern std::atomic<uint64_t> allocation_count;	/* calls to mymalloc() so far */
 extern void *myrealloc(void *where, unsigned size, Memory_Type type);
 
+#ifdef USE_SLAB_ALLOCATOR
+struct Var;
+extern Var slab_stats(void);
+#endif
+
 static inline void		/* XXX was extern, fix for non-gcc compilers */
 free_str(const char *s)
 {
@@ -110,6 +110,11 @@ extern std::mutex task_queue_mutex;
 
 extern void write_task_queue(void);
 extern int read_task_queue(void);
+extern void discard_task_queue(void);
+				/* Frees the forked and suspended tasks read
+				 * so far, so that a later read_task_queue()
+				 * can replace them.
+				 */
 
 extern db_verb_handle find_verb_for_programming(Objid player,
 						const char *verbref,
@@ -40,6 +40,14 @@ extern Var complex_var_ref(Var);
 extern Var complex_var_dup(Var);
 extern int var_refcount(Var);
 
+extern Var var_deep_copy(Var);
+				/* Returns a copy of the value that shares
+				 * no strings, lists or maps with it (the
+				 * shared empty values aside).  Objects,
+				 * anonymous objects and WAIFs are referenced,
+				 * not copied.
+				 */
+
 extern void aux_free(Var);
 
 static inline void
@@ -82,6 +90,20 @@ extern Objid get_system_object(const char *);
 
 extern int value_bytes(Var);
 
+#ifdef MEMO_SIZE
+/*
+ * The memoized size of a list or map, as counted by value_bytes() less
+ * the Var itself, or 0 if it isn't known yet.  A list or map that is
+ * changed in place must adjust it or reset it to 0.
+ */
+static inline uint32_t &
+memo_size(Var v)
+{
+    void *p = v.type == TYPE_LIST ? (void *) v.v.list : (void *) v.v.tree;
+    return (((var_metadata *) p) - 1)->size;
+}
+#endif
+
 extern void stream_add_raw_bytes_to_clean(Stream *, const char *buffer, int buflen);
 extern const char *raw_bytes_to_clean(const char *buffer, int buflen);
 extern const char *clean_to_raw_bytes(const char *binary, int *rawlen);
@@ -84,6 +84,10 @@ typedef enum {
                  */
     DBV_Bool,       /* Boolean type
                      */
+    DBV_Superinstructions,	/* Common opcode sequences compiled to
+				 * superinstructions, changing the program
+				 * counters of suspended tasks.
+				 */
     Num_DB_Versions		/* Special: the current version is this - 1. */
 } DB_Version;
 
@@ -35,6 +35,7 @@ my @options =
 	      [MPLEX_STYLE =>
 	       qw(MP_SELECT
 		  MP_POLL
+		  MP_EPOLL
 		)],
 	      [OUTBOUND_NETWORK =>
 	       { qw(0 OFF
@@ -58,14 +59,21 @@ my @options =
 
    # optimizations
    _DDEF => [qw(UNFORKED_CHECKPOINTS
+		INCREMENTAL_CHECKPOINTS
+		LAZY_VERB_PROGRAMS
 		BYTECODE_REDUCE_REF
+		THREADED_DISPATCH
 		STRING_INTERNING
 		MEMO_SIZE
+		USE_SLAB_ALLOCATOR
+		NONATOMIC_REFCOUNTS
 		ENABLE_GC
 		USE_ANCESTOR_CACHE
 		UNSAFE_FIO
 		THREAD_ARGON2
 	      )],
+   _DINT => [qw(CHECKPOINT_COMPACT_INTERVAL
+	      )],
 
    # logging
    _DDEF => [qw(LOG_COMMANDS
@@ -107,6 +115,7 @@ my @options =
 		EXEC_MAX_PROCESSES
 		FILE_IO_BUFFER_LENGTH
 		FILE_IO_MAX_FILES
+		FILE_IO_LINE_INDEX_INTERVAL
 	      )],
 	_DFLOAT => [qw(DEFAULT_LAG_THRESHOLD
 		  )],
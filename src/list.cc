@@ -46,6 +46,87 @@
 #include "background.h"   // Threads
 #include "random.h"
 
+/* Unshared lists grow by half again their capacity when they run out
+ * of room, and shrink to twice their length when they fall below a
+ * quarter of it.
+ */
+#define LIST_MIN_CAPACITY   4
+
+static inline uint32_t &
+list_capacity(Var *list)
+{
+    return (((list_metadata *)list) - 1)->capacity;
+}
+
+static Var *
+resize_list(Var *list, uint32_t capacity)
+{
+    list = (Var *) myrealloc(list, (capacity + 1) * sizeof(Var), M_LIST);
+    list_capacity(list) = capacity;
+
+    return list;
+}
+
+/* Makes room for `size' elements in an unshared list. */
+static Var *
+reserve_list(Var *list, int size)
+{
+    uint32_t capacity = list_capacity(list);
+
+    if ((uint32_t) size <= capacity)
+        return list;
+
+    capacity += capacity / 2;
+    if (capacity < (uint32_t) size)
+        capacity = size;
+    if (capacity < LIST_MIN_CAPACITY)
+        capacity = LIST_MIN_CAPACITY;
+
+    return resize_list(list, capacity);
+}
+
+/* Gives back room an unshared list has stopped using. */
+static Var *
+trim_list(Var *list)
+{
+    uint32_t length = list[0].v.num, capacity = list_capacity(list);
+
+    if (capacity > LIST_MIN_CAPACITY * 4 && length < capacity / 4)
+        return resize_list(list, MAX(length * 2, LIST_MIN_CAPACITY));
+
+    return list;
+}
+
+/* True if the list can be changed in place, and moved in memory. */
+static inline bool
+list_is_unshared(Var list)
+{
+#ifdef ENABLE_GC
+    /* The cycle collector's root buffer may point at the list. */
+    if (gc_is_buffered(list.v.list))
+        return false;
+#endif
+
+    return var_refcount(list) == 1;
+}
+
+/* Must be called after an unshared list is changed in place.  Unless
+ * the caller has already adjusted the memoized size to match, it is
+ * thrown away.
+ */
+static inline void
+list_changed(Var list, bool size_adjusted = false)
+{
+#ifdef MEMO_SIZE
+    if (!size_adjusted)
+        memo_size(list) = 0;
+#endif
+
+#ifdef ENABLE_GC
+    gc_set_color(list.v.list, GC_YELLOW);
+#endif
+}
+
 Var
 new_list(int size)
 {
@@ -59,10 +140,12 @@ new_list(int size)
             if ((ptr = (Var *)mymalloc(1 * sizeof(Var), M_LIST)) == nullptr)
                 panic_moo("EMPTY_LIST: mymalloc failed");
 
+            list_capacity(ptr) = 0;
             emptylist.type = TYPE_LIST;
             emptylist.v.list = ptr;
             emptylist.v.list[0].type = TYPE_INT;
             emptylist.v.list[0].v.num = 0;
+            pin(emptylist.v.list);
         }
 
 #ifdef ENABLE_GC
@@ -77,6 +160,7 @@ new_list(int size)
     if ((ptr = (Var *)mymalloc((size + 1) * sizeof(Var), M_LIST)) == nullptr)
         panic_moo("EMPTY_LIST: mymalloc failed");
 
+    list_capacity(ptr) = size;
     list.type = TYPE_LIST;
     list.v.list = ptr;
     list.v.list[0].type = TYPE_INT;
@@ -108,6 +192,8 @@ destroy_list(Var list)
 #endif
 }
 
+uint64_t list_dup_count = 0;
+
 /* called from utils.c */
 Var
 list_dup(Var list)
@@ -118,6 +204,12 @@ list_dup(Var list)
     for (i = 1; i <= n; i++)
         _new.v.list[i] = var_ref(list.v.list[i]);
 
+#ifdef MEMO_SIZE
+    if (n > 0)
+        memo_size(_new) = memo_size(list);
+#endif
+    list_dup_count++;
+
 #ifdef ENABLE_GC
     gc_set_color(_new.v.list, gc_get_color(list.v.list));
 #endif
@@ -174,9 +266,9 @@ listset(Var list, Var value, int pos)
     }
 
 #ifdef MEMO_SIZE
-    /* reset the memoized size */
-    var_metadata *metadata = ((var_metadata*)_new.v.list) - 1;
-    metadata->size = 0;
+    /* keep the memoized size, if there is one, up to date */
+    if (memo_size(_new))
+        memo_size(_new) += value_bytes(value) - value_bytes(_new.v.list[pos]);
 #endif
 
     free_var(_new.v.list[pos]);
@@ -189,6 +281,17 @@ listset(Var list, Var value, int pos)
     return _new;
 }
 
+/* called from execute.c */
+void
+clear_list_value(Var list, int pos)
+{
+#ifdef MEMO_SIZE
+    if (memo_size(list))
+        memo_size(list) -= value_bytes(list.v.list[pos]) - sizeof(Var);
+#endif
+    list.v.list[pos].type = TYPE_NONE;
+}
+
 static Var
 doinsert(Var list, Var value, int pos)
 {
@@ -196,19 +299,17 @@ doinsert(Var list, Var value, int pos)
     int i;
     int size = list.v.list[0].v.num + 1;
 
-    if (var_refcount(list) == 1 && pos == size) {
-        list.v.list = (Var *) myrealloc(list.v.list, (size + 1) * sizeof(Var), M_LIST);
-#ifdef MEMO_SIZE
-        /* reset the memoized size */
-        var_metadata *metadata = ((var_metadata*)list.v.list) - 1;
-        metadata->size = 0;
-#endif
+    if (list_is_unshared(list)) {
+        list.v.list = reserve_list(list.v.list, size);
+        memmove(list.v.list + pos + 1, list.v.list + pos,
+                (size - pos) * sizeof(Var));
         list.v.list[0].v.num = size;
         list.v.list[pos] = value;
-
-#ifdef ENABLE_GC
-        gc_set_color(list.v.list, GC_YELLOW);
+#ifdef MEMO_SIZE
+        if (memo_size(list))
+            memo_size(list) += value_bytes(value);
 #endif
+        list_changed(list, true);
 
         return list;
     }
@@ -251,6 +352,21 @@ listdelete(Var list, int pos)
     int i;
     int size = list.v.list[0].v.num - 1;
 
+    if (list_is_unshared(list)) {
+#ifdef MEMO_SIZE
+        if (memo_size(list))
+            memo_size(list) -= value_bytes(list.v.list[pos]);
+#endif
+        free_var(list.v.list[pos]);
+        memmove(list.v.list + pos, list.v.list + pos + 1,
+                (size - pos + 1) * sizeof(Var));
+        list.v.list[0].v.num = size;
+        list.v.list = trim_list(list.v.list);
+        list_changed(list, true);
+
+        return list;
+    }
+
     _new = new_list(size);
     for (i = 1; i < pos; i++) {
         _new.v.list[i] = var_ref(list.v.list[i]);
@@ -276,6 +392,18 @@ listconcat(Var first, Var second)
     Var _new;
     int i;
 
+    if (list_is_unshared(first)) {
+        first.v.list = reserve_list(first.v.list, lfirst + lsecond);
+        for (i = 1; i <= lsecond; i++)
+            first.v.list[i + lfirst] = var_ref(second.v.list[i]);
+        first.v.list[0].v.num = lfirst + lsecond;
+        list_changed(first);
+
+        free_var(second);
+
+        return first;
+    }
+
     _new = new_list(lsecond + lfirst);
     for (i = 1; i <= lfirst; i++)
         _new.v.list[i] = var_ref(first.v.list[i]);
@@ -306,6 +434,28 @@ listrangeset(Var base, int from, int to, Var value)
     int newsize = lenleft + lenmiddle + lenright;
     Var ans;
 
+    /* When `from' > `to' + 1, the elements in between appear twice. */
+    if (list_is_unshared(base) && lenleft + lenright <= base_len) {
+        /* Replace base[lenleft + 1..base_len - lenright] with value. */
+        int lenold = base_len - lenleft - lenright;
+
+        for (index = 1; index <= lenold; index++)
+            free_var(base.v.list[lenleft + index]);
+        if (newsize > base_len)
+            base.v.list = reserve_list(base.v.list, newsize);
+        memmove(base.v.list + lenleft + lenmiddle + 1,
+                base.v.list + lenleft + lenold + 1, lenright * sizeof(Var));
+        for (index = 1; index <= lenmiddle; index++)
+            base.v.list[lenleft + index] = var_ref(value.v.list[index]);
+        base.v.list[0].v.num = newsize;
+        base.v.list = trim_list(base.v.list);
+        list_changed(base);
+
+        free_var(value);
+
+        return base;
+    }
+
     ans = new_list(newsize);
     for (index = 1; index <= lenleft; index++)
         ans.v.list[++offset] = var_ref(base.v.list[index]);
@@ -580,6 +730,8 @@ substr(Var str, int lower, int upper)
     r.type = TYPE_STR;
     if (lower > upper)
         r.v.str = str_dup("");
+    else if (lower == upper)
+        r.v.str = str_char_ref(str.v.str[lower - 1]);
     else {
         int loop, index = 0;
         char *s = (char *)mymalloc(upper - lower + 2, M_STRING);
@@ -597,12 +749,9 @@ Var
 strget(Var str, int i)
 {
     Var r;
-    char *s;
 
     r.type = TYPE_STR;
-    s = str_dup(" ");
-    s[0] = str.v.str[i - 1];
-    r.v.str = s;
+    r.v.str = str_char_ref(str.v.str[i - 1]);
     return r;
 }
 
@@ -1400,8 +1549,7 @@ bf_strsub(Var arglist, Byte next, void *vdata, Objid progr)
         Var r;
         stream_add_strsub(s, arglist.v.list[1].v.str, arglist.v.list[2].v.str,
                           arglist.v.list[3].v.str, case_matters);
-        r.type = TYPE_STR;
-        r.v.str = str_dup(stream_contents(s));
+        r = str_dup_to_var(stream_contents(s));
         p = make_var_pack(r);
     }
     catch (stream_too_big& exception) {
@@ -1510,8 +1658,7 @@ bf_tostr(Var arglist, Byte next, void *vdata, Objid progr)
         for (i = 1; i <= arglist.v.list[0].v.num; i++) {
             stream_add_tostr(s, arglist.v.list[i]);
         }
-        r.type = TYPE_STR;
-        r.v.str = str_dup(stream_contents(s));
+        r = str_dup_to_var(stream_contents(s));
         p = make_var_pack(r);
     }
     catch (stream_too_big& exception) {
@@ -1945,8 +2092,7 @@ bf_chr(Var arglist, Byte next, void *vdata, Objid progr)
     try {
         int encoded = (!is_wizard(progr) ? encode_binary(s, arglist, 32, 254) : encode_binary(s, arglist, 0, 255));
         if (encoded) {
-            r.type = TYPE_STR;
-            r.v.str = str_dup(stream_contents(s));
+            r = str_dup_to_var(stream_contents(s));
             p = make_var_pack(r);
         }
         else
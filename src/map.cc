@@ -31,6 +31,9 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
+
 #include "functions.h"
 #include "list.h"
 #include "log.h"
@@ -40,28 +43,115 @@
 #include "structures.h"
 #include "utils.h"
 
+/* The smallest number of entries a non-empty map has room for. */
+#define MIN_CAPACITY 4
+
+static inline uint32_t
+hash_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t) x;
+}
+
 /*
-  Red Black balanced tree library
+ * Hashes a key.  Strings hash without regard to case, since that's how
+ * keys are matched.
+ */
+static uint32_t
+key_hash(Var key)
+{
+    switch (key.type) {
+        case TYPE_STR:
+            return hash_mix(str_hash(key.v.str));
+        case TYPE_INT:
+            return hash_mix(key.v.num);
+        case TYPE_OBJ:
+            return hash_mix(key.v.obj);
+        case TYPE_ERR:
+            return hash_mix(key.v.err);
+        case TYPE_FLOAT: {
+            /* 0.0 and -0.0 are the same key */
+            double d = key.v.fnum == 0.0 ? 0.0 : key.v.fnum;
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return hash_mix(bits);
+        }
+        case TYPE_ANON:
+            return hash_mix((uintptr_t) key.v.anon);
+        case TYPE_WAIF:
+            return hash_mix((uintptr_t) key.v.waif);
+        case TYPE_BOOL:
+            return key.v.truth;
+        default:
+            panic_moo("KEY_HASH: invalid key");
+    }
 
-    > Created (Julienne Walker): August 23, 2003
-    > Modified (Julienne Walker): March 14, 2008
+    return 0;
+}
 
-  This code is in the public domain. Anyone may
-  use it or change it in any way that they see
-  fit. The author assumes no responsibility for
-  damages incurred through use of the original
-  code or any variations thereof.
+/*
+ * Returns 1 if two keys name the same entry (ignoring case).
+ */
+static int
+key_match(Var lhs, Var rhs)
+{
+    if (lhs.type != rhs.type)
+        return 0;
 
-  It is requested, but not required, that due
-  credit is given to the original author and
-  anyone who has modified the code through a
-  header comment, such as this one.
-*/
+    switch (lhs.type) {
+        case TYPE_STR:
+            return lhs.v.str == rhs.v.str || !strcasecmp(lhs.v.str, rhs.v.str);
+        case TYPE_INT:
+            return lhs.v.num == rhs.v.num;
+        case TYPE_OBJ:
+            return lhs.v.obj == rhs.v.obj;
+        case TYPE_ERR:
+            return lhs.v.err == rhs.v.err;
+        case TYPE_FLOAT:
+            return lhs.v.fnum == rhs.v.fnum;
+        case TYPE_ANON:
+            return lhs.v.anon == rhs.v.anon;
+        case TYPE_WAIF:
+            return lhs.v.waif == rhs.v.waif;
+        case TYPE_BOOL:
+            return lhs.v.truth == rhs.v.truth;
+        default:
+            return 0;
+    }
+}
 
+/*
+ * The order in which entries are visited.  This is the order `compare'
+ * gives, except that it doesn't truncate the difference of large
+ * numbers, and it gives the keys `compare' can't order (anonymous
+ * objects, waifs and booleans) an order of their own.
+ */
 static int
-node_compare(const rbnode *node1, const rbnode *node2, int case_matters)
+key_order(Var lhs, Var rhs)
 {
-    return compare(node1->key, node2->key, case_matters);
+    if (lhs.type != rhs.type)
+        return lhs.type - rhs.type;
+
+    switch (lhs.type) {
+        case TYPE_INT:
+            return (lhs.v.num > rhs.v.num) - (lhs.v.num < rhs.v.num);
+        case TYPE_OBJ:
+            return (lhs.v.obj > rhs.v.obj) - (lhs.v.obj < rhs.v.obj);
+        case TYPE_FLOAT:
+            return (lhs.v.fnum > rhs.v.fnum) - (lhs.v.fnum < rhs.v.fnum);
+        case TYPE_ANON:
+            return std::less<Object *>()(rhs.v.anon, lhs.v.anon)
+                   - std::less<Object *>()(lhs.v.anon, rhs.v.anon);
+        case TYPE_WAIF:
+            return std::less<Waif *>()(rhs.v.waif, lhs.v.waif)
+                   - std::less<Waif *>()(lhs.v.waif, rhs.v.waif);
+        case TYPE_BOOL:
+            return lhs.v.truth - rhs.v.truth;
+        default:
+            return compare(lhs, rhs, 0);
+    }
 }
 
 static void
@@ -71,72 +161,141 @@ node_free_data(const rbnode *node)
     free_var(node->value);
 }
 
+static inline bool
+is_deleted(const rbnode *node)
+{
+    return node->key.type == TYPE_NONE;
+}
+
 /*
- * Returns 1 for a red node, 0 for a black node.
+ * Adds the entry at `index' to the slots.  There must be a free slot.
  */
-static int
-is_red(const rbnode *root)
+static void
+place(rbtree *tree, uint32_t index)
 {
-    return root != nullptr && root->red == 1;
+    uint32_t i = key_hash(tree->nodes[index].key) & tree->mask;
+
+    while (tree->slots[i] != 0)
+        i = (i + 1) & tree->mask;
+
+    tree->slots[i] = index + 1;
 }
 
 /*
- * Performs a single red black rotation in the specified direction.
- * Assumes that all nodes are valid for a rotation.
- *
- * `dir' is the direction to rotate (0 = left, 1 = right).
+ * Rebuilds the slots from scratch.  There are always at least twice as
+ * many slots as there is room for entries, so the index never gets more
+ * than half full, even counting the slots of deleted entries (which stay
+ * behind until the next rebuild).
  */
-static rbnode *
-rbsingle(rbnode *root, int dir)
+static void
+rebuild_slots(rbtree *tree)
 {
-    rbnode *save = root->link[!dir];
+    uint32_t count = 8;
+    uint32_t i;
 
-    root->link[!dir] = save->link[dir];
-    save->link[dir] = root;
+    while (count < tree->capacity * 2)
+        count <<= 1;
 
-    root->red = 1;
-    save->red = 0;
+    if (tree->slots == nullptr || count != tree->mask + 1) {
+        if (tree->slots != nullptr)
+            myfree(tree->slots, M_NODE);
+        tree->slots = (uint32_t *)mymalloc(count * sizeof(uint32_t), M_NODE);
+        tree->mask = count - 1;
+    }
+    memset(tree->slots, 0, count * sizeof(uint32_t));
 
-    return save;
+    for (i = 0; i < tree->used; i++)
+        if (!is_deleted(&tree->nodes[i]))
+            place(tree, i);
 }
 
 /*
- * Performs a double red black rotation in the specified direction.
- * Assumes that all nodes are valid for a rotation.
- *
- * `dir' is the direction to rotate (0 = left, 1 = right).
+ * Squeezes deleted entries out of the array, keeping the rest in the
+ * same order.  The slots must be rebuilt afterward.
  */
-static rbnode *
-rbdouble(rbnode *root, int dir)
+static void
+compact(rbtree *tree)
 {
-    root->link[!dir] = rbsingle(root->link[!dir], !dir);
+    uint32_t i, j;
+
+    for (i = j = 0; i < tree->used; i++)
+        if (!is_deleted(&tree->nodes[i]))
+            tree->nodes[j++] = tree->nodes[i];
 
-    return rbsingle(root, dir);
+    tree->used = j;
 }
 
 /*
- * Creates and initializes a new red black node with a copy of the
- * data.  This function does not insert the new node into a tree.
+ * Makes room for at least `count' more entries, by reclaiming deleted
+ * entries if there are enough of them and growing the array if not.
  */
-static rbnode *
-new_node(rbtree *tree, Var key, Var value)
+static void
+reserve(rbtree *tree, uint32_t count)
 {
-    rbnode *rn = (rbnode *)mymalloc(sizeof * rn, M_NODE);
+    uint32_t capacity = tree->capacity;
 
-    if (rn == nullptr)
-        return nullptr;
+    if (tree->used + count <= capacity)
+        return;
 
-    rn->red = 1;
-    rn->key = key;
-    rn->value = value;
-    rn->link[0] = rn->link[1] = nullptr;
+    if (tree->size + count <= capacity
+            && tree->used - tree->size >= capacity / 4) {
+        compact(tree);
+        rebuild_slots(tree);
+        return;
+    }
+
+    compact(tree);
+    capacity = capacity < MIN_CAPACITY ? MIN_CAPACITY : capacity * 2;
+    while (capacity < tree->size + count)
+        capacity *= 2;
 
-    return rn;
+    tree->nodes = (rbnode *)(tree->nodes
+                             ? myrealloc(tree->nodes, capacity * sizeof(rbnode), M_NODE)
+                             : mymalloc(capacity * sizeof(rbnode), M_NODE));
+    tree->capacity = capacity;
+    rebuild_slots(tree);
+}
+
+/*
+ * Puts the entries back into key order if new keys have been added out
+ * of order since the last time.  This rearranges the array, so it must
+ * not be done while someone is traversing the map -- but nothing can
+ * add keys to a map someone is traversing, so a map being traversed is
+ * always already sorted.
+ */
+static void
+ensure_sorted(rbtree *tree)
+{
+    if (tree->sorted)
+        return;
+
+    compact(tree);
+    std::sort(tree->nodes, tree->nodes + tree->used,
+              [](const rbnode &a, const rbnode &b) {
+                  return key_order(a.key, b.key) < 0;
+              });
+    rebuild_slots(tree);
+    tree->sorted = true;
 }
 
 /*
- * Creates and initializes an empty red black tree.  The returned
- * pointer must be released with `rbdelete'.
+ * Returns the first entry at or after `node' that hasn't been deleted,
+ * or a null pointer.
+ */
+static rbnode *
+skip_deleted(rbtree *tree, rbnode *node)
+{
+    rbnode *end = tree->nodes + tree->used;
+
+    while (node < end && is_deleted(node))
+        node++;
+
+    return node < end ? node : nullptr;
+}
+
+/*
+ * Creates and initializes an empty map.  The returned pointer must be
+ * released with `rbdelete'.
  */
 static rbtree *
 rbnew(void)
@@ -146,41 +305,38 @@ rbnew(void)
     if (rt == nullptr)
         return nullptr;
 
-    rt->root = nullptr;
+    rt->nodes = nullptr;
+    rt->slots = nullptr;
     rt->size = 0;
+    rt->used = 0;
+    rt->capacity = 0;
+    rt->mask = 0;
+    rt->sorted = true;
 
     return rt;
 }
 
 /*
- * Releases a valid red black tree.
+ * Releases a map's entries.
  */
 static void
 rbdelete(rbtree *tree)
 {
-    rbnode *it = tree->root;
-    rbnode *save;
+    uint32_t i;
 
-    /*
-       Rotate away the left links so that
-       we can treat this like the destruction
-       of a linked list
-     */
-    while (it != nullptr) {
-        if (it->link[0] == nullptr) {
-            /* No left links, just kill the node and move on */
-            save = it->link[1];
-            node_free_data(it);
-            myfree(it, M_NODE);
-        } else {
-            /* Rotate away the left link and check again */
-            save = it->link[0];
-            it->link[0] = save->link[1];
-            save->link[1] = it;
-        }
+    for (i = 0; i < tree->used; i++)
+        if (!is_deleted(&tree->nodes[i]))
+            node_free_data(&tree->nodes[i]);
 
-        it = save;
-    }
+    if (tree->nodes != nullptr)
+        myfree(tree->nodes, M_NODE);
+    if (tree->slots != nullptr)
+        myfree(tree->slots, M_NODE);
+
+    tree->nodes = nullptr;
+    tree->slots = nullptr;
+    tree->size = tree->used = tree->capacity = tree->mask = 0;
+    tree->sorted = true;
 
     /* Since this map could possibly be the root of a cycle, final
      * destruction is handled in the garbage collector if garbage
@@ -192,258 +348,102 @@ rbdelete(rbtree *tree)
 }
 
 /*
- * Searches for a copy of the specified node data in a red black tree.
- * Returns a pointer to the data value stored in the tree, or a null
- * pointer if no data could be found.
+ * Searches for the entry with the specified key.  Returns a pointer to
+ * the entry, or a null pointer if there is none.  Keys that differ only
+ * in case are the same key; with `case_matters' the case of the key
+ * must match as well.
  */
 static rbnode *
-rbfind(rbtree *tree, rbnode *node, int case_matters)
+rbfind(rbtree *tree, Var key, int case_matters)
 {
-    rbnode *it = tree->root;
+    uint32_t i, s;
 
-    while (it != nullptr) {
-        int cmp = node_compare(it, node, case_matters);
+    if (tree->size == 0)
+        return nullptr;
 
-        if (cmp == 0)
-            break;
+    for (i = key_hash(key) & tree->mask; (s = tree->slots[i]) != 0; i = (i + 1) & tree->mask) {
+        rbnode *node = &tree->nodes[s - 1];
 
-        /*
-           If the tree supports duplicates, they should be
-           chained to the right subtree for this to work
-         */
-        if (case_matters) {
-            /* The tree is built without case sensitivity. So if we try to
-             * navigate with case_matters, we will skip things and ultimately get
-             * incorrect results. So in lieu of a smarter solution, compare again
-             * without case sensitivity for the purposes of navigation. */
-            cmp = node_compare(it, node, 0);
+        if (!is_deleted(node) && key_match(node->key, key)) {
+            if (case_matters && key.type == TYPE_STR
+                    && strcmp(node->key.v.str, key.v.str))
+                return nullptr;
+            return node;
         }
-        it = it->link[cmp < 0];
     }
 
-    return it;
+    return nullptr;
 }
 
 /*
- * Searches for a copy of the specified node data in a red black tree.
- * Returns a new traversal object initialized to start at the
- * specified node, or a null pointer if no data could be found.  The
- * pointer must be released with `rbtdelete'.
+ * Appends an entry for a key that isn't in the map.
  */
-static rbtrav *
-rbseek(rbtree *tree, rbnode *node, int case_matters)
-{
-    rbtrav *trav = (rbtrav *)mymalloc(sizeof(rbtrav), M_TRAV);
-
-    trav->tree = tree;
-    trav->it = tree->root;
-    trav->top = 0;
-
-    while (trav->it != nullptr) {
-        int cmp = node_compare(trav->it, node, case_matters);
-
-        if (cmp == 0)
-            break;
-
-        /*
-           If the tree supports duplicates, they should be
-           chained to the right subtree for this to work
-         */
-        trav->path[trav->top++] = trav->it;
-        trav->it = trav->it->link[cmp < 0];
-    }
-
-    if (trav->it == nullptr) {
-        myfree(trav, M_TRAV);
-        trav = nullptr;
-    }
-
-    return trav;
+static void
+rbappend(rbtree *tree, Var key, Var value)
+{   /* consumes `key', `value' */
+    uint32_t index;
+
+    reserve(tree, 1);
+
+    index = tree->used++;
+    if (tree->sorted && index > 0
+            && (is_deleted(&tree->nodes[index - 1])
+                || key_order(tree->nodes[index - 1].key, key) >= 0))
+        tree->sorted = false;
+
+    tree->nodes[index].key = key;
+    tree->nodes[index].value = value;
+    place(tree, index);
+    tree->size++;
 }
 
 /*
- * Inserts a copy of the user-specified data into a red black tree.
- * Returns 1 if the value was inserted successfully, 0 if the
- * insertion failed for any reason.
+ * Inserts the key and value into the map, replacing the entry for the
+ * key if there is one.  The new key replaces the old one too, in case
+ * they differ in case.
  */
-static int
-rbinsert(rbtree *tree, rbnode *node)
-{
-    if (tree->root == nullptr) {
-        /*
-           We have an empty tree; attach the
-           new node directly to the root
-         */
-        tree->root = new_node(tree, node->key, node->value);
-
-        if (tree->root == nullptr)
-            return 0;
-    } else {
-        rbnode head = {};   /* False tree root */
-        rbnode *g, *t;      /* Grandparent & parent */
-        rbnode *p, *q;      /* Iterator & parent */
-        int dir = 0, last = 0;
-
-        /* Set up our helpers */
-        t = &head;
-        g = p = nullptr;
-        q = t->link[1] = tree->root;
-
-        /* Search down the tree for a place to insert */
-        for (;;) {
-            if (q == nullptr) {
-                /* Insert a new node at the first null link */
-                p->link[dir] = q = new_node(tree, node->key, node->value);
-
-                if (q == nullptr)
-                    return 0;
-            } else if (is_red(q->link[0]) && is_red(q->link[1])) {
-                /* Simple red violation: color flip */
-                q->red = 1;
-                q->link[0]->red = 0;
-                q->link[1]->red = 0;
-            }
-
-            if (is_red(q) && is_red(p)) {
-                /* Hard red violation: rotations necessary */
-                int dir2 = t->link[1] == g;
-
-                if (q == p->link[last])
-                    t->link[dir2] = rbsingle(g, !last);
-                else
-                    t->link[dir2] = rbdouble(g, !last);
-            }
-
-            /*
-               Stop working if we inserted a node. This
-               check also disallows duplicates in the tree
-             */
-            if (node_compare(q, node, 0) == 0)
-                break;
-
-            last = dir;
-            dir = node_compare(q, node, 0) < 0;
-
-            /* Move the helpers down */
-            if (g != nullptr)
-                t = g;
-
-            g = p, p = q;
-            q = q->link[dir];
-        }
-
-        /* Update the root (it may be different) */
-        tree->root = head.link[1];
-    }
-
-    /* Make the root black for simplified logic */
-    tree->root->red = 0;
-    ++tree->size;
+static void
+rbinsert(rbtree *tree, Var key, Var value)
+{   /* consumes `key', `value' */
+    rbnode *node = rbfind(tree, key, 0);
 
-    return 1;
+    if (node != nullptr) {
+        node_free_data(node);
+        node->key = key;
+        node->value = value;
+    } else
+        rbappend(tree, key, value);
 }
 
 /*
- * Removes a node from a red black tree that matches the
- * user-specified data.  Returns 1 if the value was removed
- * successfully, 0 if the removal failed for any reason.
-*/
+ * Removes the entry with the specified key.  Returns 1 if the entry was
+ * removed, 0 if there was no such entry.
+ */
 static int
-rberase(rbtree *tree, rbnode *node)
+rberase(rbtree *tree, Var key)
 {
-    int ret = 1;
+    rbnode *node = rbfind(tree, key, 0);
 
-    if (tree->root == nullptr) {
+    if (node == nullptr)
         return 0;
-    } else {
-        rbnode head = {};   /* False tree root */
-        rbnode *q, *p, *g;  /* Helpers */
-        rbnode *f = nullptr;    /* Found item */
-        int dir = 1;
-
-        /* Set up our helpers */
-        q = &head;
-        g = p = nullptr;
-        q->link[1] = tree->root;
-
-        /*
-           Search and push a red node down
-           to fix red violations as we go
-         */
-        while (q->link[dir] != nullptr) {
-            int last = dir;
-
-            /* Move the helpers down */
-            g = p, p = q;
-            q = q->link[dir];
-            dir = node_compare(q, node, 0) < 0;
-
-            /*
-               Save the node with matching data and keep
-               going; we'll do removal tasks at the end
-             */
-            if (node_compare(q, node, 0) == 0)
-                f = q;
-
-            /* Push the red node down with rotations and color flips */
-            if (!is_red(q) && !is_red(q->link[dir])) {
-                if (is_red(q->link[!dir]))
-                    p = p->link[last] = rbsingle(q, dir);
-                else if (!is_red(q->link[!dir])) {
-                    rbnode *s = p->link[!last];
-
-                    if (s != nullptr) {
-                        if (!is_red(s->link[!last])
-                                && !is_red(s->link[last])) {
-                            /* Color flip */
-                            p->red = 0;
-                            s->red = 1;
-                            q->red = 1;
-                        } else {
-                            int dir2 = g->link[1] == p;
-
-                            if (is_red(s->link[last]))
-                                g->link[dir2] = rbdouble(p, last);
-                            else if (is_red(s->link[!last]))
-                                g->link[dir2] = rbsingle(p, last);
-
-                            /* Ensure correct coloring */
-                            q->red = g->link[dir2]->red = 1;
-                            g->link[dir2]->link[0]->red = 0;
-                            g->link[dir2]->link[1]->red = 0;
-                        }
-                    }
-                }
-            }
-        }
-
-        /* Replace and remove the saved node */
-        if (f != nullptr) {
-            node_free_data(f);
-            f->key = q->key;
-            f->value = q->value;
-            p->link[p->link[1] == q] = q->link[q->link[0] == nullptr];
-            myfree(q, M_NODE);
-
-            --tree->size;
-        } else
-            ret = 0;
 
-        /* Update the root (it may be different) */
-        tree->root = head.link[1];
+    node_free_data(node);
+    node->key.type = TYPE_NONE;
+    node->value.type = TYPE_NONE;
 
-        /* Make the root black for simplified logic */
-        if (tree->root != nullptr)
-            tree->root->red = 0;
+    if (--tree->size == 0) {
+        tree->used = 0;
+        tree->sorted = true;
+        memset(tree->slots, 0, (tree->mask + 1) * sizeof(uint32_t));
     }
 
-    return ret;
+    return 1;
 }
 
 /*
  * Creates a new traversal object.  The traversal object is not
- * initialized until `rbtfirst' or `rbtlast' are called.  The
- * pointer must be released with `rbtdelete'.
+ * initialized until `rbtfirst' is called.  The pointer must be released
+ * with `rbtdelete'.
  */
 static rbtrav *
 rbtnew(void)
@@ -460,82 +460,18 @@ rbtdelete(rbtrav *trav)
     myfree(trav, M_TRAV);
 }
 
-/*
- * Initializes a traversal object. The user-specified direction
- * determines whether to begin traversal at the smallest or largest
- * valued node.  `dir' is the direction to traverse (0 = ascending, 1
- * = descending).
- */
-static rbnode *
-rbstart(rbtrav *trav, rbtree *tree, int dir)
-{
-    trav->tree = tree;
-    trav->it = tree->root;
-    trav->top = 0;
-
-    /* Save the path for later traversal */
-    if (trav->it != nullptr) {
-        while (trav->it->link[dir] != nullptr) {
-            trav->path[trav->top++] = trav->it;
-            trav->it = trav->it->link[dir];
-        }
-    }
-
-    return trav->it == nullptr ? nullptr : trav->it;
-}
-
-/*
- * Traverses a red black tree in the user-specified direction.  `dir'
- * is the direction to traverse (0 = ascending, 1 = descending).
- * Returns a pointer to the next data value in the specified
- * direction.
- */
-static rbnode *
-rbmove(rbtrav *trav, int dir)
-{
-    if (trav->it->link[dir] != nullptr) {
-        /* Continue down this branch */
-        trav->path[trav->top++] = trav->it;
-        trav->it = trav->it->link[dir];
-
-        while (trav->it->link[!dir] != nullptr) {
-            trav->path[trav->top++] = trav->it;
-            trav->it = trav->it->link[!dir];
-        }
-    } else {
-        /* Move to the next branch */
-        rbnode *last;
-
-        do {
-            if (trav->top == 0) {
-                trav->it = nullptr;
-                break;
-            }
-
-            last = trav->it;
-            trav->it = trav->path[--trav->top];
-        } while (last == trav->it->link[dir]);
-    }
-
-    return trav->it == nullptr ? nullptr : trav->it;
-}
-
 /*
  * Initializes a traversal object to the smallest valued node.
  */
 rbnode *
 rbtfirst(rbtrav *trav, rbtree *tree)
 {
-    return rbstart(trav, tree, 0);  /* Min value */
-}
+    ensure_sorted(tree);
 
-/*
- * Initializes a traversal object to the largest valued node.
- */
-rbnode *
-rbtlast(rbtrav *trav, rbtree *tree)
-{
-    return rbstart(trav, tree, 1);  /* Max value */
+    trav->tree = tree;
+    trav->it = tree->used ? skip_deleted(tree, tree->nodes) : nullptr;
+
+    return trav->it;
 }
 
 /*
@@ -544,16 +480,33 @@ rbtlast(rbtrav *trav, rbtree *tree)
 rbnode *
 rbtnext(rbtrav *trav)
 {
-    return rbmove(trav, 1); /* Toward larger items */
+    if (trav->it != nullptr)
+        trav->it = skip_deleted(trav->tree, trav->it + 1);
+
+    return trav->it;
 }
 
 /*
- * Traverses to the next value in descending order.
+ * Searches for the specified key.  Returns a new traversal object
+ * initialized to start at that entry, or a null pointer if there is no
+ * such entry.  The pointer must be released with `rbtdelete'.
  */
-rbnode *
-rbtprev(rbtrav *trav)
+static rbtrav *
+rbseek(rbtree *tree, Var key, int case_matters)
 {
-    return rbmove(trav, 0); /* Toward smaller items */
+    rbtrav *trav;
+    rbnode *node;
+
+    ensure_sorted(tree);
+
+    if ((node = rbfind(tree, key, case_matters)) == nullptr)
+        return nullptr;
+
+    trav = rbtnew();
+    trav->tree = tree;
+    trav->it = node;
+
+    return trav;
 }
 
 /********/
@@ -578,8 +531,10 @@ new_map(void)
 {
     static Var map;
 
-    if (map.v.tree == nullptr)
+    if (map.v.tree == nullptr) {
         map = empty_map();
+        pin(map.v.tree);
+    }
 
 #ifdef ENABLE_GC
     assert(gc_get_color(map.v.tree) == GC_GREEN);
@@ -597,21 +552,35 @@ destroy_map(Var map)
     rbdelete(map.v.tree);
 }
 
+uint64_t map_dup_count = 0;
+
 /* called from utils.c */
 Var
 map_dup(Var map)
 {
-    rbtrav trav;
-    rbnode node;
-    const rbnode *pnode;
+    rbtree *tree = map.v.tree;
     Var _new = empty_map();
-
-    for (pnode = rbtfirst(&trav, map.v.tree); pnode; pnode = rbtnext(&trav)) {
-        node.key = var_ref(pnode->key);
-        node.value = var_ref(pnode->value);
-        if (!rbinsert(_new.v.tree, &node))
-            panic_moo("MAP_DUP: rbinsert failed");
+    rbtree *copy = _new.v.tree;
+    uint32_t i;
+
+    if (tree->size > 0) {
+        reserve(copy, tree->size);
+        for (i = 0; i < tree->used; i++) {
+            const rbnode *pnode = &tree->nodes[i];
+
+            if (is_deleted(pnode))
+                continue;
+            copy->nodes[copy->used].key = var_ref(pnode->key);
+            copy->nodes[copy->used].value = var_ref(pnode->value);
+            place(copy, copy->used++);
+        }
+        copy->size = tree->size;
+        copy->sorted = tree->sorted;
+#ifdef MEMO_SIZE
+        memo_size(_new) = memo_size(map);
+#endif
     }
+    map_dup_count++;
 #ifdef ENABLE_GC
     gc_set_color(_new.v.tree, gc_get_color(map.v.tree));
 #endif
@@ -626,8 +595,7 @@ map_sizeof(rbtree *tree)
 #ifdef MEMO_SIZE
     var_metadata *metadata = ((var_metadata*)tree) - 1;
 #endif
-    rbtrav trav;
-    const rbnode *pnode;
+    uint32_t i;
     int size;
 
 #ifdef MEMO_SIZE
@@ -635,9 +603,14 @@ map_sizeof(rbtree *tree)
         return size;
 #endif
 
+    /* The order doesn't matter here, so don't sort the map. */
     size = sizeof(rbtree);
-    for (pnode = rbtfirst(&trav, tree); pnode; pnode = rbtnext(&trav)) {
-        size += sizeof(rbnode) - 2 * sizeof(Var);
+    for (i = 0; i < tree->used; i++) {
+        const rbnode *pnode = &tree->nodes[i];
+
+        if (is_deleted(pnode))
+            continue;
+        size += sizeof(uint32_t);   /* its slot */
         size += value_bytes(pnode->key);
         size += value_bytes(pnode->value);
     }
@@ -669,19 +642,20 @@ mapinsert(Var map, Var key, Var value)
     }
 
 #ifdef MEMO_SIZE
-    /* reset the memoized size */
-    var_metadata *metadata = ((var_metadata*)_new.v.tree) - 1;
-    metadata->size = 0;
+    /* keep the memoized size, if there is one, up to date */
+    if (memo_size(_new)) {
+        const rbnode *node = rbfind(_new.v.tree, key, 0);
+        int delta = value_bytes(key) + value_bytes(value);
+
+        if (node)
+            delta -= value_bytes(node->key) + value_bytes(node->value);
+        else
+            delta += sizeof(uint32_t);
+        memo_size(_new) += delta;
+    }
 #endif
 
-    rbnode node;
-    node.key = key;
-    node.value = value;
-
-    rberase(_new.v.tree, &node);
-
-    if (!rbinsert(_new.v.tree, &node))
-        panic_moo("MAPINSERT: rbinsert failed");
+    rbinsert(_new.v.tree, key, value);
 
 #ifdef ENABLE_GC
     gc_set_color(_new.v.tree, GC_YELLOW);
@@ -704,11 +678,9 @@ const rbnode *
 maplookup(Var map, Var key, Var *value, int case_matters)
 {   /* does NOT consume `map' or `'key',
        does NOT increment the ref count on `value' */
-    rbnode node;
     const rbnode *pnode;
 
-    node.key = key;
-    pnode = rbfind(map.v.tree, &node, case_matters);
+    pnode = rbfind(map.v.tree, key, case_matters);
     if (pnode && value)
         *value = pnode->value;
 
@@ -722,11 +694,9 @@ int
 mapseek(Var map, Var key, Var *iter, int case_matters)
 {   /* does NOT consume `map' or `'key',
        ALWAYS returns a newly allocated value in `iter' */
-    rbnode node;
     rbtrav *ptrav;
 
-    node.key = key;
-    ptrav = rbseek(map.v.tree, &node, case_matters);
+    ptrav = rbseek(map.v.tree, key, case_matters);
     if (ptrav && iter) {
         iter->type = TYPE_ITER;
         iter->v.trav = ptrav;
@@ -740,27 +710,28 @@ mapseek(Var map, Var key, Var *iter, int case_matters)
 int
 mapequal(Var lhs, Var rhs, int case_matters)
 {
-    rbtrav trav_lhs, trav_rhs;
-    const rbnode *pnode_lhs = nullptr, *pnode_rhs = nullptr;
+    rbtree *tree = lhs.v.tree;
+    uint32_t i;
 
     if (lhs.v.tree == rhs.v.tree)
         return 1;
+    if (lhs.v.tree->size != rhs.v.tree->size)
+        return 0;
 
-    while (1) {
-        pnode_lhs =
-            pnode_lhs == nullptr ? rbtfirst(&trav_lhs, lhs.v.tree)
-            : rbtnext(&trav_lhs);
-        pnode_rhs =
-            pnode_rhs == nullptr ? rbtfirst(&trav_rhs, rhs.v.tree)
-            : rbtnext(&trav_rhs);
-        if (pnode_lhs == nullptr || pnode_rhs == nullptr)
-            break;
+    /* No need for either map to be in order: look each key up instead. */
+    for (i = 0; i < tree->used; i++) {
+        const rbnode *pnode_lhs = &tree->nodes[i], *pnode_rhs;
+
+        if (is_deleted(pnode_lhs))
+            continue;
+        if ((pnode_rhs = rbfind(rhs.v.tree, pnode_lhs->key, 0)) == nullptr)
+            return 0;
         if (!equality(pnode_lhs->key, pnode_rhs->key, case_matters)
                 || !equality(pnode_lhs->value, pnode_rhs->value, case_matters))
-            break;
+            return 0;
     }
 
-    return pnode_lhs == nullptr && pnode_rhs == nullptr;
+    return 1;
 }
 
 int
@@ -800,13 +771,8 @@ mapforeach(Var map, mapfunc func, void *data)
 int
 mapfirst(Var map, var_pair *pair)
 {
-    rbnode *node = map.v.tree->root;
-
-    if (node != nullptr) {
-        while (node->link[0] != nullptr) {
-            node = node->link[0];
-        }
-    }
+    rbtrav trav;
+    const rbnode *node = rbtfirst(&trav, map.v.tree);
 
     if (node != nullptr && pair != nullptr) {
         pair->a = node->key;
@@ -819,13 +785,16 @@ mapfirst(Var map, var_pair *pair)
 int
 maplast(Var map, var_pair *pair)
 {
-    rbnode *node = map.v.tree->root;
-
-    if (node != nullptr) {
-        while (node->link[1] != nullptr) {
-            node = node->link[1];
+    rbtree *tree = map.v.tree;
+    const rbnode *node = nullptr;
+    uint32_t i;
+
+    ensure_sorted(tree);
+    for (i = tree->used; i > 0; i--)
+        if (!is_deleted(&tree->nodes[i - 1])) {
+            node = &tree->nodes[i - 1];
+            break;
         }
-    }
 
     if (node != nullptr && pair != nullptr) {
         pair->a = node->key;
@@ -841,17 +810,20 @@ maplast(Var map, var_pair *pair)
 Var
 maprange(Var map, rbtrav *from, rbtrav *to)
 {   /* consumes `map' */
-    rbnode node;
     const rbnode *pnode = nullptr;
     Var _new = empty_map();
 
+    if (from->it > to->it) {
+        free_var(map);
+        return _new;
+    }
+
+    /* The entries come out in order, so the new map is in order too. */
+    reserve(_new.v.tree, to->it - from->it + 1);
     do {
         pnode = pnode == nullptr ? from->it : rbtnext(from);
 
-        node.key = var_ref(pnode->key);
-        node.value = var_ref(pnode->value);
-        if (!rbinsert(_new.v.tree, &node))
-            panic_moo("MAP_DUP: rbinsert failed");
+        rbappend(_new.v.tree, var_ref(pnode->key), var_ref(pnode->value));
     } while (pnode != to->it);
 
     free_var(map);
@@ -872,7 +844,6 @@ enum error
 maprangeset(Var map, rbtrav *from, rbtrav *to, Var value, Var *_new)
 {   /* consumes `map', `value' */
     rbtrav trav;
-    rbnode node;
     const rbnode *pnode = nullptr;
     enum error e = E_NONE;
 
@@ -885,27 +856,14 @@ maprangeset(Var map, rbtrav *from, rbtrav *to, Var value, Var *_new)
     for (pnode = rbtfirst(&trav, map.v.tree); pnode; pnode = rbtnext(&trav)) {
         if (pnode == from->it)
             break;
-        node.key = var_ref(pnode->key);
-        node.value = var_ref(pnode->value);
-        if (!rbinsert(_new->v.tree, &node))
-            panic_moo("MAP_DUP: rbinsert failed");
+        rbappend(_new->v.tree, var_ref(pnode->key), var_ref(pnode->value));
     }
 
-    for (pnode = rbtfirst(&trav, value.v.tree); pnode; pnode = rbtnext(&trav)) {
-        node.key = var_ref(pnode->key);
-        node.value = var_ref(pnode->value);
-        rberase(_new->v.tree, &node);
-        if (!rbinsert(_new->v.tree, &node))
-            panic_moo("MAP_DUP: rbinsert failed");
-    }
+    for (pnode = rbtfirst(&trav, value.v.tree); pnode; pnode = rbtnext(&trav))
+        rbinsert(_new->v.tree, var_ref(pnode->key), var_ref(pnode->value));
 
-    while ((pnode = rbtnext(to))) {
-        node.key = var_ref(pnode->key);
-        node.value = var_ref(pnode->value);
-        rberase(_new->v.tree, &node);
-        if (!rbinsert(_new->v.tree, &node))
-            panic_moo("MAP_DUP: rbinsert failed");
-    }
+    while ((pnode = rbtnext(to)))
+        rbinsert(_new->v.tree, var_ref(pnode->key), var_ref(pnode->value));
 
     free_var(map);
     free_var(value);
@@ -966,11 +924,34 @@ iternext(Var iter)
     rbtnext(iter.v.trav);
 }
 
+/* called from background.cc */
+void
+map_sort_deep(Var v)
+{
+    rbtree *tree;
+    uint32_t i;
+
+    if (v.type == TYPE_LIST) {
+        for (i = 1; i <= v.v.list[0].v.num; i++)
+            map_sort_deep(v.v.list[i]);
+    } else if (v.type == TYPE_MAP) {
+        tree = v.v.tree;
+        ensure_sorted(tree);
+        for (i = 0; i < tree->used; i++)
+            if (!is_deleted(&tree->nodes[i]))
+                map_sort_deep(tree->nodes[i].value);
+    }
+}
+
 /* called from execute.c */
 
 void
-clear_node_value(const rbnode *node)
+clear_node_value(Var map, const rbnode *node)
 {
+#ifdef MEMO_SIZE
+    if (memo_size(map))
+        memo_size(map) -= value_bytes(node->value) - sizeof(Var);
+#endif
     ((rbnode *)node)->value.type = TYPE_NONE;
 }
 
@@ -991,14 +972,14 @@ bf_mapdelete(Var arglist, Byte next, void *vdata, Objid progr)
     r = var_refcount(map) == 1 ? var_ref(map) : map_dup(map);
 
 #ifdef MEMO_SIZE
-    /* reset the memoized size */
-    var_metadata *metadata = ((var_metadata*)r.v.tree) - 1;
-    metadata->size = 0;
+    /* keep the memoized size, if there is one, up to date */
+    const rbnode *node;
+
+    if (memo_size(r) && (node = rbfind(r.v.tree, key, 0)))
+        memo_size(r) -= sizeof(uint32_t) + value_bytes(node->key) + value_bytes(node->value);
 #endif
 
-    rbnode node;
-    node.key = key;
-    if (!rberase(r.v.tree, &node)) {
+    if (!rberase(r.v.tree, key)) {
         free_var(r);
         free_var(arglist);
         return make_error_pack(E_RANGE);
@@ -0,0 +1,266 @@
+/* Multiplexing wait implementation using the Linux epoll facility.
+ *
+ * Unlike select() and poll(), the kernel keeps an epoll wait set from one
+ * wait to the next.  mplex_watch() only records what is wanted of a
+ * descriptor; the next wait passes the kernel whatever changed since the
+ * last one, and the descriptors it reports are the only ones looked at
+ * afterwards.  Neither the kernel nor the server does work per wait for
+ * descriptors that are idle.
+ *
+ * Registrations are level-triggered: the server expects a descriptor it
+ * didn't fully drain (or whose input was suspended and later resumed) to
+ * be reported again by the next wait.
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "net_mplex.h"
+#include "storage.h"
+
+typedef struct {
+    unsigned wanted;            /* events asked for by mplex_watch() */
+    unsigned registered;        /* events registered with the kernel */
+    unsigned ready;             /* events reported by a wait */
+    unsigned ready_round;       /* the wait that reported them */
+    bool changed;               /* is the fd in `changed'? */
+    bool unpollable;            /* is the fd in `unpollable'? */
+} Port;
+
+static Port *ports = nullptr;
+static int num_ports = 0;
+static int epfd = -1;
+static unsigned wait_round = 1;
+static int num_registered = 0;
+
+/* Descriptors whose wanted events differ from their registration. */
+static int *changed = nullptr;
+static int num_changed = 0, max_changed = 0;
+
+/* Descriptors epoll refuses (e.g. regular files).  They are always ready,
+ * just as poll() would report them.
+ */
+static int *unpollable = nullptr;
+static int num_unpollable = 0, max_unpollable = 0;
+
+/* Descriptors the last wait found ready. */
+static int *ready = nullptr;
+static int num_ready = 0, max_ready = 0;
+
+static struct epoll_event *events = nullptr;
+static int max_events = 0;
+
+static void
+grow_fd_list(int **list, int *max, int min)
+{
+    int new_max = *max ? *max * 2 : 64;
+    int *new_list;
+    int i;
+
+    while (new_max < min)
+        new_max *= 2;
+    new_list = (int *)mymalloc(new_max * sizeof(int), M_NETWORK);
+
+    for (i = 0; i < *max; i++)
+        new_list[i] = (*list)[i];
+
+    if (*list)
+        myfree(*list, M_NETWORK);
+
+    *list = new_list;
+    *max = new_max;
+}
+
+static void
+remove_unpollable(int fd)
+{
+    int i;
+
+    for (i = 0; i < num_unpollable; i++)
+        if (unpollable[i] == fd) {
+            unpollable[i] = unpollable[--num_unpollable];
+            break;
+        }
+    ports[fd].unpollable = false;
+}
+
+void
+mplex_watch(int fd, int kinds)
+{
+    unsigned wanted = ((kinds & MPLEX_READ) ? (unsigned) EPOLLIN : 0)
+                      | ((kinds & MPLEX_WRITE) ? (unsigned) EPOLLOUT : 0);
+    Port *p;
+
+    if (fd < 0 || (fd >= num_ports && !wanted))
+        return;
+
+    if (fd >= num_ports) {  /* Grow ports array */
+        int new_num = (fd + 9) / 10 * 10 + 1;
+        Port *new_ports = (Port *)mymalloc(new_num * sizeof(Port), M_NETWORK);
+        int i;
+
+        for (i = 0; i < num_ports; i++)
+            new_ports[i] = ports[i];
+        for (; i < new_num; i++) {
+            new_ports[i].wanted = new_ports[i].registered = 0;
+            new_ports[i].ready = new_ports[i].ready_round = 0;
+            new_ports[i].changed = new_ports[i].unpollable = false;
+        }
+
+        if (ports != nullptr)
+            myfree(ports, M_NETWORK);
+
+        ports = new_ports;
+        num_ports = new_num;
+    }
+
+    p = ports + fd;
+    p->wanted = wanted;
+
+    if (!wanted) {
+        /* The descriptor may be about to be closed, so this can't wait.
+         * A copy inherited by a child process would otherwise keep it in
+         * the kernel's wait set.
+         */
+        if (p->registered) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            p->registered = 0;
+            num_registered--;
+        }
+        if (p->unpollable)
+            remove_unpollable(fd);
+        p->ready_round = 0;
+    } else if (p->wanted != p->registered && !p->changed && !p->unpollable) {
+        if (num_changed == max_changed)
+            grow_fd_list(&changed, &max_changed, 0);
+        changed[num_changed++] = fd;
+        p->changed = true;
+    }
+}
+
+static void
+update_registration(int fd)
+{
+    Port *p = ports + fd;
+    struct epoll_event ev;
+    int op = p->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if (!p->wanted || p->wanted == p->registered || p->unpollable)
+        return;
+
+    ev.events = p->wanted;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+        /* The descriptor may have been closed and reused without being
+         * removed first, leaving our idea of the kernel's wait set out
+         * of date.
+         */
+        if (errno == ENOENT)
+            op = EPOLL_CTL_ADD;
+        else if (errno == EEXIST)
+            op = EPOLL_CTL_MOD;
+        else if (errno == EPERM) {
+            if (num_unpollable == max_unpollable)
+                grow_fd_list(&unpollable, &max_unpollable, 0);
+            unpollable[num_unpollable++] = fd;
+            p->unpollable = true;
+            return;
+        } else {
+            log_perror("Registering descriptor for network I/O");
+            return;
+        }
+        if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+            log_perror("Registering descriptor for network I/O");
+            return;
+        }
+    }
+
+    if (!p->registered)
+        num_registered++;
+    p->registered = p->wanted;
+}
+
+int
+mplex_wait(unsigned timeout)
+{
+    int i, result;
+
+    if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log_perror("Creating epoll instance");
+        return 1;
+    }
+
+    for (i = 0; i < num_changed; i++) {
+        ports[changed[i]].changed = false;
+        update_registration(changed[i]);
+    }
+    num_changed = 0;
+
+    if (!events || max_events < num_registered) {
+        if (events)
+            myfree(events, M_NETWORK);
+        max_events = num_registered < 32 ? 64 : num_registered * 2;
+        events = (struct epoll_event *)mymalloc(max_events * sizeof(struct epoll_event), M_NETWORK);
+    }
+
+    wait_round++;
+    num_ready = 0;
+
+    result = epoll_wait(epfd, events, max_events,
+                        num_unpollable ? 0 : timeout / 1000);
+
+    if (result < 0) {
+        if (errno != EINTR)
+            log_perror("Waiting for network I/O");
+        return 1;
+    }
+
+    if (max_ready < result + num_unpollable)
+        grow_fd_list(&ready, &max_ready, result + num_unpollable);
+
+    for (i = 0; i < result; i++) {
+        int fd = events[i].data.fd;
+        Port *p = ports + fd;
+
+        p->ready = events[i].events;
+        /* Let whichever side is waiting find out about the error. */
+        if (p->ready & (EPOLLERR | EPOLLHUP))
+            p->ready |= p->registered;
+        p->ready_round = wait_round;
+        ready[num_ready++] = fd;
+    }
+
+    for (i = 0; i < num_unpollable; i++) {
+        int fd = unpollable[i];
+
+        ports[fd].ready = ports[fd].wanted;
+        ports[fd].ready_round = wait_round;
+        ready[num_ready++] = fd;
+    }
+
+    return num_ready == 0;
+}
+
+int
+mplex_ready(const int **fds)
+{
+    *fds = ready;
+    return num_ready;
+}
+
+int
+mplex_is_readable(int fd)
+{
+    return fd < num_ports && ports[fd].ready_round == wait_round
+           && (ports[fd].ready & EPOLLIN) != 0;
+}
+
+int
+mplex_is_writable(int fd)
+{
+    return fd < num_ports && ports[fd].ready_round == wait_round
+           && (ports[fd].ready & EPOLLOUT) != 0;
+}
@@ -26,25 +26,25 @@
 
 typedef struct pollfd Port;
 
+/* Indexed by descriptor; unwatched entries have an fd of -1, which poll()
+ * ignores.
+ */
 static Port *ports = 0;
-static unsigned num_ports = 0;
-static unsigned max_fd;
+static int num_ports = 0;
+static int max_fd = -1;
+
+static int *ready = 0;
+static int num_ready = 0, max_ready = 0;
 
 void
-mplex_clear(void)
+mplex_watch(int fd, int kinds)
 {
-    int i;
+    unsigned events = ((kinds & MPLEX_READ) ? POLLIN : 0)
+                      | ((kinds & MPLEX_WRITE) ? POLLOUT : 0);
 
-    max_fd = 0;
-    for (i = 0; i < num_ports; i++) {
-        ports[i].fd = -1;
-        ports[i].events = 0;
-    }
-}
+    if (fd < 0 || (fd >= num_ports && !events))
+        return;
 
-static void
-add_common(int fd, unsigned dir)
-{
     if (fd >= num_ports) {  /* Grow ports array */
         int new_num = (fd + 9) / 10 * 10 + 1;
         Port *new_ports = (Port *)mymalloc(new_num * sizeof(Port), M_NETWORK);
@@ -52,6 +52,10 @@ add_common(int fd, unsigned dir)
 
         for (i = 0; i < num_ports; i++)
             new_ports[i] = ports[i];
+        for (; i < new_num; i++) {
+            new_ports[i].fd = -1;
+            new_ports[i].events = new_ports[i].revents = 0;
+        }
 
         if (ports != 0)
             myfree(ports, M_NETWORK);
@@ -59,45 +63,64 @@ add_common(int fd, unsigned dir)
         ports = new_ports;
         num_ports = new_num;
     }
-    ports[fd].fd = fd;
-    ports[fd].events |= dir;
-    if (fd > max_fd)
-        max_fd = fd;
-}
 
-void
-mplex_add_reader(int fd)
-{
-    add_common(fd, POLLIN);
-}
-
-void
-mplex_add_writer(int fd)
-{
-    add_common(fd, POLLOUT);
+    if (events) {
+        if (ports[fd].fd < 0)
+            ports[fd].revents = 0;
+        ports[fd].fd = fd;
+        ports[fd].events = events;
+        if (fd > max_fd)
+            max_fd = fd;
+    } else {
+        ports[fd].fd = -1;
+        ports[fd].events = ports[fd].revents = 0;
+        while (max_fd >= 0 && ports[max_fd].fd < 0)
+            max_fd--;
+    }
 }
 
 int
 mplex_wait(unsigned timeout)
 {
-    int result = poll(ports, max_fd + 1, timeout / 1000);
+    int result, fd;
+
+    if (max_ready < num_ports) {
+        if (ready != 0)
+            myfree(ready, M_NETWORK);
+        max_ready = num_ports;
+        ready = (int *)mymalloc(max_ready * sizeof(int), M_NETWORK);
+    }
+    num_ready = 0;
 
+    result = poll(ports, max_fd + 1, timeout / 1000);
     if (result < 0) {
         if (errno != EINTR)
             log_perror("Waiting for network I/O");
         return 1;
-    } else
-        return (result == 0);
+    }
+
+    for (fd = 0; fd <= max_fd && num_ready < result; fd++)
+        if (ports[fd].revents != 0)
+            ready[num_ready++] = fd;
+
+    return (result == 0);
+}
+
+int
+mplex_ready(const int **fds)
+{
+    *fds = ready;
+    return num_ready;
 }
 
 int
 mplex_is_readable(int fd)
 {
-    return fd <= max_fd && (ports[fd].revents & (POLLIN | POLLHUP)) != 0;
+    return fd < num_ports && (ports[fd].revents & (POLLIN | POLLHUP)) != 0;
 }
 
 int
 mplex_is_writable(int fd)
 {
-    return fd <= max_fd && (ports[fd].revents & POLLOUT) != 0;
+    return fd < num_ports && (ports[fd].revents & POLLOUT) != 0;
 }
@@ -25,50 +25,76 @@
 #include "log.h"
 #include "net_mplex.h"
 
+/* The wait set is kept in `want_input' and `want_output'; select()
+ * overwrites its own copies of them.  Being static, all four start out
+ * empty.
+ */
+static fd_set want_input, want_output;
 static fd_set input, output;
-static int max_descriptor;
+static int max_descriptor = -1;
 
-void
-mplex_clear(void)
-{
-    FD_ZERO(&input);
-    FD_ZERO(&output);
-    max_descriptor = -1;
-}
+static int ready[FD_SETSIZE];
+static int num_ready = 0;
 
 void
-mplex_add_reader(int fd)
+mplex_watch(int fd, int kinds)
 {
-    FD_SET(fd, &input);
-    if (fd > max_descriptor)
-	max_descriptor = fd;
-}
+    if (kinds & MPLEX_READ)
+	FD_SET(fd, &want_input);
+    else
+	FD_CLR(fd, &want_input);
+    if (kinds & MPLEX_WRITE)
+	FD_SET(fd, &want_output);
+    else
+	FD_CLR(fd, &want_output);
 
-void
-mplex_add_writer(int fd)
-{
-    FD_SET(fd, &output);
-    if (fd > max_descriptor)
+    if (kinds && fd > max_descriptor)
 	max_descriptor = fd;
+    else if (!kinds) {
+	FD_CLR(fd, &input);
+	FD_CLR(fd, &output);
+	while (max_descriptor >= 0
+	       && !FD_ISSET(max_descriptor, &want_input)
+	       && !FD_ISSET(max_descriptor, &want_output))
+	    max_descriptor--;
+    }
 }
 
 int
 mplex_wait(unsigned timeout)
 {
     struct timeval tv;
-    int n;
+    int n, fd;
 
     tv.tv_sec = timeout / 1000000;
     tv.tv_usec = timeout % 1000000;
 
+    input = want_input;
+    output = want_output;
+    num_ready = 0;
+
     n = select(max_descriptor + 1, &input, &output, nullptr, &tv);
 
     if (n < 0) {
 	if (errno != EINTR)
 	    log_perror("Waiting for network I/O");
+	FD_ZERO(&input);
+	FD_ZERO(&output);
 	return 1;
-    } else
-	return (n == 0);
+    }
+
+    for (fd = 0; fd <= max_descriptor && num_ready < n; fd++)
+	if (FD_ISSET(fd, &input) || FD_ISSET(fd, &output))
+	    ready[num_ready++] = fd;
+
+    return (n == 0);
+}
+
+int
+mplex_ready(const int **fds)
+{
+    *fds = ready;
+    return num_ready;
 }
 
 int
@@ -24,3 +24,7 @@
 #  if MPLEX_STYLE == MP_POLL
 #    include "net_mp_poll.cc"
 #  endif
+
+#  if MPLEX_STYLE == MP_EPOLL
+#    include "net_mp_epoll.cc"
+#  endif
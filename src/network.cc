@@ -33,7 +33,9 @@
 #include <stdlib.h>         /* strtoul() */
 #include <string.h>         /* memcpy() */
 #include <unistd.h>         /* close() */
+#include <sys/uio.h>        /* writev() */
 #include <netinet/tcp.h>
+#include <algorithm>
 #include <atomic>
 #include <vector>
 
@@ -71,11 +73,30 @@ static int *pocket_descriptors = nullptr;   /* fds we keep around in case we nee
 SSL_CTX *tls_ctx;
 #endif
 
+/* Queued output is kept in blocks of at least OUTPUT_BLOCK_SIZE bytes,
+ * each allocated together with its header.  Lines are appended to the
+ * last block while they fit, so a burst of short lines to a connection
+ * needs only a few allocations and a few write()s.
+ *
+ * Text grows up from the start of a block's buffer, and the offset at
+ * which each line ends grows down from its end, so that a full queue can
+ * still be trimmed a line at a time.
+ */
+#define OUTPUT_BLOCK_SIZE 4096
+
+/* Offset from b->buffer of the end of the i'th line in block `b' */
+#define LINE_END(b, i)  (((int *)((b)->buffer + (b)->capacity))[-1 - (i)])
+
+/* Most blocks written by a single writev() */
+#define OUTPUT_IOV_MAX 64
+
 typedef struct text_block {
     struct text_block *next;
     char *buffer;
     char *start;
     int length;
+    int capacity;
+    int lines;
 } text_block;
 
 typedef struct nhandle {
@@ -93,6 +114,9 @@ typedef struct nhandle {
     int rfd, wfd;
     int output_length;
     int output_lines_flushed;
+    uint64_t output_bytes_written;
+    uint64_t output_syscalls;
+    uint64_t output_flushes;
     uint16_t source_port;                   // port on server
     uint16_t destination_port;              // local port on connectee
     uint16_t keep_alive_idle;
@@ -108,6 +132,7 @@ typedef struct nhandle {
     SSL *tls;                               // TLS context; not TLS if null
     bool connected;
     bool want_write;
+    bool tls_pending;                       // on `tls_pending'?
 #endif
 } nhandle;
 
@@ -131,15 +156,30 @@ typedef struct nlistener {
 
 static nlistener *all_nlisteners = nullptr;
 
+/* What each descriptor in the wait set belongs to, so that the results
+ * of a wait can be dispatched without looking at every connection.
+ */
+typedef enum {
+    FD_UNUSED, FD_LISTENER, FD_CONNECTION, FD_REGISTERED
+} fd_kind;
+
 typedef struct {
-    void *data;
+    fd_kind kind;
+    void *ptr;                  /* nlistener, nhandle, or callback data */
     network_fd_callback readable;
     network_fd_callback writable;
-    int fd;
-} fd_reg;
+} fd_owner;
 
-static fd_reg *reg_fds = nullptr;
-static int max_reg_fds = 0;
+static fd_owner *fd_owners = nullptr;
+static int max_fd_owners = 0;
+
+#ifdef USE_TLS
+/* Connections whose last read left decrypted input buffered in OpenSSL.
+ * Their sockets needn't become readable again, so they're read from after
+ * every wait until the buffer is empty.
+ */
+static std::vector<nhandle *> tls_pending;
+#endif
 
 struct addrinfo tcp_hint;
 
@@ -148,85 +188,104 @@ static const char *get_nameinfo(const struct sockaddr *sa);
 static unsigned short int get_in_port(const struct sockaddr_storage *sa);
 static char *get_port_str(int port);
 
-void
-network_register_fd(int fd, network_fd_callback readable, network_fd_callback writable, void *data)
+static void
+set_fd_owner(int fd, fd_kind kind, void *ptr,
+             network_fd_callback readable, network_fd_callback writable)
 {
-    int i;
-
-    if (!reg_fds) {
-        max_reg_fds = 5;
-        reg_fds = (fd_reg *) mymalloc(max_reg_fds * sizeof(fd_reg), M_NETWORK);
-        for (i = 0; i < max_reg_fds; i++)
-            reg_fds[i].fd = -1;
-    }
-    /* Find an empty slot */
-    for (i = 0; i < max_reg_fds; i++)
-        if (reg_fds[i].fd == -1)
-            break;
-    if (i >= max_reg_fds) { /* No free slots */
-        int new_max = 2 * max_reg_fds;
-        fd_reg *_new = (fd_reg *) mymalloc(new_max * sizeof(fd_reg), M_NETWORK);
+    if (fd >= max_fd_owners) {
+        int new_max = max_fd_owners ? max_fd_owners * 2 : 64;
+        fd_owner *_new;
+        int i;
 
+        while (new_max <= fd)
+            new_max *= 2;
+        _new = (fd_owner *) mymalloc(new_max * sizeof(fd_owner), M_NETWORK);
         for (i = 0; i < new_max; i++)
-            if (i < max_reg_fds)
-                _new[i] = reg_fds[i];
+            if (i < max_fd_owners)
+                _new[i] = fd_owners[i];
             else
-                _new[i].fd = -1;
+                _new[i].kind = FD_UNUSED;
 
-        myfree(reg_fds, M_NETWORK);
-        i = max_reg_fds;    /* first free slot */
-        max_reg_fds = new_max;
-        reg_fds = _new;
+        if (fd_owners)
+            myfree(fd_owners, M_NETWORK);
+        max_fd_owners = new_max;
+        fd_owners = _new;
     }
-    reg_fds[i].fd = fd;
-    reg_fds[i].readable = readable;
-    reg_fds[i].writable = writable;
-    reg_fds[i].data = data;
+    fd_owners[fd].kind = kind;
+    fd_owners[fd].ptr = ptr;
+    fd_owners[fd].readable = readable;
+    fd_owners[fd].writable = writable;
+}
+
+/* Take `fd' out of the wait set.  Must be done before closing it. */
+static void
+forget_fd(int fd)
+{
+    mplex_watch(fd, 0);
+    if (fd >= 0 && fd < max_fd_owners)
+        fd_owners[fd].kind = FD_UNUSED;
 }
 
 void
-network_unregister_fd(int fd)
+network_register_fd(int fd, network_fd_callback readable, network_fd_callback writable, void *data)
 {
-    int i;
+    set_fd_owner(fd, FD_REGISTERED, data, readable, writable);
+    mplex_watch(fd, (readable ? MPLEX_READ : 0) | (writable ? MPLEX_WRITE : 0));
+}
 
-    for (i = 0; i < max_reg_fds; i++)
-        if (reg_fds[i].fd == fd)
-            reg_fds[i].fd = -1;
+void
+network_unregister_fd(int fd)
+{
+    forget_fd(fd);
 }
 
+/* Tell mplex what a connection is waiting for.  This has to be called
+ * whenever its input is suspended or resumed, or its output queue becomes
+ * empty or non-empty.  Both directions use the same descriptor.
+ */
 static void
-add_registered_fds(void)
+watch_nhandle(nhandle * h)
 {
-    fd_reg *reg;
-
-    for (reg = reg_fds; reg < reg_fds + max_reg_fds; reg++)
-        if (reg->fd != -1) {
-            if (reg->readable)
-                mplex_add_reader(reg->fd);
-            if (reg->writable)
-                mplex_add_writer(reg->fd);
-        }
+    mplex_watch(h->rfd, (h->input_suspended ? 0 : MPLEX_READ)
+                | (h->output_head ? MPLEX_WRITE : 0));
 }
 
-static void
-check_registered_fds(void)
+static text_block *
+new_text_block(int length)
 {
-    fd_reg *reg;
+    /* Room for the text and where it ends, keeping the ends aligned */
+    int capacity = (length + 2 * (int)sizeof(int) - 1) / (int)sizeof(int) * (int)sizeof(int);
+    text_block *b;
 
-    for (reg = reg_fds; reg < reg_fds + max_reg_fds; reg++)
-        if (reg->fd != -1) {
-            if (reg->readable && mplex_is_readable(reg->fd))
-                (*reg->readable) (reg->fd, reg->data);
-            if (reg->writable && mplex_is_writable(reg->fd))
-                (*reg->writable) (reg->fd, reg->data);
-        }
+    if (capacity < OUTPUT_BLOCK_SIZE)
+        capacity = OUTPUT_BLOCK_SIZE;
+    b = (text_block *) mymalloc(sizeof(text_block) + capacity, M_NETWORK);
+
+    b->next = nullptr;
+    b->buffer = b->start = (char *)(b + 1);
+    b->length = 0;
+    b->capacity = capacity;
+    b->lines = 0;
+
+    return b;
 }
 
+/* Index of the first line in `b' that hasn't been completely written. */
+static int
+first_unwritten_line(const text_block * b)
+{
+    int written = b->start - b->buffer;
+    int i = 0;
+
+    while (i < b->lines && LINE_END(b, i) <= written)
+        i++;
+
+    return i;
+}
 
 static void
 free_text_block(text_block * b)
 {
-    myfree(b->buffer, M_NETWORK);
     myfree(b, M_NETWORK);
 }
 
@@ -300,6 +359,28 @@ push_network_buffer_overflow(nhandle *h)
     return count >= 0 || errno == eagain || errno == ewouldblock;
 }
 
+/* Remove `count' written bytes from the front of the output queue. */
+static void
+consume_output(nhandle * h, int count)
+{
+    text_block *b;
+
+    h->output_length -= count;
+    h->output_bytes_written += count;
+
+    while (count > 0 && (b = h->output_head) != nullptr) {
+        if (count >= b->length) {
+            count -= b->length;
+            h->output_head = b->next;
+            free_text_block(b);
+        } else {
+            b->start += count;
+            b->length -= count;
+            count = 0;
+        }
+    }
+}
+
 static int
 push_output(nhandle * h)
 {
@@ -321,16 +402,19 @@ push_output(nhandle * h)
             if (!push_network_buffer_overflow(h))
                 return 0;
 
-    while ((b = h->output_head) != nullptr) {
+    if (h->output_head)
+        h->output_flushes++;
+
 #ifdef USE_TLS
-        if (h->tls)
+    /* Each SSL_write() becomes at least one TLS record; since lines are
+     * coalesced into blocks, that's one record per block rather than one
+     * per line.
+     */
+    if (h->tls) {
+        while ((b = h->output_head) != nullptr) {
             count = SSL_write(h->tls, b->start, b->length);
-        else
-#endif
-            count = write(h->wfd, b->start, b->length);
-#ifdef USE_TLS
-        if (count <= 0) {
-            if (h->tls) {
+            h->output_syscalls++;
+            if (count <= 0) {
                 int error = SSL_get_error(h->tls, count);
                 if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ || errno == eagain || errno == ewouldblock)
                     h->want_write = true;
@@ -342,28 +426,40 @@ push_output(nhandle * h)
                 ERR_clear_error();
                 return (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE || errno == eagain || errno == ewouldblock);
             }
-#else
-        if (count < 0) {
-#endif
-            return (errno == eagain || errno == ewouldblock);
-        } // end of count checks
-        h->output_length -= count;
-        if (count == b->length) {
-            h->output_head = b->next;
-            free_text_block(b);
-        } else {
-            b->start += count;
-            b->length -= count;
-        }
+            consume_output(h, count);
 
-#ifdef USE_TLS
-        if (h->want_write) {
-            h->want_write = false;
-            if (h->output_lines_flushed > 0 && !push_network_buffer_overflow(h))
-                break;
+            if (h->want_write) {
+                h->want_write = false;
+                if (h->output_lines_flushed > 0 && !push_network_buffer_overflow(h))
+                    break;
+            }
         }
+
+        if (h->output_head == nullptr)
+            h->output_tail = &(h->output_head);
+        return 1;
+    }
 #endif
-    } // endwhile
+
+    while (h->output_head != nullptr) {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        int n = 0, total = 0;
+
+        for (b = h->output_head; b && n < OUTPUT_IOV_MAX; b = b->next, n++) {
+            iov[n].iov_base = b->start;
+            iov[n].iov_len = b->length;
+            total += b->length;
+        }
+
+        count = writev(h->wfd, iov, n);
+        h->output_syscalls++;
+        if (count < 0)
+            return (errno == eagain || errno == ewouldblock);
+
+        consume_output(h, count);
+        if (count < total)      /* the socket buffer is full */
+            break;
+    }
 
     if (h->output_head == nullptr)
         h->output_tail = &(h->output_head);
@@ -543,6 +639,9 @@ new_nhandle(const int rfd, const int wfd, const bool outbound, uint16_t listen_p
     h->output_tail = &(h->output_head);
     h->output_length = 0;
     h->output_lines_flushed = 0;
+    h->output_bytes_written = 0;
+    h->output_syscalls = 0;
+    h->output_flushes = 0;
     h->outbound = outbound;
     h->binary = false;
     h->name = local_hostname;   // already malloced by a get_network* function
@@ -564,8 +663,12 @@ new_nhandle(const int rfd, const int wfd, const bool outbound, uint16_t listen_p
     h->tls = tls;
     h->connected = false;
     h->want_write = false;
+    h->tls_pending = false;
 #endif
 
+    set_fd_owner(rfd, FD_CONNECTION, h, nullptr, nullptr);
+    watch_nhandle(h);
+
     if (h->keep_alive) {
         network_handle nh;
         nh.ptr = h;
@@ -591,6 +694,10 @@ close_nhandle(nhandle * h)
         b = bb;
     }
     free_stream(h->input);
+#ifdef USE_TLS
+    if (h->tls_pending)
+        tls_pending.erase(std::find(tls_pending.begin(), tls_pending.end(), h));
+#endif
     network_close_connection(h->rfd, h->wfd);
     free_str(h->name);
     free_str(h->source_address);
@@ -629,12 +736,14 @@ void
 network_close_connection(int read_fd, int write_fd)
 {
     /* read_fd and write_fd are the same, so we only need to deal with one. */
+    forget_fd(read_fd);
     close(read_fd);
 }
 
 void
 close_listener(int fd)
 {
+    forget_fd(fd);
     close(fd);
 }
 
@@ -1243,6 +1352,8 @@ network_make_listener(server_listener sl, Var desc, network_listener * nl,
         listener->next = all_nlisteners;
         listener->prev = &all_nlisteners;
         all_nlisteners = listener;
+        set_fd_owner(fd, FD_LISTENER, listener, nullptr, nullptr);
+        mplex_watch(fd, MPLEX_READ);
     }
     return e;
 }
@@ -1294,9 +1405,26 @@ enqueue_output(network_handle nh, const char *line, int line_length, int add_eol
         }
 #endif
         while (to_flush > 0 && (b = next)) {
+            int i = first_unwritten_line(b);
+
+            if (b->length > to_flush) {
+                /* Only part of this block has to go, a line at a time. */
+                while (to_flush > 0) {
+                    int n = LINE_END(b, i) - (b->start - b->buffer);
+
+                    b->start += n;
+                    b->length -= n;
+                    h->output_length -= n;
+                    to_flush -= n;
+                    h->output_lines_flushed++;
+                    i++;
+                }
+                break;
+            }
+
             h->output_length -= b->length;
             to_flush -= b->length;
-            h->output_lines_flushed++;
+            h->output_lines_flushed += b->lines - i;
             next = b->next;
             if (move_output_head)
                 h->output_head = next;
@@ -1310,17 +1438,33 @@ enqueue_output(network_handle nh, const char *line, int line_length, int add_eol
             h->output_tail = &(h->output_head->next);
     }
 
-    buffer = (char *)mymalloc(length * sizeof(char), M_NETWORK);
-    block = (text_block *) mymalloc(sizeof(text_block), M_NETWORK);
+    /* Append to the last block if the line and its end fit.  The
+     * output_tail points into the last block, which is where we find it.
+     * A TLS connection waiting to retry its first block must hand
+     * SSL_write() exactly the same data again, so that block is left
+     * alone.
+     */
+    block = h->output_head ? (text_block *)((char *)h->output_tail - offsetof(text_block, next)) : nullptr;
+    if (!block || block->buffer + block->capacity - (int)sizeof(int) * block->lines
+                  - (block->start + block->length) < length + (int)sizeof(int)
+#ifdef USE_TLS
+            || (h->want_write && block == h->output_head)
+#endif
+       ) {
+        block = new_text_block(length);
+        *(h->output_tail) = block;
+        h->output_tail = &(block->next);
+    }
+
+    buffer = block->start + block->length;
     memcpy(buffer, line, line_length);
     if (add_eol)
         memcpy(buffer + line_length, proto.eol_out_string, eol_length);
-    block->buffer = block->start = buffer;
-    block->length = length;
-    block->next = nullptr;
-    *(h->output_tail) = block;
-    h->output_tail = &(block->next);
+    block->length += length;
+    LINE_END(block, block->lines) = block->start + block->length - block->buffer;
+    block->lines++;
     h->output_length += length;
+    watch_nhandle(h);
 
     return 1;
 }
@@ -1351,6 +1495,7 @@ network_suspend_input(network_handle nh)
     nhandle *h = (nhandle *) nh.ptr;
 
     h->input_suspended = 1;
+    watch_nhandle(h);
 }
 
 void
@@ -1359,53 +1504,100 @@ network_resume_input(network_handle nh)
     nhandle *h = (nhandle *) nh.ptr;
 
     h->input_suspended = 0;
+    watch_nhandle(h);
+}
+
+/* Do whatever I/O a wait found possible on a connection, closing it if
+ * that fails.
+ */
+static void
+process_nhandle_io(nhandle * h, bool readable, bool writable)
+{
+    if (((readable && !pull_input(h))
+            || (writable && !push_output(h))) && get_nhandle_refcount(h) == 1) {
+        server_close(h->shandle);
+        network_handle nh;
+        nh.ptr = h;
+        decrement_nhandle_refcount(nh);
+        return;
+    }
+
+    watch_nhandle(h);
+#ifdef USE_TLS
+    if (readable && h->tls && h->connected && !h->tls_pending && SSL_has_pending(h->tls)) {
+        h->tls_pending = true;
+        tls_pending.push_back(h);
+    }
+#endif
 }
 
 int
 network_process_io(int timeout)
 {
-    nhandle *h, *hnext;
-    nlistener *l;
+    const int *ready;
+    int i, count;
     bool pending_tls = false;
 
-    mplex_clear();
-    for (l = all_nlisteners; l; l = l->next)
-        mplex_add_reader(l->fd);
-    for (h = all_nhandles; h; h = h->next) {
-        if (!h->input_suspended)
-        {
-            mplex_add_reader(h->rfd);
 #ifdef USE_TLS
-            if (h->tls && h->connected && SSL_has_pending(h->tls)) {
-                pending_tls = true;
-                timeout = 0;
-            }
-#endif
+    for (nhandle *h : tls_pending)
+        if (!h->input_suspended) {
+            pending_tls = true;
+            timeout = 0;
+            break;
         }
-        if (h->output_head)
-            mplex_add_writer(h->wfd);
-    }
-    add_registered_fds();
+#endif
 
     if (mplex_wait(timeout) && !pending_tls)
         return 0;
-    else {
-        for (l = all_nlisteners; l; l = l->next)
-            if (mplex_is_readable(l->fd))
-                accept_new_connection(l);
-        for (h = all_nhandles; h; h = hnext) {
-            hnext = h->next;
-            if (((mplex_is_readable(h->rfd) && !pull_input(h))
-                    || (mplex_is_writable(h->wfd) && !push_output(h))) && get_nhandle_refcount(h) == 1) {
-                server_close(h->shandle);
-                network_handle nh;
-                nh.ptr = h;
-                decrement_nhandle_refcount(nh);
-            }
+
+#ifdef USE_TLS
+    /* Handles are taken off the list one at a time, since reading from one
+     * may close another.
+     */
+    for (count = tls_pending.size(); count > 0 && !tls_pending.empty(); count--) {
+        nhandle *h = tls_pending.front();
+
+        tls_pending.erase(tls_pending.begin());
+        h->tls_pending = false;
+        if (h->input_suspended) {
+            h->tls_pending = true;
+            tls_pending.push_back(h);
+        } else
+            process_nhandle_io(h, true, false);
+    }
+#endif
+
+    count = mplex_ready(&ready);
+    for (i = 0; i < count; i++) {
+        int fd = ready[i];
+        bool readable = mplex_is_readable(fd);
+        bool writable = mplex_is_writable(fd);
+        /* A callback may register more descriptors, moving the table. */
+        fd_owner owner = fd_owners[fd];
+
+        if (!readable && !writable)     /* removed since the wait */
+            continue;
+
+        switch (owner.kind) {
+            case FD_LISTENER:
+                if (readable)
+                    accept_new_connection((nlistener *) owner.ptr);
+                break;
+            case FD_CONNECTION:
+                process_nhandle_io((nhandle *) owner.ptr, readable, writable);
+                break;
+            case FD_REGISTERED:
+                if (readable && owner.readable)
+                    (*owner.readable) (fd, owner.ptr);
+                if (writable && owner.writable && mplex_is_writable(fd))
+                    (*owner.writable) (fd, owner.ptr);
+                break;
+            case FD_UNUSED:
+                break;
         }
-        check_registered_fds();
-        return 1;
     }
+
+    return 1;
 }
 
 bool
@@ -1619,6 +1811,24 @@ network_protocol(const network_handle nh)
     }
 }
 
+Var
+network_output_stats(const network_handle nh)
+{
+    static Var bytes_key = str_dup_to_var("bytes");
+    static Var syscalls_key = str_dup_to_var("syscalls");
+    static Var flushes_key = str_dup_to_var("flushes");
+    static Var queued_key = str_dup_to_var("queued");
+    const nhandle *h = (nhandle *)nh.ptr;
+    Var ret = new_map();
+
+    ret = mapinsert(ret, var_ref(bytes_key), Var::new_int(h->output_bytes_written));
+    ret = mapinsert(ret, var_ref(syscalls_key), Var::new_int(h->output_syscalls));
+    ret = mapinsert(ret, var_ref(flushes_key), Var::new_int(h->output_flushes));
+    ret = mapinsert(ret, var_ref(queued_key), Var::new_int(h->output_length));
+
+    return ret;
+}
+
 #ifdef USE_TLS
 int
 network_handle_is_tls(const network_handle nh)
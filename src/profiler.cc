@@ -0,0 +1,394 @@
+/* A sampling profiler for MOO code.
+ *
+ * While the profiler is running, the interpreter counts the ticks used by
+ * each opcode and, every `sample_interval' ticks, hands the stack of the
+ * running task to profiler_sample().  The ticks, wall-clock time and
+ * allocations since the previous sample are blamed on the opcode each
+ * activation was executing.  Those are recorded as (program, vector, pc)
+ * and only turned into line numbers when a report is asked for, since
+ * find_line_number() decompiles the program.  The programs involved are
+ * kept alive until the profile is reset.
+ *
+ * profiler_report() returns the verb lines that the most ticks were spent
+ * in, and profiler_dump() writes every sampled stack to a file in the
+ * folded format read by flamegraph.pl:
+ *
+ *     #0:do_command:3;#10:look_self:12 4200
+ *
+ * At most MAX_STACKS distinct stacks are kept; the ticks of samples with
+ * any other stack are only counted, and dumped as `*other*'.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bf_register.h"
+#include "decompile.h"
+#include "disassemble.h"
+#include "execute.h"
+#include "fileio.h"
+#include "functions.h"
+#include "list.h"
+#include "map.h"
+#include "opcode.h"
+#include "profiler.h"
+#include "storage.h"
+#include "streams.h"
+#include "utils.h"
+
+#define DEFAULT_SAMPLE_INTERVAL 100
+#define DEFAULT_REPORT_LENGTH   20
+#define MAX_STACKS              10000
+
+bool profiler_running = false;
+int profiler_countdown = 0;
+uint64_t profiler_opcode_counts[256];
+uint64_t profiler_ext_opcode_counts[256];
+
+static int sample_interval = DEFAULT_SAMPLE_INTERVAL;
+
+typedef std::chrono::steady_clock Clock;
+
+static Clock::time_point last_sample;
+static uint64_t last_allocations;
+static uint64_t total_samples;
+
+struct Location {
+    Program *prog;
+    int vector;
+    unsigned pc;
+
+    bool operator<(const Location &l) const {
+        if (prog != l.prog)
+            return prog < l.prog;
+        if (vector != l.vector)
+            return vector < l.vector;
+        return pc < l.pc;
+    }
+};
+
+typedef struct {
+    uint64_t ticks;
+    double seconds;
+    uint64_t allocations;
+} Cost;
+
+/* The verb each sampled program belongs to, as of its first sample. */
+typedef struct {
+    Objid definer;
+    const char *verbname;
+} Program_Info;
+
+static std::unordered_map<Program *, Program_Info> programs;
+
+/* Costs by the location of the innermost activation. */
+static std::map<Location, Cost> self_costs;
+
+/* Ticks by whole stack, outermost activation first. */
+static std::map<std::vector<Location>, uint64_t> stacks;
+static uint64_t other_stack_ticks;
+
+static void
+remember_program(const Profile_Frame *f)
+{
+    if (programs.find(f->prog) != programs.end())
+        return;
+
+    Program_Info info;
+
+    info.definer = f->definer;
+    info.verbname = str_ref(f->verbname);
+    programs[program_ref(f->prog)] = info;
+}
+
+void
+profiler_task_resumed(void)
+{
+    last_sample = Clock::now();
+    last_allocations = allocation_count.load(std::memory_order_relaxed);
+}
+
+void
+profiler_sample(const Profile_Frame *frames, unsigned count)
+{
+    Clock::time_point now = Clock::now();
+    uint64_t allocations = allocation_count.load(std::memory_order_relaxed);
+    std::vector<Location> stack;
+    unsigned i;
+
+    profiler_countdown = sample_interval;
+    if (count == 0)
+        return;
+
+    stack.reserve(count);
+    for (i = 0; i < count; i++) {
+        Location l = {frames[i].prog, frames[i].vector, frames[i].pc};
+
+        remember_program(&frames[i]);
+        stack.push_back(l);
+    }
+
+    Cost &c = self_costs[stack.back()];
+
+    c.ticks += sample_interval;
+    c.seconds += std::chrono::duration<double>(now - last_sample).count();
+    c.allocations += allocations - last_allocations;
+
+    auto st = stacks.find(stack);
+
+    if (st != stacks.end())
+        st->second += sample_interval;
+    else if (stacks.size() < MAX_STACKS)
+        stacks.emplace(std::move(stack), sample_interval);
+    else
+        other_stack_ticks += sample_interval;
+    total_samples++;
+
+    last_sample = now;
+    last_allocations = allocations;
+}
+
+static void
+reset_profile(void)
+{
+    for (auto &p : programs) {
+        free_program(p.first);
+        free_str(p.second.verbname);
+    }
+    programs.clear();
+    self_costs.clear();
+    stacks.clear();
+    other_stack_ticks = 0;
+    total_samples = 0;
+    memset(profiler_opcode_counts, 0, sizeof(profiler_opcode_counts));
+    memset(profiler_ext_opcode_counts, 0, sizeof(profiler_ext_opcode_counts));
+}
+
+static unsigned
+location_line(const Location &l)
+{
+    return find_line_number(l.prog, l.vector, l.pc);
+}
+
+/* `#definer:verbname:line', as frames appear in the folded stacks. */
+static void
+add_frame_name(Stream *s, const Location &l)
+{
+    const Program_Info &info = programs[l.prog];
+
+    if (info.definer == NOTHING)
+        stream_add_string(s, "*anonymous*");
+    else
+        stream_printf(s, "#%" PRIdN, info.definer);
+    stream_printf(s, ":%s:%u", info.verbname, location_line(l));
+}
+
+/*********** Built-in functions ***********/
+
+/* profiler_start([INT interval]) */
+static package
+bf_profiler_start(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    int interval = DEFAULT_SAMPLE_INTERVAL;
+
+    if (arglist.v.list[0].v.num > 0)
+        interval = arglist.v.list[1].v.num;
+    free_var(arglist);
+
+    if (!is_wizard(progr))
+        return make_error_pack(E_PERM);
+    if (interval < 1)
+        return make_error_pack(E_INVARG);
+
+    sample_interval = interval;
+    profiler_countdown = interval;
+    profiler_task_resumed();
+    profiler_running = true;
+    hold_ticks_for_profiler();
+
+    return no_var_pack();
+}
+
+static package
+bf_profiler_stop(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    free_var(arglist);
+
+    if (!is_wizard(progr))
+        return make_error_pack(E_PERM);
+
+    profiler_running = false;
+
+    return no_var_pack();
+}
+
+static package
+bf_profiler_reset(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    free_var(arglist);
+
+    if (!is_wizard(progr))
+        return make_error_pack(E_PERM);
+
+    reset_profile();
+
+    return no_var_pack();
+}
+
+static Var
+opcode_counts(void)
+{
+    std::map<std::string, uint64_t> counts;
+    Var r = new_map();
+    unsigned i;
+
+    for (i = 0; i < 256; i++) {
+        if (profiler_opcode_counts[i] && i != OP_EXTENDED)
+            counts[opcode_name(i)] += profiler_opcode_counts[i];
+        if (profiler_ext_opcode_counts[i])
+            counts[ext_opcode_name(i)] += profiler_ext_opcode_counts[i];
+    }
+
+    for (auto &c : counts)
+        r = mapinsert(r, str_dup_to_var(c.first.c_str()), Var::new_int(c.second));
+
+    return r;
+}
+
+/* profiler_report([INT count])
+ *
+ * Returns a map with the `running' state, the sample `interval' in
+ * ticks, the number of `samples', the ticks used by each of the
+ * `opcodes' by name, and
+ * the `lines' that used the most ticks, as lists of
+ * {definer, verb name, line, ticks, seconds, allocations}.
+ */
+static package
+bf_profiler_report(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    int count = DEFAULT_REPORT_LENGTH;
+
+    if (arglist.v.list[0].v.num > 0)
+        count = arglist.v.list[1].v.num;
+    free_var(arglist);
+
+    if (!is_wizard(progr))
+        return make_error_pack(E_PERM);
+    if (count < 0)
+        return make_error_pack(E_INVARG);
+
+    /* Samples at different opcodes of the same line are one entry. */
+    typedef std::pair<Program *, unsigned> Line;
+    std::map<Line, Cost> lines;
+
+    for (auto &sc : self_costs) {
+        Cost &c = lines[Line(sc.first.prog, location_line(sc.first))];
+
+        c.ticks += sc.second.ticks;
+        c.seconds += sc.second.seconds;
+        c.allocations += sc.second.allocations;
+    }
+
+    std::vector<std::pair<Line, Cost>> sorted(lines.begin(), lines.end());
+
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<Line, Cost> &a, const std::pair<Line, Cost> &b) {
+                  return a.second.ticks > b.second.ticks;
+              });
+    if (sorted.size() > (size_t) count)
+        sorted.resize(count);
+
+    Var top = new_list(0);
+
+    for (auto &l : sorted) {
+        const Program_Info &info = programs[l.first.first];
+        Var row = new_list(6);
+
+        row.v.list[1] = Var::new_obj(info.definer);
+        row.v.list[2] = str_ref_to_var(info.verbname);
+        row.v.list[3] = Var::new_int(l.first.second);
+        row.v.list[4] = Var::new_int(l.second.ticks);
+        row.v.list[5] = Var::new_float(l.second.seconds);
+        row.v.list[6] = Var::new_int(l.second.allocations);
+        top = listappend(top, row);
+    }
+
+    Var r = new_map();
+
+    r = mapinsert(r, str_dup_to_var("running"), Var::new_int(profiler_running));
+    r = mapinsert(r, str_dup_to_var("interval"), Var::new_int(sample_interval));
+    r = mapinsert(r, str_dup_to_var("samples"), Var::new_int(total_samples));
+    r = mapinsert(r, str_dup_to_var("opcodes"), opcode_counts());
+    r = mapinsert(r, str_dup_to_var("lines"), top);
+
+    return make_var_pack(r);
+}
+
+/* profiler_dump(STR path)
+ *
+ * Writes the sampled stacks in folded format to PATH, relative to the
+ * files directory.  Returns the number of stacks written.
+ */
+static package
+bf_profiler_dump(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    const char *path;
+    FILE *f;
+
+    if (!is_wizard(progr)) {
+        free_var(arglist);
+        return make_error_pack(E_PERM);
+    }
+    if (!(path = file_resolve_path(arglist.v.list[1].v.str))) {
+        free_var(arglist);
+        return make_error_pack(E_INVARG);
+    }
+    if (!(f = fopen(path, "w"))) {
+        package p = make_raise_pack(E_FILE, strerror(errno),
+                                    var_ref(arglist.v.list[1]));
+        free_var(arglist);
+        return p;
+    }
+    free_var(arglist);
+
+    /* Different pcs on the same lines fold into one stack. */
+    std::map<std::string, uint64_t> folded;
+    Stream *s = new_stream(100);
+
+    for (auto &st : stacks) {
+        for (auto l = st.first.begin(); l != st.first.end(); ++l) {
+            if (l != st.first.begin())
+                stream_add_char(s, ';');
+            add_frame_name(s, *l);
+        }
+        folded[reset_stream(s)] += st.second;
+    }
+    free_stream(s);
+    if (other_stack_ticks)
+        folded["*other*"] += other_stack_ticks;
+
+    for (auto &st : folded)
+        fprintf(f, "%s %llu\n", st.first.c_str(),
+                (unsigned long long) st.second);
+    fclose(f);
+
+    return make_var_pack(Var::new_int(folded.size()));
+}
+
+void
+register_profiler(void)
+{
+    register_function("profiler_start", 0, 1, bf_profiler_start, TYPE_INT);
+    register_function("profiler_stop", 0, 0, bf_profiler_stop);
+    register_function("profiler_reset", 0, 0, bf_profiler_reset);
+    register_function("profiler_report", 0, 1, bf_profiler_report, TYPE_INT);
+    register_function("profiler_dump", 1, 1, bf_profiler_dump, TYPE_STR);
+}
@@ -128,6 +128,7 @@ const char *default_key_path = DEFAULT_TLS_KEY;
 #endif
 
 int clear_last_move = false;
+int binary_db_output = -1;
 char *bind_ipv4 = nullptr;
 char *bind_ipv6 = nullptr;
 char *file_subdir = FILE_SUBDIR;
@@ -840,11 +841,18 @@ main_loop(void)
 #else
             if (!db_flush(FLUSH_ALL_NOW))
                 call_checkpoint_notifier(0);
+#ifdef INCREMENTAL_CHECKPOINTS
+            else if (!db_checkpoint_forked())
+                call_checkpoint_notifier(1);
+#endif
 #endif
             set_checkpoint_timer(0);
         }
 #ifndef UNFORKED_CHECKPOINTS
         if (checkpoint_finished) {
+#ifdef INCREMENTAL_CHECKPOINTS
+            db_checkpoint_finished(checkpoint_finished - 1);
+#endif
             call_checkpoint_notifier(checkpoint_finished - 1);
             checkpoint_finished = 0;
         }
@@ -1803,9 +1811,12 @@ read_active_connections(void)
     int count, i, have_listeners = 0;
     char c;
 
+    /* Replaying an incremental checkpoint reads a newer list. */
+    free_var(checkpointed_connections);
+    checkpointed_connections = new_list(0);
+
     i = dbio_scanf("%d active connections%c", &count, &c);
     if (i == EOF) {     /* older database format */
-        checkpointed_connections = new_list(0);
         return 1;
     } else if (i != 2) {
         errlog("READ_ACTIVE_CONNECTIONS: Bad active connections count.\n");
@@ -1820,6 +1831,7 @@ read_active_connections(void)
         errlog("READ_ACTIVE_CONNECTIONS: Bad EOL.\n");
         return 0;
     }
+    free_var(checkpointed_connections);
     checkpointed_connections = new_list(count);
     for (i = 1; i <= count; i++) {
         Objid who, listener;
@@ -1878,7 +1890,7 @@ set_system_object_integer_limits()
 void
 print_usage()
 {
-    fprintf(stderr, "Usage:\n  %s [-e] [-f script-file] [-c script-line] [-l log-file] [-m] [-w waif-type] [-O|-o] [-4 ipv4-address] [-6 ipv6-address] [-r certificate-path] [-k key-path] [-i files-path] [-x executables-path] %s [-t|-p port-number]\n",
+    fprintf(stderr, "Usage:\n  %s [-e] [-f script-file] [-c script-line] [-l log-file] [-m] [-w waif-type] [-B|-T] [-C] [-O|-o] [-4 ipv4-address] [-6 ipv6-address] [-r certificate-path] [-k key-path] [-i files-path] [-x executables-path] %s [-t|-p port-number]\n",
             this_program, db_usage_string());
     fprintf(stderr, "\nMETA OPTIONS\n");
     fprintf(stderr, "  %-20s %s\n", "-v, --version", "current version");
@@ -1889,6 +1901,9 @@ print_usage()
     fprintf(stderr, "\nDATABASE OPTIONS\n");
     fprintf(stderr, "  %-20s %s\n", "-m, --clear-move", "clear the `last_move' builtin property on all objects");
     fprintf(stderr, "  %-20s %s\n", "-w, --waif-type", "convert waifs from the specified type (check with typeof(waif) in your old MOO)");
+    fprintf(stderr, "  %-20s %s\n", "-B, --binary-db", "dump the database in the binary encoding");
+    fprintf(stderr, "  %-20s %s\n", "-T, --text-db", "dump the database as text");
+    fprintf(stderr, "  %-20s %s\n", "-C, --convert-db", "load the input database, dump it to the output database and exit");
     fprintf(stderr, "  %-20s %s\n", "-f, --start-script", "file to load and pass to `#0:do_start_script()'");
     fprintf(stderr, "  %-20s %s\n", "-c, --start-line", "line to pass to `#0:do_start_script()'");
     fprintf(stderr, "\nDIRECTORY OPTIONS\n");
@@ -1905,9 +1920,11 @@ print_usage()
     fprintf(stderr, "  %-20s %s\n", "-p, --port", "port to listen for connections on (can be used multiple times)");
     fprintf(stderr, "\nThe emergency mode switch (-e) may not be used with either the file (-f) or line (-c) options.\n\n");
     fprintf(stderr, "Both the file and line options may be specified. Their order on the command line determines the order of their invocation.\n\n");
+    fprintf(stderr, "Without -B or -T, the database is dumped in the same encoding it was loaded in.\n\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "%s -c '$enable_debugging();' -f development.moo Minimal.db Minimal.db.new 7777\n", this_program);
     fprintf(stderr, "%s Minimal.db Minimal.db.new\n", this_program);
+    fprintf(stderr, "%s -B -C Minimal.db Minimal.db.bin\n", this_program);
 }
 
 int waif_conversion_type = _TYPE_WAIF;    /* For shame. We can remove this someday. */
@@ -1921,6 +1938,7 @@ main(int argc, char **argv)
     const char *script_line = nullptr;
     int script_file_first = 0;
     int emergency = 0;
+    int convert_db = 0;
     Var desc = Var::new_int(0);
 
 #ifdef USE_TLS
@@ -1956,6 +1974,9 @@ main(int argc, char **argv)
         {"start-line",      required_argument,  nullptr,            'c'},
         {"waif-type",       required_argument,  nullptr,            'w'},
         {"clear-move",      no_argument,        nullptr,            'm'},
+        {"binary-db",       no_argument,        nullptr,            'B'},
+        {"text-db",         no_argument,        nullptr,            'T'},
+        {"convert-db",      no_argument,        nullptr,            'C'},
         {"outbound",        no_argument,        nullptr,            'o'},
         {"no-outbound",     no_argument,        nullptr,            'O'},
         {"tls-port",        no_argument,        nullptr,            't'},
@@ -1970,7 +1991,7 @@ main(int argc, char **argv)
         {nullptr,           0,                  nullptr,              0}
     };
 
-    while ((c = getopt_long(argc, argv, "vel:f:c:w:moOt:4:6:p:r:k:i:x:h", long_options, &option_index)) != -1)
+    while ((c = getopt_long(argc, argv, "vel:f:c:w:mBTCoOt:4:6:p:r:k:i:x:h", long_options, &option_index)) != -1)
     {
         switch (c)
         {
@@ -2016,6 +2037,18 @@ main(int argc, char **argv)
                 clear_last_move = true;
                 break;
 
+            case 'B':                   /* --binary-db; dump the database in the binary encoding */
+                binary_db_output = 1;
+                break;
+
+            case 'T':                   /* --text-db; dump the database as text */
+                binary_db_output = 0;
+                break;
+
+            case 'C':                   /* --convert-db; dump the database and exit */
+                convert_db = 1;
+                break;
+
             case 'o':                   /* --outbound; enable outbound network connections */
             {
 #ifndef OUTBOUND_NETWORK
@@ -2230,6 +2263,13 @@ main(int argc, char **argv)
 
     register_bi_functions();
 
+    if (convert_db) {
+        if (!db_load())
+            exit(1);
+        db_shutdown();
+        exit(0);
+    }
+
     std::vector<slistener*> initial_listeners;
 
 
@@ -2388,12 +2428,14 @@ bf_reset_max_object(Var arglist, Byte next, void *vdata, Objid progr)
     return no_var_pack();
 }
 
-/* Returns total memory usage, resident set size, shared pages, text/code, and data + stack. */
+/* Returns total memory usage, resident set size, shared pages, text/code, and data + stack.
+ * With a true argument, a map of allocation counters is appended. */
 static package
 bf_memory_usage(Var arglist, Byte next, void *vdata, Objid progr)
 {
     // LINUX: Values are returned in pages. To get KB, multiply by 4.
     // macOS: The only value available is the resident set size, which is returned in bytes.
+    bool with_counts = arglist.v.list[0].v.num > 0 && is_true(arglist.v.list[1]);
     free_var(arglist);
 
     long double size = 0.0, resident = 0.0, share = 0.0, text = 0.0, lib = 0.0, data = 0.0, dt = 0.0;
@@ -2422,7 +2464,12 @@ bf_memory_usage(Var arglist, Byte next, void *vdata, Objid progr)
     fclose(f);
 #endif
 
-    Var s = new_list(5);
+    // Allocations made so far, and how many lists and maps had to be
+    // copied because they couldn't be changed in place.  Read them
+    // before building the result, which allocates and copies too.
+    Num allocations = allocation_count.load(std::memory_order_relaxed), list_copies = list_dup_count, map_copies = map_dup_count;
+
+    Var s = new_list(with_counts ? 6 : 5);
     s.v.list[1].type = TYPE_FLOAT;
     s.v.list[2].type = TYPE_FLOAT;
     s.v.list[3].type = TYPE_FLOAT;
@@ -2434,6 +2481,14 @@ bf_memory_usage(Var arglist, Byte next, void *vdata, Objid progr)
     s.v.list[4].v.fnum = text;           // Text (code)
     s.v.list[5].v.fnum = data;           // Data + stack
 
+    if (with_counts) {
+        Var counts = new_map();
+        counts = mapinsert(counts, str_dup_to_var("allocations"), Var::new_int(allocations));
+        counts = mapinsert(counts, str_dup_to_var("list_copies"), Var::new_int(list_copies));
+        counts = mapinsert(counts, str_dup_to_var("map_copies"), Var::new_int(map_copies));
+        s.v.list[6] = counts;            // Allocation counters
+    }
+
     return make_var_pack(s);
 }
 
@@ -2491,6 +2546,19 @@ bf_malloc_stats(Var arglist, Byte next, void *vdata, Objid progr)
 }
 #endif
 
+#ifdef USE_SLAB_ALLOCATOR
+/* Returns a LIST of per-type, per-size-class slab allocator statistics.
+ * See slab_stats() in storage.cc for the layout of each row. */
+static package
+bf_slab_stats(Var arglist, Byte next, void *vdata, Objid progr)
+{
+    free_var(arglist);
+    if (!is_wizard(progr))
+        return make_error_pack(E_PERM);
+
+    return make_var_pack(slab_stats());
+}
+#endif
 
 /* Return resource usage information from the operating system.
  * Values returned: {{load averages}, user time, system time, page reclaims, page faults, block input ops, block output ops, voluntary context switches, involuntary context switches, signals received
@@ -3032,6 +3100,7 @@ bf_connection_info(Var arglist, Byte next, void *vdata, Objid progr)
     static Var dest_port =  str_dup_to_var("destination_port");
     static Var protocol =   str_dup_to_var("protocol");
     static Var is_outbound = str_dup_to_var("outbound");
+    static Var output_key = str_dup_to_var("output");
 
     network_handle nh = h->nhandle;
 
@@ -3046,6 +3115,7 @@ bf_connection_info(Var arglist, Byte next, void *vdata, Objid progr)
     ret = mapinsert(ret, var_ref(dest_ip), str_dup_to_var(network_ip_address(nh)));
     ret = mapinsert(ret, var_ref(protocol), str_dup_to_var(network_protocol(nh)));
     ret = mapinsert(ret, var_ref(is_outbound), Var::new_int(h->outbound));
+    ret = mapinsert(ret, var_ref(output_key), network_output_stats(nh));
 #ifdef USE_TLS
     ret = mapinsert(ret, var_ref(tls_key), tls_connection_info(nh));
 #endif
@@ -3641,9 +3711,12 @@ register_server(void)
     register_function("server_version", 0, 1, bf_server_version, TYPE_ANY);
     register_function("renumber", 1, 1, bf_renumber, TYPE_OBJ);
     register_function("reset_max_object", 0, 0, bf_reset_max_object);
-    register_function("memory_usage", 0, 0, bf_memory_usage);
+    register_function("memory_usage", 0, 1, bf_memory_usage, TYPE_ANY);
 #ifdef JEMALLOC_FOUND
     register_function("malloc_stats", 0, 0, bf_malloc_stats);
+#endif
+#ifdef USE_SLAB_ALLOCATOR
+    register_function("slab_stats", 0, 0, bf_slab_stats);
 #endif
     register_function("usage", 0, 0, bf_usage);
     register_function("panic", 0, 1, bf_panic, TYPE_STR);
@@ -14,6 +14,10 @@
  * of an individual SQL library's functions. Common convention is to prepend
  * SQL database type to the class name when inheriting. 
  *
+ * Sessions keep the statements they've prepared, keyed by their text, and
+ * can open a cursor (an SQLCursor) that returns a query's rows a batch at a
+ * time, or run a list of statements as one transaction.
+ *
  * After implementing these classes, an entry has to be created in:
  *
  * create_session_pool()
@@ -21,7 +25,9 @@
  *
  */
 
+#include <atomic>
 #include <iostream>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -187,6 +193,42 @@ class Uri {
         }
 };
 
+/* Turn one column of a result into a MOO value according to `options'. */
+static Var column_to_moo(char *str, unsigned char options)
+{
+    Var column;
+
+    if (str == nullptr) {
+        column.type = TYPE_STR;
+        column.v.str = str_dup("NULL");
+    } else if (!(options & SQL_PARSE_TYPES)) {
+        if (options & SQL_SANITIZE_STRINGS)
+            sanitize_string_for_moo(str);
+        column.type = TYPE_STR;
+        column.v.str = str_dup(str);
+    } else {
+        column = string_to_moo_type(str, options & SQL_PARSE_OBJECTS, options & SQL_SANITIZE_STRINGS);
+    }
+
+    return column;
+}
+
+/* The rows of a query that haven't been fetched yet.  A cursor keeps its
+ * session to itself until it's destroyed. */
+class SQLCursor {
+    public:
+        /* Set `ret' to a list of up to `count' more rows; it's empty once
+         * they've all been fetched. */
+        virtual void fetch(int count, Var* ret, unsigned char options = 0) = 0;
+        virtual ~SQLCursor() { }
+};
+
+/* One statement of a transaction, with its parameters (or nullptr). */
+struct SQLStatement {
+    std::string query;
+    Var* bind;
+};
+
 class SQLSession {
     public:
         virtual void query(
@@ -194,11 +236,29 @@ class SQLSession {
             Var* bind, 
             Var* ret, 
             unsigned char options = 0)      = 0;
+        virtual std::unique_ptr<SQLCursor> open_cursor(
+            std::string statement,
+            Var* bind)                      = 0;
+        /* Run `statements' in one transaction, setting `ret' to a list of
+         * their results.  If one fails, the transaction is rolled back
+         * and an exception naming the statement is thrown. */
+        virtual void transaction(
+            const std::vector<SQLStatement>& statements,
+            Var* ret,
+            unsigned char options = 0)      = 0;
         virtual void shutdown()             = 0;
         virtual bool is_healthy()           = 0;
+        virtual ~SQLSession() { }
         void wait() {
             std::unique_lock<std::mutex> lock(busy_mutex);
         }
+        std::unique_lock<std::mutex> lock() {
+            return std::unique_lock<std::mutex>(busy_mutex);
+        }
+
+        // How many statements were prepared, and how many times one was reused.
+        std::atomic<uint64_t> statements_prepared {0};
+        std::atomic<uint64_t> statements_reused {0};
     protected:
         mutable std::mutex busy_mutex;
 };
@@ -281,7 +341,18 @@ class SQLSessionPool {
             return connections_busy.size();
         }
 
-        ~SQLSessionPool() {
+        void statement_stats(uint64_t *prepared, uint64_t *reused) {
+            std::unique_lock<std::mutex> lock(connections_mutex);
+            *prepared = *reused = 0;
+            for (auto *connections : {&connections_idle, &connections_busy}) {
+                for (auto&& connection : *connections) {
+                    *prepared += connection.second->statements_prepared;
+                    *reused += connection.second->statements_reused;
+                }
+            }
+        }
+
+        virtual ~SQLSessionPool() {
             this->stop();
         }
     
@@ -326,6 +397,47 @@ class SQLSessionPool {
 };
 
 #ifdef POSTGRESQL_FOUND
+static pqxx::params moo_to_pqxx_params(Var* bind)
+{
+    pqxx::params p;
+
+    for (int bind_col=1; bind_col <= bind->v.num; bind_col++) {
+        switch (bind[bind_col].type) {
+            case TYPE_STR:
+                p.append(pqxx::to_string(bind[bind_col].v.str));
+                break;
+            case TYPE_INT:
+            case TYPE_NUMERIC:
+                p.append(bind[bind_col].v.num);
+                break;
+            case TYPE_FLOAT:
+                p.append(bind[bind_col].v.fnum);
+                break;
+            case TYPE_BOOL:
+                p.append(bind[bind_col].v.truth);
+                break;
+        }
+    }
+
+    return p;
+}
+
+static Var pqxx_rows_to_moo(const pqxx::result &res, unsigned char options)
+{
+    Var ret = new_list(res.size());
+    int i = 0;
+
+    for (const auto &row: res) {
+        Var rv = new_list(row.size());
+        int j = 0;
+        for (auto col: row)
+            rv.v.list[++j] = column_to_moo((char*)col.c_str(), options);
+        ret.v.list[++i] = rv;
+    }
+
+    return ret;
+}
+
 class PostgreSQLSession: public SQLSession {
     public:
         PostgreSQLSession(Uri* uri) {
@@ -339,54 +451,15 @@ class PostgreSQLSession: public SQLSession {
             try {
                 pqxx::work txn {*connection.get()};
                 pqxx::result res;
-                
-                // Code for binding prepared statements.
+
                 if (bind != nullptr) {
-                    pqxx::params p;
-                    for (int bind_col=1; bind_col <= bind->v.num; bind_col++) {
-                        switch (bind[bind_col].type) {
-                            case TYPE_STR:
-                                p.append(pqxx::to_string(bind[bind_col].v.str));
-                                break;
-                            case TYPE_INT:
-                            case TYPE_NUMERIC:
-                                p.append(bind[bind_col].v.num);
-                                break;
-                            case TYPE_FLOAT:
-                                p.append(bind[bind_col].v.fnum);
-                                break;
-                            case TYPE_BOOL:
-                                p.append(bind[bind_col].v.truth);
-                                break;
-                        }
-                    }
-                    
-                    res = txn.exec_params(statement, p);
+                    res = txn.exec_params(statement, moo_to_pqxx_params(bind));
                 } else {
                     res = txn.exec(statement);
                 }
 
                 // Get results
-                *ret = new_list(0);
-                for (const auto &row: res) {
-                    Var rv = new_list(0);
-                    for (auto col: row) {
-                        char *str = (char*)col.c_str();
-                        Var column;
-
-                        if (!(options & SQL_PARSE_TYPES)) {
-                            if (options & SQL_SANITIZE_STRINGS)
-                                sanitize_string_for_moo(str);
-                            column.type = TYPE_STR;
-                            column.v.str = str_dup(str);
-                        } else {
-                            column = string_to_moo_type(str, options & SQL_PARSE_OBJECTS, options & SQL_SANITIZE_STRINGS);
-                        }
-
-                        rv = listappend(rv, column);
-                    }
-                    *ret = listappend(*ret, rv);
-                }
+                *ret = pqxx_rows_to_moo(res, options);
 
                 res.clear();
                 txn.commit();
@@ -399,6 +472,14 @@ class PostgreSQLSession: public SQLSession {
             }
         }
 
+        void transaction(const std::vector<SQLStatement>& statements, Var* ret, unsigned char options = 0) {
+            throw std::runtime_error("Transactions aren't supported on PostgreSQL connections.");
+        }
+
+        std::unique_ptr<SQLCursor> open_cursor(std::string statement, Var* bind) {
+            throw std::runtime_error("Cursors aren't supported on PostgreSQL connections.");
+        }
+
         void shutdown() {
             if (!this->broken_connection) {
                 connection->close();
@@ -426,6 +507,59 @@ class PostgreSQLSessionPool: public SQLSessionPool {
 #endif // POSTGRESQL_FOUND
 
 #ifdef SQLITE3_FOUND
+static Var sqlite_row_to_moo(sqlite3_stmt* res, int column_count, unsigned char options)
+{
+    Var row = new_list(column_count);
+
+    for (int i=0;i < column_count;i++)
+        row.v.list[i + 1] = column_to_moo((char*)sqlite3_column_text(res, i), options);
+
+    return row;
+}
+
+class SQLiteCursor: public SQLCursor {
+    public:
+        SQLiteCursor(SQLSession* session, sqlite3* db, sqlite3_stmt* res)
+            : session(session), db(db), res(res) { }
+
+        void fetch(int count, Var* ret, unsigned char options = 0) {
+            auto lock = session->lock();
+            int return_code = SQLITE_DONE;
+
+            *ret = new_list(0);
+            while (!done && count > 0 && (return_code = sqlite3_step(res)) == SQLITE_ROW) {
+                int column_count = sqlite3_data_count(res);
+                if (column_count <= 0) {
+                  continue;
+                }
+
+                *ret = listappend(*ret, sqlite_row_to_moo(res, column_count, options));
+                count--;
+            }
+
+            if (return_code != SQLITE_ROW && return_code != SQLITE_DONE) {
+                done = true;
+                free_var(*ret);
+                throw std::runtime_error(sqlite3_errmsg(db));
+            }
+            done = done || return_code == SQLITE_DONE;
+        }
+
+        ~SQLiteCursor() {
+            auto lock = session->lock();
+
+            // The statement belongs to the session's cache; ready it for its next use.
+            sqlite3_reset(res);
+            sqlite3_clear_bindings(res);
+        }
+
+    private:
+        SQLSession* session;
+        sqlite3* db;
+        sqlite3_stmt* res;
+        bool done = false;
+};
+
 class SQLiteSession: public SQLSession {
     public:
         SQLiteSession(Uri* uri) {
@@ -438,26 +572,139 @@ class SQLiteSession: public SQLSession {
         void query(std::string statement, Var* bind, Var* ret, unsigned char options = 0) {
             std::unique_lock<std::mutex> lock(busy_mutex);
 
-            // Create the statement.
+            if (!step(prepare(statement, bind), ret, options))
+                *ret = str_dup_to_var(sqlite3_errmsg(db));
+        }
+
+        void transaction(const std::vector<SQLStatement>& statements, Var* ret, unsigned char options = 0) {
+            std::unique_lock<std::mutex> lock(busy_mutex);
+            Var results = new_list(0);
+            int i = 0;
+
+            try {
+                execute("BEGIN");
+                for (i = 1; i <= (int)statements.size(); i++) {
+                    Var result;
+                    if (!step(prepare(statements[i - 1].query, statements[i - 1].bind), &result, options))
+                        throw std::runtime_error(sqlite3_errmsg(db));
+                    results = listappend(results, result);
+                }
+                i = 0;
+                execute("COMMIT");
+                *ret = results;
+            } catch (const std::runtime_error &e) {
+                std::string message = i > 0 ? "Statement " + std::to_string(i) + ": " + e.what() : e.what();
+                free_var(results);
+                if (!sqlite3_get_autocommit(db))
+                    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+                throw std::runtime_error(message);
+            }
+        }
+
+        std::unique_ptr<SQLCursor> open_cursor(std::string statement, Var* bind) {
+            std::unique_lock<std::mutex> lock(busy_mutex);
+
+            return std::make_unique<SQLiteCursor>(this, db, prepare(statement, bind));
+        }
+
+        void shutdown() {
+            for (auto&& item : statements)
+                sqlite3_finalize(item.second.res);
+            statements.clear();
+            statement_ages.clear();
+            sqlite3_close(db);
+        }
+
+        bool is_healthy() {
+            return true;
+        }
+
+    private:
+        /* Set `ret' to the rows of `res' and reset it for its next use.
+         * Returns false, with `ret' set to 0, if a step fails. */
+        bool step(sqlite3_stmt* res, Var* ret, unsigned char options) {
+            int return_code;
+            *ret = new_list(0);
+            while((return_code = sqlite3_step(res)) == SQLITE_ROW) {
+                int column_count = sqlite3_data_count(res);
+                if (column_count <= 0) {
+                  continue;
+                }
+
+                *ret = listappend(*ret, sqlite_row_to_moo(res, column_count, options));
+            }
+
+            sqlite3_reset(res);
+            sqlite3_clear_bindings(res);
+
+            if (return_code != SQLITE_DONE) {
+                free_var(*ret);
+                *ret = Var::new_int(0);
+                return false;
+            }
+            return true;
+        }
+
+        void execute(const char* statement) {
+            char *errstr = nullptr;
+
+            if (sqlite3_exec(db, statement, nullptr, nullptr, &errstr) != SQLITE_OK) {
+                std::string message = errstr ? errstr : sqlite3_errmsg(db);
+                sqlite3_free(errstr);
+                throw std::runtime_error(message);
+            }
+        }
+
+        /* Returns the statement for `statement' with `bind' bound to it.
+         * Statements are kept after they're used, so the
+         * SQL_STATEMENT_CACHE_SIZE most recently used needn't be compiled
+         * again; whoever steps through one must reset it afterwards. */
+        sqlite3_stmt* prepare(const std::string& statement, Var* bind) {
             sqlite3_stmt *res;
-            auto return_code = sqlite3_prepare_v2(db, statement.c_str(), -1, &res, nullptr);
+            auto it = statements.find(statement);
 
-            if (return_code != SQLITE_OK) {
-                char *errstr = (char*)sqlite3_errmsg(db);
-                sqlite3_finalize(res);
-                throw std::runtime_error(errstr);
+            if (it != statements.end()) {
+                statement_ages.splice(statement_ages.begin(), statement_ages, it->second.age);
+                statements_reused++;
+                res = it->second.res;
+            } else {
+                // Create the statement.
+                auto return_code = sqlite3_prepare_v3(db, statement.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &res, nullptr);
+
+                if (return_code != SQLITE_OK) {
+                    char *errstr = (char*)sqlite3_errmsg(db);
+                    sqlite3_finalize(res);
+                    throw std::runtime_error(errstr);
+                }
+
+                if (statements.size() >= SQL_STATEMENT_CACHE_SIZE) {
+                    auto oldest = statements.find(statement_ages.back());
+                    sqlite3_finalize(oldest->second.res);
+                    statements.erase(oldest);
+                    statement_ages.pop_back();
+                }
+
+                statements_prepared++;
+                statement_ages.push_front(statement);
+                CachedStatement& entry = statements[statement];
+                entry.res = res;
+                entry.age = statement_ages.begin();
             }
 
-            // Code for binding prepared statements.
+            // Code for binding prepared statements.  The values are copied,
+            // since a cursor may step through the statement after the
+            // arguments are gone.
             if (bind != nullptr) {
                 for (int bind_col=1; bind_col <= bind->v.num; bind_col++) {
+                    int return_code = SQLITE_OK;
+
                     switch (bind[bind_col].type) {
                         case TYPE_STR:
-                            return_code = sqlite3_bind_text(res, bind_col, bind[bind_col].v.str, -1, 0);
+                            return_code = sqlite3_bind_text(res, bind_col, bind[bind_col].v.str, -1, SQLITE_TRANSIENT);
                             break;
                         case TYPE_INT:
                         case TYPE_NUMERIC:
-                            return_code = sqlite3_bind_int(res, bind_col, bind[bind_col].v.num);
+                            return_code = sqlite3_bind_int64(res, bind_col, bind[bind_col].v.num);
                             break;
                         case TYPE_FLOAT:
                             return_code = sqlite3_bind_double(res, bind_col, bind[bind_col].v.fnum);
@@ -468,62 +715,26 @@ class SQLiteSession: public SQLSession {
                     }
 
                     if (return_code == SQLITE_RANGE) {
-                        sqlite3_finalize(res);
+                        sqlite3_clear_bindings(res);
                         throw std::runtime_error("Parameter index out of range.");
                     } else if (return_code != SQLITE_OK) {
-                        sqlite3_finalize(res);
+                        sqlite3_clear_bindings(res);
                         throw std::runtime_error("Error when binding argument to query.");
                     }
                 }
             }
 
-            // Actually parsing the results.
-            int column_count = 0;
-            *ret = new_list(0);
-            while((return_code = sqlite3_step(res)) == SQLITE_ROW) {
-                int column_count = sqlite3_data_count(res);
-                if (column_count <= 0) {
-                  continue;
-                }
-
-                Var row = new_list(0);
-                for (int i=0;i < column_count;i++) {
-                    char *str = (char*)sqlite3_column_text(res, i);
-
-                    Var column;
-                    if (!(options & SQL_PARSE_TYPES)) {
-                        if (options & SQL_SANITIZE_STRINGS)
-                            sanitize_string_for_moo(str);
-                        column.type = TYPE_STR;
-                        column.v.str = str_dup(str);
-                    } else {
-                        column = string_to_moo_type(str, options & SQL_PARSE_OBJECTS, options & SQL_SANITIZE_STRINGS);
-                    }
-
-                    row = listappend(row, column);
-                }
-
-                *ret = listappend(*ret, row);
-            }
-
-            if (return_code != SQLITE_DONE) {
-                char *errstr = (char*)sqlite3_errmsg(db);
-                *ret = str_dup_to_var(errstr);
-            }
-
-            sqlite3_finalize(res);
-        }
-
-        void shutdown() {
-            sqlite3_close(db);
+            return res;
         }
 
-        bool is_healthy() {
-            return true;
-        }
+        struct CachedStatement {
+            sqlite3_stmt* res;
+            std::list<std::string>::iterator age;
+        };
 
-    private:
         sqlite3 *db;
+        std::unordered_map<std::string, CachedStatement> statements;
+        std::list<std::string> statement_ages;  // Most recently used first.
 };
 
 class SQLiteSessionPool: public SQLSessionPool {
@@ -536,7 +747,7 @@ class SQLiteSessionPool: public SQLSessionPool {
 };
 #endif // SQLITE3_FOUND
 
-static std::unordered_map<unsigned short, std::unique_ptr<SQLSessionPool>> connection_pools;
+static std::unordered_map<unsigned short, std::shared_ptr<SQLSessionPool>> connection_pools;
 
 static int
 next_identifier()
@@ -556,8 +767,58 @@ next_identifier()
     return next_id;
 }
 
+/* An open cursor keeps the session it was opened on busy until it's closed
+ * or its connection is.  Handles are shared with the background threads
+ * opening and fetching from them, and are only ever released on the main
+ * thread.  Those threads hold `mutex' while they use the cursor, so closing
+ * it waits for them and they find out if it was closed first. */
+struct SQLCursorHandle {
+    int id;
+    int handle_id;
+    std::shared_ptr<SQLSessionPool> pool;
+    SQLSession *session = nullptr;
+    std::unique_ptr<SQLCursor> cursor;
+    bool closed = false;
+    std::mutex mutex;
+
+    /* Give the session back to the pool.  This must happen before the pool
+     * is stopped, since the cursor still uses the session. */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (closed)
+            return;
+        closed = true;
+        if (session != nullptr) {
+            cursor.reset();
+            pool->release_connection(session);
+            session = nullptr;
+        }
+    }
+
+    ~SQLCursorHandle() {
+        close();
+    }
+};
+
+static std::unordered_map<int, std::shared_ptr<SQLCursorHandle>> open_cursors;
+static int next_cursor_id = 1;
+
+static void close_cursors(int handle_id)
+{
+    for (auto it = open_cursors.begin(); it != open_cursors.end();) {
+        if (handle_id < 0 || it->second->handle_id == handle_id) {
+            it->second->close();
+            it = open_cursors.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
 void sql_shutdown()
 {
+    close_cursors(-1);
     connection_pools.clear();
 }
 
@@ -605,6 +866,24 @@ static SQLSessionPool* get_or_create_session_pool(
     return create_session_pool(connection_string, options);
 }
 
+/* Validate the parameters of a query. */
+static bool valid_parameters(Var params)
+{
+    Var *tmp = params.v.list;
+    for (int x = 1; x <= tmp->v.num; x++) {
+        switch(tmp[x].type) {
+            case TYPE_FLOAT:
+            case TYPE_INT:
+            case TYPE_STR:
+            case TYPE_NUMERIC:
+                continue;
+        }
+        return false;
+    }
+
+    return true;
+}
+
 void
 query_callback(const Var arglist, Var *ret, void *extra_data)
 {
@@ -618,7 +897,7 @@ query_callback(const Var arglist, Var *ret, void *extra_data)
         return;
     }
 
-    SQLSession* session;
+    SQLSession* session = nullptr;
 
     try {
         int tries = 0;
@@ -626,6 +905,10 @@ query_callback(const Var arglist, Var *ret, void *extra_data)
             tries++;
             try {
             session = pool->get_connection();
+            if (session == nullptr) {
+                *ret = str_dup_to_var("No connection available.");
+                return;
+            }
             if (nargs < 3 || arglist.v.list[3].v.num < 1) {
                 // There's no SQL parameters.
                 session->query(query, nullptr, ret);
@@ -636,25 +919,30 @@ query_callback(const Var arglist, Var *ret, void *extra_data)
             // We're done with the connection, let it go back to the pool.
             pool->release_connection(session);
             break;
+#ifdef POSTGRESQL_FOUND
             } catch (pqxx::sql_error) {
                 oklog("pqxx exception caught");
                 throw;
+#endif
             } catch (const std::runtime_error& re) {
                 if (tries >= 3) {
                     throw;
                 }
                 // We're done with the connection, let it go back to the pool.
                 pool->release_connection(session);
+                session = nullptr;
             } 
         }        
     } catch (const std::runtime_error& re) {
         auto err = (char*)re.what();
         sanitize_string_for_moo(err);
         *ret = str_dup_to_var(err);
-        pool->release_connection(session);
+        if (session)
+            pool->release_connection(session);
     } catch(...) {
         *ret = str_dup_to_var("Unknown failure encountered.");
-        pool->release_connection(session);
+        if (session)
+            pool->release_connection(session);
     }
 }
 
@@ -675,20 +963,9 @@ bf_sql_query (Var arglist, Byte next, void *vdata, Objid progr)
     }
 
     // Input validation for arguments.
-    if (arglist.v.list[0].v.num == 3 && arglist.v.list[3].v.list->v.num > 0) {
-        Var *tmp = arglist.v.list[3].v.list;
-        for (int x = 1; x <= tmp->v.num; x++) {
-            switch(tmp[x].type) {
-                case TYPE_FLOAT:
-                case TYPE_INT:
-                case TYPE_STR:
-                case TYPE_NUMERIC:
-                    continue;                    
-            }
-
-            free_var(arglist);
-            return make_error_pack(E_INVARG);
-        }
+    if (arglist.v.list[0].v.num == 3 && !valid_parameters(arglist.v.list[3])) {
+        free_var(arglist);
+        return make_error_pack(E_INVARG);
     }
 
     char *human_string = nullptr;
@@ -698,6 +975,233 @@ bf_sql_query (Var arglist, Byte next, void *vdata, Objid progr)
     return background_thread(query_callback, &arglist, human_string);  
 }
 
+static void
+cursor_open_callback(const Var arglist, Var *ret, void *extra_data)
+{
+    auto handle = *(std::shared_ptr<SQLCursorHandle>*)extra_data;
+    std::string query = arglist.v.list[2].v.str;
+    Var *bind = (arglist.v.list[0].v.num < 3 || arglist.v.list[3].v.list->v.num < 1) ? nullptr : arglist.v.list[3].v.list;
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    if (handle->closed) {
+        *ret = str_dup_to_var("No connection handle value found by that ID.");
+        return;
+    }
+
+    try {
+        handle->session = handle->pool->get_connection();
+        if (handle->session == nullptr) {
+            *ret = str_dup_to_var("No connection available.");
+            return;
+        }
+        handle->cursor = handle->session->open_cursor(query, bind);
+        *ret = Var::new_int(handle->id);
+    } catch (const std::runtime_error& re) {
+        auto err = (char*)re.what();
+        sanitize_string_for_moo(err);
+        *ret = str_dup_to_var(err);
+    } catch(...) {
+        *ret = str_dup_to_var("Unknown failure encountered.");
+    }
+}
+
+static void
+cursor_open_cleanup(void *extra_data)
+{
+    auto handle = (std::shared_ptr<SQLCursorHandle>*)extra_data;
+
+    /* The thread is done with the cursor, so nothing else can have it locked. */
+    if (!(*handle)->cursor) {
+        open_cursors.erase((*handle)->id);
+        (*handle)->close();
+    }
+
+    delete handle;
+}
+
+static package
+bf_sql_cursor_open (Var arglist, Byte next, void *vdata, Objid progr)
+{
+    if (!is_wizard(progr))
+    {
+        free_var(arglist);
+        return make_error_pack(E_PERM);
+    }
+
+    int handle_id = arglist.v.list[1].v.num;
+    auto pool = connection_pools.find(handle_id);
+    if (pool == connection_pools.end()) {
+        free_var(arglist);
+        return make_var_pack(str_dup_to_var("No connection handle value by that ID."));
+    }
+
+    if (arglist.v.list[0].v.num == 3 && !valid_parameters(arglist.v.list[3])) {
+        free_var(arglist);
+        return make_error_pack(E_INVARG);
+    }
+
+    auto handle = new std::shared_ptr<SQLCursorHandle>(std::make_shared<SQLCursorHandle>());
+    (*handle)->id = next_cursor_id++;
+    (*handle)->handle_id = handle_id;
+    (*handle)->pool = pool->second;
+    /* Listed right away, so that closing the connection closes it too. */
+    open_cursors[(*handle)->id] = *handle;
+
+    return background_thread(cursor_open_callback, &arglist, handle, cursor_open_cleanup);
+}
+
+static void
+cursor_fetch_callback(const Var arglist, Var *ret, void *extra_data)
+{
+    auto handle = *(std::shared_ptr<SQLCursorHandle>*)extra_data;
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    if (handle->closed || !handle->cursor) {
+        *ret = str_dup_to_var("No cursor by that ID.");
+        return;
+    }
+
+    try {
+        handle->cursor->fetch(arglist.v.list[2].v.num, ret);
+    } catch (const std::exception& e) {
+        auto err = (char*)e.what();
+        sanitize_string_for_moo(err);
+        *ret = str_dup_to_var(err);
+    } catch(...) {
+        *ret = str_dup_to_var("Unknown failure encountered.");
+    }
+}
+
+static void
+cursor_fetch_cleanup(void *extra_data)
+{
+    delete (std::shared_ptr<SQLCursorHandle>*)extra_data;
+}
+
+static package
+bf_sql_cursor_fetch (Var arglist, Byte next, void *vdata, Objid progr)
+{
+    if (!is_wizard(progr))
+    {
+        free_var(arglist);
+        return make_error_pack(E_PERM);
+    }
+
+    if (arglist.v.list[2].v.num < 1) {
+        free_var(arglist);
+        return make_error_pack(E_INVARG);
+    }
+
+    auto cursor = open_cursors.find(arglist.v.list[1].v.num);
+    if (cursor == open_cursors.end()) {
+        free_var(arglist);
+        return make_var_pack(str_dup_to_var("No cursor by that ID."));
+    }
+
+    auto handle = new std::shared_ptr<SQLCursorHandle>(cursor->second);
+    return background_thread(cursor_fetch_callback, &arglist, handle, cursor_fetch_cleanup);
+}
+
+static package
+bf_sql_cursor_close (Var arglist, Byte next, void *vdata, Objid progr)
+{
+    if (!is_wizard(progr))
+    {
+        free_var(arglist);
+        return make_error_pack(E_PERM);
+    }
+
+    auto cursor = open_cursors.find(arglist.v.list[1].v.num);
+    free_var(arglist);
+    if (cursor == open_cursors.end())
+        return make_var_pack(str_dup_to_var("No cursor by that ID."));
+
+    /* A fetch still running keeps the handle, but not the session. */
+    cursor->second->close();
+    open_cursors.erase(cursor);
+    return make_var_pack(Var::new_int(1));
+}
+
+static void
+transaction_callback(const Var arglist, Var *ret, void *extra_data)
+{
+    Var *items = arglist.v.list[2].v.list;
+    auto pool = *(std::shared_ptr<SQLSessionPool>*)extra_data;
+
+    std::vector<SQLStatement> statements;
+    for (int x = 1; x <= items->v.num; x++) {
+        Var *item = items[x].v.list;
+        bool has_params = item->v.num > 1 && item[2].v.list->v.num > 0;
+        statements.push_back({item[1].v.str, has_params ? item[2].v.list : nullptr});
+    }
+
+    SQLSession* session = nullptr;
+
+    try {
+        session = pool->get_connection();
+        if (session == nullptr) {
+            *ret = str_dup_to_var("No connection available.");
+            return;
+        }
+        session->transaction(statements, ret);
+        pool->release_connection(session);
+    } catch (const std::runtime_error& re) {
+        auto err = (char*)re.what();
+        sanitize_string_for_moo(err);
+        *ret = str_dup_to_var(err);
+        if (session)
+            pool->release_connection(session);
+    } catch(...) {
+        *ret = str_dup_to_var("Unknown failure encountered.");
+        if (session)
+            pool->release_connection(session);
+    }
+}
+
+static void
+transaction_cleanup(void *extra_data)
+{
+    delete (std::shared_ptr<SQLSessionPool>*)extra_data;
+}
+
+/* Run a list of statements, each a list of {query [, params]}, in one
+ * transaction on one connection.  Returns a list of their results, or a
+ * string if one of them failed and they were all rolled back. */
+static package
+bf_sql_transaction (Var arglist, Byte next, void *vdata, Objid progr)
+{
+    if (!is_wizard(progr))
+    {
+        free_var(arglist);
+        return make_error_pack(E_PERM);
+    }
+
+    int handle_id = arglist.v.list[1].v.num;
+    auto handle = connection_pools.find(handle_id);
+    if (handle == connection_pools.end()) {
+        free_var(arglist);
+        return make_var_pack(str_dup_to_var("No connection handle value by that ID."));
+    }
+
+    // Input validation for the statements.
+    Var statements = arglist.v.list[2];
+    for (int x = 1; x <= statements.v.list[0].v.num; x++) {
+        Var item = statements.v.list[x];
+        if (item.type != TYPE_LIST
+            || item.v.list[0].v.num < 1 || item.v.list[0].v.num > 2
+            || item.v.list[1].type != TYPE_STR
+            || (item.v.list[0].v.num == 2
+                && (item.v.list[2].type != TYPE_LIST || !valid_parameters(item.v.list[2])))) {
+            free_var(arglist);
+            return make_error_pack(E_INVARG);
+        }
+    }
+
+    // The thread gets the pool itself; connection_pools is the main thread's.
+    auto pool = new std::shared_ptr<SQLSessionPool>(handle->second);
+    return background_thread(transaction_callback, &arglist, pool, transaction_cleanup);
+}
+
 static package
 bf_sql_connections (Var arglist, Byte next, void *vdata, Objid progr)
 {
@@ -733,7 +1237,7 @@ bf_sql_open_connection (Var arglist, Byte next, void *vdata, Objid progr)
     try {
         std::string connection_string = arglist.v.list[1].v.str;        
         
-        unsigned char options;
+        unsigned char options = SQL_PARSE_TYPES | SQL_PARSE_OBJECTS;
         if (arglist.v.list[0].v.num >= 2)
             options = arglist.v.list[2].v.num;        
         auto pool = get_or_create_session_pool(connection_string, options);
@@ -774,6 +1278,7 @@ bf_sql_close_connection (Var arglist, Byte next, void *vdata, Objid progr)
     {
         auto pool = handle->second.get();
 
+        close_cursors(handle_id);
         pool->stop();
         connection_pools.erase(handle);
 
@@ -817,6 +1322,17 @@ bf_sql_info(Var arglist, Byte next, void *vdata, Objid progr)
     ret = mapinsert(ret, str_dup_to_var("sanitize_strings"), Var::new_int(pool->options & SQL_SANITIZE_STRINGS ? 1 : 0));
     ret = mapinsert(ret, str_dup_to_var("pool_size"), Var::new_int(pool->size()));
 
+    int cursors = 0;
+    for (auto const& item: open_cursors)
+        if (item.second->handle_id == handle_id)
+            cursors++;
+    ret = mapinsert(ret, str_dup_to_var("cursors"), Var::new_int(cursors));
+
+    uint64_t prepared, reused;
+    pool->statement_stats(&prepared, &reused);
+    ret = mapinsert(ret, str_dup_to_var("statements_prepared"), Var::new_int(prepared));
+    ret = mapinsert(ret, str_dup_to_var("statements_reused"), Var::new_int(reused));
+
     return make_var_pack(ret);
 }
 
@@ -835,6 +1351,10 @@ void register_sql(void)
     register_function("sql_open", 1, 1, bf_sql_open_connection, TYPE_STR, TYPE_INT, TYPE_INT);
     register_function("sql_close", 1, 1, bf_sql_close_connection, TYPE_INT, TYPE_ANY);
     register_function("sql_info", 1, 1, bf_sql_info, TYPE_INT, TYPE_ANY);
+    register_function("sql_cursor_open", 2, 3, bf_sql_cursor_open, TYPE_INT, TYPE_STR, TYPE_LIST);
+    register_function("sql_cursor_fetch", 2, 2, bf_sql_cursor_fetch, TYPE_INT, TYPE_INT);
+    register_function("sql_cursor_close", 1, 1, bf_sql_cursor_close, TYPE_INT);
+    register_function("sql_transaction", 2, 2, bf_sql_transaction, TYPE_INT, TYPE_LIST);
 }
 
 #else /* SQL_FOUND */
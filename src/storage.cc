@@ -15,8 +15,12 @@
     Pavel@Xerox.Com
  *****************************************************************************/
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
 
 #include "config.h"
 #include "list.h"
@@ -37,6 +41,12 @@ refcount_overhead(Memory_Type type)
     switch (type) {
         /* deal with systems with picky alignment issues */
         case M_LIST:
+            /* The elements follow the header, so keep them aligned for
+             * Var even when the header is an odd number of words.
+             */
+            total = (sizeof(list_metadata) + alignof(Var) - 1)
+                    / alignof(Var) * alignof(Var);
+            break;
         case M_TREE:
         case M_TRAV:
         case M_ANON:
@@ -51,6 +61,363 @@ refcount_overhead(Memory_Type type)
     return total;
 }
 
+#ifdef USE_SLAB_ALLOCATOR
+/* Size-class slab allocator.
+ *
+ * Small allocations are carved out of SLAB_CHUNK_SIZE chunks into blocks of
+ * a handful of fixed sizes.  Every Memory_Type gets its own set of size
+ * classes, so a burst of strings can't fragment the pages holding list
+ * and map nodes (and so the statistics are meaningful per type).
+ *
+ * Freed blocks go onto a per-thread free list.  When a thread's list for a
+ * class grows too long, a batch of blocks is handed to a mutex-protected
+ * depot that any thread can refill from.  This keeps the main thread lock-free
+ * in the common case while still allowing values allocated by background
+ * threads to be freed on the main thread (and vice versa).
+ *
+ * Chunks are never returned to the system.  Allocations larger than the
+ * largest size class go straight to malloc().
+ *
+ * Every block carries a header in front of the refcount slot (if any)
+ * recording the requested size and the size class, since myfree() and
+ * myrealloc() are not told the size of the allocation.  The header is
+ * padded to the alignment malloc() guarantees, so that what follows it is
+ * aligned just as well.
+ */
+
+#define SLAB_CHUNK_SIZE     65536
+#define SLAB_CACHE_LIMIT    256     /* max blocks on a thread's free list */
+#define SLAB_BATCH          128     /* blocks moved to/from the depot at once */
+#define SLAB_LARGE          0xffffffff
+
+static constexpr unsigned slab_class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+#define SLAB_CLASSES        Arraysize(slab_class_sizes)
+#define SLAB_MAX_BLOCK      512
+
+typedef struct alignas(std::max_align_t) slab_header {
+    uint32_t size;          /* bytes requested, including refcount overhead */
+    uint32_t size_class;    /* index into slab_class_sizes or SLAB_LARGE */
+} slab_header;
+
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block;
+
+typedef struct slab_free_list {
+    slab_block *head;
+    unsigned count;
+} slab_free_list;
+
+typedef struct slab_depot {
+    std::mutex lock;
+    slab_free_list blocks;
+} slab_depot;
+
+typedef struct slab_class_stats {
+    std::atomic<uint64_t> blocks;       /* blocks carved out of chunks */
+    std::atomic<uint64_t> in_use;       /* blocks handed out and not freed */
+    std::atomic<uint64_t> requested;    /* bytes requested by blocks in use */
+    std::atomic<uint64_t> hits;         /* allocations served from a free list */
+    std::atomic<uint64_t> misses;       /* allocations that needed a new chunk */
+} slab_class_stats;
+
+typedef struct slab_large_stats {
+    std::atomic<uint64_t> allocations;
+    std::atomic<uint64_t> in_use;
+    std::atomic<uint64_t> requested;
+} slab_large_stats;
+
+static slab_depot slab_depots[Sizeof_Memory_Type][SLAB_CLASSES];
+static slab_class_stats slab_stats_table[Sizeof_Memory_Type][SLAB_CLASSES];
+static slab_large_stats slab_large_table[Sizeof_Memory_Type];
+
+/* Maps (size + 15) / 16 to the smallest class that can hold `size' bytes. */
+struct slab_class_table {
+    unsigned char index[SLAB_MAX_BLOCK / 16 + 1];
+
+    constexpr slab_class_table() : index() {
+        unsigned c = 0;
+        for (unsigned i = 0; i <= SLAB_MAX_BLOCK / 16; i++) {
+            while (slab_class_sizes[c] < i * 16)
+                c++;
+            index[i] = c;
+        }
+    }
+};
+
+static constexpr slab_class_table slab_class_index;
+
+static void slab_release(slab_free_list *list, Memory_Type type, unsigned cls, unsigned count);
+
+struct slab_thread_cache {
+    slab_free_list lists[Sizeof_Memory_Type][SLAB_CLASSES];
+
+    ~slab_thread_cache() {
+        /* Hand everything back so other threads can reuse it. */
+        for (int t = 0; t < Sizeof_Memory_Type; t++)
+            for (unsigned c = 0; c < SLAB_CLASSES; c++)
+                if (lists[t][c].count)
+                    slab_release(&lists[t][c], (Memory_Type)t, c, lists[t][c].count);
+    }
+};
+
+static thread_local slab_thread_cache slab_cache;
+
+static inline unsigned
+slab_block_size(unsigned cls)
+{
+    return sizeof(slab_header) + slab_class_sizes[cls];
+}
+
+/* Move `count' blocks from the front of `list' to the shared depot. */
+static void
+slab_release(slab_free_list *list, Memory_Type type, unsigned cls, unsigned count)
+{
+    slab_block *first = list->head, *last = first;
+    unsigned n;
+
+    for (n = 1; n < count; n++)
+        last = last->next;
+
+    list->head = last->next;
+    list->count -= count;
+
+    slab_depot *depot = &slab_depots[type][cls];
+    std::lock_guard<std::mutex> guard(depot->lock);
+    last->next = depot->blocks.head;
+    depot->blocks.head = first;
+    depot->blocks.count += count;
+}
+
+/* Refill an empty thread free list, first from the depot and then, if that
+ * is empty too, by carving up a fresh chunk.  Returns true if a new chunk
+ * was needed.
+ */
+static bool
+slab_refill(slab_free_list *list, Memory_Type type, unsigned cls)
+{
+    slab_depot *depot = &slab_depots[type][cls];
+
+    {
+        std::lock_guard<std::mutex> guard(depot->lock);
+        if (depot->blocks.count) {
+            unsigned n, count = depot->blocks.count < SLAB_BATCH ? depot->blocks.count : SLAB_BATCH;
+            slab_block *first = depot->blocks.head, *last = first;
+
+            for (n = 1; n < count; n++)
+                last = last->next;
+
+            depot->blocks.head = last->next;
+            depot->blocks.count -= count;
+            last->next = nullptr;
+            list->head = first;
+            list->count = count;
+            return false;
+        }
+    }
+
+    char *chunk = (char *) malloc(SLAB_CHUNK_SIZE);
+    if (!chunk)
+        panic_moo("slab chunk allocation failed!");
+
+    unsigned block_size = slab_block_size(cls);
+    unsigned n, count = SLAB_CHUNK_SIZE / block_size;
+    slab_block *head = nullptr;
+
+    for (n = count; n > 0; n--) {
+        slab_block *b = (slab_block *)(chunk + (n - 1) * block_size);
+        b->next = head;
+        head = b;
+    }
+
+    list->head = head;
+    list->count = count;
+
+    slab_stats_table[type][cls].blocks.fetch_add(count, std::memory_order_relaxed);
+
+    return true;
+}
+
+/* Returns a pointer just past the slab header of a block of at least
+ * `size' bytes.
+ */
+static char *
+slab_alloc(unsigned size, Memory_Type type)
+{
+    slab_header *h;
+
+    if (size > SLAB_MAX_BLOCK) {
+        h = (slab_header *) malloc(sizeof(slab_header) + size);
+        if (!h)
+            return nullptr;
+        h->size_class = SLAB_LARGE;
+        slab_large_table[type].allocations.fetch_add(1, std::memory_order_relaxed);
+        slab_large_table[type].in_use.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        unsigned cls = slab_class_index.index[(size + 15) >> 4];
+        slab_free_list *list = &slab_cache.lists[type][cls];
+        slab_class_stats *stats = &slab_stats_table[type][cls];
+
+        if (!list->head && slab_refill(list, type, cls))
+            stats->misses.fetch_add(1, std::memory_order_relaxed);
+        else
+            stats->hits.fetch_add(1, std::memory_order_relaxed);
+
+        slab_block *b = list->head;
+        list->head = b->next;
+        list->count--;
+
+        h = (slab_header *) b;
+        h->size_class = cls;
+        stats->in_use.fetch_add(1, std::memory_order_relaxed);
+        stats->requested.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    h->size = size;
+    return (char *)(h + 1);
+}
+
+static void
+slab_free(char *ptr, Memory_Type type)
+{
+    slab_header *h = ((slab_header *) ptr) - 1;
+
+    if (h->size_class == SLAB_LARGE) {
+        slab_large_table[type].in_use.fetch_sub(1, std::memory_order_relaxed);
+        free(h);
+        return;
+    }
+
+    unsigned cls = h->size_class;
+    slab_free_list *list = &slab_cache.lists[type][cls];
+    slab_block *b = (slab_block *) h;
+
+    slab_stats_table[type][cls].in_use.fetch_sub(1, std::memory_order_relaxed);
+    slab_stats_table[type][cls].requested.fetch_sub(h->size, std::memory_order_relaxed);
+
+    b->next = list->head;
+    list->head = b;
+    if (++list->count > SLAB_CACHE_LIMIT)
+        slab_release(list, type, cls, SLAB_BATCH);
+}
+
+static char *
+slab_realloc(char *ptr, unsigned size, Memory_Type type)
+{
+    slab_header *h = ((slab_header *) ptr) - 1;
+
+    if (h->size_class == SLAB_LARGE && size > SLAB_MAX_BLOCK) {
+        h = (slab_header *) realloc(h, sizeof(slab_header) + size);
+        if (!h)
+            return nullptr;
+        h->size = size;
+        return (char *)(h + 1);
+    }
+
+    if (h->size_class != SLAB_LARGE && size <= slab_class_sizes[h->size_class]) {
+        slab_class_stats *stats = &slab_stats_table[type][h->size_class];
+        stats->requested.fetch_add(size - h->size, std::memory_order_relaxed);
+        h->size = size;
+        return ptr;
+    }
+
+    char *r = slab_alloc(size, type);
+    if (!r)
+        return nullptr;
+    memcpy(r, ptr, h->size < size ? h->size : size);
+    slab_free(ptr, type);
+    return r;
+}
+
+static const char *memory_type_names[] = {
+    "ast_pool", "ast", "program", "pval", "network", "string", "verbdef",
+    "list", "prep", "propdef", "object_table", "object", "float", "int",
+    "stream", "names", "env", "task", "pattern", "inputtoken",
+
+    "bytecodes", "fork_vectors", "lit_list",
+    "prototype", "code_gen", "disassemble", "decompile",
+
+    "rt_stack", "rt_env", "bi_func_data", "vm",
+
+    "ref_entry", "ref_table", "vc_entry", "vc_table", "string_ptrs",
+    "intern_pointer", "intern_entry", "intern_hunk",
+
+    "tree", "node", "trav",
+
+    "anon",
+
+    "waif", "waif_xtra",
+
+    "struct", "array",
+
+    "xml_data",
+};
+
+static_assert(Arraysize(memory_type_names) == Sizeof_Memory_Type,
+              "memory_type_names is out of sync with Memory_Type");
+
+/* Returns a list with one row per (type, size class) that has ever been
+ * used.  Each row is:
+ *   {type, block size, blocks, blocks in use, occupancy, fragmentation, hits, misses}
+ * Occupancy is the fraction of carved blocks currently handed out;
+ * fragmentation is the fraction of in-use block bytes that were not
+ * requested.  Allocations too large for a slab are reported with a
+ * block size of 0, in which case `blocks' is the number of allocations.
+ */
+Var
+slab_stats(void)
+{
+    Var r = new_list(0);
+
+    for (int t = 0; t < Sizeof_Memory_Type; t++) {
+        for (unsigned c = 0; c < SLAB_CLASSES; c++) {
+            slab_class_stats *stats = &slab_stats_table[t][c];
+            uint64_t blocks = stats->blocks.load(std::memory_order_relaxed);
+            if (blocks == 0)
+                continue;
+
+            uint64_t in_use = stats->in_use.load(std::memory_order_relaxed);
+            uint64_t requested = stats->requested.load(std::memory_order_relaxed);
+            uint64_t used_bytes = in_use * slab_class_sizes[c];
+
+            Var row = new_list(8);
+            row.v.list[1] = str_dup_to_var(memory_type_names[t]);
+            row.v.list[2] = Var::new_int(slab_class_sizes[c]);
+            row.v.list[3] = Var::new_int(blocks);
+            row.v.list[4] = Var::new_int(in_use);
+            row.v.list[5] = Var::new_float((double) in_use / blocks);
+            row.v.list[6] = Var::new_float(used_bytes ? 1.0 - (double) requested / used_bytes : 0.0);
+            row.v.list[7] = Var::new_int(stats->hits.load(std::memory_order_relaxed));
+            row.v.list[8] = Var::new_int(stats->misses.load(std::memory_order_relaxed));
+            r = listappend(r, row);
+        }
+
+        slab_large_stats *large = &slab_large_table[t];
+        uint64_t allocations = large->allocations.load(std::memory_order_relaxed);
+        if (allocations) {
+            Var row = new_list(8);
+            row.v.list[1] = str_dup_to_var(memory_type_names[t]);
+            row.v.list[2] = Var::new_int(0);
+            row.v.list[3] = Var::new_int(allocations);
+            row.v.list[4] = Var::new_int(large->in_use.load(std::memory_order_relaxed));
+            row.v.list[5] = Var::new_float(0.0);
+            row.v.list[6] = Var::new_float(0.0);
+            row.v.list[7] = Var::new_int(0);
+            row.v.list[8] = Var::new_int(allocations);
+            r = listappend(r, row);
+        }
+    }
+
+    return r;
+}
+
+#endif /* USE_SLAB_ALLOCATOR */
+
+std::atomic<uint64_t> allocation_count(0);
+
 void *
 mymalloc(unsigned size, Memory_Type type)
 {
@@ -61,8 +428,13 @@ mymalloc(unsigned size, Memory_Type type)
     if (size == 0)      /* For queasy systems */
         size = 1;
 
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
     offs = refcount_overhead(type);
+#ifdef USE_SLAB_ALLOCATOR
+    memptr = slab_alloc(offs + size, type);
+#else
     memptr = (char *) malloc(offs + size);
+#endif
     if (!memptr) {
         sprintf(msg, "memory allocation (size %u) failed!", size);
         panic_moo(msg);
@@ -113,6 +485,7 @@ str_dup(const char *s)
         if (!emptystring) {
             emptystring = (char *) mymalloc(1, M_STRING);
             *emptystring = '\0';
+            pin(emptystring);
         }
         addref(emptystring);
         return emptystring;
@@ -123,13 +496,60 @@ str_dup(const char *s)
     return r;
 }
 
+/* One-character strings are produced constantly (string indexing,
+ * explode(), substr(), tostr() of a digit...) and allocating a fresh
+ * block for each of them dominates string-heavy command parsing.  Hand
+ * out references to a shared table instead.  The entries are pinned, so
+ * they are never passed to myfree().  As with the shared empty string
+ * from str_dup(), callers must not modify the result.
+ */
+typedef struct char_string {
+    var_metadata metadata;
+    char s[2];
+} char_string;
+
+static char_string *
+make_char_strings(void)
+{
+    static char_string table[256];
+
+    static_assert(offsetof(char_string, s) == sizeof(var_metadata),
+                  "char_string must match the mymalloc() string layout");
+
+    for (int c = 0; c < 256; c++) {
+        table[c].metadata.refcount = PINNED_REFCOUNT;
+#ifdef MEMO_SIZE
+        table[c].metadata.size = (c != 0);
+#endif
+        table[c].s[0] = c;
+        table[c].s[1] = '\0';
+    }
+    return table;
+}
+
+const char *
+str_char_ref(unsigned char c)
+{
+    static char_string *char_strings = make_char_strings();
+
+    if (c == '\0')
+        return str_dup("");
+
+    addref(char_strings[c].s);
+    return char_strings[c].s;
+}
+
 void *
 myrealloc(void *ptr, unsigned size, Memory_Type type)
 {
     int offs = refcount_overhead(type);
     static char msg[100];
 
+#ifdef USE_SLAB_ALLOCATOR
+    ptr = slab_realloc((char *) ptr - offs, size + offs, type);
+#else
     ptr = realloc((char *) ptr - offs, size + offs);
+#endif
     if (!ptr) {
         sprintf(msg, "memory re-allocation (size %u) failed!", size);
         panic_moo(msg);
@@ -141,5 +561,9 @@ myrealloc(void *ptr, unsigned size, Memory_Type type)
 void
 myfree(void *ptr, Memory_Type type)
 {
+#ifdef USE_SLAB_ALLOCATOR
+    slab_free((char *) ptr - refcount_overhead(type), type);
+#else
     free((char *) ptr - refcount_overhead(type));
+#endif
 }
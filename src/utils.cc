@@ -344,6 +344,43 @@ complex_var_dup(Var v)
     return v;
 }
 
+static int
+deep_copy_pair(Var key, Var value, void *data, int first)
+{
+    Var *map = (Var *)data;
+
+    *map = mapinsert(*map, var_deep_copy(key), var_deep_copy(value));
+
+    return 0;
+}
+
+Var
+var_deep_copy(Var v)
+{   /* does NOT consume `v' */
+    int i, n;
+    Var r;
+
+    switch (v.type) {
+        case TYPE_STR:
+            return str_dup_to_var(v.v.str);
+        case TYPE_LIST:
+            n = v.v.list[0].v.num;
+            r = new_list(n);
+            for (i = 1; i <= n; i++)
+                r.v.list[i] = var_deep_copy(v.v.list[i]);
+            return r;
+        case TYPE_MAP:
+            r = new_map();
+            mapforeach(v, deep_copy_pair, &r);
+            return r;
+        default:
+            /* Waifs, anonymous objects and iterators are shared, not copied;
+             * background_thread() keeps them off other threads.
+             */
+            return var_ref(v);
+    }
+}
+
 /* could be inlined and use complex_etc like the others, but this should
  * usually be called in a context where we already know the type.
  */
@@ -850,6 +850,9 @@ waif_put_prop(Waif *w, const char *name, Var val, Objid progr)
             return E_RECMOVE;
     }
 
+    /* A WAIF's properties aren't part of any object's record. */
+    db_note_unlogged_change();
+
     if (dest) {
         /* This is the easy case, there's already a slot for it.
          * Just fill it in.
@@ -0,0 +1,52 @@
+# Measures how fast the interpreter gets through a few loops of common
+# opcodes.  Run it against servers built with and without
+# THREADED_DISPATCH (see options.h) to compare the two dispatch modes:
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_dispatch.rb
+#
+# Each workload runs in samples small enough to stay well under the
+# foreground tick limit; only the time spent inside the loops counts.
+
+require 'moo_support'
+
+class BenchDispatch
+  include MooSupport
+
+  SAMPLES = 50
+  ITERATIONS = 2000
+
+  WORKLOADS = {
+    'arithmetic'   => 'x = 0; for i in [1..N] x = x + i * 2 - 1; endfor',
+    'comparisons'  => 'x = 0; for i in [1..N] if (i > 5 && i != 7) x = x + 1; endif endfor',
+    'list indexing' => 'l = {1, 2, 3, 4, 5}; x = 0; for i in [1..N] x = x + l[i % 5 + 1]; endfor',
+    'while loop'   => 'i = 0; while (i < N) i = i + 1; endwhile',
+    'string ops'   => 's = ""; for i in [1..N] s = "abc" + tostr(i)[1]; endfor',
+  }
+
+  def measure(code)
+    body = code.gsub('N', ITERATIONS.to_s)
+    ticks = 0
+    seconds = 0.0
+    SAMPLES.times do
+      t, s = simplify(command(%Q|; n = ticks_left(); t = ftime(1); #{body}; t = ftime(1) - t; return {n - ticks_left(), t};|))
+      ticks += t
+      seconds += s
+    end
+    [ticks, seconds]
+  end
+
+  def run
+    run_test_as('wizard') do
+      threaded = simplify(command(%Q|; for o in (server_version("options")) if (o[1] == "THREADED_DISPATCH") return o[2] != #-1; endif endfor return 0;|))
+      puts "Dispatch: #{threaded == 1 ? 'threaded' : 'switch'}"
+      puts '%-14s %16s %16s' % ['workload', 'iterations/sec', 'ticks/sec']
+      WORKLOADS.each do |name, code|
+        ticks, seconds = measure(code)
+        iterations = SAMPLES * ITERATIONS
+        puts '%-14s %16.0f %16.0f' % [name, iterations / seconds, ticks / seconds]
+      end
+    end
+  end
+end
+
+BenchDispatch.new.run
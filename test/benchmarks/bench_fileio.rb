@@ -0,0 +1,61 @@
+# Compares file_grep() on a 100 MB text file opened normally ("r-tn"),
+# which reads it a line at a time through stdio, against the same file
+# opened memory-mapped ("r-tm"):
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_fileio.rb
+#
+# The file is written to files/ in the current directory, which has to be
+# the server's working directory.  A few lines in each million contain
+# the pattern; the rest have to be read and rejected.
+
+require 'moo_support'
+
+class BenchFileio
+  include MooSupport
+
+  SAMPLES = 5
+  FILE = 'bench_fileio.tmp'
+  SIZE = 100 * 1024 * 1024
+  PATTERN = 'needle'
+
+  def write_file
+    line = 0
+    File.open(File.join('files', FILE), 'w') do |f|
+      while f.pos < SIZE
+        line += 1
+        f.puts "#{line} the quick brown fox jumps over the lazy dog#{line % 250000 == 0 ? ' NEEDLE' : ''}"
+      end
+    end
+  end
+
+  def measure(mode)
+    seconds = 0.0
+    matches = nil
+    SAMPLES.times do
+      r = simplify(command(%Q|; fh = file_open("#{FILE}", "#{mode}"); t = ftime(1); m = file_grep(fh, "#{PATTERN}", 1); t = ftime(1) - t; file_close(fh); return {t, length(m)};|))
+      seconds += r[0]
+      matches = r[1]
+    end
+    [seconds / SAMPLES, matches]
+  end
+
+  def run
+    write_file
+    run_test_as('wizard') do
+      if simplify(command(%Q|; return file_size("#{FILE}");|)) != File.size(File.join('files', FILE))
+        puts "The server isn't running in #{Dir.pwd}."
+        return
+      end
+
+      puts '%-8s %10s %8s %8s' % ['mode', 'seconds', 'MB/sec', 'matches']
+      ['r-tn', 'r-tm'].each do |mode|
+        seconds, matches = measure(mode)
+        puts '%-8s %10.3f %8.0f %8d' % [mode, seconds, SIZE / seconds / 1024 / 1024, matches]
+      end
+    end
+  ensure
+    File.delete(File.join('files', FILE)) if File.exist?(File.join('files', FILE))
+  end
+end
+
+BenchFileio.new.run
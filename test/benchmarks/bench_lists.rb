@@ -0,0 +1,54 @@
+# Measures how fast lists can be built up and torn down one element at
+# a time.  Each workload runs at two sizes; if the cost of an operation
+# grows with the length of the list, the larger size gets through far
+# fewer elements per second:
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_lists.rb
+#
+# Each workload runs in samples small enough to stay well under the
+# foreground tick limit; only the time spent inside the loops counts.
+
+require 'moo_support'
+
+class BenchLists
+  include MooSupport
+
+  SAMPLES = 10
+  SIZES = [1000, 4000]
+
+  # Setup code that runs before the clock starts, and the timed loop.
+  BUILD = 'l = {}; for i in [1..N] l = {@l, 0}; endfor'
+
+  WORKLOADS = {
+    'splice append' => ['', 'l = {}; for i in [1..N] l = {@l, i}; endfor'],
+    'listappend'    => ['', 'l = {}; for i in [1..N] l = listappend(l, i); endfor'],
+    'splice concat' => ['c = {1}', 'l = {}; for i in [1..N] l = {@l, @c}; endfor'],
+    'range set'     => ['', 'l = {}; for i in [1..N] l[$ + 1..$] = {i}; endfor'],
+    'insert head'   => ['', 'l = {}; for i in [1..N] l = listinsert(l, i); endfor'],
+    'delete tail'   => [BUILD, 'for i in [1..N] l = listdelete(l, length(l)); endfor'],
+    'delete head'   => [BUILD, 'for i in [1..N] l = listdelete(l, 1); endfor'],
+    'range delete'  => [BUILD, 'for i in [1..N] l[$..$] = {}; endfor'],
+  }
+
+  def measure(setup, loop, n)
+    setup = setup.gsub('N', n.to_s)
+    loop = loop.gsub('N', n.to_s)
+    seconds = 0.0
+    SAMPLES.times do
+      seconds += simplify(command(%Q|; #{setup}; t = ftime(1); #{loop}; return ftime(1) - t;|))
+    end
+    seconds
+  end
+
+  def run
+    run_test_as('wizard') do
+      puts '%-14s %s' % ['workload', SIZES.map { |n| '%18s' % "elements/sec @#{n}" }.join]
+      WORKLOADS.each do |name, code|
+        rates = SIZES.map { |n| SAMPLES * n / measure(*code, n) }
+        puts '%-14s %s' % [name, rates.map { |r| '%18.0f' % r }.join]
+      end
+    end
+  end
+end
+
+BenchLists.new.run
@@ -0,0 +1,54 @@
+# Measures how fast maps can be built up, searched and torn down.  Each
+# workload runs at two sizes; if the cost of an operation grows with the
+# size of the map, the larger size gets through fewer entries per second:
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_maps.rb
+#
+# Each workload runs in samples small enough to stay well under the
+# foreground tick limit; only the time spent inside the loops counts.
+
+require 'moo_support'
+
+class BenchMaps
+  include MooSupport
+
+  SAMPLES = 10
+  SIZES = [1000, 4000]
+
+  # Setup code that runs before the clock starts, and the timed loop.
+  BUILD = 'm = []; for i in [1..N] m[i] = i; endfor'
+  BUILD_STRINGS = 'm = []; for i in [1..N] m[tostr("key", i)] = i; endfor'
+
+  WORKLOADS = {
+    'insert'         => ['', 'm = []; for i in [1..N] m[i] = i; endfor'],
+    'insert reverse' => ['', 'm = []; for i in [1..N] m[N + 1 - i] = i; endfor'],
+    'insert strings' => ['', 'm = []; for i in [1..N] m[tostr("key", i)] = i; endfor'],
+    'lookup'         => [BUILD, 'for i in [1..N] x = m[i]; endfor'],
+    'lookup strings' => [BUILD_STRINGS, 'for i in [1..N] x = m[tostr("KEY", i)]; endfor'],
+    'maphaskey'      => [BUILD, 'for i in [1..N] x = maphaskey(m, i); endfor'],
+    'delete'         => [BUILD, 'for i in [1..N] m = mapdelete(m, i); endfor'],
+    'iterate'        => [BUILD, 'for v, k in (m) endfor'],
+  }
+
+  def measure(setup, loop, n)
+    setup = setup.gsub('N', n.to_s)
+    loop = loop.gsub('N', n.to_s)
+    seconds = 0.0
+    SAMPLES.times do
+      seconds += simplify(command(%Q|; #{setup}; t = ftime(1); #{loop}; return ftime(1) - t;|))
+    end
+    seconds
+  end
+
+  def run
+    run_test_as('wizard') do
+      puts '%-14s %s' % ['workload', SIZES.map { |n| '%18s' % "entries/sec @#{n}" }.join]
+      WORKLOADS.each do |name, code|
+        rates = SIZES.map { |n| SAMPLES * n / measure(*code, n) }
+        puts '%-14s %s' % [name, rates.map { |r| '%18.0f' % r }.join]
+      end
+    end
+  end
+end
+
+BenchMaps.new.run
@@ -0,0 +1,73 @@
+# Runs the stress tests from tests/test_stress_objects.rb, followed by a
+# few loops that do little but copy and free values.  Run it against
+# servers built with and without NONATOMIC_REFCOUNTS (see options.h) to
+# compare the two reference counting modes:
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_refcounts.rb
+#
+# The stress tests are timed from here, so they include the time spent
+# talking to the server; the loops only count time spent inside them.
+
+require 'test/unit'
+require 'test/unit/testresult'
+
+Test::Unit::AutoRunner.need_auto_run = false
+
+require_relative '../tests/test_stress_objects'
+
+class BenchRefcounts
+  include MooSupport
+
+  ROUNDS = 3
+  SAMPLES = 20
+  ITERATIONS = 2000
+
+  STRESS_TESTS = TestStressObjects.public_instance_methods.grep(/^test_.*stress_tests/).sort
+
+  WORKLOADS = {
+    'list copies'   => 'l = {1, "two", {3}}; for i in [1..N] m = l; n = {@m, i}; endfor',
+    'string copies' => 's = "abc"; for i in [1..N] t = s; u = {t, t, t}; endfor',
+    'map copies'    => 'm = ["a" -> 1, "b" -> {2}]; for i in [1..N] n = m; o = n["b"]; endfor',
+  }
+
+  def stress
+    result = Test::Unit::TestResult.new
+    started = Time.now
+    ROUNDS.times do
+      STRESS_TESTS.each do |name|
+        TestStressObjects.new(name.to_s).run(result) {}
+      end
+    end
+    [Time.now - started, result]
+  end
+
+  def measure(code)
+    body = code.gsub('N', ITERATIONS.to_s)
+    seconds = 0.0
+    SAMPLES.times do
+      seconds += simplify(command(%Q|; t = ftime(1); #{body}; return ftime(1) - t;|))
+    end
+    seconds
+  end
+
+  def run
+    nonatomic = nil
+    run_test_as('wizard') do
+      nonatomic = simplify(command(%Q|; for o in (server_version("options")) if (o[1] == "NONATOMIC_REFCOUNTS") return o[2] != #-1; endif endfor return 0;|))
+    end
+    puts "Reference counts: #{nonatomic == 1 ? 'non-atomic' : 'atomic'}"
+
+    seconds, result = stress
+    puts '%-14s %10.3f sec for %d rounds of %d tests (%d failures, %d errors)' %
+         ['stress tests', seconds, ROUNDS, STRESS_TESTS.length, result.failure_count, result.error_count]
+
+    run_test_as('wizard') do
+      WORKLOADS.each do |name, code|
+        iterations = SAMPLES * ITERATIONS
+        puts '%-14s %10.0f iterations/sec' % [name, iterations / measure(code)]
+      end
+    end
+  end
+end
+
+BenchRefcounts.new.run
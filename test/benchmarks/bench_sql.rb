@@ -0,0 +1,52 @@
+# Compares inserting rows into an SQLite database with one sql_query()
+# call per row, each committed on its own, against sql_transaction()
+# calls of several batch sizes:
+#
+#   ruby -r rubygems -Itests/lib benchmarks/bench_sql.rb
+#
+# The database is a file in the server's working directory, since most
+# of what a transaction saves is the sync after each commit.  Building
+# the list of statements doesn't count.
+
+require 'moo_support'
+
+class BenchSql
+  include MooSupport
+
+  DATABASE = 'bench_sql.db'
+  ROWS = 1000
+  BATCHES = [10, 100, 1000]
+
+  def measure(code)
+    simplify(command(%Q|; #{code}|))
+  end
+
+  def run
+    run_test_as('wizard') do
+      if simplify(command(%Q|; return `function_info("sql_transaction") ! ANY => 0' != 0;|)) != 1
+        puts 'The server was built without SQL support.'
+        return
+      end
+
+      handle = simplify(command(%Q|; return sql_open("sqlite://#{DATABASE}");|))
+      command(%Q|; sql_query(#{handle}, "DROP TABLE IF EXISTS bench");|)
+      command(%Q|; sql_query(#{handle}, "CREATE TABLE bench (a INTEGER, b TEXT)");|)
+
+      puts '%-24s %s' % ['method', 'rows/sec']
+
+      seconds = measure(%Q|t = ftime(1); for i in [1..#{ROWS}] sql_query(#{handle}, "INSERT INTO bench VALUES (?, ?)", {i, tostr("row ", i)}); endfor; return ftime(1) - t;|)
+      puts '%-24s %8.0f' % ['sql_query', ROWS / seconds]
+
+      BATCHES.each do |batch|
+        seconds = measure(%Q|t = 0.0; for j in [1..#{ROWS / batch}] s = {}; for i in [1..#{batch}] s = {@s, {"INSERT INTO bench VALUES (?, ?)", {i, tostr("row ", i)}}}; endfor; u = ftime(1); sql_transaction(#{handle}, s); t = t + ftime(1) - u; endfor; return t;|)
+        puts '%-24s %8.0f' % ["sql_transaction (#{batch})", ROWS / seconds]
+      end
+
+      command(%Q|; sql_close(#{handle});|)
+    end
+  ensure
+    File.delete(DATABASE) if File.exist?(DATABASE)
+  end
+end
+
+BenchSql.new.run
@@ -624,6 +624,10 @@ module MooSupport
     simplify command %|; return verb_cache_stats();|
   end
 
+  def property_cache_stats
+    simplify command %|; return property_cache_stats();|
+  end
+
   ## FileIO Operations
 
   def file_version
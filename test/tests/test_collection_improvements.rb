@@ -190,4 +190,53 @@ class TestCollectionImprovements < Test::Unit::TestCase
     end
   end
 
+
+  def test_that_lists_changed_in_place_are_not_shared
+    run_test_as('programmer') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'foobar'], ['this', 'none', 'this'])
+      set_verb_code(o, 'foobar') do |vc|
+        vc << 'x = {};'
+        vc << 'for i in [1..100]'
+        vc << 'x = {@x, i};'
+        vc << 'endfor'
+        vc << 'y = x;'
+        vc << 'x = listdelete(x, 1);'
+        vc << 'x = listinsert(x, "a", 50);'
+        vc << 'x = {@x, @{"b", "c"}};'
+        vc << 'x[2..98] = {"d"};'
+        vc << 'return {x, length(y), y[1], y[100]};'
+      end
+      assert_equal [[2, 'd', 99, 100, 'b', 'c'], 100, 1, 100], call(o, 'foobar')
+    end
+  end
+
+  def test_that_lists_can_be_built_up_and_torn_down_in_place
+    run_test_as('programmer') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'foobar'], ['this', 'none', 'this'])
+      set_verb_code(o, 'foobar') do |vc|
+        vc << 'x = {};'
+        vc << 'for i in [1..1000]'
+        vc << 'x = {@x, {i}};'
+        vc << 'endfor'
+        vc << 'x = listinsert(x, "first");'
+        vc << 'x[$ + 1..$] = {"last"};'
+        vc << 'for i in [1..990]'
+        vc << 'x = listdelete(x, 2);'
+        vc << 'endfor'
+        vc << 'x[3..4] = {};'
+        vc << 'x[2..1] = {"second"};'
+        vc << 'return x;'
+      end
+      assert_equal ['first', 'second', [991], [994], [995], [996], [997], [998], [999], [1000], 'last'], call(o, 'foobar')
+    end
+  end
+
+  def test_that_a_range_set_with_a_backward_range_repeats_elements
+    run_test_as('programmer') do
+      assert_equal [1, 2, 3, 4, 'x', 3, 4, 5, 6], simplify(command(%Q|; x = {1, 2, 3, 4, 5, 6}; x[5..2] = {"x"}; return x;|))
+    end
+  end
+
 end
@@ -0,0 +1,118 @@
+require 'test_helper'
+require 'socket'
+
+# Runs curl() against a small HTTP/1.1 server in this process, which
+# counts the connections it accepts.  `/sleep/N' answers after N seconds;
+# everything else answers at once with the request's path as the body.
+
+class TestCurl < Test::Unit::TestCase
+
+  class KeepAliveServer
+    attr_reader :port
+
+    def initialize
+      @server = TCPServer.new('127.0.0.1', 0)
+      @port = @server.addr[1]
+      @connections = 0
+      @mutex = Mutex.new
+      @thread = Thread.new do
+        loop do
+          client = @server.accept
+          @mutex.synchronize { @connections += 1 }
+          Thread.new(client) { |c| serve(c) }
+        end
+      end
+    end
+
+    def connections
+      @mutex.synchronize { @connections }
+    end
+
+    def serve(client)
+      while (line = client.gets)
+        path = line.split(' ')[1]
+        length = 0
+        while (header = client.gets) && header != "\r\n"
+          length = header.split(':')[1].to_i if header =~ /^content-length:/i
+        end
+        client.read(length) if length > 0
+        sleep($1.to_f) if path =~ %r{^/sleep/([\d.]+)}
+        client.write "HTTP/1.1 200 OK\r\nContent-Length: #{path.length}\r\nConnection: keep-alive\r\n\r\n#{path}"
+      end
+    rescue IOError, SystemCallError
+    ensure
+      client.close
+    end
+
+    def close
+      @thread.kill
+      @server.close
+    end
+  end
+
+  def setup
+    @http = KeepAliveServer.new
+  end
+
+  def teardown
+    @http.close
+  end
+
+  def url(path)
+    "http://127.0.0.1:#{@http.port}#{path}"
+  end
+
+  # Runs `code', which may suspend, and returns the list it returns.
+  def run_suspending(code)
+    send_string "; #{code}"
+    line = nil
+    while (true)
+      line = @sock.gets.chomp
+      break if line[0] == ?{
+    end
+    simplify(line)
+  end
+
+  def curl_available?
+    simplify(command(%Q|; return `function_info("curl") ! ANY => 0' != 0;|)) == 1
+  end
+
+  def test_that_curl_reuses_its_connection_without_threading
+    run_test_as('wizard') do
+      omit('the server was built without curl') unless curl_available?
+      r = run_suspending(%Q|set_thread_mode(0); r = {}; for i in [1..10]; x = curl("#{url('/plain')}"); r = {@r, x["status"], x["body"]}; endfor; return r;|)
+      assert_equal [200, '/plain'] * 10, r
+      assert_equal 1, @http.connections
+    end
+  end
+
+  def test_that_curl_reuses_its_connection_with_threading
+    run_test_as('wizard') do
+      omit('the server was built without curl') unless curl_available?
+      r = run_suspending(%Q|set_thread_mode(1); r = {}; for i in [1..10]; x = curl("#{url('/threaded')}"); r = {@r, x["status"], x["body"]}; endfor; return r;|)
+      assert_equal [200, '/threaded'] * 10, r
+      assert_equal 1, @http.connections
+    end
+  end
+
+  def test_that_threaded_curl_calls_run_concurrently
+    run_test_as('wizard') do
+      omit('the server was built without curl') unless curl_available?
+      o = create(:nothing)
+      add_property(o, 'bodies', [], [player, ''])
+      # More requests than there are background threads, each taking a second.
+      r = run_suspending(%Q|o = #{obj_ref(o)}; t = ftime(1); for i in [1..24]; fork (0); set_thread_mode(1); x = curl("#{url('/sleep/1')}"); o.bodies = {@o.bodies, x["body"]}; endfork; endfor; while (length(o.bodies) < 24); suspend(0); endwhile; return {ftime(1) - t, o.bodies};|)
+      assert r[0] < 5, "24 one-second requests took #{r[0]} seconds"
+      assert_equal ['/sleep/1'] * 24, r[1]
+    end
+  end
+
+  def test_that_a_killed_curl_task_is_not_resumed
+    run_test_as('wizard') do
+      omit('the server was built without curl') unless curl_available?
+      r = run_suspending(%Q|fork t (0); set_thread_mode(1); curl("#{url('/sleep/1')}"); endfork; suspend(0); waiting = length(queued_tasks()); kill_task(t); suspend(2); return {waiting, length(queued_tasks()), curl("#{url('/after')}")["body"]};|)
+      assert_equal [1, 0, '/after'], r
+    end
+  end
+
+end
@@ -124,6 +124,105 @@ class TestFileio < Test::Unit::TestCase
     end
   end
 
+  def test_that_readlines_reads_any_page_of_a_long_file
+    run_test_as('wizard') do
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      simplify(command(%Q|; for i in [1..1000] file_writeline(#{fh}, tostr("line ", i)); endfor; return 1;|))
+      file_close(fh)
+      fh = file_open('test_fileio.tmp', 'r-tn')
+      [[990, 1000], [1, 3], [64, 66], [500, 500], [129, 200], [998, 1005], [1001, 1001], [63, 65]].each do |first, last|
+        expected = (first..[last, 1000].min).map { |i| "line #{i}" }
+        assert_equal expected, file_readlines(fh, first, last)
+      end
+      assert_equal E_FILE, file_readlines(fh, 1002, 1002)
+      assert_equal 1000, simplify(command(%Q|; return file_count_lines(#{fh});|))
+      assert_equal ['line 700'], file_readlines(fh, 700, 700)
+      assert_equal 'line 700', file_readline(fh)
+      file_close(fh)
+      file_remove('test_fileio.tmp')
+    end
+  end
+
+  def test_that_readlines_sees_lines_written_through_the_same_handle
+    run_test_as('wizard') do
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      file_writeline(fh, 'one')
+      file_writeline(fh, 'two')
+      file_close(fh)
+      fh = file_open('test_fileio.tmp', 'r+tf')
+      assert_equal ['one', 'two'], file_readlines(fh, 1, 10)
+      assert_equal 2, simplify(command(%Q|; return file_count_lines(#{fh});|))
+      file_seek(fh, 0, 'SEEK_END')
+      file_writeline(fh, 'three')
+      assert_equal ['two', 'three'], file_readlines(fh, 2, 10)
+      assert_equal 3, simplify(command(%Q|; return file_count_lines(#{fh});|))
+      file_close(fh)
+      file_remove('test_fileio.tmp')
+    end
+  end
+
+  def test_that_a_mapped_file_can_be_searched_and_sliced
+    run_test_as('wizard') do
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      file_writeline(fh, 'one apple')
+      file_writeline(fh, 'two pears')
+      file_writeline(fh, 'three APPLES')
+      file_write(fh, 'four')
+      file_close(fh)
+      fh = file_open('test_fileio.tmp', 'r-tn')
+      plain = simplify(command(%Q|; return file_grep(#{fh}, "apple", 1);|))
+      file_close(fh)
+      fh = file_open('test_fileio.tmp', 'r-tm')
+      assert_equal 'r-tm', file_openmode(fh)
+      assert_equal plain, simplify(command(%Q|; return file_grep(#{fh}, "apple", 1);|))
+      assert_equal [['one apple', 1], ['three APPLES', 3]], plain
+      assert_equal [['one apple', 1]], simplify(command(%Q|; return file_grep(#{fh}, "APPLE");|))
+      assert_equal [['four', 4]], simplify(command(%Q|; return file_grep(#{fh}, "our", 1);|))
+      assert_equal [], simplify(command(%Q|; return file_grep(#{fh}, "banana", 1);|))
+      assert_equal 'two pears', simplify(command(%Q|; return file_slice(#{fh}, 11, 19);|))
+      assert_equal 'four', simplify(command(%Q|; return file_slice(#{fh}, 34, 37);|))
+      assert_equal '', simplify(command(%Q|; return file_slice(#{fh}, 38, 37);|))
+      assert_equal E_RANGE, simplify(command(%Q|; return `file_slice(#{fh}, 0, 3) ! ANY';|))
+      assert_equal E_RANGE, simplify(command(%Q|; return `file_slice(#{fh}, 30, 38) ! ANY';|))
+      assert_equal 'one apple', file_readline(fh)
+      assert_equal E_INVARG, file_writeline(fh, 'five')
+      file_close(fh)
+      fh = file_open('test_fileio.tmp', 'r-tn')
+      assert_equal E_INVARG, simplify(command(%Q|; return `file_slice(#{fh}, 1, 3) ! ANY';|))
+      file_close(fh)
+      assert_equal E_INVARG, file_open('test_fileio.tmp', 'r+tm')
+      assert_equal E_INVARG, file_open('test_fileio.tmp', 'w-tm')
+      file_remove('test_fileio.tmp')
+    end
+  end
+
+  def test_that_a_mapped_file_follows_truncation_and_appends
+    run_test_as('wizard') do
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      simplify(command(%Q|; for i in [1..2000] file_writeline(#{fh}, tostr("line ", i)); endfor; return 1;|))
+      file_close(fh)
+      mapped = file_open('test_fileio.tmp', 'r-tm')
+      assert_equal 2000, simplify(command(%Q|; return length(file_grep(#{mapped}, "line", 1));|))
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      file_writeline(fh, 'line 1')
+      file_writeline(fh, 'line 2')
+      file_close(fh)
+      assert_equal [['line 1', 1], ['line 2', 2]], simplify(command(%Q|; return file_grep(#{mapped}, "line", 1);|))
+      assert_equal E_RANGE, simplify(command(%Q|; return `file_slice(#{mapped}, 1, 100) ! ANY';|))
+      fh = file_open('test_fileio.tmp', 'a-tn')
+      file_writeline(fh, 'appended')
+      file_close(fh)
+      assert_equal [['appended', 3]], simplify(command(%Q|; return file_grep(#{mapped}, "append", 1);|))
+      assert_equal 'appended', simplify(command(%Q|; return file_slice(#{mapped}, 15, 22);|))
+      fh = file_open('test_fileio.tmp', 'w-tn')
+      file_close(fh)
+      assert_equal [], simplify(command(%Q|; return file_grep(#{mapped}, "line", 1);|))
+      assert_equal '', simplify(command(%Q|; return file_slice(#{mapped}, 1, 0);|))
+      file_close(mapped)
+      file_remove('test_fileio.tmp')
+    end
+  end
+
   def test_that_readlines_reads_blank_lines
     run_test_as('wizard') do
       fh = file_open('test_fileio.tmp', 'w-tn')
@@ -31,6 +31,55 @@ class TestMap < Test::Unit::TestCase
     end
   end
 
+  def test_that_a_map_stays_sorted_through_many_inserts_and_deletes
+    run_test_as('programmer') do
+      keys = (1..300).reject { |i| i % 3 == 0 }
+      assert_equal keys, simplify(command(%Q|; x = []; for i in [1..300]; x[301 - i] = i; endfor; for i in [1..100]; x = mapdelete(x, i * 3); endfor; return mapkeys(x);|))
+      assert_equal keys.map { |k| 301 - k }, simplify(command(%Q|; x = []; for i in [1..300]; x[301 - i] = i; endfor; for i in [1..100]; x = mapdelete(x, i * 3); endfor; r = {}; for v in (x); r = {@r, v}; endfor; return r;|))
+      assert_equal({4 => 297, 5 => 296, 7 => 294}, simplify(command(%Q|; x = []; for i in [1..300]; x[301 - i] = i; endfor; for i in [1..100]; x = mapdelete(x, i * 3); endfor; return x[4..7];|)))
+      assert_equal [300, 1], simplify(command(%Q|; x = []; for i in [1..300]; x[301 - i] = i; endfor; return {x[^], x[$]};|))
+    end
+  end
+
+  def test_that_keys_that_differ_only_in_case_are_the_same_key
+    run_test_as('programmer') do
+      assert_equal [1, 2, ['ABC'], 0, 1], simplify(command(%Q|; x = ["abc" -> 1]; x["ABC"] = 2; return {length(x), x["aBc"], mapkeys(x), maphaskey(x, "abc", 1), maphaskey(x, "ABC", 1)};|))
+      assert_equal({}, simplify(command(%Q|; return mapdelete(["Foo" -> 1], "fOO");|)))
+      assert_equal 1, simplify(command(%Q|; return ["a" -> 1, "B" -> 2] == ["b" -> 2, "A" -> 1];|))
+    end
+  end
+
+  def test_that_nested_updates_change_unshared_maps_and_lists_in_place
+    run_test_as('programmer') do
+      assert_equal [5, 6], simplify(command(%Q|; return {length(memory_usage()), length(memory_usage(1))};|))
+      assert_equal [0, {'a' => {'b' => 100}}], simplify(command(%Q|; m = ["a" -> ["b" -> 0]]; c = memory_usage(1)[6]["map_copies"]; for i in [1..100]; m["a"]["b"] = i; endfor; return {memory_usage(1)[6]["map_copies"] - c, m};|))
+      assert_equal [0, [[100]]], simplify(command(%Q|; l = {{0}}; c = memory_usage(1)[6]["list_copies"]; for i in [1..100]; l[1][1] = i; endfor; return {memory_usage(1)[6]["list_copies"] - c, l};|))
+      assert_equal [0, {'a' => [[1, 2, 100]]}], simplify(command(%Q|; m = ["a" -> {{1, 2, 0}}]; c = memory_usage(1)[6]; for i in [1..100]; m["a"][1][3] = i; endfor; d = memory_usage(1)[6]; return {d["map_copies"] + d["list_copies"] - c["map_copies"] - c["list_copies"], m};|))
+    end
+  end
+
+  def test_that_nested_updates_still_copy_shared_maps
+    run_test_as('programmer') do
+      assert_equal [{'a' => {'b' => 0}}, {'a' => {'b' => 1}}], simplify(command(%Q|; m = ["a" -> ["b" -> 0]]; n = m; n["a"]["b"] = 1; return {m, n};|))
+      assert_equal [{'b' => 0}, {'a' => {'b' => 1}}], simplify(command(%Q|; m = ["a" -> ["b" -> 0]]; x = m["a"]; m["a"]["b"] = 1; return {x, m};|))
+    end
+  end
+
+  def test_that_nested_updates_are_in_place_in_verbs_with_many_variables
+    run_test_as('programmer') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'update'], ['this', 'none', 'this'])
+      set_verb_code(o, 'update') do |vc|
+        vc << (1..40).map { |i| "v#{i} = #{i};" }.join(' ')
+        vc << 'm = ["a" -> ["b" -> 0]];'
+        vc << 'c = memory_usage(1)[6]["map_copies"];'
+        vc << 'for i in [1..100]; m["a"]["b"] = i; endfor'
+        vc << 'return {memory_usage(1)[6]["map_copies"] - c, m, v1 + v40};'
+      end
+      assert_equal [0, {'a' => {'b' => 100}}, 41], call(o, 'update')
+    end
+  end
+
   def test_that_mapdelete_deletes_an_entry
     run_test_as('programmer') do
       x = simplify(command(%Q|; return [E_NONE -> "No error", E_TYPE -> "Type mismatch", E_DIV -> "Division by zero", E_PERM -> "Permission denied"];|))
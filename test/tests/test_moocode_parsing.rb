@@ -293,4 +293,40 @@ class TestMoocodeParsing < Test::Unit::TestCase
     end
   end
 
+  def test_that_superinstructions_work
+    run_test_as('programmer') do
+      assert_equal 'foo', simplify(command('; x = {"foo", "bar"}; return x[1];'))
+      assert_equal 3, simplify(command('; x = ["a" -> 3]; return x["a"];'))
+      assert_equal 'foobar', simplify(command('; x = "foo"; return x + "bar";'))
+      assert_equal 6, simplify(command('; x = 1; return x + 5;'))
+      assert_equal 'Nothing', simplify(command('; x = #-1; return `x.name ! ANY => "Nothing"\';'))
+      assert_equal E_RANGE, simplify(command('; x = {}; return `x[1] ! ANY\';'))
+      assert_equal E_TYPE, simplify(command('; x = 1; return `x + "a" ! ANY\';'))
+      assert_equal E_VARNF, simplify(command('; return `y[1] ! ANY\';'))
+    end
+  end
+
+  def test_that_disassembling_superinstructions_works
+    run_test_as('programmer') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'super'], ['this', 'none', 'this'])
+      set_verb_code(o, 'super', ['return {this.name, args[1], args + {2}};'])
+      code = disassemble(o, 'super')
+      assert code.detect { |line| line =~ /VAR_GET_PROP this "name"/ }
+      assert code.detect { |line| line =~ /VAR_INDEX args 1/ }
+      assert code.detect { |line| line =~ /VAR_ADD args/ }
+    end
+  end
+
+  def test_that_decompiling_superinstructions_works
+    run_test_as('programmer') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'super'], ['this', 'none', 'this'])
+      set_verb_code(o, 'super', ['x = this.name + args[1];', 'return x + "!";'])
+      assert_equal ['x = this.name + args[1];', 'return x + "!";'], verb_code(o, 'super')
+      set(o, 'name', 'Foo')
+      assert_equal 'Foothing!', call(o, 'super', 'thing')
+    end
+  end
+
 end
@@ -0,0 +1,55 @@
+require 'test_helper'
+
+# Opens a lot of connections that never send anything, to check that the
+# server keeps serving the ones that do and notices when idle ones go away.
+
+class TestNetwork < Test::Unit::TestCase
+
+  IDLE = 200
+
+  def open_idle_connections
+    (1..IDLE).map { TCPSocket.open(options['host'], options['port']) }
+  end
+
+  def connection_count
+    simplify(command(%Q|; return length(connected_players(1));|))
+  end
+
+  # Waits up to five seconds for the number of connections to reach `count'.
+  def wait_for_connection_count(count)
+    50.times do
+      break if connection_count == count
+      sleep 0.1
+    end
+    connection_count
+  end
+
+  def test_that_idle_connections_do_not_hold_up_busy_ones
+    idle = nil
+    run_test_as('wizard') do
+      base = connection_count
+      idle = open_idle_connections
+      assert_equal base + IDLE, wait_for_connection_count(base + IDLE)
+
+      (1..100).each do |i|
+        assert_equal i * 2, simplify(command(%Q|; return #{i} * 2;|))
+      end
+
+      # One of them wakes up.
+      busy = @sock
+      @sock = idle.last
+      begin
+        send_string 'connect programmer'
+        assert_equal 42, simplify(command(%Q|; return 6 * 7;|))
+      ensure
+        @sock = busy
+      end
+
+      idle.first(IDLE / 2).each(&:close)
+      assert_equal base + IDLE / 2, wait_for_connection_count(base + IDLE / 2)
+    end
+  ensure
+    idle.each { |s| s.close unless s.closed? } if idle
+  end
+
+end
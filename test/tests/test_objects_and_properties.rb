@@ -1328,4 +1328,49 @@ class TestObjectsAndProperties < Test::Unit::TestCase
     end
   end
 
+  def test_that_repeated_property_reads_hit_the_property_cache
+    run_test_as('wizard') do
+      a = create(NOTHING)
+      b = create(a)
+      add_property(a, 'foo', 1, [player, ''])
+
+      assert_equal 1, get(b, 'foo')
+      x = property_cache_stats
+      assert_equal 1, get(b, 'foo')
+      assert_equal 1, get(b, 'FOO')
+      y = property_cache_stats
+
+      assert_operator y[0] - x[0], :>=, 2
+    end
+  end
+
+  def test_that_changing_properties_invalidates_the_property_cache
+    run_test_as('wizard') do
+      a = create(NOTHING)
+      b = create(a)
+      add_property(a, 'foo', 1, [player, ''])
+      add_property(b, 'bar', 2, [player, ''])
+
+      assert_equal 1, get(b, 'foo')
+      assert_equal 2, get(b, 'bar')
+
+      add_property(a, 'baz', 3, [player, ''])
+      assert_equal 1, get(b, 'foo')
+      assert_equal 2, get(b, 'bar')
+      assert_equal 3, get(b, 'baz')
+
+      set_property_info(a, 'foo', [player, '', 'qux'])
+      assert_equal E_PROPNF, property_info(b, 'foo')
+      assert_equal 1, get(b, 'qux')
+
+      delete_property(a, 'baz')
+      assert_equal 1, get(b, 'qux')
+      assert_equal 2, get(b, 'bar')
+
+      chparent(b, NOTHING)
+      assert_equal E_PROPNF, property_info(b, 'qux')
+      assert_equal 2, get(b, 'bar')
+    end
+  end
+
 end
@@ -1223,6 +1223,40 @@ class TestObjectsAndVerbs < Test::Unit::TestCase
     end
   end
 
+  def test_that_verb_calls_reuse_pooled_environments_and_stacks
+    run_test_as('wizard') do
+      o = create(NOTHING)
+      add_verb(o, [player, 'xd', 'sum'], ['this', 'none', 'this'])
+      set_verb_code(o, 'sum') do |vc|
+        vc << %|{n} = args;|
+        vc << %|return n <= 0 ? 0 \| n + this:sum(n - 1);|
+      end
+      add_verb(o, [player, 'xd', 'wide'], ['this', 'none', 'this'])
+      set_verb_code(o, 'wide') do |vc|
+        vc << (1..100).map { |i| "v#{i} = #{i};" }.join(' ')
+        vc << %|return v1 + v100;|
+      end
+
+      assert_equal 1275, call(o, 'sum', 50)
+      x = simplify command %|; return rt_pool_stats();|
+      assert_equal 1275, call(o, 'sum', 50)
+      assert_equal 101, call(o, 'wide')
+      assert_equal 101, call(o, 'wide')
+      y = simplify command %|; return rt_pool_stats();|
+
+      hits = lambda { |stats, kind| stats.select { |row| row[0] == kind }.map { |row| row[3] }.inject(0, :+) }
+      assert_operator hits.call(y, 'env') - hits.call(x, 'env'), :>=, 50
+      assert_operator hits.call(y, 'stack') - hits.call(x, 'stack'), :>=, 50
+      assert y.any? { |row| row[0] == 'env' && row[1] >= 128 }
+    end
+  end
+
+  def test_that_rt_pool_stats_requires_wizperms
+    run_test_as('programmer') do
+      assert_equal E_PERM, simplify(command(%|; return rt_pool_stats();|))
+    end
+  end
+
   private
 
   def kahuna(parent, name, opt = 0)
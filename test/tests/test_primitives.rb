@@ -41,6 +41,32 @@ class TestPrimitives < Test::Unit::TestCase
     }
   end
 
+  def test_that_changing_a_prototype_takes_effect_immediately
+    run_test_as('wizard') do
+      begin
+        a = create(:nothing)
+        b = create(:nothing)
+        add_property(:system, "str_proto", a, [player, ''])
+        [a, b].each do |o|
+          add_verb(o, [player, 'xd', 'which'], ['this', 'none', 'this'])
+          set_verb_code(o, 'which') do |vc|
+            vc << %Q|return this + " #{o}";|
+          end
+        end
+        assert_equal "x #{a}", simplify(command(%Q|; return "x":which();|))
+        set(:system, 'str_proto', b)
+        assert_equal "x #{b}", simplify(command(%Q|; return "x":which();|))
+        recycle(b)
+        assert_equal E_TYPE, simplify(command(%Q|; return "x":which();|))
+        delete_property(:system, "str_proto")
+        assert_equal E_TYPE, simplify(command(%Q|; return "x":which();|))
+      ensure
+        delete_property(:system, "str_proto")
+        recycle(a)
+      end
+    end
+  end
+
   def test_that_queued_tasks_includes_this
     run_test_as('wizard') do
       begin
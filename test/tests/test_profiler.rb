@@ -0,0 +1,55 @@
+require 'test_helper'
+
+class TestProfiler < Test::Unit::TestCase
+
+  def test_that_the_profiler_requires_wizperms
+    run_test_as('programmer') do
+      assert_equal E_PERM, simplify(command('; return profiler_start();'))
+      assert_equal E_PERM, simplify(command('; return profiler_stop();'))
+      assert_equal E_PERM, simplify(command('; return profiler_reset();'))
+      assert_equal E_PERM, simplify(command('; return profiler_report();'))
+      assert_equal E_PERM, simplify(command('; return profiler_dump("profile.folded");'))
+    end
+  end
+
+  def test_that_the_profiler_blames_ticks_on_verb_lines
+    run_test_as('wizard') do
+      o = create(:nothing)
+      add_verb(o, [player, 'xd', 'spin'], ['this', 'none', 'this'])
+      set_verb_code(o, 'spin') do |vc|
+        vc << 'x = 0;'
+        vc << 'for i in [1..1000]'
+        vc << '  x = x + i;'
+        vc << 'endfor'
+        vc << 'return x;'
+      end
+
+      report = simplify command %Q|; profiler_reset(); profiler_start(1); #{obj_ref(o)}:spin(); profiler_stop(); return profiler_report(5);|
+
+      assert_equal 0, report['running']
+      assert_equal 1, report['interval']
+      assert_operator report['samples'], :>, 1000
+      assert_operator report['opcodes']['ADD'], :>=, 1000
+      spin = report['lines'].select { |row| row[1] == 'spin' }
+      assert_not_empty spin
+      assert_operator spin.map { |row| row[3] }.inject(:+), :>=, 1000
+
+      assert_operator simplify(command('; return profiler_dump("test_profiler.folded");')), :>=, 1
+      file_remove('test_profiler.folded')
+
+      command '; profiler_reset();'
+      report = simplify command '; return profiler_report();'
+      assert_equal 0, report['samples']
+      assert_equal [], report['lines']
+    end
+  end
+
+  def test_that_profiling_does_not_use_up_ticks
+    run_test_as('wizard') do
+      r = simplify command %Q|; a = ticks_left(); profiler_start(1); b = ticks_left(); for i in [1..100] endfor; c = ticks_left(); profiler_stop(); d = ticks_left(); profiler_reset(); return {a - b, b - c, c - d};|
+      r.each { |used| assert_operator used, :<, 200 }
+      assert_operator r[1], :>=, 100
+    end
+  end
+
+end
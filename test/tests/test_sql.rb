@@ -0,0 +1,126 @@
+require 'test_helper'
+
+# Runs against a private in-memory SQLite database.  Each connection in a
+# pool gets its own, so nothing here runs a query while a cursor holds
+# the pool's only connection.
+
+class TestSql < Test::Unit::TestCase
+
+  def sqlite_available?
+    simplify(command(%Q|; return `function_info("sql_open") ! ANY => 0' != 0;|)) == 1
+  end
+
+  def setup
+    run_test_as('wizard') do
+      omit('the server was built without SQL support') unless sqlite_available?
+      @handle = simplify(command(%Q|; return sql_open("sqlite://:memory:");|))
+      assert_kind_of Integer, @handle
+      assert_equal [], sql(%Q|"CREATE TABLE t (a INTEGER, b TEXT)"|)
+      assert_equal [], sql(%Q{"INSERT INTO t (a, b) WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) SELECT i, 'row ' || i FROM n"})
+    end
+  end
+
+  def teardown
+    run_test_as('wizard') do
+      command(%Q|; sql_close(#{@handle});|) if @handle
+    end
+  end
+
+  def sql(query)
+    simplify(command(%Q|; return sql_query(#{@handle}, #{query});|))
+  end
+
+  def test_that_a_cursor_returns_every_row_in_batches
+    run_test_as('wizard') do
+      cursor = simplify(command(%Q|; return sql_cursor_open(#{@handle}, "SELECT a, b FROM t WHERE a > ? ORDER BY a", {40});|))
+      assert_kind_of Integer, cursor
+      assert_equal 1, simplify(command(%Q|; return sql_info(#{@handle})["cursors"];|))
+
+      rows = []
+      batches = 0
+      while (true)
+        batch = simplify(command(%Q|; return sql_cursor_fetch(#{cursor}, 25);|))
+        assert_kind_of Array, batch
+        break if batch.empty?
+        assert batch.length <= 25
+        rows += batch
+        batches += 1
+      end
+
+      assert_equal 3, batches
+      assert_equal((41..100).map { |i| [i.to_s, "row #{i}"] }, rows)
+      assert_equal [], simplify(command(%Q|; return sql_cursor_fetch(#{cursor}, 25);|))
+
+      assert_equal 1, simplify(command(%Q|; return sql_cursor_close(#{cursor});|))
+      assert_equal 0, simplify(command(%Q|; return sql_info(#{@handle})["cursors"];|))
+      assert_equal 'No cursor by that ID.', simplify(command(%Q|; return sql_cursor_fetch(#{cursor}, 25);|))
+      assert_equal 'No cursor by that ID.', simplify(command(%Q|; return sql_cursor_close(#{cursor});|))
+    end
+  end
+
+  def test_that_cursor_arguments_are_checked
+    run_test_as('wizard') do
+      assert_equal E_INVARG, simplify(command(%Q|; return `sql_cursor_open(#{@handle}, "SELECT ?", {{}}) ! ANY';|))
+      assert_equal 'No connection handle value by that ID.', simplify(command(%Q|; return sql_cursor_open(#{@handle + 1000}, "SELECT 1");|))
+      assert_equal 'no such table: nope', simplify(command(%Q|; return sql_cursor_open(#{@handle}, "SELECT * FROM nope");|))
+      cursor = simplify(command(%Q|; return sql_cursor_open(#{@handle}, "SELECT a FROM t");|))
+      assert_equal E_INVARG, simplify(command(%Q|; return `sql_cursor_fetch(#{cursor}, 0) ! ANY';|))
+      assert_equal 1, simplify(command(%Q|; return sql_cursor_close(#{cursor});|))
+    end
+    run_test_as('programmer') do
+      assert_equal E_PERM, simplify(command(%Q|; return `sql_cursor_fetch(1, 1) ! ANY';|))
+    end
+  end
+
+  def test_that_closing_a_connection_closes_its_cursors
+    run_test_as('wizard') do
+      cursor = simplify(command(%Q|; return sql_cursor_open(#{@handle}, "SELECT a FROM t");|))
+      assert_equal [['1']], simplify(command(%Q|; return sql_cursor_fetch(#{cursor}, 1);|))
+      command(%Q|; sql_close(#{@handle});|)
+      @handle = nil
+      assert_equal 'No cursor by that ID.', simplify(command(%Q|; return sql_cursor_fetch(#{cursor}, 1);|))
+    end
+  end
+
+  def test_that_repeated_queries_reuse_their_statements
+    run_test_as('wizard') do
+      before = simplify(command(%Q|; return sql_info(#{@handle});|))
+      (1..10).each do |i|
+        assert_equal [["row #{i}"]], sql(%Q|"SELECT b FROM t WHERE a = ?", {#{i}}|)
+      end
+      after = simplify(command(%Q|; return sql_info(#{@handle});|))
+      assert_equal 1, after['statements_prepared'] - before['statements_prepared']
+      assert_equal 9, after['statements_reused'] - before['statements_reused']
+    end
+  end
+
+  def test_that_a_transaction_returns_the_result_of_each_statement
+    run_test_as('wizard') do
+      r = simplify(command(%Q|; return sql_transaction(#{@handle}, {{"INSERT INTO t (a, b) VALUES (?, ?)", {101, "row 101"}}, {"DELETE FROM t WHERE a <= ?", {50}}, {"SELECT count(*), max(a) FROM t"}});|))
+      assert_equal [[], [], [['51', '101']]], r
+      assert_equal [['51']], sql(%Q|"SELECT count(*) FROM t"|)
+    end
+  end
+
+  def test_that_a_failed_transaction_is_rolled_back
+    run_test_as('wizard') do
+      r = simplify(command(%Q|; return sql_transaction(#{@handle}, {{"DELETE FROM t"}, {"INSERT INTO nope VALUES (1)"}});|))
+      assert_equal 'Statement 2: no such table: nope', r
+      assert_equal [['100']], sql(%Q|"SELECT count(*) FROM t"|)
+      assert_equal [], simplify(command(%Q|; return sql_transaction(#{@handle}, {});|))
+    end
+  end
+
+  def test_that_transaction_arguments_are_checked
+    run_test_as('wizard') do
+      ['{"SELECT 1"}', '{{}}', '{{1}}', '{{"SELECT ?", 1}}', '{{"SELECT ?", {{}}}}', '{{"SELECT ?", {1}, 2}}'].each do |statements|
+        assert_equal E_INVARG, simplify(command(%Q|; return `sql_transaction(#{@handle}, #{statements}) ! ANY';|))
+      end
+      assert_equal 'No connection handle value by that ID.', simplify(command(%Q|; return sql_transaction(#{@handle + 1000}, {});|))
+    end
+    run_test_as('programmer') do
+      assert_equal E_PERM, simplify(command(%Q|; return `sql_transaction(1, {}) ! ANY';|))
+    end
+  end
+
+end
@@ -32,4 +32,15 @@ class TestSystemBuiltins < Test::Unit::TestCase
     end
   end
 
+  def test_that_connection_info_reports_coalesced_output
+    run_test_as('programmer') do
+      x = simplify command %Q|; return connection_info(player)["output"];|
+      command %Q|; for i in [1..50] notify(player, "line " + tostr(i)); endfor|
+      y = simplify command %Q|; return connection_info(player)["output"];|
+
+      assert_operator y['bytes'] - x['bytes'], :>=, 50 * 'line 1'.length
+      assert_operator y['syscalls'] - x['syscalls'], :<, 10
+    end
+  end
+
 end
@@ -1,3 +1,5 @@
+require 'open3'
+
 require 'test_helper'
 
 class TestVerbCache < Test::Unit::TestCase
@@ -27,4 +29,71 @@ class TestVerbCache < Test::Unit::TestCase
     end
   end
 
+  def test_that_changing_an_unrelated_object_does_not_invalidate_cached_verbs
+    run_test_as('wizard') do
+      a = simplify(command(%Q|; return create($nothing); |))
+      b = simplify(command(%Q|; return create($nothing); |))
+      add_verb(a, [player, 'xd', 'test'], ['this', 'none', 'this'])
+      set_verb_code(a, 'test', ['return "test";'])
+      assert_equal 'test', call(a, 'test')
+
+      x = verb_cache_stats()
+      add_verb(b, [player, 'xd', 'other'], ['this', 'none', 'this'])
+      assert_equal 'test', call(a, 'test')
+      y = verb_cache_stats()
+
+      assert_equal 0, y[2] - x[2]
+      assert_equal 1, y[7]['verb added'] - x[7]['verb added']
+    end
+  end
+
+  def test_that_changing_a_parent_invalidates_cached_verbs_on_its_descendants
+    run_test_as('wizard') do
+      a = simplify(command(%Q|; return create($nothing); |))
+      b = simplify(command(%Q|; return create(#{a}); |))
+      add_verb(b, [player, 'xd', 'test'], ['this', 'none', 'this'])
+      set_verb_code(b, 'test', ['return "b";'])
+      assert_equal 'b', call(b, 'test')
+      assert_equal E_VERBNF, call(b, 'foo')
+
+      x = verb_cache_stats()
+      add_verb(a, [player, 'xd', 'foo'], ['this', 'none', 'this'])
+      set_verb_code(a, 'foo', ['return "a";'])
+      assert_equal 'a', call(b, 'foo')
+      y = verb_cache_stats()
+
+      assert_equal 1, y[5] - x[5]
+      assert_equal 1, y[7]['verb added'] - x[7]['verb added']
+    end
+  end
+
+  def test_that_calling_a_verb_does_not_add_uncompiled_verbs
+    run_test_as('wizard') do
+      a = simplify(command(%Q|; return create($nothing); |))
+      add_verb(a, [player, 'xd', 'test'], ['this', 'none', 'this'])
+      set_verb_code(a, 'test', ['return "test";'])
+
+      x = verb_cache_stats()
+      assert_equal 'test', call(a, 'test')
+      y = verb_cache_stats()
+
+      assert_kind_of Integer, x[8]
+      assert_equal x[8], y[8]
+    end
+  end
+
+  # Lazy.db has three verbs on #0 with source.  Its server_started runs,
+  # so it is compiled; then it calls #0:a and leaves #0:b alone.
+  def test_that_calling_a_verb_from_a_loaded_database_compiles_only_that_verb
+    _, _, log, wait = Open3.popen3 %[./moo tests/Lazy.db /tmp/Lazy.db 9899]
+    wait.value
+
+    counts = log.readlines.map { |l| l[/uncompiled verbs: (\d+ \d+)/, 1] }.compact.first
+    assert_not_nil counts
+    before, after = counts.split.map(&:to_i)
+    omit('the server was built without LAZY_VERB_PROGRAMS') if before == 0
+    assert_equal 2, before
+    assert_equal before - 1, after
+  end
+
 end
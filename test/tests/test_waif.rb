@@ -195,6 +195,55 @@ class TestWaif < Test::Unit::TestCase
       end
   end
 
+  def test_that_sorting_waifs_in_the_background_leaves_them_intact
+    run_test_as('programmer') do
+      a = create(:waif)
+      simplify(command(%Q|; add_property(#{a}, ":n", 0, {player, ""}); |))
+      add_verb(a, ['player', 'xd', 'go'], ['this', 'none', 'this'])
+      add_verb(a, ['player', 'xd', 'gc'], ['this', 'none', 'this'])
+      set_verb_code(a, 'go') do |vc|
+        lines = <<-EOF
+          w = k = {};
+          for i in [1..200];
+              x = #{a}:new();
+              x.n = i;
+              w = {@w, x};
+              k = {@k, 201 - i};
+          endfor;
+          fork (0)
+              for j in [1..50];
+                  c = w;
+                  suspend(0);
+              endfor
+          endfork
+          for j in [1..50];
+              s = sort(w, k);
+              if (s[1].n != 200 || s[$].n != 1 || length(s) != 200)
+                  return 0;
+              endif
+          endfor
+          return 1;
+        EOF
+        lines.split("\n").each do |line|
+          vc << line
+        end
+      end
+      set_verb_code(a, 'gc') do |vc|
+        lines = <<-EOF
+        for x in [1..100]
+        suspend(0);
+        endfor
+        EOF
+        lines.split("\n").each do |line|
+          vc << line
+        end
+      end
+      assert_equal 1, call(a, 'go')
+      call(a, 'gc')
+      assert_equal({"pending_recycle" => 0, "total" => 0}, simplify(command(";; return waif_stats();")))
+    end
+  end
+
   def test_that_anon_cant_be_waif_parent
       run_test_as('programmer') do
           a = create(:object)